@@ -0,0 +1,204 @@
+﻿#include "BufferPool.hpp"
+
+#include <new>
+#include <utility>
+
+Buffer::Block::Block(int32_t capacity, int32_t sizeClass) : ref_(1), capacity_(capacity), sizeClass_(sizeClass)
+{
+}
+
+char *Buffer::Block::data()
+{
+    return reinterpret_cast<char *>(this + 1);
+}
+
+Buffer::Buffer()
+{
+}
+
+Buffer::Buffer(Block *block, int32_t size) : block_(block), size_(size)
+{
+}
+
+Buffer::Buffer(const Buffer &other) : block_(other.block_), size_(other.size_)
+{
+    if (block_ != nullptr)
+    {
+        block_->ref_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+Buffer::Buffer(Buffer &&other) noexcept : block_(other.block_), size_(other.size_)
+{
+    other.block_ = nullptr;
+    other.size_ = 0;
+}
+
+Buffer &Buffer::operator=(const Buffer &other)
+{
+    if (this != &other)
+    {
+        Buffer tmp(other);
+        *this = std::move(tmp);
+    }
+    return *this;
+}
+
+Buffer &Buffer::operator=(Buffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        reset();
+        block_ = other.block_;
+        size_ = other.size_;
+        other.block_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+Buffer::~Buffer()
+{
+    reset();
+}
+
+char *Buffer::data()
+{
+    return (block_ == nullptr) ? nullptr : block_->data();
+}
+
+const char *Buffer::data() const
+{
+    return (block_ == nullptr) ? nullptr : block_->data();
+}
+
+int32_t Buffer::size() const
+{
+    return size_;
+}
+
+int32_t Buffer::capacity() const
+{
+    return (block_ == nullptr) ? 0 : block_->capacity_;
+}
+
+bool Buffer::empty() const
+{
+    return (block_ == nullptr);
+}
+
+void Buffer::resize(const int32_t size)
+{
+    if ((size >= 0) && (size <= capacity()))
+    {
+        size_ = size;
+    }
+}
+
+void Buffer::reset()
+{
+    if (block_ != nullptr)
+    {
+        if (block_->ref_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            BufferPool::instance().put(block_);
+        }
+        block_ = nullptr;
+    }
+    size_ = 0;
+}
+
+BufferPool::BufferPool() : allocCount_(0), reuseCount_(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    clear();
+}
+
+BufferPool &BufferPool::instance()
+{
+    // 終了時に他スレッドが保持しているバッファが返却されても良いように破棄しない
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
+
+Buffer BufferPool::get(const int32_t size)
+{
+    if (size < 0)
+    {
+        // 不正なサイズは確保しない(空のバッファを返す)
+        return Buffer();
+    }
+    const int32_t sizeClass = size_class(size);
+    if (sizeClass >= 0)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<Buffer::Block *> &blocks = freeBlocks_[sizeClass];
+        if (!blocks.empty())
+        {
+            Buffer::Block *block = blocks.back();
+            blocks.pop_back();
+            block->ref_.store(1, std::memory_order_relaxed);
+            reuseCount_++;
+            return Buffer(block, size);
+        }
+    }
+
+    // プールに無い、またはサイズクラスを超える場合は新規に確保する
+    const int32_t capacity = (sizeClass >= 0) ? (1 << (sizeClass + MIN_CLASS_SHIFT)) : size;
+    void *mem = ::operator new(sizeof(Buffer::Block) + static_cast<size_t>(capacity));
+    allocCount_++;
+    return Buffer(new (mem) Buffer::Block(capacity, sizeClass), size);
+}
+
+void BufferPool::put(Buffer::Block *block)
+{
+    if (block->sizeClass_ >= 0)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<Buffer::Block *> &blocks = freeBlocks_[block->sizeClass_];
+        if (blocks.size() < MAX_FREE_BLOCKS)
+        {
+            blocks.push_back(block);
+            return;
+        }
+    }
+    block->~Block();
+    ::operator delete(block);
+}
+
+void BufferPool::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (int32_t i = 0; i < CLASS_NUM; i++)
+    {
+        for (Buffer::Block *block : freeBlocks_[i])
+        {
+            block->~Block();
+            ::operator delete(block);
+        }
+        freeBlocks_[i].clear();
+    }
+}
+
+uint64_t BufferPool::allocCount() const
+{
+    return allocCount_;
+}
+
+uint64_t BufferPool::reuseCount() const
+{
+    return reuseCount_;
+}
+
+int32_t BufferPool::size_class(const int32_t size)
+{
+    int32_t shift = MIN_CLASS_SHIFT;
+    while ((shift <= MAX_CLASS_SHIFT) && ((1 << shift) < size))
+    {
+        shift++;
+    }
+    return (shift <= MAX_CLASS_SHIFT) ? (shift - MIN_CLASS_SHIFT) : -1;
+}
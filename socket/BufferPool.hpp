@@ -0,0 +1,80 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+class BufferPool;
+
+// 受信データを保持する参照カウント付きバッファ
+// コピーは参照カウントの加算のみで、最後の参照が無くなるとBufferPoolに返却される
+class Buffer
+{
+public:
+    class alignas(16) Block
+    {
+    public:
+        std::atomic<int32_t> ref_;
+        int32_t capacity_;
+        int32_t sizeClass_;
+
+    public:
+        Block(int32_t capacity, int32_t sizeClass);
+        char *data();
+    };
+
+private:
+    Block *block_ = nullptr;
+    int32_t size_ = 0;
+
+public:
+    Buffer();
+    Buffer(Block *block, int32_t size);
+    Buffer(const Buffer &other);
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(const Buffer &other);
+    Buffer &operator=(Buffer &&other) noexcept;
+    ~Buffer();
+    char *data();
+    const char *data() const;
+    int32_t size() const;
+    int32_t capacity() const;
+    bool empty() const;
+    void resize(const int32_t size);
+    void reset();
+};
+
+// サイズクラス(2のべき乗)ごとに受信バッファを再利用するプール
+// 定常状態ではヒープ確保を行わない
+class BufferPool
+{
+public:
+    static constexpr int32_t MIN_CLASS_SHIFT = 10; // 1KB
+    static constexpr int32_t MAX_CLASS_SHIFT = 24; // 16MB
+    static constexpr int32_t CLASS_NUM = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+    static constexpr size_t MAX_FREE_BLOCKS = 16;
+
+private:
+    std::mutex mtx_;
+    std::vector<Buffer::Block *> freeBlocks_[CLASS_NUM];
+    std::atomic<uint64_t> allocCount_;
+    std::atomic<uint64_t> reuseCount_;
+
+private:
+    BufferPool();
+    ~BufferPool();
+
+public:
+    static BufferPool &instance();
+    // sizeが負の場合は空のバッファを返す
+    Buffer get(const int32_t size);
+    void put(Buffer::Block *block);
+    void clear();
+    uint64_t allocCount() const;
+    uint64_t reuseCount() const;
+
+private:
+    static int32_t size_class(const int32_t size);
+};
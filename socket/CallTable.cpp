@@ -0,0 +1,235 @@
+﻿#include "CallTable.hpp"
+
+#include <cstring>
+#include <utility>
+
+const char *CallResult::data() const
+{
+    return (buffer_.size() > CallTable::PREFIX_SIZE) ? buffer_.data() + CallTable::PREFIX_SIZE : nullptr;
+}
+
+int32_t CallResult::size() const
+{
+    return (buffer_.size() > CallTable::PREFIX_SIZE) ? buffer_.size() - CallTable::PREFIX_SIZE : 0;
+}
+
+CallTable::CallTable()
+{
+}
+
+CallTable::~CallTable()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        isRunning_ = false;
+        cv_.notify_all();
+    }
+    if (th_.joinable())
+    {
+        th_.join();
+    }
+    failAll();
+}
+
+uint32_t CallTable::add(const int32_t timeoutMs, const std::function<void(CallResult &)> &callback)
+{
+    std::function<void()> notify;
+    std::unique_lock<std::mutex> lock(mtx_);
+    // 要求IDは0を使わない(一周しても応答待ちの要求IDとは重ならないようにする)
+    do
+    {
+        nextId_++;
+    } while ((nextId_ == 0) || (pending_.find(nextId_) != pending_.end()));
+    const uint32_t requestId = nextId_;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    Pending &entry = pending_[requestId];
+    entry.callback_ = callback;
+    entry.deadline_ = deadlines_.emplace(deadline, requestId);
+    if (notify_)
+    {
+        if (deadlines_.begin() == entry.deadline_)
+        {
+            // 最も早い期限が変わったため、外部のタイマーの待ち時間を更新させる
+            notify = notify_;
+        }
+    }
+    else if (!isRunning_)
+    {
+        isRunning_ = true;
+        std::thread th(&CallTable::task_, this);
+        th_.swap(th);
+    }
+    else if (deadlines_.begin() == entry.deadline_)
+    {
+        // 最も早い期限が変わったため、監視スレッドの待ち時間を更新する
+        cv_.notify_all();
+    }
+    lock.unlock();
+
+    if (notify)
+    {
+        notify();
+    }
+    return requestId;
+}
+
+bool CallTable::complete(Buffer &buffer)
+{
+    uint32_t requestId = 0;
+    if (!unpack(buffer, requestId))
+    {
+        return false;
+    }
+    // 期限切れ後に届いた応答は捨てる
+    return finish_(requestId, CallResult::Status::OK, &buffer);
+}
+
+void CallTable::fail(const uint32_t requestId)
+{
+    (void)finish_(requestId, CallResult::Status::FAILED, nullptr);
+}
+
+void CallTable::failAll()
+{
+    std::map<uint32_t, Pending> failed;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        failed.swap(pending_);
+        deadlines_.clear();
+    }
+    for (auto &item : failed)
+    {
+        CallResult result;
+        result.status_ = CallResult::Status::FAILED;
+        item.second.callback_(result);
+    }
+}
+
+size_t CallTable::pending()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return pending_.size();
+}
+
+void CallTable::setTimer(const std::function<void()> &notify)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    notify_ = notify;
+    if (!notify_ && !deadlines_.empty() && !isRunning_)
+    {
+        // 外部のタイマーに任せていた応答待ちを、監視スレッドで引き継ぐ
+        isRunning_ = true;
+        std::thread th(&CallTable::task_, this);
+        th_.swap(th);
+    }
+}
+
+bool CallTable::expire(const std::chrono::steady_clock::time_point &now, std::chrono::steady_clock::time_point &next)
+{
+    std::vector<std::function<void(CallResult &)>> expired;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        take_expired_(now, expired);
+        if (!deadlines_.empty())
+        {
+            next = deadlines_.begin()->first;
+            found = true;
+        }
+    }
+    notify_expired_(expired);
+    return found;
+}
+
+Buffer CallTable::pack(const uint32_t requestId, const char *data, const int32_t size)
+{
+    Buffer buffer = BufferPool::instance().get(PREFIX_SIZE + size);
+    std::memcpy(buffer.data(), &requestId, sizeof(requestId));
+    if (size > 0)
+    {
+        std::memcpy(buffer.data() + PREFIX_SIZE, data, static_cast<size_t>(size));
+    }
+    return buffer;
+}
+
+bool CallTable::unpack(const Buffer &buffer, uint32_t &requestId)
+{
+    if (buffer.size() < PREFIX_SIZE)
+    {
+        return false;
+    }
+    std::memcpy(&requestId, buffer.data(), sizeof(requestId));
+    return true;
+}
+
+void CallTable::task_()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (isRunning_)
+    {
+        if (deadlines_.empty())
+        {
+            cv_.wait(lock);
+            continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (deadlines_.begin()->first > now)
+        {
+            cv_.wait_until(lock, deadlines_.begin()->first);
+            continue;
+        }
+
+        // 期限を過ぎた要求を取り出し、ロック外で通知する
+        std::vector<std::function<void(CallResult &)>> expired;
+        take_expired_(now, expired);
+        lock.unlock();
+        notify_expired_(expired);
+        lock.lock();
+    }
+}
+
+void CallTable::take_expired_(const std::chrono::steady_clock::time_point &now, std::vector<std::function<void(CallResult &)>> &expired)
+{
+    while (!deadlines_.empty() && (deadlines_.begin()->first <= now))
+    {
+        auto itr = pending_.find(deadlines_.begin()->second);
+        expired.emplace_back(std::move(itr->second.callback_));
+        pending_.erase(itr);
+        deadlines_.erase(deadlines_.begin());
+    }
+}
+
+void CallTable::notify_expired_(std::vector<std::function<void(CallResult &)>> &expired)
+{
+    for (auto &callback : expired)
+    {
+        CallResult result;
+        result.status_ = CallResult::Status::TIMEOUT;
+        callback(result);
+    }
+}
+
+bool CallTable::finish_(const uint32_t requestId, const CallResult::Status status, Buffer *buffer)
+{
+    std::function<void(CallResult &)> callback;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto itr = pending_.find(requestId);
+        if (itr == pending_.end())
+        {
+            return false;
+        }
+        callback = std::move(itr->second.callback_);
+        deadlines_.erase(itr->second.deadline_);
+        pending_.erase(itr);
+    }
+    CallResult result;
+    result.status_ = status;
+    if (buffer != nullptr)
+    {
+        result.buffer_ = std::move(*buffer);
+    }
+    callback(result);
+    return true;
+}
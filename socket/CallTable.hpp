@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "BufferPool.hpp"
+
+// RPC呼び出しの結果
+class CallResult
+{
+public:
+    enum class Status
+    {
+        OK,      // 応答を受信した
+        TIMEOUT, // 期限までに応答が無かった
+        FAILED,  // 送信できなかった、または応答を受信する前に切断した
+    };
+
+public:
+    Status status_ = Status::FAILED;
+    Buffer buffer_; // 応答フレーム(先頭に要求IDを含む)
+
+public:
+    const char *data() const;
+    int32_t size() const;
+};
+
+// RPC呼び出しの応答待ち表
+// 要求IDで応答を対応付けるため、1つの接続で複数の要求を応答を待たずに送信できる
+// 期限を過ぎた要求は監視スレッドがTIMEOUTで通知する(監視スレッドは最初の要求で起動する)
+// 外部のタイマーを設定した場合は監視スレッドを起動せず、タイマーの持ち主がexpireで通知する
+class CallTable
+{
+public:
+    // RPCフレームのデータは、先頭4バイトに要求IDを置く
+    static constexpr int32_t PREFIX_SIZE = static_cast<int32_t>(sizeof(uint32_t));
+
+private:
+    class Pending
+    {
+    public:
+        std::function<void(CallResult &)> callback_;
+        std::multimap<std::chrono::steady_clock::time_point, uint32_t>::iterator deadline_;
+    };
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::map<uint32_t, Pending> pending_;
+    std::multimap<std::chrono::steady_clock::time_point, uint32_t> deadlines_;
+    uint32_t nextId_ = 0;
+    std::thread th_;
+    bool isRunning_ = false;
+    std::function<void()> notify_; // 外部のタイマー(最も早い期限が変わった時に呼ぶ)
+
+public:
+    CallTable();
+    CallTable(const CallTable &) = delete;
+    CallTable &operator=(const CallTable &) = delete;
+    ~CallTable();
+    // 応答待ちに加えて要求IDを返す
+    uint32_t add(const int32_t timeoutMs, const std::function<void(CallResult &)> &callback);
+    // 応答フレームを対応する要求に通知する(対応する要求が無い場合はfalse)
+    bool complete(Buffer &buffer);
+    // 送信に失敗した要求をFAILEDで通知する
+    void fail(const uint32_t requestId);
+    // 全ての応答待ちをFAILEDで通知する(切断時)
+    void failAll();
+    size_t pending();
+    // 期限の監視を外部のタイマーに任せる(nullptrで監視スレッドに戻す)
+    void setTimer(const std::function<void()> &notify);
+    // 期限を過ぎた要求をTIMEOUTで通知し、次の期限をnextに返す(応答待ちが無ければfalse)
+    bool expire(const std::chrono::steady_clock::time_point &now, std::chrono::steady_clock::time_point &next);
+
+    // 要求IDを付けたRPCフレームのデータを作る(圧縮して送る場合のみ使い、通常は要求IDをヘッダに続けて送る)
+    static Buffer pack(const uint32_t requestId, const char *data, const int32_t size);
+    // RPCフレームのデータから要求IDを取り出す(短すぎる場合はfalse)
+    static bool unpack(const Buffer &buffer, uint32_t &requestId);
+
+private:
+    void task_();
+    void take_expired_(const std::chrono::steady_clock::time_point &now, std::vector<std::function<void(CallResult &)>> &expired);
+    static void notify_expired_(std::vector<std::function<void(CallResult &)>> &expired);
+    bool finish_(const uint32_t requestId, const CallResult::Status status, Buffer *buffer);
+};
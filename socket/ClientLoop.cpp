@@ -0,0 +1,440 @@
+﻿#include "ClientLoop.hpp"
+#include "Logger.hpp"
+
+#include <algorithm>
+
+#include <sys/epoll.h>   // epoll系
+#include <sys/eventfd.h> // eventfd()
+#include <unistd.h>      // close()
+
+bool ClientLoop::Timer::operator>(const Timer &other) const
+{
+    return deadline_ > other.deadline_;
+}
+
+void ClientLoop::Worker::wake(const uint64_t tag)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    woken_.emplace_back(reinterpret_cast<Client *>(static_cast<uintptr_t>(tag)));
+    notify_();
+}
+
+void ClientLoop::Worker::notify_()
+{
+    // ループがまだ起きていなければeventfdに書き込む(起きるまでの要求はまとめて処理する)
+    if (!wakePending_ && (wakeFd_ != -1))
+    {
+        wakePending_ = true;
+        uint64_t value = 1;
+        (void)::write(wakeFd_, &value, sizeof(value));
+    }
+}
+
+ClientLoop::ClientLoop(int32_t logid) : logid_(logid), isRunning_(false), next_(0)
+{
+    workers_.emplace_back(new Worker());
+}
+
+ClientLoop::~ClientLoop()
+{
+    end();
+}
+
+void ClientLoop::setThreadNum(const int32_t threadNum)
+{
+    if (isRunning_ || (threadNum < 1))
+    {
+        return;
+    }
+    // 割り当て済みのClientがいるWorkerは減らさない
+    while ((static_cast<int32_t>(workers_.size()) > threadNum) && workers_.back()->clients_.empty())
+    {
+        workers_.pop_back();
+    }
+    while (static_cast<int32_t>(workers_.size()) < threadNum)
+    {
+        workers_.emplace_back(new Worker());
+    }
+}
+
+bool ClientLoop::start()
+{
+    if (isRunning_)
+    {
+        return true;
+    }
+    for (auto &worker : workers_)
+    {
+        worker->epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        worker->wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        // eventfdのイベントは0、Clientの接続ソケットのイベントはClientのアドレスで区別する
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0;
+        if ((worker->epfd_ == -1) || (worker->wakeFd_ == -1) ||
+            (::epoll_ctl(worker->epfd_, EPOLL_CTL_ADD, worker->wakeFd_, &ev) == -1))
+        {
+            LOGGER_ERROR(logid_, "ERR! create epfd err:%d", errno);
+            for (auto &created : workers_)
+            {
+                if (created->epfd_ != -1)
+                {
+                    ::close(created->epfd_);
+                    created->epfd_ = -1;
+                }
+                if (created->wakeFd_ != -1)
+                {
+                    ::close(created->wakeFd_);
+                    created->wakeFd_ = -1;
+                }
+            }
+            return false;
+        }
+    }
+    isRunning_ = true;
+    for (auto &worker : workers_)
+    {
+        std::thread th(&ClientLoop::task_, this, worker.get());
+        worker->th_.swap(th);
+    }
+    return true;
+}
+
+void ClientLoop::end()
+{
+    if (!isRunning_)
+    {
+        return;
+    }
+    isRunning_ = false;
+    for (auto &worker : workers_)
+    {
+        uint64_t value = 1;
+        (void)::write(worker->wakeFd_, &value, sizeof(value));
+        worker->th_.join();
+        ::close(worker->epfd_);
+        worker->epfd_ = -1;
+        {
+            std::lock_guard<std::mutex> lock(worker->mtx_);
+            ::close(worker->wakeFd_);
+            worker->wakeFd_ = -1;
+        }
+    }
+}
+
+size_t ClientLoop::clientCount()
+{
+    size_t count = 0;
+    for (auto &worker : workers_)
+    {
+        std::lock_guard<std::mutex> lock(worker->mtx_);
+        count += worker->clients_.size();
+    }
+    return count;
+}
+
+void ClientLoop::attach_(Client *client)
+{
+    // 割り当てるWorkerは順番に選ぶ
+    Worker &worker = *workers_[next_++ % workers_.size()];
+    std::lock_guard<std::mutex> lock(worker.mtx_);
+    worker.clients_.emplace(client);
+    worker.added_.emplace_back(client);
+    worker.notify_();
+}
+
+void ClientLoop::detach_(Client *client)
+{
+    for (auto &worker : workers_)
+    {
+        std::unique_lock<std::mutex> lock(worker->mtx_);
+        if (worker->clients_.find(client) == worker->clients_.end())
+        {
+            continue;
+        }
+        if (!isRunning_)
+        {
+            // ループが停止中のため、切断済みの接続状態を破棄する
+            worker->clients_.erase(client);
+            worker->added_.erase(std::remove(worker->added_.begin(), worker->added_.end(), client), worker->added_.end());
+            worker->entries_.erase(client);
+            return;
+        }
+        worker->removed_.emplace_back(client);
+        worker->notify_();
+        worker->cv_.wait(lock, [&]
+                         { return !isRunning_ || (worker->clients_.find(client) == worker->clients_.end()); });
+        return;
+    }
+}
+
+void ClientLoop::task_(Worker *worker)
+{
+    LOGGER_INFO(logid_, "task sta");
+    auto now = std::chrono::steady_clock::now();
+    // 再開前に割り当てていたClientを、作り直したepollで再接続させる
+    for (auto &item : worker->entries_)
+    {
+        item.first->clientSock_.setLoop(worker->epfd_, tag_(item.first), worker);
+        schedule_(*worker, *item.second, now);
+    }
+
+    static constexpr int32_t MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+    while (isRunning_)
+    {
+        // 追加・削除の要求と、タスクを積んだClientを取り出す
+        std::vector<Client *> added;
+        std::vector<Client *> removed;
+        std::vector<Client *> woken;
+        {
+            std::lock_guard<std::mutex> lock(worker->mtx_);
+            added.swap(worker->added_);
+            removed.swap(worker->removed_);
+            woken.swap(worker->woken_);
+            worker->wakePending_ = false;
+        }
+        now = std::chrono::steady_clock::now();
+        for (Client *client : added)
+        {
+            std::unique_ptr<Entry> entry(new Entry());
+            entry->client_ = client;
+            entry->retry_ = now;
+            client->clientSock_.setLoop(worker->epfd_, tag_(client), worker);
+            schedule_(*worker, *entry, now);
+            worker->entries_[client] = std::move(entry);
+        }
+        if (!removed.empty())
+        {
+            for (Client *client : removed)
+            {
+                auto it = worker->entries_.find(client);
+                if (it != worker->entries_.end())
+                {
+                    close_(*it->second);
+                    worker->entries_.erase(it);
+                }
+                client->clientSock_.setLoop(-1, 0, nullptr);
+            }
+            std::lock_guard<std::mutex> lock(worker->mtx_);
+            for (Client *client : removed)
+            {
+                worker->clients_.erase(client);
+            }
+            worker->cv_.notify_all();
+        }
+        for (Client *client : woken)
+        {
+            // 積まれたタスクを実行し、RPCの応答待ちの期限を取り直す(接続前のタスクは接続した後で実行する)
+            auto it = worker->entries_.find(client);
+            if (it == worker->entries_.end())
+            {
+                continue;
+            }
+            Entry &entry = *it->second;
+            if ((entry.state_ == Entry::State::CONNECTED) && !entry.client_->ready_(0))
+            {
+                close_(entry);
+                entry.retry_ = now;
+            }
+            schedule_(*worker, entry, now);
+        }
+
+        // 期限を過ぎたClientを処理する(期限を更新したClientの古い期限は読み捨てる)
+        while (!worker->timers_.empty() && (worker->timers_.top().deadline_ <= now))
+        {
+            Timer timer = worker->timers_.top();
+            worker->timers_.pop();
+            auto it = worker->entries_.find(timer.client_);
+            if ((it == worker->entries_.end()) || (it->second->timer_ != timer.deadline_))
+            {
+                continue;
+            }
+            Entry &entry = *it->second;
+            entry.timer_ = std::chrono::steady_clock::time_point::max();
+            if (entry.state_ == Entry::State::IDLE)
+            {
+                connect_(*worker, entry, now);
+            }
+            else if ((entry.state_ == Entry::State::CONNECTED) && !entry.client_->ready_(0))
+            {
+                // 集約中の送信キューを書き込めなかったため、再接続させる
+                close_(entry);
+                entry.retry_ = now;
+            }
+            schedule_(*worker, entry, now);
+        }
+
+        // 次に起きる時刻は最も早い期限(期限の直前に空回りしないよう切り上げる)
+        int32_t timeout = 1000; // タイムアウト時間[msec]
+        if (!worker->timers_.empty())
+        {
+            auto remain = std::chrono::duration_cast<std::chrono::microseconds>(worker->timers_.top().deadline_ - std::chrono::steady_clock::now()).count();
+            int64_t ms = (remain <= 0) ? 0 : (remain + 999) / 1000;
+            timeout = (ms < timeout) ? static_cast<int32_t>(ms) : timeout;
+        }
+
+        int32_t nfds = ::epoll_wait(worker->epfd_, events, MAX_EVENTS, timeout);
+        if ((nfds == -1) && (errno != EINTR))
+        {
+            LOGGER_ERROR(logid_, "ERR! wait epfd err:%d", errno);
+        }
+        now = std::chrono::steady_clock::now();
+        for (int32_t n = 0; n < nfds; n++)
+        {
+            if (events[n].data.u64 == 0)
+            {
+                uint64_t value = 0;
+                (void)::read(worker->wakeFd_, &value, sizeof(value));
+                continue;
+            }
+            auto it = worker->entries_.find(reinterpret_cast<Client *>(static_cast<uintptr_t>(events[n].data.u64)));
+            if (it == worker->entries_.end())
+            {
+                continue;
+            }
+            Entry &entry = *it->second;
+            if (entry.state_ == Entry::State::CONNECTING)
+            {
+                // 非同期の接続が完了した
+                if (!entry.client_->clientSock_.do_connect_finish())
+                {
+                    close_(entry);
+                    entry.retry_ = now + std::chrono::milliseconds(100);
+                }
+                else
+                {
+                    entry.state_ = Entry::State::CONNECTED;
+                    connected_(entry, now);
+                }
+            }
+            else if (entry.state_ == Entry::State::CONNECTED)
+            {
+                if (!entry.client_->ready_(events[n].events))
+                {
+                    // 接続が切れたため、再接続させる
+                    close_(entry);
+                    entry.retry_ = now;
+                }
+            }
+            schedule_(*worker, entry, now);
+        }
+    }
+
+    // 割り当て中のClientは切断する(再開すると再接続する)
+    for (auto &item : worker->entries_)
+    {
+        close_(*item.second);
+        item.second->retry_ = std::chrono::steady_clock::now();
+        item.second->timer_ = std::chrono::steady_clock::time_point::max();
+        item.first->clientSock_.setLoop(-1, 0, nullptr);
+    }
+    while (!worker->timers_.empty())
+    {
+        worker->timers_.pop();
+    }
+    {
+        std::lock_guard<std::mutex> lock(worker->mtx_);
+        worker->woken_.clear();
+        worker->cv_.notify_all();
+    }
+    LOGGER_INFO(logid_, "task end");
+}
+
+void ClientLoop::connect_(Worker &worker, Entry &entry, const std::chrono::steady_clock::time_point now)
+{
+    Client &client = *entry.client_;
+    int32_t ret = client.connect_(true);
+    if (ret < 0)
+    {
+        // リトライ
+        client.clientSock_.do_delete();
+        entry.retry_ = now + std::chrono::milliseconds(100);
+        return;
+    }
+    if (ret == 1)
+    {
+        // 書き込み可能になれば接続が完了している
+        entry.state_ = Entry::State::CONNECTING;
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.u64 = tag_(&client);
+        if (::epoll_ctl(worker.epfd_, EPOLL_CTL_ADD, client.clientSock_.get(), &ev) == -1)
+        {
+            LOGGER_ERROR(logid_, "ERR! ctl_add epfd err:%d", errno);
+            close_(entry);
+            entry.retry_ = now + std::chrono::milliseconds(100);
+        }
+        return;
+    }
+    entry.state_ = Entry::State::CONNECTED;
+    connected_(entry, now);
+}
+
+void ClientLoop::connected_(Entry &entry, const std::chrono::steady_clock::time_point now)
+{
+    Client &client = *entry.client_;
+    client.connected_();
+    // 受信の監視を開始し、接続前に積まれたタスクを実行する
+    if (!client.clientSock_.do_watch())
+    {
+        close_(entry);
+        entry.retry_ = now + std::chrono::milliseconds(100);
+        return;
+    }
+    if (!client.ready_(0))
+    {
+        close_(entry);
+        entry.retry_ = now;
+    }
+}
+
+void ClientLoop::schedule_(Worker &worker, Entry &entry, const std::chrono::steady_clock::time_point now)
+{
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (entry.state_ == Entry::State::IDLE)
+    {
+        deadline = entry.retry_;
+    }
+    else if (entry.state_ == Entry::State::CONNECTED)
+    {
+        // 集約中の送信キューの期限と、RPCの応答待ちの期限(期限を過ぎた要求はここで通知する)
+        std::chrono::steady_clock::time_point next;
+        if (entry.client_->clientSock_.waitDeadline(next) && (next < deadline))
+        {
+            deadline = next;
+        }
+        if (entry.client_->calls_.expire(now, next) && (next < deadline))
+        {
+            deadline = next;
+        }
+    }
+    // 積んだ期限より早まった場合のみ積む(遅くなった場合は、古い期限で起きた時点で積み直す)
+    if (deadline < entry.timer_)
+    {
+        entry.timer_ = deadline;
+        Timer timer;
+        timer.deadline_ = deadline;
+        timer.client_ = entry.client_;
+        worker.timers_.push(timer);
+    }
+}
+
+void ClientLoop::close_(Entry &entry)
+{
+    // ソケットを閉じるとループのepollの監視対象から外れる
+    if (entry.state_ == Entry::State::CONNECTING)
+    {
+        entry.client_->clientSock_.do_delete();
+    }
+    else if (entry.state_ == Entry::State::CONNECTED)
+    {
+        entry.client_->disconnect_();
+    }
+    entry.state_ = Entry::State::IDLE;
+}
+
+uint64_t ClientLoop::tag_(Client *client)
+{
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(client));
+}
@@ -0,0 +1,109 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "MySocket.hpp"
+
+// 複数のClientの接続を少数のスレッドで多重化するイベントループ
+// Client::setLoopで割り当てたClientは自身のスレッドを起動せず、ループのスレッドで接続・受信・再接続する
+// Clientの接続ソケットをループのepollに直接登録し、イベントのあったClientのみ処理する
+// (Clientごとのepoll・eventfd・RPCの監視スレッドは作成しない)
+// 再接続・送信の集約・RPCの応答待ちの期限は、ループごとの1つのタイマー(期限順のヒープ)で監視する
+// 割り当てたClientより後に破棄すること
+class ClientLoop
+{
+private:
+    // ループに割り当てたClientの接続状態(ループのスレッドのみが参照する)
+    class Entry
+    {
+    public:
+        enum class State
+        {
+            IDLE,       // 未接続(retry_に接続を試みる)
+            CONNECTING, // 非同期の接続中(ソケットの書き込み可能を待つ)
+            CONNECTED,  // 接続中(ソケットのイベントを待つ)
+        };
+
+    public:
+        Client *client_ = nullptr;
+        State state_ = State::IDLE;
+        std::chrono::steady_clock::time_point retry_;
+        std::chrono::steady_clock::time_point timer_ = std::chrono::steady_clock::time_point::max(); // タイマーに積んだ期限
+    };
+
+    // タイマーに積む期限(期限を更新したEntryの古い期限は、取り出した時点で読み捨てる)
+    class Timer
+    {
+    public:
+        std::chrono::steady_clock::time_point deadline_;
+        Client *client_ = nullptr;
+
+    public:
+        bool operator>(const Timer &other) const;
+    };
+
+    // ループのスレッドごとのepollと、割り当てたClient
+    class Worker : public Socket::Waker
+    {
+    public:
+        std::thread th_;
+        int32_t epfd_ = -1;
+        int32_t wakeFd_ = -1; // 追加・削除の要求とClientのタスクでループを起こすeventfd
+        std::mutex mtx_;
+        std::condition_variable cv_;
+        std::unordered_set<Client *> clients_; // 割り当て中のClient(mtx_をロックして参照する)
+        std::vector<Client *> added_;          // 追加待ち(mtx_をロックして参照する)
+        std::vector<Client *> removed_;        // 削除待ち(mtx_をロックして参照する)
+        std::vector<Client *> woken_;          // タスクを積んだClient(mtx_をロックして参照する)
+        bool wakePending_ = false;             // eventfdに書き込み済み(mtx_をロックして参照する)
+        std::unordered_map<Client *, std::unique_ptr<Entry>> entries_;
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+
+    public:
+        void wake(const uint64_t tag) override;
+        // mtx_をロックして呼ぶ
+        void notify_();
+    };
+
+private:
+    int32_t logid_ = 0;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool> isRunning_;
+    std::atomic<uint32_t> next_; // 次に割り当てるWorker
+
+public:
+    ClientLoop(int32_t logid = 0);
+    ~ClientLoop();
+    ClientLoop(const ClientLoop &) = delete;
+    ClientLoop &operator=(const ClientLoop &) = delete;
+    // ループのスレッド数(開始前に呼ぶ)
+    void setThreadNum(const int32_t threadNum);
+    bool start();
+    // 割り当て中のClientは切断し、再開すると再接続する
+    void end();
+    size_t clientCount();
+
+private:
+    friend class Client;
+    void attach_(Client *client);
+    // ループのスレッドが切断し終えるまで待つ
+    void detach_(Client *client);
+    void task_(Worker *worker);
+    void connect_(Worker &worker, Entry &entry, const std::chrono::steady_clock::time_point now);
+    void connected_(Entry &entry, const std::chrono::steady_clock::time_point now);
+    // Entryの次の期限をタイマーに積む
+    void schedule_(Worker &worker, Entry &entry, const std::chrono::steady_clock::time_point now);
+    void close_(Entry &entry);
+    static uint64_t tag_(Client *client);
+};
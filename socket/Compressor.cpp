@@ -0,0 +1,279 @@
+﻿#include "Compressor.hpp"
+
+#include <cstring>
+
+namespace
+{
+const int32_t LAST_LITERALS = 5; // 末尾の5バイトは必ずリテラルにする
+const int32_t MF_LIMIT = 12;     // 末尾12バイト以内からは一致を探さない
+const int32_t SKIP_SHIFT = 6;    // 一致が見つからない間は探索の間隔を広げる
+const int32_t MAX_RATIO = 255;   // 1バイトの圧縮データが表せる最大の伸長サイズ
+
+uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash(const uint32_t v, const int32_t bits)
+{
+    return (v * 2654435761U) >> (32 - bits);
+}
+
+// 長さの15以上の部分を255の連続で書く
+uint8_t *write_length(uint8_t *op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = static_cast<uint8_t>(len);
+    return op;
+}
+
+// 長さの15以上の部分を読む(データが途中で終わった場合はfalse)
+bool read_length(const uint8_t *&ip, const uint8_t *iend, size_t &len)
+{
+    uint8_t b = 0;
+    do
+    {
+        if (ip >= iend)
+        {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+} // namespace
+
+int32_t Compressor::compress(const char *src, const int32_t srcSize, char *dst, const int32_t dstCapacity)
+{
+    const uint8_t *const base = reinterpret_cast<const uint8_t *>(src);
+    const uint8_t *const iend = base + srcSize;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    uint8_t *op = reinterpret_cast<uint8_t *>(dst);
+    uint8_t *const oend = op + dstCapacity;
+
+    if (srcSize > MF_LIMIT)
+    {
+        // 位置はbaseからのオフセットで保持する(候補は一致を確認するため、初期値0でも誤らない)
+        // 小さなデータではハッシュ表も小さくして、初期化の時間を抑える
+        int32_t bits = 8;
+        while ((bits < HASH_BITS) && ((1 << (bits + 2)) < srcSize))
+        {
+            bits++;
+        }
+        uint32_t table[1 << HASH_BITS];
+        std::memset(table, 0, sizeof(uint32_t) << bits);
+        const uint8_t *const mflimit = iend - MF_LIMIT;
+        const uint8_t *const matchlimit = iend - LAST_LITERALS;
+        int32_t misses = 0;
+        ip++;
+        while (ip < mflimit)
+        {
+            const uint32_t seq = read32(ip);
+            const uint32_t h = hash(seq, bits);
+            const uint8_t *ref = base + table[h];
+            table[h] = static_cast<uint32_t>(ip - base);
+            if ((ip - ref > MAX_DISTANCE) || (read32(ref) != seq) || (ref >= ip))
+            {
+                ip += 1 + (misses++ >> SKIP_SHIFT);
+                continue;
+            }
+            misses = 0;
+
+            // 一致を前後に伸ばす
+            while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1]))
+            {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + MIN_MATCH;
+            const uint8_t *mr = ref + MIN_MATCH;
+            while ((mp + sizeof(uint64_t) <= matchlimit) && (read64(mp) == read64(mr)))
+            {
+                mp += sizeof(uint64_t);
+                mr += sizeof(uint64_t);
+            }
+            while ((mp < matchlimit) && (*mp == *mr))
+            {
+                mp++;
+                mr++;
+            }
+
+            // トークン・リテラル・距離・一致長を書く(出力先に収まらなければ圧縮をやめる)
+            const size_t litLen = static_cast<size_t>(ip - anchor);
+            const size_t matchLen = static_cast<size_t>(mp - ip - MIN_MATCH);
+            if (static_cast<size_t>(oend - op) < 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1)
+            {
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = static_cast<uint8_t>(((litLen < 15) ? litLen : 15) << 4);
+            if (litLen >= 15)
+            {
+                op = write_length(op, litLen - 15);
+            }
+            std::memcpy(op, anchor, litLen);
+            op += litLen;
+            const uint32_t offset = static_cast<uint32_t>(ip - ref);
+            *op++ = static_cast<uint8_t>(offset);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+            *token = static_cast<uint8_t>(*token | ((matchLen < 15) ? matchLen : 15));
+            if (matchLen >= 15)
+            {
+                op = write_length(op, matchLen - 15);
+            }
+
+            ip = mp;
+            anchor = ip;
+            if (ip < mflimit)
+            {
+                table[hash(read32(ip - 2), bits)] = static_cast<uint32_t>(ip - 2 - base);
+            }
+        }
+    }
+
+    // 残りはリテラルのみの最後のシーケンスにする
+    const size_t litLen = static_cast<size_t>(iend - anchor);
+    if (static_cast<size_t>(oend - op) < 1 + litLen / 255 + 1 + litLen)
+    {
+        return 0;
+    }
+    *op++ = static_cast<uint8_t>(((litLen < 15) ? litLen : 15) << 4);
+    if (litLen >= 15)
+    {
+        op = write_length(op, litLen - 15);
+    }
+    std::memcpy(op, anchor, litLen);
+    op += litLen;
+    return static_cast<int32_t>(op - reinterpret_cast<uint8_t *>(dst));
+}
+
+int32_t Compressor::decompress(const char *src, const int32_t srcSize, char *dst, const int32_t dstSize)
+{
+    // 受信データは信用できないため、読み書きの範囲を全て確認する
+    const uint8_t *ip = reinterpret_cast<const uint8_t *>(src);
+    const uint8_t *const iend = ip + srcSize;
+    uint8_t *const obase = reinterpret_cast<uint8_t *>(dst);
+    uint8_t *op = obase;
+    uint8_t *const oend = obase + dstSize;
+
+    while (true)
+    {
+        if (ip >= iend)
+        {
+            return -1;
+        }
+        const uint8_t token = *ip++;
+
+        size_t litLen = token >> 4;
+        if ((litLen == 15) && !read_length(ip, iend, litLen))
+        {
+            return -1;
+        }
+        if ((litLen > static_cast<size_t>(iend - ip)) || (litLen > static_cast<size_t>(oend - op)))
+        {
+            return -1;
+        }
+        std::memcpy(op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == iend)
+        {
+            // 最後のシーケンス
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        const size_t offset = static_cast<size_t>(ip[0]) | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > static_cast<size_t>(op - obase)))
+        {
+            return -1;
+        }
+        size_t matchLen = token & 15;
+        if ((matchLen == 15) && !read_length(ip, iend, matchLen))
+        {
+            return -1;
+        }
+        matchLen += MIN_MATCH;
+        if (matchLen > static_cast<size_t>(oend - op))
+        {
+            return -1;
+        }
+        const uint8_t *ref = op - offset;
+        if (offset >= matchLen)
+        {
+            std::memcpy(op, ref, matchLen);
+            op += matchLen;
+        }
+        else
+        {
+            // 重なる一致(繰り返し)は1バイトずつコピーする
+            for (size_t i = 0; i < matchLen; i++)
+            {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return (op == oend) ? dstSize : -1;
+}
+
+bool Compressor::pack(const char *data, const int32_t size, Buffer &packed)
+{
+    // 圧縮後のサイズが上限を超えた時点で圧縮をやめる(圧縮率の悪いデータに時間をかけない)
+    const int32_t limit = size - (size >> RATIO_SHIFT);
+    if (limit <= 0)
+    {
+        return false;
+    }
+    packed = BufferPool::instance().get(static_cast<int32_t>(sizeof(int32_t)) + limit);
+    int32_t compressed = compress(data, size, packed.data() + sizeof(int32_t), limit);
+    if (compressed <= 0)
+    {
+        packed.reset();
+        return false;
+    }
+    std::memcpy(packed.data(), &size, sizeof(size));
+    packed.resize(static_cast<int32_t>(sizeof(int32_t)) + compressed);
+    return true;
+}
+
+bool Compressor::unpack(const Buffer &packed, Buffer &buffer)
+{
+    if (packed.size() < static_cast<int32_t>(sizeof(int32_t)))
+    {
+        return false;
+    }
+    int32_t size = 0;
+    std::memcpy(&size, packed.data(), sizeof(size));
+    const int32_t compressed = packed.size() - static_cast<int32_t>(sizeof(int32_t));
+    // 圧縮データから伸長できる最大サイズを超えるサイズは不正とする(巨大なバッファを確保させない)
+    if ((size < 0) || (static_cast<int64_t>(size) > static_cast<int64_t>(compressed) * MAX_RATIO))
+    {
+        return false;
+    }
+    Buffer out = BufferPool::instance().get(size);
+    if (decompress(packed.data() + sizeof(int32_t), compressed, out.data(), size) != size)
+    {
+        return false;
+    }
+    buffer = std::move(out);
+    return true;
+}
@@ -0,0 +1,27 @@
+﻿#pragma once
+
+#include <cstdint>
+
+#include "BufferPool.hpp"
+
+// フレームのデータ圧縮(LZ4のブロック形式と同じ、リテラルと一致(距離・長さ)の列)
+// 圧縮フレームのデータは、先頭4バイトに圧縮前のサイズ、続けて圧縮したバイト列を置く
+class Compressor
+{
+public:
+    static constexpr int32_t MIN_MATCH = 4;
+    static constexpr int32_t MAX_DISTANCE = 65535;
+    static constexpr int32_t HASH_BITS = 13;
+    // 圧縮しても1/RATIO_SHIFT以上小さくならない場合は圧縮せずに送る(1/8)
+    static constexpr int32_t RATIO_SHIFT = 3;
+
+public:
+    // 圧縮したバイト数を返す(dstCapacityに収まらない場合は0)
+    static int32_t compress(const char *src, const int32_t srcSize, char *dst, const int32_t dstCapacity);
+    // 伸長したバイト数を返す(不正なデータまたはdstSizeと一致しない場合は-1)
+    static int32_t decompress(const char *src, const int32_t srcSize, char *dst, const int32_t dstSize);
+    // 圧縮フレームのデータをプールのバッファに作る(圧縮率が悪い場合はfalse)
+    static bool pack(const char *data, const int32_t size, Buffer &packed);
+    // 圧縮フレームのデータをプールのバッファに伸長する(不正なデータの場合はfalse)
+    static bool unpack(const Buffer &packed, Buffer &buffer);
+};
@@ -0,0 +1,34 @@
+﻿#include "ConnectionTable.hpp"
+
+#include <mutex>
+
+int64_t ConnectionId::issue(const int32_t fd, const int32_t loop)
+{
+    static std::mutex mtx;
+    static std::vector<uint32_t> generations;
+
+    if ((fd < 0) || (fd > FD_MASK) || (loop < 0) || (loop > LOOP_MAX))
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    size_t idx = static_cast<size_t>(fd);
+    if (idx >= generations.size())
+    {
+        generations.resize(idx + 1, 0);
+    }
+    // 世代は1〜GEN_MAXを巡回する(0は使わないため、接続IDは常に正の値)
+    uint32_t gen = (generations[idx] % GEN_MAX) + 1;
+    generations[idx] = gen;
+    return (static_cast<int64_t>(gen) << (LOOP_BITS + FD_BITS)) | (static_cast<int64_t>(loop) << FD_BITS) | fd;
+}
+
+int32_t ConnectionId::fd(const int64_t id)
+{
+    return static_cast<int32_t>(id & FD_MASK);
+}
+
+int32_t ConnectionId::loop(const int64_t id)
+{
+    return static_cast<int32_t>((id >> FD_BITS) & LOOP_MAX);
+}
@@ -0,0 +1,129 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+
+// 接続ID: (世代 << (LOOP_BITS + FD_BITS)) | (ループ番号 << FD_BITS) | fd
+// fdは切断後に再利用されるため、世代を付けて以前の接続IDと一致しないようにする
+// ループ番号は、Serverが接続を持つイベントループを探索せずに求めるために付ける
+class ConnectionId
+{
+public:
+    static constexpr int32_t FD_BITS = 24;
+    static constexpr int32_t FD_MASK = (1 << FD_BITS) - 1;
+    static constexpr int32_t LOOP_BITS = 8;
+    static constexpr int32_t LOOP_MAX = (1 << LOOP_BITS) - 1;
+    // io_uringのuser_dataに3bit左シフトして入れるため、接続IDは61bitに収める
+    static constexpr int32_t GEN_BITS = 61 - LOOP_BITS - FD_BITS;
+    static constexpr uint32_t GEN_MAX = (1U << GEN_BITS) - 1;
+
+public:
+    // fdに新しい世代を割り当てて接続IDを返す(fdかループ番号が範囲外の場合は0)
+    // 世代はプロセス全体で共有するため、複数のイベントループ間でも接続IDは重複しない
+    static int64_t issue(const int32_t fd, const int32_t loop);
+    static int32_t fd(const int64_t id);
+    static int32_t loop(const int64_t id);
+};
+
+// fdを添字とする接続テーブル(追加・検索・削除がO(1))
+// 要素は削除後も保持し、同じfdの次の接続で再利用する
+template <typename T>
+class ConnectionTable
+{
+private:
+    class Slot
+    {
+    public:
+        int64_t id_ = 0; // 0:未使用
+        std::unique_ptr<T> value_;
+    };
+
+private:
+    std::vector<Slot> slots_;
+    size_t count_ = 0;
+    int32_t loop_ = 0;
+
+public:
+    // 接続IDに付けるループ番号を設定する(接続を追加する前に呼ぶ)
+    void setLoop(const int32_t loop)
+    {
+        loop_ = loop;
+    }
+
+    // 追加した要素を返す(fdが範囲外または使用中の場合はnullptr)
+    T *add(const int32_t fd, int64_t &id)
+    {
+        if ((fd < 0) || (fd > ConnectionId::FD_MASK))
+        {
+            return nullptr;
+        }
+        size_t idx = static_cast<size_t>(fd);
+        if (idx >= slots_.size())
+        {
+            slots_.resize(idx + 1);
+        }
+        Slot &slot = slots_[idx];
+        if (slot.id_ != 0)
+        {
+            return nullptr;
+        }
+        slot.id_ = ConnectionId::issue(fd, loop_);
+        if (slot.id_ == 0)
+        {
+            return nullptr;
+        }
+        if (!slot.value_)
+        {
+            slot.value_.reset(new T());
+        }
+        count_++;
+        id = slot.id_;
+        return slot.value_.get();
+    }
+
+    T *find(const int64_t id) const
+    {
+        if (id <= 0)
+        {
+            return nullptr;
+        }
+        size_t idx = static_cast<size_t>(ConnectionId::fd(id));
+        if ((idx >= slots_.size()) || (slots_[idx].id_ != id))
+        {
+            return nullptr;
+        }
+        return slots_[idx].value_.get();
+    }
+
+    bool remove(const int64_t id)
+    {
+        if (find(id) == nullptr)
+        {
+            return false;
+        }
+        slots_[static_cast<size_t>(ConnectionId::fd(id))].id_ = 0;
+        count_--;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return count_;
+    }
+
+    std::vector<int64_t> ids() const
+    {
+        std::vector<int64_t> ids;
+        ids.reserve(count_);
+        for (const Slot &slot : slots_)
+        {
+            if (slot.id_ != 0)
+            {
+                ids.emplace_back(slot.id_);
+            }
+        }
+        return ids;
+    }
+};
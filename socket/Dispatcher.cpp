@@ -0,0 +1,106 @@
+﻿#include "Dispatcher.hpp"
+
+#include <utility>
+
+#include "MyThread.hpp"
+
+Dispatcher::Dispatcher()
+{
+}
+
+Dispatcher::~Dispatcher()
+{
+    wait();
+}
+
+void Dispatcher::setPool(ThreadPool *pool)
+{
+    pool_ = pool;
+}
+
+void Dispatcher::setHandler(const std::function<void(int64_t, uint8_t, Buffer &)> &handler)
+{
+    handler_ = handler;
+}
+
+bool Dispatcher::enabled() const
+{
+    return (pool_ != nullptr);
+}
+
+void Dispatcher::dispatch(const int64_t id, const uint8_t flags, Buffer &&buffer)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Strand &strand = strands_[id];
+        strand.queue_.emplace_back();
+        strand.queue_.back().flags_ = flags;
+        strand.queue_.back().buffer_ = std::move(buffer);
+        if (strand.scheduled_)
+        {
+            // 処理中のタスクが続けて処理する
+            return;
+        }
+        strand.scheduled_ = true;
+        running_++;
+    }
+
+    auto task = [this, id]()
+    {
+        drain_(id);
+    };
+    if (!pool_->add(task))
+    {
+        // ThreadPoolのキューが一杯の場合は受信スレッドで処理する(受信が遅れることで送信元に背圧がかかる)
+        drain_(id);
+    }
+}
+
+void Dispatcher::wait()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (running_ > 0)
+    {
+        cv_.wait(lock);
+    }
+}
+
+void Dispatcher::drain_(const int64_t id)
+{
+    int32_t count = 0;
+    while (true)
+    {
+        if (count >= MAX_BATCH)
+        {
+            // 他の接続のフレームを先に処理させるため、続きは新しいタスクで処理する
+            auto task = [this, id]()
+            {
+                drain_(id);
+            };
+            if (pool_->add(task))
+            {
+                return;
+            }
+            // キューが一杯の場合はこのまま続けて処理する
+            count = 0;
+        }
+
+        Frame frame;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto itr = strands_.find(id);
+            if (itr->second.queue_.empty())
+            {
+                // 処理待ちが無くなった接続は削除する(切断の通知を受けずに済むように)
+                strands_.erase(itr);
+                running_--;
+                cv_.notify_all();
+                return;
+            }
+            frame = std::move(itr->second.queue_.front());
+            itr->second.queue_.pop_front();
+        }
+        handler_(id, frame.flags_, frame.buffer_);
+        count++;
+    }
+}
@@ -0,0 +1,59 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "BufferPool.hpp"
+
+class ThreadPool;
+
+// 受信フレームをThreadPoolに渡して受信スレッド以外で処理する
+// 同じ接続のフレームは受信順に1つずつ処理し、異なる接続のフレームは並列に処理する
+class Dispatcher
+{
+public:
+    // 1回のタスクで処理する最大フレーム数(超えた場合はタスクを積み直して他の接続に譲る)
+    static constexpr int32_t MAX_BATCH = 16;
+
+private:
+    // 未処理フレーム(flags_はフレームのヘッダのフラグ)
+    class Frame
+    {
+    public:
+        uint8_t flags_ = 0;
+        Buffer buffer_;
+    };
+
+    // 接続ごとの未処理フレーム(scheduled_がtrueの間はThreadPoolにタスクが1つだけ存在する)
+    class Strand
+    {
+    public:
+        std::deque<Frame> queue_;
+        bool scheduled_ = false;
+    };
+
+private:
+    ThreadPool *pool_ = nullptr;
+    std::function<void(int64_t, uint8_t, Buffer &)> handler_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::map<int64_t, Strand> strands_;
+    int32_t running_ = 0;
+
+public:
+    Dispatcher();
+    ~Dispatcher();
+    void setPool(ThreadPool *pool);
+    void setHandler(const std::function<void(int64_t, uint8_t, Buffer &)> &handler);
+    bool enabled() const;
+    void dispatch(const int64_t id, const uint8_t flags, Buffer &&buffer);
+    // 積まれているフレームを全て処理し終えるまで待つ
+    void wait();
+
+private:
+    void drain_(const int64_t id);
+};
@@ -1,13 +1,17 @@
 ﻿#include "Logger.hpp"
 #include <stdarg.h>
-#include <mutex>
-
-#define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 namespace
 {
-    static Logger *instance_ = nullptr;
-    //std::mutex mtx_;
+    static std::atomic<Logger *> instance_{nullptr};
+    static uint64_t generations_ = 0; // init()の回数(deinit()前のリングを使い続けないため)
 
     static constexpr int32_t TAB_NUM = 3;
 
@@ -20,14 +24,583 @@ namespace
         }
         return tabs;
     }
+
+    // リング上の1件の先頭(fmt_がnullptrの場合はリングの終端までの詰め物)
+    // 続けて、書式の変換指定の順に引数の値を8バイト単位で置く
+    // 文字列は8バイトの長さに続けて、終端の'\0'を含めた文字列を8バイト境界まで置く
+    class RecordHead
+    {
+    public:
+        uint32_t size_; // 先頭を含めた8バイト単位のサイズ
+        int32_t logid_;
+        const char *fmt_;
+        uint64_t time_; // エポックからのナノ秒
+    };
+
+    // バイナリファイルの形式
+    // [MAGIC 8バイト] に続けて [種別 4バイト][本体のサイズ 4バイト][本体] を繰り返す
+    static constexpr char MAGIC[8] = {'S', 'O', 'C', 'K', 'L', 'O', 'G', '1'};
+    enum FileRecord : uint32_t
+    {
+        FORMAT = 1,  // 書式ID 4バイト + 書式の文字列
+        ENTRY = 2,   // 書式ID 4バイト + logid 4バイト + 時刻 8バイト + 引数の値
+        DROPPED = 3, // 捨てた件数 8バイト
+    };
+
+    size_t align8(size_t size)
+    {
+        return (size + 7) & ~static_cast<size_t>(7);
+    }
+
+    // printfの変換指定1つ
+    class FormatSpec
+    {
+    public:
+        enum class Length
+        {
+            NONE,
+            HH,
+            H,
+            L,
+            LL,
+            Z,
+            J,
+            T,
+            LD,
+        };
+
+    public:
+        const char *begin_ = nullptr;
+        size_t size_ = 0;
+        Length length_ = Length::NONE;
+        char conv_ = '\0';
+        int32_t starNum_ = 0;           // '*'で引数から取る幅・精度の数
+        bool precisionStar_ = false;    // 精度を引数から取る
+        int32_t precision_ = -1;        // 精度(指定が無い場合は-1)
+    };
+
+    // pは'%'を指す。変換指定を解析して、その次の位置を返す
+    const char *parse_spec(const char *p, FormatSpec &spec)
+    {
+        spec = FormatSpec();
+        spec.begin_ = p;
+        p++;
+        while ((*p == '-') || (*p == '+') || (*p == ' ') || (*p == '#') || (*p == '0') || (*p == '\''))
+        {
+            p++;
+        }
+        if (*p == '*')
+        {
+            spec.starNum_++;
+            p++;
+        }
+        while ((*p >= '0') && (*p <= '9'))
+        {
+            p++;
+        }
+        if (*p == '.')
+        {
+            p++;
+            spec.precision_ = 0;
+            if (*p == '*')
+            {
+                spec.starNum_++;
+                spec.precisionStar_ = true;
+                p++;
+            }
+            while ((*p >= '0') && (*p <= '9'))
+            {
+                spec.precision_ = spec.precision_ * 10 + (*p - '0');
+                p++;
+            }
+        }
+        switch (*p)
+        {
+        case 'h':
+            p++;
+            spec.length_ = (*p == 'h') ? FormatSpec::Length::HH : FormatSpec::Length::H;
+            p += (*p == 'h') ? 1 : 0;
+            break;
+        case 'l':
+            p++;
+            spec.length_ = (*p == 'l') ? FormatSpec::Length::LL : FormatSpec::Length::L;
+            p += (*p == 'l') ? 1 : 0;
+            break;
+        case 'z':
+            spec.length_ = FormatSpec::Length::Z;
+            p++;
+            break;
+        case 'j':
+            spec.length_ = FormatSpec::Length::J;
+            p++;
+            break;
+        case 't':
+            spec.length_ = FormatSpec::Length::T;
+            p++;
+            break;
+        case 'L':
+            spec.length_ = FormatSpec::Length::LD;
+            p++;
+            break;
+        default:
+            break;
+        }
+        spec.conv_ = *p;
+        if (*p != '\0')
+        {
+            p++;
+        }
+        spec.size_ = static_cast<size_t>(p - spec.begin_);
+        return p;
+    }
+
+    typedef std::make_signed<size_t>::type ssize_type;
+
+    // 引数の値を取り出して8バイトの値にする(va_argは呼び出し側の型で読む必要がある)
+    int64_t read_signed(FormatSpec::Length length, va_list &ap)
+    {
+        switch (length)
+        {
+        case FormatSpec::Length::L:
+            return va_arg(ap, long);
+        case FormatSpec::Length::LL:
+            return va_arg(ap, long long);
+        case FormatSpec::Length::Z:
+            return va_arg(ap, ssize_type);
+        case FormatSpec::Length::J:
+            return va_arg(ap, intmax_t);
+        case FormatSpec::Length::T:
+            return va_arg(ap, ptrdiff_t);
+        default:
+            return va_arg(ap, int);
+        }
+    }
+    uint64_t read_unsigned(FormatSpec::Length length, va_list &ap)
+    {
+        switch (length)
+        {
+        case FormatSpec::Length::L:
+            return va_arg(ap, unsigned long);
+        case FormatSpec::Length::LL:
+            return va_arg(ap, unsigned long long);
+        case FormatSpec::Length::Z:
+            return va_arg(ap, size_t);
+        case FormatSpec::Length::J:
+            return va_arg(ap, uintmax_t);
+        case FormatSpec::Length::T:
+            return static_cast<uint64_t>(va_arg(ap, ptrdiff_t));
+        default:
+            return va_arg(ap, unsigned int);
+        }
+    }
+
+    bool put_slot(char *args, size_t capacity, size_t &pos, const void *value)
+    {
+        if (pos + 8 > capacity)
+        {
+            return false;
+        }
+        std::memcpy(args + pos, value, 8);
+        pos += 8;
+        return true;
+    }
+
+    // 書式の変換指定の順に引数の値をargsに詰め、詰めたサイズを返す(書式化はしない)
+    size_t encode_args(const char *fmt, va_list &ap, char *args, size_t capacity)
+    {
+        size_t pos = 0;
+        const char *p = fmt;
+        while ((p = std::strchr(p, '%')) != nullptr)
+        {
+            FormatSpec spec;
+            p = parse_spec(p, spec);
+            int32_t stars[2] = {0, 0};
+            for (int32_t i = 0; i < spec.starNum_; i++)
+            {
+                stars[i] = va_arg(ap, int);
+                const int64_t value = stars[i];
+                if (!put_slot(args, capacity, pos, &value))
+                {
+                    return pos;
+                }
+            }
+            const int32_t precision = spec.precisionStar_ ? stars[spec.starNum_ - 1] : spec.precision_;
+            bool isOk = true;
+            switch (spec.conv_)
+            {
+            case 'd':
+            case 'i':
+            {
+                const int64_t value = read_signed(spec.length_, ap);
+                isOk = put_slot(args, capacity, pos, &value);
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            {
+                const uint64_t value = read_unsigned(spec.length_, ap);
+                isOk = put_slot(args, capacity, pos, &value);
+                break;
+            }
+            case 'c':
+            {
+                const int64_t value = va_arg(ap, int);
+                isOk = put_slot(args, capacity, pos, &value);
+                break;
+            }
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+            {
+                const double value = (spec.length_ == FormatSpec::Length::LD) ? static_cast<double>(va_arg(ap, long double)) : va_arg(ap, double);
+                isOk = put_slot(args, capacity, pos, &value);
+                break;
+            }
+            case 'p':
+            {
+                const uint64_t value = reinterpret_cast<uintptr_t>(va_arg(ap, void *));
+                isOk = put_slot(args, capacity, pos, &value);
+                break;
+            }
+            case 's':
+            {
+                const char *text = va_arg(ap, const char *);
+                if (text == nullptr)
+                {
+                    text = "(null)";
+                }
+                // 精度がある場合は終端の'\0'が無い文字列もあるため、精度までしか読まない
+                size_t length = (precision >= 0) ? strnlen(text, static_cast<size_t>(precision)) : std::strlen(text);
+                if (pos + 8 + 8 > capacity)
+                {
+                    return pos;
+                }
+                length = std::min(length, capacity - pos - 8 - 1);
+                const uint64_t value = length;
+                (void)put_slot(args, capacity, pos, &value);
+                std::memcpy(args + pos, text, length);
+                std::memset(args + pos + length, 0, align8(length + 1) - length);
+                pos += align8(length + 1);
+                break;
+            }
+            case 'n':
+                (void)va_arg(ap, void *);
+                break;
+            case '%':
+                break;
+            default:
+                // 解析できない変換指定以降の引数は読まない
+                return pos;
+            }
+            if (!isOk)
+            {
+                return pos;
+            }
+        }
+        return pos;
+    }
+
+    template <typename T>
+    void append_value(std::string &out, const std::string &spec, const int32_t *stars, int32_t starNum, T value)
+    {
+        char wk[Logger::TEXT_MAX];
+        int ret = 0;
+        switch (starNum)
+        {
+        case 0:
+            ret = snprintf(&wk[0], sizeof(wk), spec.c_str(), value);
+            break;
+        case 1:
+            ret = snprintf(&wk[0], sizeof(wk), spec.c_str(), stars[0], value);
+            break;
+        default:
+            ret = snprintf(&wk[0], sizeof(wk), spec.c_str(), stars[0], stars[1], value);
+            break;
+        }
+        if (ret > 0)
+        {
+            out.append(&wk[0], std::min(static_cast<size_t>(ret), sizeof(wk) - 1));
+        }
+    }
+
+    bool get_slot(const char *args, size_t size, size_t &pos, void *value)
+    {
+        if (pos + 8 > size)
+        {
+            return false;
+        }
+        std::memcpy(value, args + pos, 8);
+        pos += 8;
+        return true;
+    }
+
+    // encode_args()で詰めた引数の値を書式に当てはめてoutに追加する
+    void format_args(const char *fmt, const char *args, size_t size, std::string &out)
+    {
+        const size_t start = out.size();
+        size_t pos = 0;
+        const char *p = fmt;
+        while (*p != '\0')
+        {
+            const char *percent = std::strchr(p, '%');
+            if (percent == nullptr)
+            {
+                out.append(p);
+                break;
+            }
+            out.append(p, static_cast<size_t>(percent - p));
+            FormatSpec spec;
+            p = parse_spec(percent, spec);
+            if (spec.conv_ == '%')
+            {
+                out += '%';
+                continue;
+            }
+            if (spec.conv_ == 'n')
+            {
+                continue;
+            }
+            int32_t stars[2] = {0, 0};
+            bool isOk = true;
+            for (int32_t i = 0; i < spec.starNum_; i++)
+            {
+                int64_t value = 0;
+                isOk = isOk && get_slot(args, size, pos, &value);
+                stars[i] = static_cast<int32_t>(value);
+            }
+            uint64_t value = 0;
+            if (!isOk || !get_slot(args, size, pos, &value))
+            {
+                // 引数が詰め切れなかった(または解析できない変換指定)以降は出力しない
+                break;
+            }
+            std::string specText(spec.begin_, spec.size_);
+            switch (spec.conv_)
+            {
+            case 'd':
+            case 'i':
+            {
+                const int64_t number = static_cast<int64_t>(value);
+                switch (spec.length_)
+                {
+                case FormatSpec::Length::L:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<long>(number));
+                    break;
+                case FormatSpec::Length::LL:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<long long>(number));
+                    break;
+                case FormatSpec::Length::Z:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<ssize_type>(number));
+                    break;
+                case FormatSpec::Length::J:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<intmax_t>(number));
+                    break;
+                case FormatSpec::Length::T:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<ptrdiff_t>(number));
+                    break;
+                default:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<int>(number));
+                    break;
+                }
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                switch (spec.length_)
+                {
+                case FormatSpec::Length::L:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<unsigned long>(value));
+                    break;
+                case FormatSpec::Length::LL:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<unsigned long long>(value));
+                    break;
+                case FormatSpec::Length::Z:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<size_t>(value));
+                    break;
+                case FormatSpec::Length::J:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<uintmax_t>(value));
+                    break;
+                case FormatSpec::Length::T:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<ptrdiff_t>(value));
+                    break;
+                default:
+                    append_value(out, specText, stars, spec.starNum_, static_cast<unsigned int>(value));
+                    break;
+                }
+                break;
+            case 'c':
+                append_value(out, specText, stars, spec.starNum_, static_cast<int>(value));
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+            {
+                double number = 0.0;
+                std::memcpy(&number, &value, sizeof(number));
+                // long doubleで書き込んでいないため、長さ修飾子を外す
+                specText.erase(std::remove(specText.begin(), specText.end(), 'L'), specText.end());
+                append_value(out, specText, stars, spec.starNum_, number);
+                break;
+            }
+            case 'p':
+                append_value(out, specText, stars, spec.starNum_, reinterpret_cast<void *>(static_cast<uintptr_t>(value)));
+                break;
+            case 's':
+            {
+                const size_t length = static_cast<size_t>(value);
+                if (pos + align8(length + 1) > size)
+                {
+                    isOk = false;
+                    break;
+                }
+                append_value(out, specText, stars, spec.starNum_, args + pos);
+                pos += align8(length + 1);
+                break;
+            }
+            default:
+                isOk = false;
+                break;
+            }
+            if (!isOk)
+            {
+                break;
+            }
+        }
+        if (out.size() - start > Logger::TEXT_MAX - 1)
+        {
+            out.resize(start + Logger::TEXT_MAX - 1);
+        }
+    }
+
+    void append_line(std::string &out, int32_t logid, const char *fmt, const char *args, size_t size)
+    {
+        const int32_t id = (logid <= 0) ? 0 : logid;
+        out += tabs(id);
+        format_args(fmt, args, size, out);
+        out += '\n';
+    }
+
+    void append_file(std::string &out, uint32_t type, const void *body, size_t size, const void *extra = nullptr, size_t extraSize = 0)
+    {
+        const uint32_t head[2] = {type, static_cast<uint32_t>(size + extraSize)};
+        out.append(reinterpret_cast<const char *>(&head[0]), sizeof(head));
+        out.append(static_cast<const char *>(body), size);
+        if (extraSize > 0)
+        {
+            out.append(static_cast<const char *>(extra), extraSize);
+        }
+    }
+
+    // print()中のスレッドが参照しているLogger(スレッドごとに1つ、deinit()は参照が外れるまで破棄しない)
+    std::mutex usersMtx_;
+    std::vector<const std::atomic<Logger *> *> users_;
+
+    // 終了したスレッドのリング(出力済みのもの)を保持しないように、スレッドの終了時に閉じる
+    class RingHolder
+    {
+    public:
+        std::shared_ptr<LogRing> ring_;
+        std::atomic<Logger *> using_;
+
+    public:
+        RingHolder() : using_(nullptr)
+        {
+            std::lock_guard<std::mutex> lock(usersMtx_);
+            users_.push_back(&using_);
+        }
+        ~RingHolder()
+        {
+            if (ring_)
+            {
+                ring_->closed_.store(true, std::memory_order_release);
+            }
+            std::lock_guard<std::mutex> lock(usersMtx_);
+            users_.erase(std::remove(users_.begin(), users_.end(), &using_), users_.end());
+        }
+        // 参照を登録してからinstance_を読み直し、deinit()が外した後のLoggerを使わない
+        Logger *acquire()
+        {
+            Logger *logger = instance_.load(std::memory_order_acquire);
+            while (logger != nullptr)
+            {
+                using_.store(logger, std::memory_order_seq_cst);
+                Logger *current = instance_.load(std::memory_order_seq_cst);
+                if (current == logger)
+                {
+                    return logger;
+                }
+                logger = current;
+            }
+            using_.store(nullptr, std::memory_order_release);
+            return nullptr;
+        }
+        void release()
+        {
+            using_.store(nullptr, std::memory_order_release);
+        }
+    };
+    thread_local RingHolder holder_;
+
+    bool in_use(const Logger *logger)
+    {
+        std::lock_guard<std::mutex> lock(usersMtx_);
+        for (const std::atomic<Logger *> *user : users_)
+        {
+            if (user->load(std::memory_order_seq_cst) == logger)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
 }
 
 Log::Log(int32_t id, std::string header) : id_(id), header_(header)
 {
-    LOG_DEBUG("%s%s\n", tabs(id_).c_str(), header_.c_str());
 }
 
-Logger::Logger()
+LogRing::LogRing(uint64_t generation) : head_(0), dropped_(0), closed_(false), tail_(0), generation_(generation), data_(new char[CAPACITY])
+{
+}
+
+bool LogRing::write(const char *data, size_t size)
+{
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    const uint64_t tail = tail_.load(std::memory_order_acquire);
+    const size_t offset = static_cast<size_t>(head & (CAPACITY - 1));
+    const size_t contig = CAPACITY - offset;
+    // 終端で途切れる場合は、終端までを詰め物にして先頭から書き込む
+    const size_t skip = (contig < size) ? contig : 0;
+    if (head + skip + size - tail > CAPACITY)
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (skip >= sizeof(RecordHead))
+    {
+        RecordHead pad = {static_cast<uint32_t>(skip), 0, nullptr, 0};
+        std::memcpy(&data_[offset], &pad, sizeof(pad));
+    }
+    std::memcpy(&data_[(head + skip) & (CAPACITY - 1)], data, size);
+    head_.store(head + skip + size, std::memory_order_release);
+    return true;
+}
+
+Logger::Logger(uint64_t generation, FILE *file) : wake_(false), generation_(generation), file_(file)
 {
 }
 
@@ -35,45 +608,337 @@ Logger::~Logger()
 {
 }
 
-void Logger::init()
+void Logger::init(const std::string &path)
 {
-    if (instance_ == nullptr)
+    if (instance_.load() == nullptr)
     {
-        instance_ = new Logger();
+        FILE *file = nullptr;
+        if (!path.empty())
+        {
+            file = fopen(path.c_str(), "wb");
+            if (file != nullptr)
+            {
+                (void)fwrite(&MAGIC[0], sizeof(MAGIC), 1, file);
+            }
+        }
+        generations_++;
+        Logger *logger = new Logger(generations_, file);
+        logger->isRunning_ = true;
+        std::thread th(&Logger::task_, logger);
+        logger->th_.swap(th);
+        instance_.store(logger);
     }
 }
 
 void Logger::deinit()
 {
-    if (instance_ != nullptr)
+    Logger *logger = instance_.exchange(nullptr);
+    if (logger != nullptr)
     {
-        delete instance_;
-        instance_ = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(logger->mtx_);
+            logger->isRunning_ = false;
+            logger->cv_.notify_all();
+        }
+        if (logger->th_.joinable())
+        {
+            logger->th_.join();
+        }
+        // 外す前に読み込んだスレッドがprint()・flush()を終えるまで待つ(出力スレッドの停止後の分は出力しない)
+        while (in_use(logger))
+        {
+            std::this_thread::yield();
+        }
+        if (logger->file_ != nullptr)
+        {
+            fclose(logger->file_);
+        }
+        delete logger;
     }
 }
 
 int32_t Logger::add(std::string header)
 {
-    return instance_->add_in(header);
+    Logger *logger = holder_.acquire();
+    if (logger == nullptr)
+    {
+        return 0;
+    }
+    int32_t idx = logger->add_in(header);
+    holder_.release();
+    return idx;
 }
 int32_t Logger::add_in(std::string header)
 {
-    int32_t idx = static_cast<int32_t>(logs_.size());
-    logs_.emplace_back(idx, header);
+    int32_t idx = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        idx = static_cast<int32_t>(logs_.size());
+        logs_.emplace_back(idx, header);
+    }
+    print(idx, "%s", header.c_str());
     return idx;
 }
 
-void Logger::print(int32_t logid, char *fmt, ...)
+void Logger::print(int32_t logid, const char *fmt, ...)
 {
-    char wk[1024];
+    // add()の中から呼ばれた場合は、add()が登録した参照をそのまま使う
+    RingHolder &holder = holder_;
+    const bool nested = (holder.using_.load(std::memory_order_relaxed) != nullptr);
+    Logger *logger = nested ? holder.using_.load(std::memory_order_relaxed) : holder.acquire();
+    if (logger == nullptr)
+    {
+        return;
+    }
+    alignas(8) char wk[sizeof(RecordHead) + ARGS_MAX];
     va_list ap;
     va_start(ap, fmt);
-    vsprintf(&wk[0], fmt, ap);
+    const size_t argSize = encode_args(fmt, ap, &wk[sizeof(RecordHead)], ARGS_MAX);
     va_end(ap);
-    instance_->print_(logid, wk);
+
+    RecordHead head;
+    head.size_ = static_cast<uint32_t>(sizeof(RecordHead) + argSize);
+    head.logid_ = logid;
+    head.fmt_ = fmt;
+    head.time_ = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    std::memcpy(&wk[0], &head, sizeof(head));
+
+    LogRing *ring = logger->ring_();
+    (void)ring->write(&wk[0], head.size_);
+    // 半分を超えたら出力スレッドを起こす(それまでは出力スレッドの周期で読み込む)
+    const uint64_t used = ring->head_.load(std::memory_order_relaxed) - ring->tail_.load(std::memory_order_relaxed);
+    if ((used > LogRing::CAPACITY / 2) && !logger->wake_.exchange(true))
+    {
+        logger->cv_.notify_all();
+    }
+    if (!nested)
+    {
+        holder.release();
+    }
 }
-void Logger::print_(int32_t logid, char *logtext)
+
+LogRing *Logger::ring_()
 {
-    int32_t id = (logid <= 0) ? 0 : logid;
-    LOG_DEBUG("%s%s\n", tabs(id).c_str(), logtext);
+    std::shared_ptr<LogRing> &ring = holder_.ring_;
+    if (!ring || (ring->generation_ != generation_))
+    {
+        if (ring)
+        {
+            ring->closed_.store(true, std::memory_order_release);
+        }
+        ring = std::make_shared<LogRing>(generation_);
+        std::lock_guard<std::mutex> lock(mtx_);
+        rings_.push_back(ring);
+    }
+    return ring.get();
+}
+
+void Logger::flush()
+{
+    Logger *logger = holder_.acquire();
+    if (logger == nullptr)
+    {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(logger->mtx_);
+        const uint64_t request = ++logger->flushRequest_;
+        logger->cv_.notify_all();
+        logger->cv_.wait(lock, [logger, request]() { return (logger->flushDone_ >= request) || !logger->isRunning_; });
+    }
+    holder_.release();
+}
+
+void Logger::task_()
+{
+    std::unordered_map<const char *, uint32_t> formats;
+    std::vector<std::shared_ptr<LogRing>> rings;
+    std::string out;
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (true)
+    {
+        const bool isRunning = isRunning_;
+        const uint64_t request = flushRequest_;
+        rings = rings_;
+        wake_.store(false);
+        lock.unlock();
+
+        for (auto &ring : rings)
+        {
+            const uint64_t dropped = ring->dropped_.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0)
+            {
+                if (file_ != nullptr)
+                {
+                    append_file(out, DROPPED, &dropped, sizeof(dropped));
+                }
+                else
+                {
+                    char wk[64];
+                    snprintf(&wk[0], sizeof(wk), "[Logger] dropped:%llu\n", static_cast<unsigned long long>(dropped));
+                    out += &wk[0];
+                }
+            }
+            const uint64_t head = ring->head_.load(std::memory_order_acquire);
+            uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+            while (tail < head)
+            {
+                const size_t offset = static_cast<size_t>(tail & (LogRing::CAPACITY - 1));
+                const size_t contig = LogRing::CAPACITY - offset;
+                if (contig < sizeof(RecordHead))
+                {
+                    tail += contig;
+                    continue;
+                }
+                RecordHead record;
+                std::memcpy(&record, &ring->data_[offset], sizeof(record));
+                if (record.fmt_ != nullptr)
+                {
+                    const char *args = &ring->data_[offset + sizeof(RecordHead)];
+                    const size_t argSize = record.size_ - sizeof(RecordHead);
+                    if (file_ != nullptr)
+                    {
+                        // 書式の文字列は初出時だけ書き込む
+                        auto found = formats.find(record.fmt_);
+                        if (found == formats.end())
+                        {
+                            const uint32_t id = static_cast<uint32_t>(formats.size());
+                            found = formats.emplace(record.fmt_, id).first;
+                            append_file(out, FORMAT, &id, sizeof(id), record.fmt_, std::strlen(record.fmt_));
+                        }
+                        char entry[16];
+                        std::memcpy(&entry[0], &found->second, 4);
+                        std::memcpy(&entry[4], &record.logid_, 4);
+                        std::memcpy(&entry[8], &record.time_, 8);
+                        append_file(out, ENTRY, &entry[0], sizeof(entry), args, argSize);
+                    }
+                    else
+                    {
+                        append_line(out, record.logid_, record.fmt_, args, argSize);
+                    }
+                }
+                tail += record.size_;
+                // 書式化した分はすぐに書き込み側へ返す
+                ring->tail_.store(tail, std::memory_order_release);
+            }
+        }
+        if (!out.empty())
+        {
+            FILE *file = (file_ != nullptr) ? file_ : stderr;
+            (void)fwrite(out.data(), 1, out.size(), file);
+            (void)fflush(file);
+            out.clear();
+        }
+        rings.clear();
+
+        lock.lock();
+        // 終了したスレッドのリングは、全て読み込んだ後に外す
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<LogRing> &ring) {
+                         return ring->closed_.load(std::memory_order_acquire) && (ring->head_.load(std::memory_order_acquire) == ring->tail_.load(std::memory_order_relaxed));
+                     }),
+                     rings_.end());
+        flushDone_ = request;
+        cv_.notify_all();
+        if (!isRunning)
+        {
+            break;
+        }
+        cv_.wait_for(lock, std::chrono::milliseconds(POLL_MS), [this, request]() { return !isRunning_ || (flushRequest_ != request) || wake_.load(); });
+    }
+}
+
+bool Logger::decode(const std::string &path, FILE *out)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    bool isOk = true;
+    char magic[sizeof(MAGIC)];
+    if ((fread(&magic[0], sizeof(magic), 1, file) != 1) || (std::memcmp(&magic[0], &MAGIC[0], sizeof(MAGIC)) != 0))
+    {
+        isOk = false;
+    }
+    std::vector<std::string> formats;
+    std::vector<char> body;
+    std::string text;
+    while (isOk)
+    {
+        uint32_t head[2];
+        if (fread(&head[0], sizeof(head), 1, file) != 1)
+        {
+            break;
+        }
+        body.resize(head[1]);
+        if ((head[1] > 0) && (fread(body.data(), head[1], 1, file) != 1))
+        {
+            isOk = false;
+            break;
+        }
+        switch (head[0])
+        {
+        case FORMAT:
+        {
+            uint32_t id = 0;
+            if (body.size() < sizeof(id))
+            {
+                isOk = false;
+                break;
+            }
+            std::memcpy(&id, body.data(), sizeof(id));
+            if (id != formats.size())
+            {
+                isOk = false;
+                break;
+            }
+            formats.emplace_back(body.data() + sizeof(id), body.size() - sizeof(id));
+            break;
+        }
+        case ENTRY:
+        {
+            uint32_t id = 0;
+            int32_t logid = 0;
+            uint64_t time = 0;
+            if (body.size() < 16)
+            {
+                isOk = false;
+                break;
+            }
+            std::memcpy(&id, &body[0], 4);
+            std::memcpy(&logid, &body[4], 4);
+            std::memcpy(&time, &body[8], 8);
+            if (id >= formats.size())
+            {
+                isOk = false;
+                break;
+            }
+            const time_t sec = static_cast<time_t>(time / 1000000000);
+            const struct tm *tm = std::localtime(&sec);
+            char stamp[32];
+            snprintf(&stamp[0], sizeof(stamp), "%02d:%02d:%02d.%06u ", (tm != nullptr) ? tm->tm_hour : 0, (tm != nullptr) ? tm->tm_min : 0, (tm != nullptr) ? tm->tm_sec : 0, static_cast<uint32_t>((time % 1000000000) / 1000));
+            text = &stamp[0];
+            append_line(text, logid, formats[id].c_str(), body.data() + 16, body.size() - 16);
+            (void)fwrite(text.data(), 1, text.size(), out);
+            break;
+        }
+        case DROPPED:
+        {
+            uint64_t dropped = 0;
+            if (body.size() < sizeof(dropped))
+            {
+                isOk = false;
+                break;
+            }
+            std::memcpy(&dropped, body.data(), sizeof(dropped));
+            fprintf(out, "[Logger] dropped:%llu\n", static_cast<unsigned long long>(dropped));
+            break;
+        }
+        default:
+            // 未知の種別は読み飛ばす
+            break;
+        }
+    }
+    fclose(file);
+    return isOk;
 }
@@ -1,9 +1,44 @@
 ﻿#pragma once
 
 #include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 
+// ログレベル(LOGGER_LEVELより大きいレベルの呼び出しはコンパイル時に消える)
+// 既定はINFOで、メッセージごとの送受信のログ(DEBUG)は含めない
+#define LOGGER_LEVEL_NONE 0
+#define LOGGER_LEVEL_ERROR 1
+#define LOGGER_LEVEL_INFO 2
+#define LOGGER_LEVEL_DEBUG 3
+#ifndef LOGGER_LEVEL
+#define LOGGER_LEVEL LOGGER_LEVEL_INFO
+#endif
+
+// 無効なレベルでも引数は式として残す(ログにしか使わない変数で警告を出さないため)
+#define LOGGER_PRINT_(level, ...)         \
+    do                                    \
+    {                                     \
+        if ((level) <= LOGGER_LEVEL)      \
+        {                                 \
+            Logger::print(__VA_ARGS__);   \
+        }                                 \
+    } while (0)
+// GCC/Clangでは書式と引数の型の不一致を警告する
+#if defined(__GNUC__) || defined(__clang__)
+#define LOGGER_FORMAT_(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define LOGGER_FORMAT_(fmt, args)
+#endif
+#define LOGGER_ERROR(...) LOGGER_PRINT_(LOGGER_LEVEL_ERROR, __VA_ARGS__)
+#define LOGGER_INFO(...) LOGGER_PRINT_(LOGGER_LEVEL_INFO, __VA_ARGS__)
+#define LOGGER_DEBUG(...) LOGGER_PRINT_(LOGGER_LEVEL_DEBUG, __VA_ARGS__)
+
 class Log
 {
     int32_t id_;
@@ -14,19 +49,72 @@ public:
     Log(int32_t id, std::string header);
 };
 
+// スレッドごとのログのリング(書き込むスレッドは1つ、読み込むのは出力スレッドだけ)
+// 書き込み位置・読み込み位置は単調増加する総バイト数で、容量は2のべき乗
+class LogRing
+{
+public:
+    static constexpr size_t CAPACITY = 128 * 1024;
+
+public:
+    alignas(64) std::atomic<uint64_t> head_; // 書き込んだ総バイト数
+    std::atomic<uint64_t> dropped_;          // リングが一杯で捨てた件数
+    std::atomic<bool> closed_;               // 書き込むスレッドが終了した
+    alignas(64) std::atomic<uint64_t> tail_; // 読み込んだ総バイト数
+    uint64_t generation_ = 0;                // 登録したLoggerの世代
+    std::unique_ptr<char[]> data_;
+
+public:
+    LogRing(uint64_t generation);
+    // 1件を連続した領域に書き込む(空きが無ければfalse)
+    bool write(const char *data, size_t size);
+};
+
+// 非同期ロガー
+// print()は書式の文字列(のポインタ)と引数の値だけをスレッドごとのリングに書き込み、
+// 書式化と出力は出力スレッドが行う(I/Oスレッドでは書式化もシステムコールもしない)
+// 出力先は標準エラーのテキスト(既定)か、init()にパスを渡した場合はバイナリファイル
+// バイナリファイルは書式の文字列を初出時に1回だけ書き、以降は書式IDと引数の値だけを書く(decode()でテキストに戻す)
 class Logger
 {
+public:
+    // 1件の書式化後の最大長と、引数(文字列を含む)の最大長
+    static constexpr size_t TEXT_MAX = 1024;
+    static constexpr size_t ARGS_MAX = 1024;
+    // 出力スレッドがリングを読み込む周期
+    static constexpr int32_t POLL_MS = 10;
+
+private:
     std::vector<Log> logs_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::atomic<bool> wake_; // リングが半分を超えたため出力スレッドを起こした
+    std::vector<std::shared_ptr<LogRing>> rings_;
+    std::thread th_;
+    bool isRunning_ = false;
+    uint64_t flushRequest_ = 0;
+    uint64_t flushDone_ = 0;
+    uint64_t generation_ = 0;
+    FILE *file_ = nullptr;
 
 private:
-    Logger();
+    Logger(uint64_t generation, FILE *file);
     ~Logger();
 
 public:
-    static void init();
+    // pathを指定した場合はバイナリファイルに出力する(空の場合は標準エラーにテキストで出力する)
+    static void init(const std::string &path = "");
+    // print()中の他のスレッドが書き終えるまで待ってから破棄する(以降のprint()は何もしない)
     static void deinit();
     static int32_t add(std::string header);
     int32_t add_in(std::string header);
-    static void print(int32_t logid, char *fmt, ...);
-    void print_(int32_t logid, char *logtext);
+    static void print(int32_t logid, const char *fmt, ...) LOGGER_FORMAT_(2, 3);
+    // print()済みのログを全て出力するまで待つ
+    static void flush();
+    // バイナリファイルをテキストにしてoutに書き込む(ファイルの形式が不正な場合はfalse)
+    static bool decode(const std::string &path, FILE *out);
+
+private:
+    LogRing *ring_();
+    void task_();
 };
@@ -0,0 +1,3338 @@
+﻿#include "MySocket.hpp"
+#include "Logger.hpp"
+#include "Compressor.hpp"
+#include "ClientLoop.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+
+#include <sys/socket.h> // socket(), setsockopt(), bind()
+#include <sys/uio.h>    // iovec
+#include <sys/un.h>     // sockaddr_un
+#include <netinet/in.h> // sockaddr_in, htons()
+#include <netinet/tcp.h> // tcp_info
+#include <unistd.h>     // close()
+#include <arpa/inet.h>  // inet_pton()
+#include <sys/eventfd.h> // eventfd()
+#include <sys/epoll.h>  // epoll系
+#include <fcntl.h>      // fcntl()
+#include <poll.h>       // poll()
+#include <pthread.h>    // pthread_getcpuclockid()
+#include <time.h>       // clock_gettime()
+#include <linux/errqueue.h> // sock_extended_err
+
+// epoll/io_uringのバックエンドで共通の実装
+// イベント待ちに依存する処理は、各バックエンドのMySocket.cppで定義する(open_reactor_・arm_send_など)
+
+// 古いヘッダ向けの定義(Linux 4.14以降で有効)
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#if 1
+#define LOG_DEBUG(...)
+//#define LOG_ERROR(...)
+#else
+#define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+namespace
+{
+    // "unix:パス"形式のアドレスは、AF_UNIXのストリームソケットで通信する("unix:@名前"は抽象名前空間)
+    constexpr char UNIX_SCHEME[] = "unix:";
+
+    bool is_unix_address(const std::string &ipaddr)
+    {
+        return ipaddr.compare(0, sizeof(UNIX_SCHEME) - 1, UNIX_SCHEME) == 0;
+    }
+
+    // アドレスのパスをsaに設定してアドレス長を返す(パスが空か長すぎる場合は0)
+    socklen_t unix_address(const std::string &ipaddr, struct sockaddr_un &sa)
+    {
+        std::string path = ipaddr.substr(sizeof(UNIX_SCHEME) - 1);
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (path.empty() || (path.size() >= sizeof(sa.sun_path)))
+        {
+            return 0;
+        }
+        std::memcpy(sa.sun_path, path.data(), path.size());
+        if (path[0] == '@')
+        {
+            // 抽象名前空間は先頭をNUL文字にし、名前の長さまでをアドレスとする
+            sa.sun_path[0] = '\0';
+            return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + path.size());
+        }
+        return static_cast<socklen_t>(sizeof(sa));
+    }
+
+    // ループに渡した非同期送信(ループで送信されずに破棄された場合も解放通知を呼ぶ)
+    class PostedSend
+    {
+    public:
+        Buffer buffer_;
+        const char *data_ = nullptr;
+        int32_t size_ = 0;
+        uint32_t requestId_ = 0;
+        bool rpc_ = false;
+        uint8_t flags_ = 0;
+        std::function<void()> release_;
+
+    public:
+        ~PostedSend()
+        {
+            if (release_)
+            {
+                release_();
+            }
+        }
+    };
+
+    // O_NONBLOCKを設定・解除する
+    bool set_nonblock(const int32_t logid, SOCKET sock, const bool nonBlocking)
+    {
+        int32_t flags = ::fcntl(sock, F_GETFL, 0);
+        if ((flags == -1) || (::fcntl(sock, F_SETFL, nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) == -1))
+        {
+            LOGGER_ERROR(logid, "ERR! fcntl sock:0x%x err:%d", sock, errno);
+            return false;
+        }
+        return true;
+    }
+
+    // 接続ソケットで監視するイベント
+    uint32_t epoll_events(const bool nonBlocking, const bool out, const bool in = true)
+    {
+        uint32_t events = EPOLLRDHUP;
+        if (in)
+        {
+            events |= EPOLLIN;
+        }
+        if (nonBlocking)
+        {
+            // ノンブロッキングモードではエッジトリガで監視する
+            events |= EPOLLET;
+        }
+        if (out)
+        {
+            events |= EPOLLOUT;
+        }
+        return events;
+    }
+
+    // ノンブロッキングのソケットが読み込み可能になるまで待つ(空回りしないよう、EAGAINを受けた後に呼ぶ)
+    void wait_readable(SOCKET sock)
+    {
+        struct pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        (void)::poll(&pfd, 1, 100);
+    }
+
+    // ホスト全体で受付待ちキューが溢れて捨てた接続数とSYN数(/proc/net/netstatのTcpExt)を読み込む
+    void read_listen_drops(uint64_t &overflows, uint64_t &drops)
+    {
+        FILE *fp = std::fopen("/proc/net/netstat", "r");
+        if (fp == nullptr)
+        {
+            return;
+        }
+        // 名前の行と値の行が対になり、同じ順に空白区切りで並ぶ
+        char names[4096];
+        char values[4096];
+        while ((std::fgets(names, sizeof(names), fp) != nullptr) && (std::fgets(values, sizeof(values), fp) != nullptr))
+        {
+            if (std::strncmp(names, "TcpExt:", 7) != 0)
+            {
+                continue;
+            }
+            char *nameSave = nullptr;
+            char *valueSave = nullptr;
+            char *name = ::strtok_r(names, " \n", &nameSave);
+            char *value = ::strtok_r(values, " \n", &valueSave);
+            while ((name != nullptr) && (value != nullptr))
+            {
+                if (std::strcmp(name, "ListenOverflows") == 0)
+                {
+                    overflows = std::strtoull(value, nullptr, 10);
+                }
+                else if (std::strcmp(name, "ListenDrops") == 0)
+                {
+                    drops = std::strtoull(value, nullptr, 10);
+                }
+                name = ::strtok_r(nullptr, " \n", &nameSave);
+                value = ::strtok_r(nullptr, " \n", &valueSave);
+            }
+            break;
+        }
+        std::fclose(fp);
+    }
+}
+
+RecvContext::RecvContext()
+{
+}
+
+RecvContext::~RecvContext()
+{
+    reset();
+}
+
+void RecvContext::reset()
+{
+    buffer_.reset();
+    state_ = State::HEADER;
+    headerSize_ = 0;
+    dataSize_ = 0;
+    streaming_ = false;
+    chunkSize_ = 0;
+}
+
+void Connection::reset(SOCKET sock, int64_t id)
+{
+    sock_ = sock;
+    id_ = id;
+    recv_.reset();
+    zeroCopy_ = false;
+    zeroCopyContext_ = ZeroCopyContext();
+    sendContext_ = SendContext();
+    flow_ = FlowContext();
+    peerCompress_.store(false, std::memory_order_relaxed);
+    compressSkip_ = 0;
+    compressBackoff_ = 0;
+    traffic_.reset();
+}
+
+void TrafficStat::add(const TrafficStat &other)
+{
+    bytesIn_ += other.bytesIn_;
+    bytesOut_ += other.bytesOut_;
+    framesIn_ += other.framesIn_;
+    framesOut_ += other.framesOut_;
+    partialReads_ += other.partialReads_;
+    eagain_ += other.eagain_;
+    wakeups_ += other.wakeups_;
+    connected_ += other.connected_;
+    disconnected_ += other.disconnected_;
+    connections_ += other.connections_;
+    queuedFrames_ += other.queuedFrames_;
+    queuedBytes_ += other.queuedBytes_;
+}
+
+void TrafficCounter::collect(TrafficStat &stat) const
+{
+    stat.bytesIn_ += bytesIn_.load(std::memory_order_relaxed);
+    stat.bytesOut_ += bytesOut_.load(std::memory_order_relaxed);
+    stat.framesIn_ += framesIn_.load(std::memory_order_relaxed);
+    stat.framesOut_ += framesOut_.load(std::memory_order_relaxed);
+    stat.partialReads_ += partialReads_.load(std::memory_order_relaxed);
+    stat.eagain_ += eagain_.load(std::memory_order_relaxed);
+    stat.wakeups_ += wakeups_.load(std::memory_order_relaxed);
+    stat.connected_ += connected_.load(std::memory_order_relaxed);
+    stat.disconnected_ += disconnected_.load(std::memory_order_relaxed);
+}
+
+void TrafficCounter::merge(const TrafficCounter &other)
+{
+    count(bytesIn_, other.bytesIn_.load(std::memory_order_relaxed));
+    count(bytesOut_, other.bytesOut_.load(std::memory_order_relaxed));
+    count(framesIn_, other.framesIn_.load(std::memory_order_relaxed));
+    count(framesOut_, other.framesOut_.load(std::memory_order_relaxed));
+    count(partialReads_, other.partialReads_.load(std::memory_order_relaxed));
+    count(eagain_, other.eagain_.load(std::memory_order_relaxed));
+    count(wakeups_, other.wakeups_.load(std::memory_order_relaxed));
+    count(connected_, other.connected_.load(std::memory_order_relaxed));
+    count(disconnected_, other.disconnected_.load(std::memory_order_relaxed));
+}
+
+void TrafficCounter::reset()
+{
+    bytesIn_.store(0, std::memory_order_relaxed);
+    bytesOut_.store(0, std::memory_order_relaxed);
+    framesIn_.store(0, std::memory_order_relaxed);
+    framesOut_.store(0, std::memory_order_relaxed);
+    partialReads_.store(0, std::memory_order_relaxed);
+    eagain_.store(0, std::memory_order_relaxed);
+    wakeups_.store(0, std::memory_order_relaxed);
+    connected_.store(0, std::memory_order_relaxed);
+    disconnected_.store(0, std::memory_order_relaxed);
+}
+
+SocketOptions SocketOptions::lowLatency()
+{
+    SocketOptions options;
+    options.noDelay_ = true;
+    options.notSentLowat_ = 16 * 1024;
+    return options;
+}
+
+SocketOptions SocketOptions::bulkThroughput()
+{
+    SocketOptions options;
+    options.sendBuffer_ = 4 * 1024 * 1024;
+    options.recvBuffer_ = 4 * 1024 * 1024;
+    return options;
+}
+
+Socket::Waker::~Waker()
+{
+}
+
+Socket::Socket(int32_t logid) : logid_(logid)
+{
+}
+
+Socket::~Socket()
+{
+    do_delete();
+    if (wakeFd_ != -1)
+    {
+        ::close(wakeFd_);
+        wakeFd_ = -1;
+    }
+}
+
+SOCKET Socket::get() const
+{
+    return sock_;
+}
+
+bool Socket::isConnected(const int64_t id) const
+{
+    return (connections_.find(id) != nullptr);
+}
+
+bool Socket::hasConnection(const int64_t id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return isConnected(id);
+}
+
+size_t Socket::connectionCount()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return connections_.size();
+}
+
+void Socket::copySettings(const Socket &other)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    nonBlocking_ = other.nonBlocking_;
+    reusePort_ = other.reusePort_;
+    backlog_ = other.backlog_;
+    options_ = other.options_;
+    zeroCopyThreshold_ = other.zeroCopyThreshold_;
+    asyncSend_ = other.asyncSend_.load();
+    sendHighWatermark_ = other.sendHighWatermark_.load();
+    sendLowWatermark_ = other.sendLowWatermark_;
+    recvHighBytes_ = other.recvHighBytes_;
+    recvLowBytes_ = other.recvLowBytes_;
+    recvHighFrames_ = other.recvHighFrames_;
+    recvLowFrames_ = other.recvLowFrames_;
+    coalesceWindowUs_ = other.coalesceWindowUs_;
+    coalesceBudget_ = other.coalesceBudget_;
+    compressThreshold_ = other.compressThreshold_;
+    streamChunk_ = other.streamChunk_;
+}
+
+void Socket::setReusePort(const bool reusePort)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    reusePort_ = reusePort;
+}
+
+void Socket::setBacklog(const int32_t backlog)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    backlog_ = backlog;
+}
+
+void Socket::setOptions(const SocketOptions &options)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    options_ = options;
+}
+
+void Socket::setNonBlocking(const bool nonBlocking)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    nonBlocking_ = nonBlocking;
+}
+
+void Socket::setZeroCopy(const int32_t threshold)
+{
+    // releaseを渡して送信したthreshold以上のサイズのデータをMSG_ZEROCOPYで送信する(0以下は無効)
+    // releaseの無い送信は、戻った時点でデータを再利用できるようコピー送信する
+    std::lock_guard<std::mutex> lock(mtx_);
+    zeroCopyThreshold_ = threshold;
+}
+
+void Socket::setAsyncSend(const bool asyncSend)
+{
+    // 非同期送信はノンブロッキングモードで動作する
+    std::lock_guard<std::mutex> lock(mtx_);
+    asyncSend_ = asyncSend;
+    if (asyncSend_)
+    {
+        nonBlocking_ = true;
+    }
+}
+
+void Socket::setSendWatermark(const size_t high, const size_t low)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    sendHighWatermark_ = high;
+    sendLowWatermark_ = (low < high) ? low : high;
+}
+
+void Socket::setRecieveWatermark(const size_t highBytes, const size_t lowBytes, const int32_t highFrames, const int32_t lowFrames)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    recvHighBytes_ = highBytes;
+    recvLowBytes_ = (lowBytes < highBytes) ? lowBytes : highBytes;
+    recvHighFrames_ = highFrames;
+    recvLowFrames_ = (lowFrames < highFrames) ? lowFrames : highFrames;
+}
+
+void Socket::setCoalesce(const int32_t windowUs, const size_t budget)
+{
+    // 集約した送信キューはリアクタが書き込むため、非同期送信モードで動作する
+    std::lock_guard<std::mutex> lock(mtx_);
+    coalesceWindowUs_ = windowUs;
+    coalesceBudget_ = budget;
+    if (coalesceWindowUs_ > 0)
+    {
+        asyncSend_ = true;
+        nonBlocking_ = true;
+    }
+}
+
+void Socket::setCompression(const int32_t threshold)
+{
+    // threshold以上のサイズのデータを圧縮して送信する(0以下は無効)
+    std::lock_guard<std::mutex> lock(mtx_);
+    compressThreshold_ = threshold;
+}
+
+void Socket::setStreaming(const int32_t chunkSize)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    streamChunk_ = chunkSize;
+}
+
+void Socket::setStreamHandler(const std::function<void(int64_t, StreamEvent, const char *, int32_t)> &func_stream)
+{
+    // 受信スレッドの開始前に設定する
+    std::lock_guard<std::mutex> lock(mtx_);
+    func_stream_ = func_stream;
+}
+
+bool Socket::coalesce_deadline_(std::chrono::steady_clock::time_point &deadline)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    bool found = false;
+    for (int64_t id : corked_)
+    {
+        Connection *conn = connections_.find(id);
+        if ((conn == nullptr) || !conn->sendContext_.corked_)
+        {
+            continue;
+        }
+        if (!found || (conn->sendContext_.deadline_ < deadline))
+        {
+            deadline = conn->sendContext_.deadline_;
+            found = true;
+        }
+    }
+    return found;
+}
+
+int32_t Socket::coalesce_timeout_(const int32_t timeout)
+{
+    // 集約中の接続があれば、最も早い窓の期限までにイベント待ちから戻る
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (corked_.empty())
+    {
+        return timeout;
+    }
+    auto now = std::chrono::steady_clock::now();
+    int32_t result = timeout;
+    for (int64_t id : corked_)
+    {
+        Connection *conn = connections_.find(id);
+        if ((conn == nullptr) || !conn->sendContext_.corked_)
+        {
+            continue;
+        }
+        auto remain = std::chrono::duration_cast<std::chrono::microseconds>(conn->sendContext_.deadline_ - now).count();
+        // タイムアウトはミリ秒単位のため切り上げる
+        int32_t ms = (remain <= 0) ? 0 : static_cast<int32_t>((remain + 999) / 1000);
+        result = (ms < result) ? ms : result;
+    }
+    return result;
+}
+
+void Socket::flush_coalesced_(const std::function<void(int64_t)> &func_drained, std::vector<int64_t> &failed)
+{
+    // 窓の期限を過ぎた接続の送信キューを書き込む(リアクタスレッドから呼び出す)
+    std::vector<int64_t> expired;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (corked_.empty())
+        {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        std::vector<int64_t> remain;
+        for (int64_t id : corked_)
+        {
+            Connection *conn = connections_.find(id);
+            if ((conn == nullptr) || !conn->sendContext_.corked_)
+            {
+                // 切断済み、または既に書き込んだ
+                continue;
+            }
+            if (conn->sendContext_.deadline_ <= now)
+            {
+                expired.emplace_back(id);
+            }
+            else
+            {
+                remain.emplace_back(id);
+            }
+        }
+        corked_.swap(remain);
+    }
+    for (int64_t id : expired)
+    {
+        if (do_flush(id, func_drained) != 0)
+        {
+            failed.emplace_back(id);
+        }
+    }
+}
+
+bool Socket::pack_frame_(const int64_t id, const char *sndData, const int32_t sndSize, const uint32_t *requestId, Buffer &packed)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if ((compressThreshold_ <= 0) || (sndSize < compressThreshold_))
+        {
+            return false;
+        }
+        Connection *conn = connections_.find(id);
+        if ((conn == nullptr) || !conn->peerCompress_.load(std::memory_order_relaxed))
+        {
+            // 古い実装の相手には圧縮フレームを送らない
+            return false;
+        }
+        if (conn->compressSkip_ > 0)
+        {
+            conn->compressSkip_--;
+            return false;
+        }
+    }
+
+    // 大きなデータの圧縮中に他のスレッドの送信を止めないように、ロック外で圧縮する
+    // (RPCのフレームは要求IDも含めて圧縮する)
+    bool compressed = false;
+    if (requestId != nullptr)
+    {
+        Buffer frame = CallTable::pack(*requestId, sndData, sndSize);
+        compressed = Compressor::pack(frame.data(), frame.size(), packed);
+    }
+    else
+    {
+        compressed = Compressor::pack(sndData, sndSize, packed);
+    }
+
+    // 圧縮率が悪い間は、圧縮を試さないフレーム数を倍にしていく(圧縮できたら毎回試すように戻す)
+    std::lock_guard<std::mutex> lock(mtx_);
+    Connection *conn = connections_.find(id);
+    if (conn != nullptr)
+    {
+        if (compressed)
+        {
+            conn->compressBackoff_ = 0;
+        }
+        else
+        {
+            conn->compressBackoff_ = (conn->compressBackoff_ == 0) ? 1 : ((conn->compressBackoff_ < 64) ? conn->compressBackoff_ * 2 : 64);
+            conn->compressSkip_ = conn->compressBackoff_;
+        }
+    }
+    return compressed;
+}
+
+bool Socket::unpack_frame_(Connection &conn, const Header &header, Buffer &buffer)
+{
+    // 受信したフレームのフラグを処理する(リアクタスレッドから呼び出す)
+    if ((header.flags() & Header::FLAG_ACCEPT_COMPRESSED) && !conn.peerCompress_.load(std::memory_order_relaxed))
+    {
+        conn.peerCompress_.store(true, std::memory_order_relaxed);
+    }
+    if (!(header.flags() & Header::FLAG_COMPRESSED))
+    {
+        return true;
+    }
+    // 圧縮フレームは、プールのバッファに伸長したものを受信データとして渡す
+    Buffer unpacked;
+    if (!Compressor::unpack(buffer, unpacked))
+    {
+        LOGGER_ERROR(logid_, "ERR! recv unpack sock:0x%x sz:%d", conn.sock_, header.size_);
+        return false;
+    }
+    LOGGER_DEBUG(logid_, " -> unpack sz:%d", unpacked.size());
+    buffer = std::move(unpacked);
+    return true;
+}
+
+bool Socket::set_family_(const int32_t family)
+{
+    // do_createはAF_INETで作成するため、アドレスの種類が異なる場合は同じfd番号のまま作り直す
+    int32_t domain = 0;
+    socklen_t len = sizeof(domain);
+    if ((::getsockopt(sock_, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0) && (domain == family))
+    {
+        return true;
+    }
+    SOCKET sock = ::socket(family, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+    {
+        LOGGER_ERROR(logid_, "ERR! create sock family:%d err:%d", family, errno);
+        return false;
+    }
+    int32_t ret = ::dup2(sock, sock_);
+    ::close(sock);
+    if (ret == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! dup sock:0x%x err:%d", sock_, errno);
+        return false;
+    }
+    return true;
+}
+
+bool Socket::stream_begin_(Connection &conn, const Header &header)
+{
+    // 圧縮フレームは伸長するまで、RPCフレームは要求IDを読むまで渡せないため、フレーム全体を受信する
+    static constexpr uint8_t BUFFERED = Header::FLAG_COMPRESSED | Header::FLAG_REQUEST | Header::FLAG_REPLY;
+    if ((streamChunk_ <= 0) || !func_stream_ || (header.flags() & BUFFERED))
+    {
+        return false;
+    }
+    Buffer empty;
+    (void)unpack_frame_(conn, header, empty);
+    conn.recv_.streaming_ = true;
+    conn.recv_.chunkSize_ = 0;
+    func_stream_(conn.id_, StreamEvent::BEGIN, nullptr, header.size_);
+    return true;
+}
+
+uint8_t Socket::accept_flags_() const
+{
+    // ストリーミング受信ではフレーム全体を保持しないため、圧縮フレームを受け付けない
+    return (streamChunk_ > 0) ? 0 : Header::FLAG_ACCEPT_COMPRESSED;
+}
+
+bool Socket::isWritable(const int64_t id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    Connection *conn = connections_.find(id);
+    if (conn == nullptr)
+    {
+        return false;
+    }
+    // ループに渡したまま送信キューに積んでいない送信も含めて、高水位を超えている間は書き込めない
+    return conn->sendContext_.writable_ && (postedBytes_ <= sendHighWatermark_);
+}
+
+bool Socket::do_create()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (sock_ != INVALID_SOCKET)
+    {
+        // ソケット作成済みのため何もしない
+        return true;
+    }
+
+    // ソケットを作成する
+    // AF_INET: IPv4 SOCK_STREAM:TCP
+    sock_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_ == INVALID_SOCKET)
+    {
+        LOGGER_ERROR(logid_, "ERR! create sock err:%d", errno);
+        return false;
+    }
+    LOGGER_INFO(logid_, "create sock:0x%x", sock_);
+
+    if (loopFd_ != -1)
+    {
+        // 外部のイベントループのepollに接続ソケットを登録する(ループはループのeventfdで起こす)
+        epfd_ = loopFd_;
+        return true;
+    }
+
+    // ループを起こすeventfdと、イベント待ち(epoll/io_uringのリング)を作成する
+    if (wakeFd_ == -1)
+    {
+        wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd_ == -1)
+        {
+            LOGGER_ERROR(logid_, "ERR! create eventfd err:%d", errno);
+        }
+    }
+    return open_reactor_();
+}
+
+void Socket::do_delete()
+{
+    std::vector<std::function<void()>> released;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (loopFd_ != -1)
+        {
+            // 外部のイベントループのepollは閉じない(接続ソケットを閉じると監視から外れる)
+            epfd_ = -1;
+        }
+        else
+        {
+            close_reactor_(released);
+        }
+        if (sock_ != INVALID_SOCKET)
+        {
+            LOGGER_INFO(logid_, "close sock:0x%x", sock_);
+            ::close(sock_);
+            sock_ = INVALID_SOCKET;
+        }
+        if (!unixPath_.empty())
+        {
+            (void)::unlink(unixPath_.c_str());
+            unixPath_.clear();
+        }
+    }
+    for (auto &func : released)
+    {
+        func();
+    }
+}
+
+int32_t Socket::do_send(const int64_t id, const char *sndData, const int32_t sndSize)
+{
+    return do_send(id, sndData, sndSize, nullptr);
+}
+
+int32_t Socket::do_send(const int64_t id, const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags)
+{
+    return send_data_(id, nullptr, sndData, sndSize, release, flags);
+}
+
+int32_t Socket::do_send(const int64_t id, const uint32_t requestId, const char *sndData, const int32_t sndSize, const uint8_t flags)
+{
+    return send_data_(id, &requestId, sndData, sndSize, nullptr, flags);
+}
+
+int32_t Socket::send_data_(const int64_t id, const uint32_t *requestId, const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags)
+{
+    if (post_send_())
+    {
+        return post_data_(id, requestId, sndData, sndSize, release, flags);
+    }
+
+    // 解放通知は送信側から再度sendされても良いように、ロック外で呼び出す
+    std::vector<std::function<void()>> released;
+    int32_t result = 0;
+    Buffer packed;
+    if (pack_frame_(id, sndData, sndSize, requestId, packed))
+    {
+        // 圧縮したデータを送信するため、呼び出し元のデータはすぐに再利用できる
+        // (圧縮したデータのバッファは、解放通知が呼ばれるまで保持する)
+        if (release)
+        {
+            released.emplace_back(release);
+        }
+        std::function<void()> hold = [packed]()
+        {
+        };
+        std::lock_guard<std::mutex> lock(mtx_);
+        result = send_frame_(id, packed.data(), packed.size(), flags | Header::FLAG_COMPRESSED, hold, released);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        result = send_frame_(id, sndData, sndSize, flags, release, released, requestId);
+    }
+    for (auto &func : released)
+    {
+        func();
+    }
+    return result;
+}
+
+bool Socket::post_send_() const
+{
+    // 同期送信はブロッキング送信と送信結果を戻り値で返すため、呼び出したスレッドでmtx_をロックして送信する
+    return asyncSend_ && (loopThread_.load(std::memory_order_relaxed) != std::this_thread::get_id());
+}
+
+int32_t Socket::post_data_(const int64_t id, const uint32_t *requestId, const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags)
+{
+    // 非同期送信は積むだけのため、他のスレッドからの送信はmtx_をロックせずにループに渡し、ループで送信キューに積む
+    // (releaseが無い場合は、戻った時点でデータを再利用できるようコピーを渡す)
+    auto send = std::make_shared<PostedSend>();
+    if (release)
+    {
+        send->data_ = sndData;
+        send->release_ = release;
+    }
+    else
+    {
+        send->buffer_ = BufferPool::instance().get(sndSize);
+        if (sndSize > 0)
+        {
+            std::memcpy(send->buffer_.data(), sndData, static_cast<size_t>(sndSize));
+        }
+        send->data_ = send->buffer_.data();
+    }
+    send->size_ = sndSize;
+    send->rpc_ = (requestId != nullptr);
+    send->requestId_ = send->rpc_ ? *requestId : 0;
+    send->flags_ = flags;
+    const size_t size = (sndSize > 0) ? static_cast<size_t>(sndSize) : 0;
+    size_t posted = postedBytes_.fetch_add(size) + size;
+    do_post([this, id, send, size]()
+            {
+                // コピーしたデータは、送信し終えるまで解放通知で保持する
+                std::function<void()> sent;
+                sent.swap(send->release_);
+                if (!sent)
+                {
+                    sent = [send]()
+                    {
+                    };
+                }
+                postedBytes_ -= size;
+                (void)send_data_(id, send->rpc_ ? &send->requestId_ : nullptr, send->data_, send->size_, sent, send->flags_);
+            });
+    // 送信の失敗はループで送信する時点でわかるため、ログとreleaseで知らせる
+    return (posted > sendHighWatermark_) ? 1 : 0;
+}
+
+int32_t Socket::do_flush_send(const int64_t id)
+{
+    if (post_send_())
+    {
+        do_post([this, id]()
+                { (void)do_flush(id, nullptr, false); });
+        return 0;
+    }
+    // 受信処理の中からも呼べるように、低水位の通知はリアクタに任せる
+    return do_flush(id, nullptr, false);
+}
+
+int32_t Socket::do_zerocopy_event(const int64_t id)
+{
+    std::vector<std::function<void()>> released;
+    int32_t result = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Connection *conn = connections_.find(id);
+        if (conn == nullptr)
+        {
+            return -1;
+        }
+        if (conn->zeroCopy_)
+        {
+            zerocopy_complete_(conn->sock_, conn->zeroCopyContext_, released);
+        }
+
+        // 完了通知以外のエラーが発生していないか確認する
+        int32_t err = 0;
+        socklen_t len = sizeof(err);
+        if ((::getsockopt(conn->sock_, SOL_SOCKET, SO_ERROR, &err, &len) == -1) || (err != 0))
+        {
+            LOGGER_ERROR(logid_, "ERR! sock:0x%x err:%d", conn->sock_, err);
+            result = -1;
+        }
+    }
+    for (auto &func : released)
+    {
+        func();
+    }
+    return result;
+}
+
+int32_t Socket::do_recieve(const int64_t id, Buffer &rcvBuffer)
+{
+    uint8_t flags = 0;
+    return do_recieve(id, rcvBuffer, flags);
+}
+
+int32_t Socket::do_recieve(const int64_t id, Buffer &rcvBuffer, uint8_t &flags)
+{
+    int32_t ret = 0;
+
+    Connection *conn = connections_.find(id);
+    if (conn == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! recv unknown id:0x%llx", static_cast<unsigned long long>(id));
+        return SOCKET_ERROR;
+    }
+    SOCKET rcvSock = conn->sock_;
+
+    Header rcvHeader;
+    ret = recv_(*conn, reinterpret_cast<char *>(&rcvHeader), sizeof(rcvHeader));
+    if (ret == SOCKET_ERROR)
+    {
+        // エラー
+        LOGGER_ERROR(logid_, "ERR! recv head sock:0x%x err:%d", rcvSock, errno);
+        return ret;
+    }
+    if (ret == 0)
+    {
+        // 接続が切れた
+        LOGGER_INFO(logid_, "recv head disconnect sock:0x%x", rcvSock);
+        return ret;
+    }
+    LOGGER_DEBUG(logid_, "recv head sock:0x%x", rcvSock);
+    LOGGER_DEBUG(logid_, " -> %.3s flags:0x%x sz:%d", rcvHeader.magic_, rcvHeader.flags(), rcvHeader.size_);
+
+    if ((std::memcmp(rcvHeader.magic_, "SOC", 3) != 0) || (rcvHeader.size_ < 0))
+    {
+        LOGGER_ERROR(logid_, "ERR! recv head invalid");
+        return SOCKET_ERROR;
+    }
+    flags = rcvHeader.flags();
+
+    if (stream_begin_(*conn, rcvHeader))
+    {
+        // 届いた分をチャンクとして通知する(受信バッファは返さない)
+        Buffer chunk = BufferPool::instance().get((rcvHeader.size_ < streamChunk_) ? rcvHeader.size_ : streamChunk_);
+        int32_t remainSize = rcvHeader.size_;
+        while (remainSize > 0)
+        {
+            int32_t n = (remainSize < chunk.size()) ? remainSize : chunk.size();
+            ssize_t sz = ::recv(rcvSock, chunk.data(), static_cast<size_t>(n), 0);
+            if ((sz == SOCKET_ERROR) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+            {
+                if (errno != EINTR)
+                {
+                    // 届くまで待ってから続きを受信する
+                    TrafficCounter::count(conn->traffic_.eagain_);
+                    wait_readable(rcvSock);
+                }
+                continue;
+            }
+            if (sz <= 0)
+            {
+                // 受信途中のフレームは、切断時にABORTを通知する
+                LOGGER_ERROR(logid_, "ERR! recv chunk sock:0x%x err:%d", rcvSock, errno);
+                return static_cast<int32_t>(sz);
+            }
+            TrafficCounter::count(conn->traffic_.bytesIn_, static_cast<uint64_t>(sz));
+            if (sz < n)
+            {
+                TrafficCounter::count(conn->traffic_.partialReads_);
+            }
+            func_stream_(id, StreamEvent::CHUNK, chunk.data(), static_cast<int32_t>(sz));
+            remainSize -= static_cast<int32_t>(sz);
+        }
+        LOGGER_DEBUG(logid_, "recv stream sock:0x%x", rcvSock);
+        LOGGER_DEBUG(logid_, " -> sz:%d", rcvHeader.size_);
+        conn->recv_.reset();
+        TrafficCounter::count(conn->traffic_.framesIn_);
+        func_stream_(id, StreamEvent::END, nullptr, rcvHeader.size_);
+        return rcvHeader.size_;
+    }
+
+    Buffer buffer = BufferPool::instance().get(rcvHeader.size_);
+    ret = recv_(*conn, buffer.data(), rcvHeader.size_);
+    if (ret == SOCKET_ERROR)
+    {
+        // エラー
+        LOGGER_ERROR(logid_, "ERR! recv data sock:0x%x err:%d", rcvSock, errno);
+        return ret;
+    }
+    if (ret == 0)
+    {
+        // 接続が切れた
+        LOGGER_INFO(logid_, "recv data disconnect sock:0x%x", rcvSock);
+        return ret;
+    }
+    LOGGER_DEBUG(logid_, "recv data sock:0x%x", rcvSock);
+    LOGGER_DEBUG(logid_, " -> sz:%d", ret);
+    quick_ack_(rcvSock);
+    TrafficCounter::count(conn->traffic_.framesIn_);
+
+    if (!unpack_frame_(*conn, rcvHeader, buffer))
+    {
+        return SOCKET_ERROR;
+    }
+    rcvBuffer = std::move(buffer);
+
+    return rcvBuffer.size();
+}
+
+void Socket::do_recieve_hold(const int64_t id, const int32_t size)
+{
+    if (!flow_enabled_())
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mtx_);
+    Connection *conn = connections_.find(id);
+    if (conn == nullptr)
+    {
+        return;
+    }
+    FlowContext &flow = conn->flow_;
+    flow.bytes_ += static_cast<size_t>(size);
+    flow.frames_++;
+    bool high = ((recvHighBytes_ > 0) && (flow.bytes_ > recvHighBytes_)) || ((recvHighFrames_ > 0) && (flow.frames_ > recvHighFrames_));
+    if (high && !flow.paused_)
+    {
+        LOGGER_DEBUG(logid_, "recv pause sock:0x%x", conn->sock_);
+        LOGGER_DEBUG(logid_, " -> bytes:%zu frames:%d", flow.bytes_, flow.frames_);
+        flow.paused_ = true;
+        recvPauses_++;
+        apply_flow_(*conn);
+    }
+}
+
+void Socket::do_recieve_release(const int64_t id, const int32_t size)
+{
+    if (!flow_enabled_())
+    {
+        return;
+    }
+    // 受信の再開(epollの監視の変更・受信要求の出し直し)はリアクタのスレッドで行う
+    do_post([this, id, size]()
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                Connection *conn = connections_.find(id);
+                if (conn == nullptr)
+                {
+                    // 処理中に切断した接続
+                    return;
+                }
+                FlowContext &flow = conn->flow_;
+                size_t bytes = static_cast<size_t>(size);
+                flow.bytes_ = (flow.bytes_ > bytes) ? (flow.bytes_ - bytes) : 0;
+                flow.frames_ = (flow.frames_ > 0) ? (flow.frames_ - 1) : 0;
+                bool low = ((recvHighBytes_ == 0) || (flow.bytes_ <= recvLowBytes_)) && ((recvHighFrames_ == 0) || (flow.frames_ <= recvLowFrames_));
+                if (low && flow.paused_)
+                {
+                    LOGGER_DEBUG(logid_, "recv resume sock:0x%x", conn->sock_);
+                    flow.paused_ = false;
+                    apply_flow_(*conn);
+                }
+            });
+}
+
+uint64_t Socket::recievePauses() const
+{
+    return recvPauses_;
+}
+
+TrafficStat Socket::trafficStat()
+{
+    // 切断した接続のカウンタの引継ぎと接続テーブルの変更はmtx_をロックして行うため、同じロックの中で読む
+    TrafficStat stat;
+    std::lock_guard<std::mutex> lock(mtx_);
+    traffic_.collect(stat);
+    for (int64_t id : connections_.ids())
+    {
+        const Connection *conn = connections_.find(id);
+        conn->traffic_.collect(stat);
+        stat.queuedFrames_ += conn->sendContext_.queue_.size();
+        stat.queuedBytes_ += conn->sendContext_.queuedBytes_;
+    }
+    stat.connections_ = connections_.size();
+    return stat;
+}
+
+bool Socket::connectionStat(const int64_t id, TrafficStat &stat)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    const Connection *conn = connections_.find(id);
+    if (conn == nullptr)
+    {
+        return false;
+    }
+    stat = TrafficStat();
+    conn->traffic_.collect(stat);
+    stat.connections_ = 1;
+    stat.queuedFrames_ = conn->sendContext_.queue_.size();
+    stat.queuedBytes_ = conn->sendContext_.queuedBytes_;
+    return true;
+}
+
+void Socket::do_post(const std::function<void()> &task)
+{
+    posted_.push(task);
+    do_wakeup();
+}
+
+void Socket::do_wakeup()
+{
+    // ループがまだ起きていなければeventfdに書き込む(起きるまでに積んだタスクはまとめて実行する)
+    if (wakePending_.exchange(true))
+    {
+        return;
+    }
+    Waker *waker = waker_.load(std::memory_order_acquire);
+    if (waker != nullptr)
+    {
+        waker->wake(loopTag_);
+        return;
+    }
+    int32_t fd = wakeFd_;
+    if (fd != -1)
+    {
+        uint64_t value = 1;
+        (void)::write(fd, &value, sizeof(value));
+    }
+}
+
+void Socket::setLoop(const int32_t epfd, const uint64_t tag, Waker *waker)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        loopFd_ = epfd;
+        if (epfd != -1)
+        {
+            // waker_を設定する前に書き込み、以降は書き換えない(起こす側はwaker_の後に読む)
+            loopTag_ = tag;
+        }
+    }
+    waker_.store((epfd != -1) ? waker : nullptr, std::memory_order_release);
+    // 切り替える前に積まれたタスクを、切り替えた先のループで実行させる
+    wakePending_ = false;
+    if (!posted_.empty())
+    {
+        do_wakeup();
+    }
+}
+
+void Socket::run_posted_()
+{
+    // このスレッドから送信した場合は、ループに渡さずにmtx_をロックして送信する
+    loopThread_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    // 実行する前に戻すため、実行中に積まれたタスクでは改めてループを起こす
+    wakePending_.exchange(false);
+    (void)posted_.run(POST_BATCH);
+    if (!posted_.empty())
+    {
+        // 上限を超えた残りは、次のイベント待ちをすぐに戻して実行する
+        do_wakeup();
+    }
+}
+
+bool Socket::flow_enabled_() const
+{
+    return (recvHighBytes_ > 0) || (recvHighFrames_ > 0);
+}
+
+bool Socket::recieve_paused_(const int64_t id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    Connection *conn = connections_.find(id);
+    return (conn != nullptr) && conn->flow_.paused_;
+}
+
+void Socket::apply_options_(SOCKET sock)
+{
+    auto set = [&](const int32_t level, const int32_t name, const int32_t value, const char *label)
+    {
+        if (::setsockopt(sock, level, name, &value, sizeof(value)) == -1)
+        {
+            LOGGER_ERROR(logid_, "ERR! %s sock:0x%x err:%d", label, sock, errno);
+        }
+    };
+    if (options_.sendBuffer_ > 0)
+    {
+        set(SOL_SOCKET, SO_SNDBUF, options_.sendBuffer_, "SO_SNDBUF");
+    }
+    if (options_.recvBuffer_ > 0)
+    {
+        set(SOL_SOCKET, SO_RCVBUF, options_.recvBuffer_, "SO_RCVBUF");
+    }
+    if (options_.busyPollUs_ > 0)
+    {
+        set(SOL_SOCKET, SO_BUSY_POLL, options_.busyPollUs_, "SO_BUSY_POLL");
+    }
+    if (options_.recvLowat_ > 0)
+    {
+        set(SOL_SOCKET, SO_RCVLOWAT, options_.recvLowat_, "SO_RCVLOWAT");
+    }
+    if (!options_.noDelay_ && !options_.quickAck_ && (options_.notSentLowat_ <= 0))
+    {
+        return;
+    }
+
+    // TCPのオプションはAF_INETのソケットにのみ設定する
+    int32_t domain = 0;
+    socklen_t len = sizeof(domain);
+    if ((::getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &len) != 0) || (domain != AF_INET))
+    {
+        return;
+    }
+    if (options_.noDelay_)
+    {
+        set(IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (options_.quickAck_)
+    {
+        set(IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+    if (options_.notSentLowat_ > 0)
+    {
+        set(IPPROTO_TCP, TCP_NOTSENT_LOWAT, options_.notSentLowat_, "TCP_NOTSENT_LOWAT");
+    }
+}
+
+void Socket::quick_ack_(SOCKET sock)
+{
+    if (options_.quickAck_)
+    {
+        // AF_UNIXのソケットでは失敗するが無視する
+        int32_t yes = 1;
+        (void)::setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+    }
+}
+
+Connection *Socket::add_connection_(SOCKET sock, const bool zeroCopy)
+{
+    // mtx_をロックして呼び出すこと
+    int64_t id = 0;
+    Connection *conn = connections_.add(sock, id);
+    if (conn == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! add connection sock:0x%x", sock);
+        return nullptr;
+    }
+    conn->reset(sock, id);
+    conn->zeroCopy_ = zeroCopy;
+    TrafficCounter::count(traffic_.connected_);
+    return conn;
+}
+
+void Socket::remove_connection_(Connection &conn, std::vector<std::function<void()>> &released)
+{
+    // mtx_をロックして呼び出すこと(解放通知はロック外で呼び出す)
+    // 切断したソケットの完了待ちデータは、以降通知が届かないため解放済みとする
+    for (auto &pending : conn.zeroCopyContext_.pending_)
+    {
+        if (pending.second)
+        {
+            released.emplace_back(std::move(pending.second));
+        }
+    }
+    // 送信待ちデータは破棄し、呼び出し元にデータを返却する
+    // (io_uringの送信要求の完了待ちのデータは、完了通知を刈り取った時点で返却する)
+    for (SendEntry &entry : conn.sendContext_.queue_)
+    {
+        if (entry.release_)
+        {
+            released.emplace_back(std::move(entry.release_));
+        }
+    }
+    if (conn.recv_.streaming_ && func_stream_)
+    {
+        // 受信途中のフレームは、最後まで受信できなかったことを通知する
+        int64_t id = conn.id_;
+        released.emplace_back([this, id]()
+                              { func_stream_(id, StreamEvent::ABORT, nullptr, 0); });
+    }
+    // 切断した接続のカウンタはソケット全体の統計に引き継ぐ
+    traffic_.merge(conn.traffic_);
+    TrafficCounter::count(traffic_.disconnected_);
+    (void)connections_.remove(conn.id_);
+    conn.reset(INVALID_SOCKET, 0);
+}
+
+int32_t Socket::send_frame_(const int64_t id, const char *sndData, const int32_t sndSize, const uint8_t flags, const std::function<void()> &release, std::vector<std::function<void()>> &released, const uint32_t *requestId)
+{
+    Connection *conn = connections_.find(id);
+    if (conn == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! send disconnect id:0x%llx", static_cast<unsigned long long>(id));
+        if (release)
+        {
+            released.emplace_back(release);
+        }
+        return -1;
+    }
+
+    SendContext &sctx = conn->sendContext_;
+    if (asyncSend_ || sctx.armed_ || !sctx.queue_.empty())
+    {
+        // 同期送信でも、送信しきれずにリアクタに任せたフレームがあれば順序を保つよう後ろに積む
+        return enqueue_(*conn, sndData, sndSize, flags, release, 0, requestId);
+    }
+
+    // ノンブロッキングのソケットの送信バッファが一杯になった場合は、mtx_を保持したまま書き込み可能になるのを待たず、
+    // 残りを送信キューに積んでリアクタに送信させる(送信キューが高水位を超えると1を返す)
+    SOCKET sndSock = conn->sock_;
+    char head[sizeof(Header) + CallTable::PREFIX_SIZE];
+    const size_t headSize = make_head_(head, sndSize, flags, requestId);
+    const size_t total = headSize + static_cast<size_t>(sndSize);
+
+    // MSG_ZEROCOPYの完了を知らせる先が無い場合は、完了を待たずに済むようコピー送信する
+    // (mtx_を保持したまま完了通知を待つと、他スレッドの送信とリアクタを止めてしまう)
+    if (!release || !conn->zeroCopy_ || (zeroCopyThreshold_ <= 0) || (sndSize < zeroCopyThreshold_))
+    {
+        // ヘッダとデータを連結せずに、iovecでまとめて送信する
+        struct iovec iov[2];
+        iov[0].iov_base = head;
+        iov[0].iov_len = headSize;
+        iov[1].iov_base = const_cast<char *>(sndData);
+        iov[1].iov_len = static_cast<size_t>(sndSize);
+
+        // 送信
+        int32_t ret = sendv_(*conn, iov, 2);
+        if (release)
+        {
+            // コピー送信のため、戻った時点でデータを再利用できる(送信しきれなかった残りはコピーして積む)
+            released.emplace_back(release);
+        }
+        if (ret == SOCKET_ERROR)
+        {
+            LOGGER_ERROR(logid_, "ERR! send sock:0x%x err:%d", sndSock, errno);
+            return -1;
+        }
+        if (static_cast<size_t>(ret) < total)
+        {
+            return enqueue_(*conn, sndData, sndSize, flags, nullptr, static_cast<size_t>(ret), requestId);
+        }
+        TrafficCounter::count(conn->traffic_.framesOut_);
+        LOGGER_DEBUG(logid_, "send sock:0x%x", sndSock);
+        LOGGER_DEBUG(logid_, " -> size:%d", ret);
+        return 0;
+    }
+
+    // 先に届いている完了通知を処理しておく
+    ZeroCopyContext &ctx = conn->zeroCopyContext_;
+    zerocopy_complete_(sndSock, ctx, released);
+
+    // ヘッダはスタック上にあるためコピー送信し、データのみMSG_ZEROCOPYで送信する
+    struct iovec hiov;
+    hiov.iov_base = head;
+    hiov.iov_len = headSize;
+    int32_t ret = sendv_(*conn, &hiov, 1, MSG_MORE);
+    uint32_t sendCount = 0;
+    if (ret == static_cast<int32_t>(headSize))
+    {
+        struct iovec diov;
+        diov.iov_base = const_cast<char *>(sndData);
+        diov.iov_len = static_cast<size_t>(sndSize);
+        int32_t dret = sendv_(*conn, &diov, 1, MSG_ZEROCOPY, &sendCount);
+        ret = (dret == SOCKET_ERROR) ? SOCKET_ERROR : (ret + dret);
+    }
+
+    if (sendCount == 0)
+    {
+        // MSG_ZEROCOPYで送信されなかった(全てコピー送信になった)
+        released.emplace_back(release);
+    }
+    else
+    {
+        // 完了通知を受信した時点でreleaseを呼ぶ
+        uint32_t last = ctx.seq_ + sendCount - 1;
+        ctx.seq_ += sendCount;
+        ctx.pending_.emplace_back(last, release);
+    }
+
+    if (ret == SOCKET_ERROR)
+    {
+        LOGGER_ERROR(logid_, "ERR! send sock:0x%x err:%d", sndSock, errno);
+        return -1;
+    }
+    if (static_cast<size_t>(ret) < total)
+    {
+        // 送信しきれなかった残りはコピーして積む(送信済みの分はreleaseが完了通知まで保持する)
+        return enqueue_(*conn, sndData, sndSize, flags, nullptr, static_cast<size_t>(ret), requestId);
+    }
+    TrafficCounter::count(conn->traffic_.framesOut_);
+    LOGGER_DEBUG(logid_, "send zerocopy sock:0x%x", sndSock);
+    LOGGER_DEBUG(logid_, " -> size:%d", sndSize);
+    return 0;
+}
+
+size_t Socket::make_head_(char *head, const int32_t sndSize, const uint8_t flags, const uint32_t *requestId)
+{
+    Header header;
+    header.size_ = sndSize;
+    header.setFlags(flags | accept_flags_());
+    if (requestId == nullptr)
+    {
+        std::memcpy(head, &header, sizeof(header));
+        return sizeof(header);
+    }
+    // RPCのフレームは、要求IDをデータの先頭に置いたのと同じ形で送る
+    header.size_ += CallTable::PREFIX_SIZE;
+    std::memcpy(head, &header, sizeof(header));
+    std::memcpy(head + sizeof(header), requestId, sizeof(*requestId));
+    return sizeof(header) + sizeof(*requestId);
+}
+
+int32_t Socket::enqueue_(Connection &conn, const char *sndData, const int32_t sndSize, const uint8_t flags, const std::function<void()> &release, const size_t sent, const uint32_t *requestId)
+{
+    SOCKET sndSock = conn.sock_;
+    SendContext &ctx = conn.sendContext_;
+
+    ctx.queue_.emplace_back();
+    SendEntry &entry = ctx.queue_.back();
+    entry.headSize_ = make_head_(entry.head_, sndSize, flags, requestId);
+    entry.size_ = sndSize;
+    entry.sent_ = sent;
+    if (release)
+    {
+        // 送信完了まで呼び出し元のデータを参照する
+        entry.data_ = sndData;
+        entry.release_ = release;
+    }
+    else
+    {
+        entry.buffer_ = BufferPool::instance().get(sndSize);
+        std::memcpy(entry.buffer_.data(), sndData, static_cast<size_t>(sndSize));
+        entry.data_ = entry.buffer_.data();
+    }
+    ctx.queuedBytes_ += entry.headSize_ + static_cast<size_t>(sndSize) - sent;
+    LOGGER_DEBUG(logid_, "enqueue sock:0x%x", sndSock);
+    LOGGER_DEBUG(logid_, " -> size:%d queued:%zu", sndSize, ctx.queuedBytes_);
+
+    if (!ctx.armed_ && (coalesceWindowUs_ > 0) && (ctx.queuedBytes_ < coalesceBudget_))
+    {
+        // 集約中は、窓の期限にリアクタが送信するまで溜める
+        if (!ctx.corked_)
+        {
+            ctx.corked_ = true;
+            ctx.deadline_ = std::chrono::steady_clock::now() + std::chrono::microseconds(coalesceWindowUs_);
+            corked_.emplace_back(conn.id_);
+            // イベント待ちのタイムアウトを窓の期限に合わせるため、ループを起こす
+            do_wakeup();
+        }
+    }
+    else if (!ctx.armed_)
+    {
+        ctx.corked_ = false;
+        arm_send_(conn);
+    }
+
+    if (ctx.queuedBytes_ > sendHighWatermark_)
+    {
+        ctx.writable_ = false;
+    }
+    return ctx.writable_ ? 0 : 1;
+}
+
+void Socket::zerocopy_complete_(SOCKET sock, ZeroCopyContext &ctx, std::vector<std::function<void()>> &released)
+{
+    // エラーキューから完了通知を読めるだけ読む
+    while (true)
+    {
+        char control[128];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            break;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+                  ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))))
+            {
+                continue;
+            }
+            struct sock_extended_err serr;
+            std::memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+            if ((serr.ee_errno != 0) || (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+            {
+                continue;
+            }
+            // ee_info〜ee_dataの通知番号の送信が完了した(TCPでは番号順に完了する)
+            uint32_t next = serr.ee_data + 1;
+            if (static_cast<int32_t>(next - ctx.done_) > 0)
+            {
+                ctx.done_ = next;
+            }
+        }
+    }
+
+    while (!ctx.pending_.empty() && (static_cast<int32_t>(ctx.pending_.front().first - ctx.done_) < 0))
+    {
+        if (ctx.pending_.front().second)
+        {
+            released.emplace_back(std::move(ctx.pending_.front().second));
+        }
+        ctx.pending_.pop_front();
+    }
+}
+
+int32_t Socket::sendv_(Connection &conn, struct iovec *iov, int32_t iovcnt, int32_t flags, uint32_t *sendCount)
+{
+    SOCKET sndSock = conn.sock_;
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = static_cast<size_t>(iovcnt);
+
+    size_t sentSize = 0;
+    while (msg.msg_iovlen > 0)
+    {
+        // SIGPIPEを発生させないために、flagsにMSG_NOSIGNALを設定する
+        // 参考:https://daeudaeu.com/sigpipe/
+        // writev()はflagsを指定できないため、sendmsg()を使う
+        ssize_t sz = ::sendmsg(sndSock, &msg, MSG_NOSIGNAL | flags);
+        if (sz == SOCKET_ERROR)
+        {
+            if ((errno == ENOBUFS) && (flags & MSG_ZEROCOPY))
+            {
+                // ページのピン留め上限に達したため、残りはコピー送信する
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                // ノンブロッキングソケットの送信バッファが一杯のため、送信できた分を返す(残りは呼び出し元がリアクタに任せる)
+                TrafficCounter::count(conn.traffic_.eagain_);
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return SOCKET_ERROR;
+        }
+        sentSize += static_cast<size_t>(sz);
+        TrafficCounter::count(conn.traffic_.bytesOut_, static_cast<uint64_t>(sz));
+        if ((sendCount != nullptr) && (flags & MSG_ZEROCOPY))
+        {
+            (*sendCount)++;
+        }
+
+        // 部分送信の場合は、送信済みの分だけiovを進めて続きを送る
+        size_t advance = static_cast<size_t>(sz);
+        while ((msg.msg_iovlen > 0) && (advance >= msg.msg_iov[0].iov_len))
+        {
+            advance -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov[0].iov_base = static_cast<char *>(msg.msg_iov[0].iov_base) + advance;
+            msg.msg_iov[0].iov_len -= advance;
+        }
+    }
+    return static_cast<int32_t>(sentSize);
+}
+
+int32_t Socket::recv_(Connection &conn, char *rcvData, int32_t rcvSize)
+{
+    SOCKET rcvSock = conn.sock_;
+    int32_t remainSize = rcvSize;
+    int32_t recievedSize = 0;
+    while (remainSize > 0)
+    {
+        ssize_t sz = ::recv(rcvSock, rcvData + recievedSize, static_cast<size_t>(remainSize), 0);
+        if (sz == SOCKET_ERROR)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                // EAGAIN/EWOULDBLOCKは届くまで待って処理続行
+                TrafficCounter::count(conn.traffic_.eagain_);
+                wait_readable(rcvSock);
+                continue;
+            }
+            return static_cast<int32_t>(sz);
+        }
+        else if (sz == 0)
+        {
+            return static_cast<int32_t>(sz);
+        }
+        else
+        {
+            TrafficCounter::count(conn.traffic_.bytesIn_, static_cast<uint64_t>(sz));
+            if (sz < remainSize)
+            {
+                TrafficCounter::count(conn.traffic_.partialReads_);
+            }
+            recievedSize += static_cast<int32_t>(sz);
+            remainSize -= static_cast<int32_t>(sz);
+        }
+    }
+    return recievedSize;
+}
+
+int32_t Socket::watch_(Connection &conn, const int32_t op)
+{
+    // 外部のイベントループのepollでは、イベントにループが接続ソケットを区別する値を格納する
+    struct epoll_event ev;
+    ev.events = epoll_events(nonBlocking_, conn.sendContext_.armed_, !conn.flow_.paused_);
+    ev.data.u64 = (loopFd_ != -1) ? loopTag_ : static_cast<uint64_t>(conn.id_);
+    return ::epoll_ctl(epfd_, op, conn.sock_, &ev);
+}
+
+int32_t Socket::flush_ready_(const int64_t id, const std::function<void(int64_t)> &func_drained, const bool notify)
+{
+    std::vector<std::function<void()>> released;
+    bool drained = false;
+    int32_t result = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Connection *conn = connections_.find(id);
+        if (conn == nullptr)
+        {
+            return 0;
+        }
+        SendContext &ctx = conn->sendContext_;
+        SOCKET sock = conn->sock_;
+        ctx.corked_ = false;
+
+        // 送信バッファが一杯になるまで、キューの先頭から複数フレームをまとめて書き込む
+        // (集約した小さなフレームを少ないシステムコールで書き込めるように、iovecはIOV_MAXまで使う)
+        while (!ctx.queue_.empty())
+        {
+            static constexpr size_t MAX_IOV = 1024;
+            struct iovec iov[MAX_IOV];
+            size_t iovcnt = 0;
+            for (SendEntry &entry : ctx.queue_)
+            {
+                if (iovcnt + 2 > MAX_IOV)
+                {
+                    break;
+                }
+                size_t offset = entry.sent_;
+                if (offset < entry.headSize_)
+                {
+                    iov[iovcnt].iov_base = entry.head_ + offset;
+                    iov[iovcnt].iov_len = entry.headSize_ - offset;
+                    iovcnt++;
+                    offset = 0;
+                }
+                else
+                {
+                    offset -= entry.headSize_;
+                }
+                if (static_cast<size_t>(entry.size_) > offset)
+                {
+                    iov[iovcnt].iov_base = const_cast<char *>(entry.data_) + offset;
+                    iov[iovcnt].iov_len = static_cast<size_t>(entry.size_) - offset;
+                    iovcnt++;
+                }
+            }
+
+            struct msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            ssize_t sz = ::sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sz == SOCKET_ERROR)
+            {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                {
+                    // 書き込み可能になったら再度EPOLLOUTが通知される
+                    TrafficCounter::count(conn->traffic_.eagain_);
+                    break;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                LOGGER_ERROR(logid_, "ERR! flush sock:0x%x err:%d", sock, errno);
+                result = -1;
+                break;
+            }
+
+            // 送信し終えたフレームをキューから取り除く
+            TrafficCounter::count(conn->traffic_.bytesOut_, static_cast<uint64_t>(sz));
+            size_t advance = static_cast<size_t>(sz);
+            while ((advance > 0) && !ctx.queue_.empty())
+            {
+                SendEntry &entry = ctx.queue_.front();
+                size_t remain = entry.headSize_ + static_cast<size_t>(entry.size_) - entry.sent_;
+                if (advance < remain)
+                {
+                    entry.sent_ += advance;
+                    ctx.queuedBytes_ -= advance;
+                    advance = 0;
+                    break;
+                }
+                advance -= remain;
+                ctx.queuedBytes_ -= remain;
+                if (entry.release_)
+                {
+                    released.emplace_back(std::move(entry.release_));
+                }
+                ctx.queue_.pop_front();
+                TrafficCounter::count(conn->traffic_.framesOut_);
+            }
+            LOGGER_DEBUG(logid_, "flush sock:0x%x", sock);
+            LOGGER_DEBUG(logid_, " -> size:%zd remain:%zu", sz, ctx.queuedBytes_);
+        }
+
+        bool drainPending = !ctx.writable_ && (ctx.queuedBytes_ <= sendLowWatermark_);
+        if (drainPending && notify)
+        {
+            ctx.writable_ = true;
+            drained = true;
+            drainPending = false;
+        }
+        // 送信するデータが残っていればEPOLLOUTを監視し、無くなれば監視をやめる
+        // (通知しない場合の低水位の通知は、EPOLLOUTを受けたリアクタに任せる)
+        bool out = !ctx.queue_.empty() || drainPending;
+        if (out != ctx.armed_)
+        {
+            ctx.armed_ = out;
+            (void)watch_(*conn, EPOLL_CTL_MOD);
+        }
+    }
+
+    for (auto &func : released)
+    {
+        func();
+    }
+    if (drained && func_drained)
+    {
+        func_drained(id);
+    }
+    return result;
+}
+
+int32_t Socket::do_recieve_nonblock(const int64_t id, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve)
+{
+    Connection *conn = connections_.find(id);
+    if (conn == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! recv unknown id:0x%llx", static_cast<unsigned long long>(id));
+        return SOCKET_ERROR;
+    }
+    RecvContext &ctx = conn->recv_;
+    SOCKET rcvSock = conn->sock_;
+    bool flow = flow_enabled_();
+    if (flow && recieve_paused_(id))
+    {
+        // 受信を止めている(再開時に改めて通知される)
+        return 1;
+    }
+
+    // EAGAINになるまで読み込む(エッジトリガのため読み残すと次の通知が来ない)
+    // フレームが途中までしか届いていなければ受信状態を保持して戻り、次のイベントで再開する
+    // 受信のフロー制御で受信を止めた場合は、フレームの区切りで読み込みをやめる
+    while (true)
+    {
+        char *buf = nullptr;
+        size_t remainSize = 0;
+        if (ctx.state_ == RecvContext::State::HEADER)
+        {
+            buf = reinterpret_cast<char *>(&ctx.header_) + ctx.headerSize_;
+            remainSize = sizeof(Header) - static_cast<size_t>(ctx.headerSize_);
+        }
+        else if (ctx.streaming_)
+        {
+            // チャンクのバッファに空きがある分だけ読み込む
+            int32_t n = ctx.buffer_.size() - ctx.chunkSize_;
+            int32_t remain = ctx.header_.size_ - ctx.dataSize_;
+            buf = ctx.buffer_.data() + ctx.chunkSize_;
+            remainSize = static_cast<size_t>((n < remain) ? n : remain);
+        }
+        else
+        {
+            buf = ctx.buffer_.data() + ctx.dataSize_;
+            remainSize = static_cast<size_t>(ctx.header_.size_ - ctx.dataSize_);
+        }
+
+        if (remainSize > 0)
+        {
+            ssize_t sz = ::recv(rcvSock, buf, remainSize, 0);
+            if (sz == SOCKET_ERROR)
+            {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                {
+                    // 読み込めるデータが無くなった
+                    TrafficCounter::count(conn->traffic_.eagain_);
+                    // ストリーミング受信では、チャンクが埋まるのを待たずに届いた分を通知する
+                    if (ctx.streaming_ && (ctx.chunkSize_ > 0))
+                    {
+                        int32_t n = ctx.chunkSize_;
+                        ctx.chunkSize_ = 0;
+                        func_stream_(id, StreamEvent::CHUNK, ctx.buffer_.data(), n);
+                    }
+                    quick_ack_(rcvSock);
+                    return 1;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                LOGGER_ERROR(logid_, "ERR! recv sock:0x%x err:%d", rcvSock, errno);
+                return SOCKET_ERROR;
+            }
+            if (sz == 0)
+            {
+                // 接続が切れた
+                LOGGER_INFO(logid_, "recv disconnect sock:0x%x", rcvSock);
+                return 0;
+            }
+            TrafficCounter::count(conn->traffic_.bytesIn_, static_cast<uint64_t>(sz));
+            if (static_cast<size_t>(sz) < remainSize)
+            {
+                TrafficCounter::count(conn->traffic_.partialReads_);
+            }
+
+            if (ctx.state_ == RecvContext::State::HEADER)
+            {
+                ctx.headerSize_ += static_cast<int32_t>(sz);
+            }
+            else
+            {
+                ctx.dataSize_ += static_cast<int32_t>(sz);
+                if (ctx.streaming_)
+                {
+                    ctx.chunkSize_ += static_cast<int32_t>(sz);
+                }
+            }
+        }
+
+        if (ctx.state_ == RecvContext::State::HEADER)
+        {
+            if (ctx.headerSize_ < static_cast<int32_t>(sizeof(Header)))
+            {
+                continue;
+            }
+            LOGGER_DEBUG(logid_, "recv head sock:0x%x", rcvSock);
+            LOGGER_DEBUG(logid_, " -> %.3s flags:0x%x sz:%d", ctx.header_.magic_, ctx.header_.flags(), ctx.header_.size_);
+            if ((std::memcmp(ctx.header_.magic_, "SOC", 3) != 0) || (ctx.header_.size_ < 0))
+            {
+                LOGGER_ERROR(logid_, "ERR! recv head invalid");
+                return SOCKET_ERROR;
+            }
+            if (stream_begin_(*conn, ctx.header_))
+            {
+                // チャンクのバッファはフレームの受信中に使い回す
+                ctx.buffer_ = BufferPool::instance().get((ctx.header_.size_ < streamChunk_) ? ctx.header_.size_ : streamChunk_);
+            }
+            else
+            {
+                ctx.buffer_ = BufferPool::instance().get(ctx.header_.size_);
+            }
+            ctx.dataSize_ = 0;
+            ctx.state_ = RecvContext::State::BODY;
+        }
+        else if (ctx.streaming_)
+        {
+            if ((ctx.chunkSize_ > 0) && ((ctx.chunkSize_ == ctx.buffer_.size()) || (ctx.dataSize_ == ctx.header_.size_)))
+            {
+                int32_t n = ctx.chunkSize_;
+                ctx.chunkSize_ = 0;
+                func_stream_(id, StreamEvent::CHUNK, ctx.buffer_.data(), n);
+            }
+            if (ctx.dataSize_ == ctx.header_.size_)
+            {
+                // フレーム受信完了
+                LOGGER_DEBUG(logid_, "recv stream sock:0x%x", rcvSock);
+                LOGGER_DEBUG(logid_, " -> sz:%d", ctx.dataSize_);
+                int32_t size = ctx.dataSize_;
+                ctx.reset();
+                TrafficCounter::count(conn->traffic_.framesIn_);
+                func_stream_(id, StreamEvent::END, nullptr, size);
+            }
+        }
+        else if (ctx.dataSize_ == ctx.header_.size_)
+        {
+            // フレーム受信完了
+            LOGGER_DEBUG(logid_, "recv data sock:0x%x", rcvSock);
+            LOGGER_DEBUG(logid_, " -> sz:%d", ctx.dataSize_);
+            // 次のフレームの受信に備えて、受信状態を戻してから通知する
+            Buffer buffer = std::move(ctx.buffer_);
+            Header header = ctx.header_;
+            ctx.reset();
+            if (!unpack_frame_(*conn, header, buffer))
+            {
+                return SOCKET_ERROR;
+            }
+            TrafficCounter::count(conn->traffic_.framesIn_);
+            func_recieve(id, header.flags(), buffer);
+            if (flow && recieve_paused_(id))
+            {
+                return 1;
+            }
+        }
+    }
+}
+
+ServerSocket::ServerSocket(int32_t logid) : Socket(logid)
+{
+}
+
+ServerSocket::~ServerSocket()
+{
+    do_disconnect_all();
+}
+
+void ServerSocket::setLoopIndex(const int32_t index)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    connections_.setLoop(index);
+}
+
+bool ServerSocket::do_bind_listen(const std::string ipaddr, const uint16_t portNo)
+{
+    LOG_DEBUG("[Server\t](%4d) ipaddr:%s portNo:%d\n", __LINE__, ipaddr.c_str(), portNo);
+    int32_t ret = 0;
+
+    struct sockaddr_storage ss;
+    socklen_t len = 0;
+    std::string unixPath;
+    if (is_unix_address(ipaddr))
+    {
+        // 同一ホストの相手とは、TCP/IPスタックを経由せずに通信する
+        struct sockaddr_un &sa = *reinterpret_cast<struct sockaddr_un *>(&ss);
+        len = unix_address(ipaddr, sa);
+        if ((len == 0) || !set_family_(AF_UNIX))
+        {
+            LOGGER_ERROR(logid_, "ERR! bind address:%s", ipaddr.c_str());
+            return false;
+        }
+        if (sa.sun_path[0] != '\0')
+        {
+            // 前回の実行で残ったソケットファイルはbindできないため削除する
+            // (リッスン中のソケットファイルは削除しない、SO_REUSEPORTでの振り分けはできない)
+            SOCKET probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            bool listening = (probe != INVALID_SOCKET) && (::connect(probe, reinterpret_cast<struct sockaddr *>(&sa), len) == 0);
+            if (probe != INVALID_SOCKET)
+            {
+                ::close(probe);
+            }
+            if (listening)
+            {
+                LOGGER_ERROR(logid_, "ERR! bind in use:%s", ipaddr.c_str());
+                return false;
+            }
+            (void)::unlink(sa.sun_path);
+            unixPath = sa.sun_path;
+        }
+    }
+    else
+    {
+        struct sockaddr_in &sa = *reinterpret_cast<struct sockaddr_in *>(&ss);
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(portNo);
+        //sa.sin_addr.s_addr = INADDR_ANY;
+        inet_pton(sa.sin_family, ipaddr.c_str(), &sa.sin_addr.s_addr);
+        len = sizeof(sa);
+
+        // SO_REUSEADDRを有効にする
+        // TIME_WAIT状態のポートが存在していてもbindができるようにする
+        int32_t yes = 1;
+        setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&yes), sizeof(yes));
+
+        // 複数のイベントループで同じポートをリッスンする場合は、SO_REUSEPORTを有効にする
+        // カーネルが接続をループ間に振り分ける
+        if (reusePort_)
+        {
+            setsockopt(sock_, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&yes), sizeof(yes));
+        }
+    }
+
+    // 受け付けた接続に引き継がれるよう、リッスン前に設定する(受信バッファはウィンドウスケールに効く)
+    apply_options_(sock_);
+
+    // リッスンソケットをバインド
+    ret = ::bind(sock_, reinterpret_cast<struct sockaddr *>(&ss), len);
+    if (ret != 0)
+    {
+        LOGGER_ERROR(logid_, "ERR! bind sock:0x%x err:%d", sock_, errno);
+        return false;
+    }
+    {
+        // バインドしたソケットファイルはdo_deleteで削除する
+        std::lock_guard<std::mutex> lock(mtx_);
+        unixPath_ = unixPath;
+    }
+    LOGGER_INFO(logid_, "bind sock:0x%x", sock_);
+    LOGGER_INFO(logid_, " -> %s:%d", ipaddr.c_str(), portNo);
+
+    // リッスン開始
+    // 接続が殺到してもSYNを捨てないよう、受付待ちキューを長くする
+    ret = ::listen(sock_, (backlog_ > 0) ? backlog_ : SOMAXCONN);
+    if (ret != 0)
+    {
+        LOGGER_ERROR(logid_, "ERR! listen sock:0x%x err:%d", sock_, errno);
+        return false;
+    }
+    LOGGER_INFO(logid_, "listen sock:0x%x", sock_);
+
+    return start_accept_();
+}
+
+AcceptStat ServerSocket::acceptStat()
+{
+    AcceptStat stat;
+    stat.accepted_ = accepted_;
+    stat.batches_ = batches_;
+    stat.maxBatch_ = maxBatch_;
+    stat.errors_ = acceptErrors_;
+    {
+        // リッスン中のTCPソケットのtcpi_unackedは受付待ちの接続数、tcpi_sackedは受付待ちキューの上限
+        std::lock_guard<std::mutex> lock(mtx_);
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if ((sock_ != INVALID_SOCKET) && (::getsockopt(sock_, IPPROTO_TCP, TCP_INFO, &info, &len) == 0))
+        {
+            stat.queued_ = info.tcpi_unacked;
+            stat.backlog_ = info.tcpi_sacked;
+        }
+    }
+    read_listen_drops(stat.listenOverflows_, stat.listenDrops_);
+    return stat;
+}
+
+void ServerSocket::count_accept_(const uint64_t batch)
+{
+    // リアクタスレッドのみが書き込む
+    if (batch == 0)
+    {
+        return;
+    }
+    accepted_ += batch;
+    batches_++;
+    if (batch > maxBatch_)
+    {
+        maxBatch_ = batch;
+    }
+}
+
+void ServerSocket::do_disconnect(const int64_t id)
+{
+    std::vector<std::function<void()>> released;
+    SOCKET sock = INVALID_SOCKET;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Connection *conn = connections_.find(id);
+        if (conn == nullptr)
+        {
+            return;
+        }
+        sock = conn->sock_;
+        remove_connection_(*conn, released);
+    }
+    detach_(sock);
+    ::close(sock);
+    for (auto &func : released)
+    {
+        func();
+    }
+}
+
+void ServerSocket::do_disconnect_all()
+{
+    std::vector<std::function<void()>> released;
+    std::vector<SOCKET> socks;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (int64_t id : connections_.ids())
+        {
+            Connection *conn = connections_.find(id);
+            socks.emplace_back(conn->sock_);
+            remove_connection_(*conn, released);
+        }
+    }
+    for (SOCKET sock : socks)
+    {
+        detach_(sock);
+        ::close(sock);
+    }
+    for (auto &func : released)
+    {
+        func();
+    }
+}
+
+ClientSocket::ClientSocket(int32_t logid) : Socket(logid), id_(0)
+{
+}
+
+ClientSocket::~ClientSocket()
+{
+}
+
+int64_t ClientSocket::id() const
+{
+    return id_;
+}
+
+bool ClientSocket::do_connect(const std::string ipaddr, const uint16_t portNo)
+{
+    return (do_connect_start(ipaddr, portNo, false) == 0) && do_connect_finish();
+}
+
+int32_t ClientSocket::do_connect_start(const std::string ipaddr, const uint16_t portNo, const bool async)
+{
+    int32_t ret = 0;
+
+    struct sockaddr_storage ss;
+    socklen_t len = 0;
+    if (is_unix_address(ipaddr))
+    {
+        struct sockaddr_un &sa_server = *reinterpret_cast<struct sockaddr_un *>(&ss);
+        len = unix_address(ipaddr, sa_server);
+        if ((len == 0) || !set_family_(AF_UNIX))
+        {
+            LOGGER_ERROR(logid_, "ERR! connect address:%s", ipaddr.c_str());
+            return -1;
+        }
+    }
+    else
+    {
+        struct sockaddr_in &sa_server = *reinterpret_cast<struct sockaddr_in *>(&ss);
+        std::memset(&sa_server, 0, sizeof(sa_server));
+        sa_server.sin_family = AF_INET;
+        sa_server.sin_port = htons(portNo);
+        inet_pton(sa_server.sin_family, ipaddr.c_str(), &sa_server.sin_addr.s_addr);
+        len = sizeof(sa_server);
+    }
+
+    // 受信バッファはウィンドウスケールに効くため、接続前に設定する
+    apply_options_(sock_);
+
+    // 非同期の場合は、接続の完了を待たずに戻る
+    connecting_ = false;
+    if (async && !set_nonblock(logid_, sock_, true))
+    {
+        return -1;
+    }
+
+    // 接続
+    ret = ::connect(sock_, reinterpret_cast<struct sockaddr *>(&ss), len);
+    if ((ret != 0) && async && (errno == EINPROGRESS))
+    {
+        connecting_ = true;
+        LOGGER_INFO(logid_, "connecting sock:0x%x", sock_);
+        LOGGER_INFO(logid_, " -> %s:%d", ipaddr.c_str(), portNo);
+        return 1;
+    }
+    if (ret != 0)
+    {
+        LOGGER_ERROR(logid_, "ERR! connect sock:0x%x err:%d", sock_, errno);
+        return -1;
+    }
+    LOGGER_INFO(logid_, "connect sock:0x%x", sock_);
+    LOGGER_INFO(logid_, " -> %s:%d", ipaddr.c_str(), portNo);
+
+    return 0;
+}
+
+bool ClientSocket::do_connect_finish()
+{
+    if (connecting_)
+    {
+        // 非同期の接続の結果を確認する
+        connecting_ = false;
+        int32_t err = 0;
+        socklen_t len = sizeof(err);
+        if ((::getsockopt(sock_, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0))
+        {
+            LOGGER_ERROR(logid_, "ERR! connect sock:0x%x err:%d", sock_, err);
+            return false;
+        }
+        LOGGER_INFO(logid_, "connect sock:0x%x", sock_);
+    }
+    // 非同期の接続で設定したノンブロッキングを、ノンブロッキングモードの設定に合わせる
+    if (!set_nonblock(logid_, sock_, nonBlocking_))
+    {
+        return false;
+    }
+
+    // 接続テーブルに登録して受信を開始する
+    int64_t id = attach_(sock_);
+    if (id == 0)
+    {
+        return false;
+    }
+    id_ = id;
+
+    return true;
+}
+
+void ClientSocket::do_disconnect()
+{
+    std::vector<std::function<void()>> released;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Connection *conn = connections_.find(id_);
+        if (conn != nullptr)
+        {
+            remove_connection_(*conn, released);
+            // ソケットはdo_deleteで閉じる
+            detach_(sock_);
+        }
+        id_ = 0;
+    }
+    for (auto &func : released)
+    {
+        func();
+    }
+}
+
+int32_t ClientSocket::do_send(const char *sndData, const int32_t sndSize)
+{
+    return Socket::do_send(id_, sndData, sndSize);
+}
+
+int32_t ClientSocket::do_send(const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags)
+{
+    return Socket::do_send(id_, sndData, sndSize, release, flags);
+}
+
+int32_t ClientSocket::do_send(const uint32_t requestId, const char *sndData, const int32_t sndSize, const uint8_t flags)
+{
+    return Socket::do_send(id_, requestId, sndData, sndSize, flags);
+}
+
+int32_t ClientSocket::do_zerocopy_event()
+{
+    return Socket::do_zerocopy_event(id_);
+}
+
+int32_t ClientSocket::do_recieve(Buffer &rcvBuffer)
+{
+    return Socket::do_recieve(id_, rcvBuffer);
+}
+
+int32_t ClientSocket::waitTimeout(const int32_t timeout)
+{
+    return (coalesceWindowUs_ > 0) ? coalesce_timeout_(timeout) : timeout;
+}
+
+bool ClientSocket::waitDeadline(std::chrono::steady_clock::time_point &deadline)
+{
+    return (coalesceWindowUs_ > 0) && coalesce_deadline_(deadline);
+}
+
+bool ClientSocket::do_watch()
+{
+    // 送信キューにデータが残っていればEPOLLOUTも監視する
+    // (ブロッキングのソケットへの同期送信はロックを保持したままブロックするため、送信キューを使う場合のみ参照する)
+    bool out = false;
+    if (asyncSend_ || nonBlocking_)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Connection *conn = connections_.find(id_);
+        out = (conn != nullptr) && conn->sendContext_.armed_;
+    }
+    struct epoll_event ev;
+    ev.events = epoll_events(nonBlocking_, out);
+    ev.data.u64 = (loopFd_ != -1) ? loopTag_ : static_cast<uint64_t>(id_);
+
+    int32_t ret = ::epoll_ctl(epfd_, EPOLL_CTL_ADD, sock_, &ev);
+    if ((ret == -1) && (errno == EEXIST))
+    {
+        ret = ::epoll_ctl(epfd_, EPOLL_CTL_MOD, sock_, &ev);
+    }
+    if (ret == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! ctl_add epfd err:%d", errno);
+        return false;
+    }
+    return true;
+}
+
+int32_t ClientSocket::do_recieve_ready(const uint32_t events, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained)
+{
+    int32_t result = 0;
+    uint32_t ready = events;
+
+    if ((ready & EPOLLERR) && (zeroCopyThreshold_ > 0))
+    {
+        // MSG_ZEROCOPYの完了通知はエラーキューに届く
+        if (do_zerocopy_event() != 0)
+        {
+            LOGGER_INFO(logid_, "disconnect sock:0x%x", sock_);
+            result = 1;
+            ready = 0;
+        }
+        else
+        {
+            ready &= ~static_cast<uint32_t>(EPOLLERR);
+        }
+    }
+
+    if (ready & EPOLLOUT)
+    {
+        // 送信キューに溜まったデータを書き込む
+        if (do_flush(id_, func_drained) != 0)
+        {
+            LOGGER_INFO(logid_, "disconnect sock:0x%x", sock_);
+            result = 1;
+            ready = 0;
+        }
+        else
+        {
+            ready &= ~static_cast<uint32_t>(EPOLLOUT);
+        }
+    }
+
+    if (ready != 0)
+    {
+        if (nonBlocking_)
+        {
+            // 切断通知と同時に届いたデータも取りこぼさないよう、先に読み込む
+            int32_t ret = do_recieve_nonblock(id_, func_recieve);
+            if ((ret <= 0) || (ready & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            {
+                // 接続が切れたため、再接続させる
+                LOGGER_INFO(logid_, "disconnect sock:0x%x", sock_);
+                result = 1;
+            }
+        }
+        else if (ready & EPOLLRDHUP)
+        {
+            // 接続が切れたため、再接続させる
+            LOGGER_INFO(logid_, "disconnect sock:0x%x", sock_);
+            result = 1;
+        }
+        else if (ready & EPOLLIN)
+        {
+            // クライアントからデータ受信
+            Buffer buffer;
+            uint8_t flags = 0;
+            int32_t ret = Socket::do_recieve(id_, buffer, flags);
+            if (ret > 0)
+            {
+                if (!buffer.empty())
+                {
+                    func_recieve(id_, flags, buffer);
+                }
+            }
+            else
+            {
+                // エラー
+                result = -1;
+            }
+        }
+        else
+        {
+            // エラー
+            LOGGER_ERROR(logid_, "ERR! wait epfd events:%d", ready);
+            result = -1;
+        }
+    }
+
+    if ((coalesceWindowUs_ > 0) && (result == 0))
+    {
+        // 窓の期限を過ぎた送信キューを書き込む
+        std::vector<int64_t> failed;
+        flush_coalesced_(func_drained, failed);
+        if (!failed.empty())
+        {
+            LOGGER_INFO(logid_, "disconnect sock:0x%x", sock_);
+            result = 1;
+        }
+    }
+
+    // 他のスレッドから積まれたタスクを実行する
+    run_posted_();
+    return result;
+}
+
+Server::Reciever::~Reciever()
+{
+}
+
+void Server::Reciever::recieveBuffer(const int64_t id, Buffer buffer)
+{
+    recieveData(id, buffer.data(), buffer.size());
+}
+
+void Server::Reciever::sendDrained(const int64_t)
+{
+}
+
+void Server::Reciever::recieveRequest(const int64_t, const uint32_t, const char *, const int32_t)
+{
+}
+
+void Server::Reciever::recieveBegin(const int64_t, const int32_t)
+{
+}
+
+void Server::Reciever::recieveChunk(const int64_t, const char *, const int32_t)
+{
+}
+
+void Server::Reciever::recieveEnd(const int64_t, const bool)
+{
+}
+
+Server::Loop::Loop(int32_t logid) : serverSock_(logid)
+{
+}
+
+Server::Server(int32_t logid) : logid_(logid)
+{
+    loops_.emplace_back(new Loop(logid_));
+}
+
+Server::~Server()
+{
+    end();
+}
+
+void Server::setAddress(const std::string ipaddr, const uint16_t portNo)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    ipaddr_ = ipaddr;
+    portNo_ = portNo;
+}
+
+void Server::setLoopNum(const int32_t loopNum)
+{
+    if (isRunning_ || (loopNum < 1) || (loopNum > ConnectionId::LOOP_MAX + 1))
+    {
+        return;
+    }
+
+    // 追加するループはループ0の設定を引き継ぐ
+    while (static_cast<int32_t>(loops_.size()) > loopNum)
+    {
+        loops_.pop_back();
+    }
+    while (static_cast<int32_t>(loops_.size()) < loopNum)
+    {
+        std::unique_ptr<Loop> loop(new Loop(logid_));
+        loop->serverSock_.copySettings(loops_[0]->serverSock_);
+        loop->serverSock_.setLoopIndex(static_cast<int32_t>(loops_.size()));
+        loops_.emplace_back(std::move(loop));
+    }
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setReusePort(loopNum > 1);
+    }
+}
+
+void Server::setOptions(const SocketOptions &options)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setOptions(options);
+    }
+}
+
+void Server::setBacklog(const int32_t backlog)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setBacklog(backlog);
+    }
+}
+
+AcceptStat Server::getAcceptStat()
+{
+    AcceptStat total;
+    for (auto &loop : loops_)
+    {
+        AcceptStat stat = loop->serverSock_.acceptStat();
+        total.accepted_ += stat.accepted_;
+        total.batches_ += stat.batches_;
+        total.maxBatch_ = (stat.maxBatch_ > total.maxBatch_) ? stat.maxBatch_ : total.maxBatch_;
+        total.errors_ += stat.errors_;
+        total.queued_ += stat.queued_;
+        total.backlog_ = (stat.backlog_ > total.backlog_) ? stat.backlog_ : total.backlog_;
+        // ホスト全体の値のため合計しない
+        total.listenOverflows_ = stat.listenOverflows_;
+        total.listenDrops_ = stat.listenDrops_;
+    }
+    return total;
+}
+
+TrafficStat Server::getTrafficStat()
+{
+    TrafficStat total;
+    for (auto &loop : loops_)
+    {
+        total.add(loop->serverSock_.trafficStat());
+    }
+    return total;
+}
+
+bool Server::getConnectionStat(const int64_t id, TrafficStat &stat)
+{
+    for (auto &loop : loops_)
+    {
+        if (loop->serverSock_.connectionStat(id, stat))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<Server::LoopStat> Server::getLoopStats()
+{
+    std::vector<LoopStat> stats;
+    for (auto &loop : loops_)
+    {
+        LoopStat stat;
+        stat.connections_ = static_cast<int32_t>(loop->serverSock_.connectionCount());
+        stat.recvPauses_ = loop->serverSock_.recievePauses();
+        stat.traffic_ = loop->serverSock_.trafficStat();
+        if (isRunning_ && loop->th_.joinable())
+        {
+            clockid_t cid;
+            struct timespec ts;
+            if ((::pthread_getcpuclockid(loop->th_.native_handle(), &cid) == 0) && (::clock_gettime(cid, &ts) == 0))
+            {
+                stat.cpuTimeUs_ = static_cast<uint64_t>(ts.tv_sec) * 1000000 + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+            }
+        }
+        stats.emplace_back(stat);
+    }
+    return stats;
+}
+
+void Server::setNonBlocking(const bool nonBlocking)
+{
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setNonBlocking(nonBlocking);
+    }
+}
+
+void Server::setZeroCopy(const int32_t threshold)
+{
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setZeroCopy(threshold);
+    }
+}
+
+void Server::setAsyncSend(const bool asyncSend)
+{
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setAsyncSend(asyncSend);
+    }
+}
+
+void Server::setCoalesce(const int32_t windowUs, const size_t budget)
+{
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setCoalesce(windowUs, budget);
+    }
+}
+
+void Server::setCompression(const int32_t threshold)
+{
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setCompression(threshold);
+    }
+}
+
+void Server::setStreaming(const int32_t chunkSize)
+{
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setStreaming(chunkSize);
+    }
+}
+
+void Server::setSendWatermark(const size_t high, const size_t low)
+{
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setSendWatermark(high, low);
+    }
+}
+
+void Server::setRecieveWatermark(const size_t highBytes, const size_t lowBytes, const int32_t highFrames, const int32_t lowFrames)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    for (auto &loop : loops_)
+    {
+        loop->serverSock_.setRecieveWatermark(highBytes, lowBytes, highFrames, lowFrames);
+    }
+}
+
+bool Server::isWritable(const int64_t id)
+{
+    ServerSocket *sock = find(id);
+    return (sock != nullptr) && sock->isWritable(id);
+}
+
+void Server::setThreadPool(ThreadPool *pool)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    for (auto &loop : loops_)
+    {
+        loop->dispatcher_.setPool(pool);
+    }
+}
+
+void Server::start(Reciever *reciever)
+{
+    for (auto &loop : loops_)
+    {
+        std::lock_guard<std::mutex> lock(loop->mtx_);
+        loop->reciever_ = reciever;
+    }
+
+    if (!isRunning_)
+    {
+        isRunning_ = true;
+        for (auto &loop : loops_)
+        {
+            Loop *l = loop.get();
+            // ThreadPoolでの処理は、異なる接続を並列に処理するためロックを保持せずに呼び出す
+            // (end()が処理中のフレームの完了を待つため、呼び出し中にrecieverが破棄されることは無い)
+            auto handler = [l](int64_t id, uint8_t flags, Buffer &buffer)
+            {
+                Reciever *reciever = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(l->mtx_);
+                    reciever = l->reciever_;
+                }
+                int32_t size = buffer.size();
+                deliver(reciever, id, flags, buffer);
+                l->serverSock_.do_recieve_release(id, size);
+            };
+            l->dispatcher_.setHandler(handler);
+            // ストリーミング受信のチャンクは受信バッファを指すため、受信スレッドで通知する
+            auto func_stream = [l](int64_t id, Socket::StreamEvent event, const char *data, int32_t size)
+            {
+                std::lock_guard<std::mutex> lock(l->mtx_);
+                stream(l->reciever_, id, event, data, size);
+            };
+            l->serverSock_.setStreamHandler(func_stream);
+            std::thread th(&Server::task, this, l);
+            loop->th_.swap(th);
+        }
+    }
+}
+
+void Server::end()
+{
+    for (auto &loop : loops_)
+    {
+        std::lock_guard<std::mutex> lock(loop->mtx_);
+        loop->reciever_ = nullptr;
+    }
+    if (isRunning_)
+    {
+        isRunning_ = false;
+        // イベント待ちのタイムアウトを待たずに終了させる
+        for (auto &loop : loops_)
+        {
+            loop->serverSock_.do_wakeup();
+        }
+        for (auto &loop : loops_)
+        {
+            loop->th_.join();
+            loop->dispatcher_.wait();
+        }
+    }
+}
+
+int32_t Server::sendData(const int64_t id, const char *data, const int32_t size)
+{
+    ServerSocket *sock = find(id);
+    if (sock == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! send disconnect sock:0x%llx", static_cast<unsigned long long>(id));
+        return -1;
+    }
+    return sock->do_send(id, data, size);
+}
+
+int32_t Server::sendData(const int64_t id, const char *data, const int32_t size, const std::function<void()> &release)
+{
+    ServerSocket *sock = find(id);
+    if (sock == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! send disconnect sock:0x%llx", static_cast<unsigned long long>(id));
+        if (release)
+        {
+            release();
+        }
+        return -1;
+    }
+    return sock->do_send(id, data, size, release);
+}
+
+int32_t Server::reply(const int64_t id, const uint32_t requestId, const char *data, const int32_t size)
+{
+    ServerSocket *sock = find(id);
+    if (sock == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! reply disconnect sock:0x%llx", static_cast<unsigned long long>(id));
+        return -1;
+    }
+    return sock->do_send(id, requestId, data, size, Header::FLAG_REPLY);
+}
+
+int32_t Server::post(const int64_t id, const std::function<void()> &task)
+{
+    ServerSocket *sock = find(id);
+    if ((sock == nullptr) || !sock->hasConnection(id))
+    {
+        LOGGER_ERROR(logid_, "ERR! post disconnect sock:0x%llx", static_cast<unsigned long long>(id));
+        return -1;
+    }
+    sock->do_post(task);
+    return 0;
+}
+
+int32_t Server::flush(const int64_t id)
+{
+    ServerSocket *sock = find(id);
+    if (sock == nullptr)
+    {
+        LOGGER_ERROR(logid_, "ERR! flush unknown id:0x%llx", static_cast<unsigned long long>(id));
+        return -1;
+    }
+    return sock->do_flush_send(id);
+}
+
+void Server::task(Loop *loop)
+{
+    LOGGER_INFO(logid_, "task sta");
+    ServerSocket &serverSock = loop->serverSock_;
+
+    // ソケットを作成
+    if (!serverSock.do_create())
+    {
+        return;
+    }
+
+    // バインド/リッスン開始
+    if (!serverSock.do_bind_listen(ipaddr_, portNo_))
+    {
+        return;
+    }
+
+    while (isRunning_)
+    {
+        auto func = [&](int64_t client, uint8_t flags, Buffer &buffer)
+        {
+            if (loop->dispatcher_.enabled())
+            {
+                // 受信スレッドはすぐにイベント待ちに戻る(処理を終えるまで受信のフロー制御で数える)
+                serverSock.do_recieve_hold(client, buffer.size());
+                loop->dispatcher_.dispatch(client, flags, std::move(buffer));
+                return;
+            }
+            std::lock_guard<std::mutex> lock(loop->mtx_);
+            deliver(loop->reciever_, client, flags, buffer);
+        };
+
+        auto func_drained = [&](int64_t client)
+        {
+            std::lock_guard<std::mutex> lock(loop->mtx_);
+            if (loop->reciever_ != nullptr)
+            {
+                loop->reciever_->sendDrained(client);
+            }
+        };
+
+        (void)serverSock.do_recieve_event(func, func_drained);
+    }
+    serverSock.do_stop_accept();
+    serverSock.do_disconnect_all();
+    serverSock.do_delete();
+    LOGGER_INFO(logid_, "task end");
+}
+
+void Server::deliver(Reciever *reciever, const int64_t id, const uint8_t flags, Buffer &buffer)
+{
+    if (reciever == nullptr)
+    {
+        return;
+    }
+    if (flags & Header::FLAG_REQUEST)
+    {
+        uint32_t requestId = 0;
+        if (CallTable::unpack(buffer, requestId))
+        {
+            reciever->recieveRequest(id, requestId, buffer.data() + CallTable::PREFIX_SIZE, buffer.size() - CallTable::PREFIX_SIZE);
+        }
+        return;
+    }
+    reciever->recieveBuffer(id, std::move(buffer));
+}
+
+void Server::stream(Reciever *reciever, const int64_t id, const Socket::StreamEvent event, const char *data, const int32_t size)
+{
+    if (reciever == nullptr)
+    {
+        return;
+    }
+    switch (event)
+    {
+    case Socket::StreamEvent::BEGIN:
+        reciever->recieveBegin(id, size);
+        break;
+    case Socket::StreamEvent::CHUNK:
+        reciever->recieveChunk(id, data, size);
+        break;
+    case Socket::StreamEvent::END:
+        reciever->recieveEnd(id, true);
+        break;
+    case Socket::StreamEvent::ABORT:
+        reciever->recieveEnd(id, false);
+        break;
+    }
+}
+
+ServerSocket *Server::find(const int64_t id)
+{
+    // 接続IDのループ番号から接続を持つループを求める(未接続はdo_sendで判定する)
+    size_t idx = static_cast<size_t>(ConnectionId::loop(id));
+    if ((id <= 0) || (idx >= loops_.size()))
+    {
+        return nullptr;
+    }
+    return &loops_[idx]->serverSock_;
+}
+
+Client::Reciever::~Reciever()
+{
+}
+
+void Client::Reciever::recieveBuffer(const int64_t id, Buffer buffer)
+{
+    recieveData(id, buffer.data(), buffer.size());
+}
+
+void Client::Reciever::sendDrained(const int64_t)
+{
+}
+
+void Client::Reciever::recieveBegin(const int64_t, const int32_t)
+{
+}
+
+void Client::Reciever::recieveChunk(const int64_t, const char *, const int32_t)
+{
+}
+
+void Client::Reciever::recieveEnd(const int64_t, const bool)
+{
+}
+
+Client::Client(int32_t logid) : logid_(logid), clientSock_(logid)
+{
+}
+
+Client::~Client()
+{
+    end();
+}
+
+void Client::setAddress(const std::string ipaddr, const uint16_t portNo)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    ipaddr_ = ipaddr;
+    portNo_ = portNo;
+}
+
+void Client::setNonBlocking(const bool nonBlocking)
+{
+    clientSock_.setNonBlocking(nonBlocking);
+}
+
+void Client::setOptions(const SocketOptions &options)
+{
+    clientSock_.setOptions(options);
+}
+
+void Client::setZeroCopy(const int32_t threshold)
+{
+    clientSock_.setZeroCopy(threshold);
+}
+
+void Client::setAsyncSend(const bool asyncSend)
+{
+    clientSock_.setAsyncSend(asyncSend);
+}
+
+void Client::setCoalesce(const int32_t windowUs, const size_t budget)
+{
+    clientSock_.setCoalesce(windowUs, budget);
+}
+
+void Client::setCompression(const int32_t threshold)
+{
+    clientSock_.setCompression(threshold);
+}
+
+void Client::setStreaming(const int32_t chunkSize)
+{
+    clientSock_.setStreaming(chunkSize);
+}
+
+void Client::setSendWatermark(const size_t high, const size_t low)
+{
+    clientSock_.setSendWatermark(high, low);
+}
+
+bool Client::isWritable()
+{
+    return clientSock_.isWritable(clientSock_.id());
+}
+
+void Client::setThreadPool(ThreadPool *pool)
+{
+    if (!isRunning_)
+    {
+        dispatcher_.reset((pool != nullptr) ? new Dispatcher() : nullptr);
+        if (dispatcher_)
+        {
+            dispatcher_->setPool(pool);
+        }
+    }
+}
+
+void Client::setLoop(ClientLoop *loop)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    loop_ = loop;
+    if (loop_ != nullptr)
+    {
+        clientSock_.setNonBlocking(true);
+        // RPCの応答待ちの期限はループのタイマーで監視する(期限が早まった場合はループを起こす)
+        calls_.setTimer([this]()
+                        { clientSock_.do_wakeup(); });
+    }
+    else
+    {
+        calls_.setTimer(nullptr);
+    }
+}
+
+void Client::setOutbox(const size_t maxBytes, const int32_t maxAgeMs, const OutboxDrop drop)
+{
+    if (isRunning_)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(outboxMtx_);
+    outboxMax_ = maxBytes;
+    outboxAgeMs_ = maxAgeMs;
+    outboxDrop_ = drop;
+    if (outboxMax_ > 0)
+    {
+        // 接続中の送信もキューに積むだけにして、呼出し元をブロックしない
+        clientSock_.setAsyncSend(true);
+    }
+}
+
+OutboxStat Client::getOutboxStat()
+{
+    std::lock_guard<std::mutex> lock(outboxMtx_);
+    expire_outbox_(std::chrono::steady_clock::now());
+    return outboxStat_;
+}
+
+TrafficStat Client::getTrafficStat()
+{
+    return clientSock_.trafficStat();
+}
+
+void Client::start(Reciever *reciever)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        reciever_ = reciever;
+    }
+    if (!isRunning_)
+    {
+        isRunning_ = true;
+        auto handler = [this](int64_t id, uint8_t, Buffer &buffer)
+        {
+            Reciever *reciever = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                reciever = reciever_;
+            }
+            if (reciever != nullptr)
+            {
+                reciever->recieveBuffer(id, std::move(buffer));
+            }
+        };
+        if (dispatcher_)
+        {
+            dispatcher_->setHandler(handler);
+        }
+        // ストリーミング受信のチャンクは受信バッファを指すため、受信スレッドで通知する
+        auto func_stream = [this](int64_t id, Socket::StreamEvent event, const char *data, int32_t size)
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stream(reciever_, id, event, data, size);
+        };
+        clientSock_.setStreamHandler(func_stream);
+        if (loop_ != nullptr)
+        {
+            loop_->attach_(this);
+            return;
+        }
+        std::thread th(&Client::task, this);
+        th_.swap(th);
+    }
+}
+
+void Client::end()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        reciever_ = nullptr;
+    }
+    if (isRunning_)
+    {
+        isRunning_ = false;
+        if (loop_ != nullptr)
+        {
+            // ループのスレッドが切断し終えるまで待つ
+            loop_->detach_(this);
+        }
+        else
+        {
+            // イベント待ちのタイムアウトを待たずに終了させる
+            clientSock_.do_wakeup();
+            th_.join();
+        }
+        if (dispatcher_)
+        {
+            dispatcher_->wait();
+        }
+    }
+    calls_.failAll();
+}
+
+int32_t Client::sendData(const char *data, const int32_t size)
+{
+    if (outboxMax_ > 0)
+    {
+        return send_outbox_(data, size, nullptr);
+    }
+    return clientSock_.do_send(data, size);
+}
+
+int32_t Client::sendData(const char *data, const int32_t size, const std::function<void()> &release)
+{
+    if (outboxMax_ > 0)
+    {
+        return send_outbox_(data, size, release);
+    }
+    return clientSock_.do_send(data, size, release);
+}
+
+std::future<CallResult> Client::call(const char *data, const int32_t size, const int32_t timeoutMs)
+{
+    auto promise = std::make_shared<std::promise<CallResult>>();
+    std::future<CallResult> future = promise->get_future();
+    auto callback = [promise](CallResult &result)
+    {
+        promise->set_value(std::move(result));
+    };
+    (void)call(data, size, timeoutMs, callback);
+    return future;
+}
+
+int32_t Client::call(const char *data, const int32_t size, const int32_t timeoutMs, const std::function<void(CallResult &)> &callback)
+{
+    uint32_t requestId = calls_.add(timeoutMs, callback);
+    int32_t ret = clientSock_.do_send(requestId, data, size, Header::FLAG_REQUEST);
+    if (ret < 0)
+    {
+        calls_.fail(requestId);
+    }
+    return ret;
+}
+
+void Client::post(const std::function<void()> &task)
+{
+    clientSock_.do_post(task);
+}
+
+int32_t Client::flush()
+{
+    return clientSock_.do_flush_send(clientSock_.id());
+}
+
+void Client::task()
+{
+    LOGGER_INFO(logid_, "task sta");
+
+    while (isRunning_)
+    {
+        if (connect_(false) != 0)
+        {
+            // リトライ
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        connected_();
+
+        while (isRunning_)
+        {
+            if (!poll_(1000))
+            {
+                // 接続が切れたため、再接続させる
+                break;
+            }
+        }
+        disconnect_();
+    }
+
+    LOGGER_INFO(logid_, "task end");
+}
+
+int32_t Client::connect_(const bool async)
+{
+    // ソケットを作成
+    if (!clientSock_.do_create())
+    {
+        return -1;
+    }
+
+    // 接続
+    int32_t ret = clientSock_.do_connect_start(ipaddr_, portNo_, async);
+    if ((ret == 0) && !clientSock_.do_connect_finish())
+    {
+        return -1;
+    }
+    return ret;
+}
+
+bool Client::poll_(const int32_t timeout)
+{
+    auto func = [this](int64_t id, uint8_t flags, Buffer &buffer)
+    {
+        recieve_(id, flags, buffer);
+    };
+    auto func_drained = [this](int64_t id)
+    {
+        drained_(id);
+    };
+    return clientSock_.do_recieve_event(func, func_drained, timeout) != 1;
+}
+
+bool Client::ready_(const uint32_t events)
+{
+    auto func = [this](int64_t id, uint8_t flags, Buffer &buffer)
+    {
+        recieve_(id, flags, buffer);
+    };
+    auto func_drained = [this](int64_t id)
+    {
+        drained_(id);
+    };
+    return clientSock_.do_recieve_ready(events, func, func_drained) != 1;
+}
+
+void Client::recieve_(const int64_t id, const uint8_t flags, Buffer &buffer)
+{
+    if (flags & Header::FLAG_REPLY)
+    {
+        // RPCの応答は受信スレッドで要求に対応付ける
+        (void)calls_.complete(buffer);
+        return;
+    }
+    if (dispatcher_ && dispatcher_->enabled())
+    {
+        dispatcher_->dispatch(id, flags, std::move(buffer));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (reciever_ != nullptr)
+    {
+        reciever_->recieveBuffer(id, std::move(buffer));
+    }
+}
+
+void Client::drained_(const int64_t id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (reciever_ != nullptr)
+    {
+        reciever_->sendDrained(id);
+    }
+}
+
+void Client::disconnect_()
+{
+    // 再接続を試みるためソケット破棄
+    // (切断した接続への要求には応答が届かないため、応答待ちを失敗させる)
+    clientSock_.do_disconnect();
+    clientSock_.do_delete();
+    calls_.failAll();
+}
+
+void Client::connected_()
+{
+    if (outboxMax_ == 0)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(outboxMtx_);
+    (void)flush_outbox_();
+}
+
+int32_t Client::send_outbox_(const char *data, const int32_t size, const std::function<void()> &release)
+{
+    std::lock_guard<std::mutex> lock(outboxMtx_);
+    // 保持しているデータを先に送信して、送信順を保つ
+    if ((clientSock_.id() != 0) && flush_outbox_())
+    {
+        int32_t ret = clientSock_.do_send(data, size, release);
+        if ((ret >= 0) || release)
+        {
+            // 送信に失敗した場合もreleaseは呼ばれているため、データを保持できない
+            return ret;
+        }
+    }
+
+    // 切断中のため、接続するまでコピーを保持する
+    int32_t ret = hold_outbox_(data, size);
+    if (release)
+    {
+        release();
+    }
+    return ret;
+}
+
+bool Client::flush_outbox_()
+{
+    if (outbox_.empty())
+    {
+        return true;
+    }
+    expire_outbox_(std::chrono::steady_clock::now());
+    while (!outbox_.empty())
+    {
+        // 送信し終えるまで解放通知で保持する
+        Buffer buffer = outbox_.front().second;
+        std::function<void()> hold = [buffer]()
+        {
+        };
+        if (clientSock_.do_send(buffer.data(), buffer.size(), hold) < 0)
+        {
+            return false;
+        }
+        outbox_.pop_front();
+        outboxStat_.frames_--;
+        outboxStat_.bytes_ -= static_cast<uint64_t>(buffer.size());
+        outboxStat_.flushed_++;
+    }
+    return true;
+}
+
+int32_t Client::hold_outbox_(const char *data, const int32_t size)
+{
+    auto now = std::chrono::steady_clock::now();
+    expire_outbox_(now);
+
+    uint64_t bytes = static_cast<uint64_t>(size);
+    if ((bytes > outboxMax_) || ((outboxDrop_ == OutboxDrop::NEWEST) && (outboxStat_.bytes_ + bytes > outboxMax_)))
+    {
+        outboxStat_.droppedOverflow_++;
+        return -1;
+    }
+    while (outboxStat_.bytes_ + bytes > outboxMax_)
+    {
+        // 古いデータから捨てて空きを作る
+        outboxStat_.frames_--;
+        outboxStat_.bytes_ -= static_cast<uint64_t>(outbox_.front().second.size());
+        outboxStat_.droppedOverflow_++;
+        outbox_.pop_front();
+    }
+
+    Buffer buffer = BufferPool::instance().get(size);
+    if (size > 0)
+    {
+        std::memcpy(buffer.data(), data, static_cast<size_t>(size));
+    }
+    outbox_.emplace_back(now, std::move(buffer));
+    outboxStat_.frames_++;
+    outboxStat_.bytes_ += bytes;
+    outboxStat_.queued_++;
+    return 0;
+}
+
+void Client::expire_outbox_(const std::chrono::steady_clock::time_point now)
+{
+    if (outboxAgeMs_ <= 0)
+    {
+        return;
+    }
+    auto limit = now - std::chrono::milliseconds(outboxAgeMs_);
+    while (!outbox_.empty() && (outbox_.front().first < limit))
+    {
+        outboxStat_.frames_--;
+        outboxStat_.bytes_ -= static_cast<uint64_t>(outbox_.front().second.size());
+        outboxStat_.droppedExpired_++;
+        outbox_.pop_front();
+    }
+}
+
+void Client::stream(Reciever *reciever, const int64_t id, const Socket::StreamEvent event, const char *data, const int32_t size)
+{
+    if (reciever == nullptr)
+    {
+        return;
+    }
+    switch (event)
+    {
+    case Socket::StreamEvent::BEGIN:
+        reciever->recieveBegin(id, size);
+        break;
+    case Socket::StreamEvent::CHUNK:
+        reciever->recieveChunk(id, data, size);
+        break;
+    case Socket::StreamEvent::END:
+        reciever->recieveEnd(id, true);
+        break;
+    case Socket::StreamEvent::ABORT:
+        reciever->recieveEnd(id, false);
+        break;
+    }
+}
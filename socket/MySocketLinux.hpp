@@ -0,0 +1,768 @@
+﻿#pragma once
+
+// epoll/io_uringのバックエンド(Linux)のAPI(MySocket.hppからインクルードする)
+
+#include <cstdint>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "BufferPool.hpp"
+#include "Dispatcher.hpp"
+#include "ConnectionTable.hpp"
+#include "CallTable.hpp"
+#include "PostQueue.hpp"
+
+typedef int32_t SOCKET;
+#define SOCKET_ERROR (-1)
+#define INVALID_SOCKET (-1)
+
+// magic_の4バイト目はフラグとして使う
+// (フラグの無い古い実装は先頭3バイトのみ確認するため、フラグを立てたフレームも受信できる)
+class Header
+{
+public:
+    enum Flag : uint8_t
+    {
+        FLAG_COMPRESSED = 0x01, // データは圧縮されている(Compressor::packの形式)
+        FLAG_ACCEPT_COMPRESSED = 0x02, // 送信元は圧縮フレームを受信できる
+        FLAG_REQUEST = 0x04, // RPCの要求(データの先頭4バイトが要求ID)
+        FLAG_REPLY = 0x08, // RPCの応答(データの先頭4バイトが要求ID)
+    };
+
+public:
+    char magic_[4] = "SOC";
+    int32_t size_ = 0;
+
+public:
+    uint8_t flags() const
+    {
+        return static_cast<uint8_t>(magic_[3]);
+    }
+    void setFlags(const uint8_t flags)
+    {
+        magic_[3] = static_cast<char>(flags);
+    }
+};
+
+// ノンブロッキングモードの受信状態(ヘッダ受信中→データ受信中)
+// 途中まで受信したフレームを保持し、次の受信イベントで続きから再開する
+class RecvContext
+{
+public:
+    enum class State
+    {
+        HEADER,
+        BODY,
+    };
+
+public:
+    State state_ = State::HEADER;
+    Header header_;
+    int32_t headerSize_ = 0;
+    Buffer buffer_;
+    int32_t dataSize_ = 0;
+    bool streaming_ = false; // 受信中のフレームをチャンク単位で通知している
+    int32_t chunkSize_ = 0;  // ストリーミング受信でbuffer_に溜めたチャンクのサイズ
+
+public:
+    RecvContext();
+    RecvContext(const RecvContext &) = delete;
+    RecvContext &operator=(const RecvContext &) = delete;
+    ~RecvContext();
+    void reset();
+};
+
+// MSG_ZEROCOPYで送信したデータの完了待ち情報
+// 送信ごとにカーネルが通知番号を割り当て、完了した番号の範囲がエラーキューに届く
+class ZeroCopyContext
+{
+public:
+    uint32_t seq_ = 0;
+    uint32_t done_ = 0;
+    std::deque<std::pair<uint32_t, std::function<void()>>> pending_;
+};
+
+// 非同期送信モードの送信待ちフレーム
+// releaseが無い場合はデータをプールのバッファにコピーして保持する
+class SendEntry
+{
+public:
+    // ヘッダと、RPCのフレームでは続く要求ID(データとは別のiovecで送る)
+    char head_[sizeof(Header) + CallTable::PREFIX_SIZE];
+    size_t headSize_ = sizeof(Header);
+    Buffer buffer_;
+    const char *data_ = nullptr;
+    int32_t size_ = 0;
+    size_t sent_ = 0;
+    std::function<void()> release_;
+};
+
+// 非同期送信モードの接続ごとの送信キュー
+// キューにデータがある間だけEPOLLOUTを監視し、リアクタがノンブロッキングで書き込む
+// 送信の集約が有効な場合は、窓の期限か上限バイト数に達するまでEPOLLOUTを監視せずに溜める
+class SendContext
+{
+public:
+    std::deque<SendEntry> queue_;
+    size_t queuedBytes_ = 0;
+    bool armed_ = false;
+    bool writable_ = true;
+    bool corked_ = false; // 集約中(deadline_にリアクタが書き込む)
+    std::chrono::steady_clock::time_point deadline_;
+};
+
+// 接続ごとの受信のフロー制御(Socket::mtx_をロックして参照する)
+// 受信したフレームのうち処理を終えていない分を数え、高水位を超えると受信を止めて送信元にTCPの背圧をかける
+class FlowContext
+{
+public:
+    size_t bytes_ = 0;
+    int32_t frames_ = 0;
+    bool paused_ = false;
+};
+
+// 送受信の統計(TrafficCounterを集計した値)
+class TrafficStat
+{
+public:
+    uint64_t bytesIn_ = 0;      // 受信したバイト数(ヘッダを含む)
+    uint64_t bytesOut_ = 0;     // 送信したバイト数(ヘッダを含む)
+    uint64_t framesIn_ = 0;     // 受信し終えたフレーム数
+    uint64_t framesOut_ = 0;    // 送信し終えたフレーム数
+    uint64_t partialReads_ = 0; // 要求したより少なく読めた受信(フレームの途中で受信データが途切れた)
+    uint64_t eagain_ = 0;       // 送受信がEAGAINで止まった回数(io_uringバックエンドでは同期送受信のみ)
+    uint64_t wakeups_ = 0;      // イベント待ち(epoll_wait/io_uring_enter)が通知を受けて戻った回数
+    uint64_t connected_ = 0;    // 登録した接続数(Serverは受け付けた数、Clientは接続した数)
+    uint64_t disconnected_ = 0; // 切断した接続数
+    // 以下は集計した時点の値
+    uint64_t connections_ = 0;  // 接続中の数
+    uint64_t queuedFrames_ = 0; // 非同期送信の送信キューのフレーム数
+    uint64_t queuedBytes_ = 0;  // 非同期送信の送信キューのバイト数
+
+public:
+    void add(const TrafficStat &other);
+};
+
+// 送受信の統計のカウンタ
+// 送受信のたびに加算するため、各項目はrelaxedのアトミック操作で数える(項目間の整合は取らない)
+class TrafficCounter
+{
+public:
+    std::atomic<uint64_t> bytesIn_{0};
+    std::atomic<uint64_t> bytesOut_{0};
+    std::atomic<uint64_t> framesIn_{0};
+    std::atomic<uint64_t> framesOut_{0};
+    std::atomic<uint64_t> partialReads_{0};
+    std::atomic<uint64_t> eagain_{0};
+    std::atomic<uint64_t> wakeups_{0};
+    std::atomic<uint64_t> connected_{0};
+    std::atomic<uint64_t> disconnected_{0};
+
+public:
+    static void count(std::atomic<uint64_t> &counter, const uint64_t value = 1)
+    {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+    // statに加える
+    void collect(TrafficStat &stat) const;
+    // 切断した接続のカウンタを引き継ぐ
+    void merge(const TrafficCounter &other);
+    void reset();
+};
+
+// 接続ごとの状態
+// 接続テーブルから接続IDで参照する
+class Connection
+{
+public:
+    SOCKET sock_ = INVALID_SOCKET;
+    int64_t id_ = 0;
+    RecvContext recv_;
+    bool zeroCopy_ = false; // SO_ZEROCOPYを有効にできた
+    ZeroCopyContext zeroCopyContext_;
+    SendContext sendContext_;
+    FlowContext flow_;
+    TrafficCounter traffic_;
+    // 相手が圧縮フレームを受信できる(受信したヘッダのフラグで知る、リアクタスレッドが書き込む)
+    std::atomic<bool> peerCompress_{false};
+    int32_t compressSkip_ = 0;    // 圧縮率が悪かったため、圧縮を試さずに送るフレーム数
+    int32_t compressBackoff_ = 0; // 次に圧縮率が悪かった場合に圧縮を試さないフレーム数
+
+public:
+    // 再利用する要素を新しい接続の状態にする
+    void reset(SOCKET sock, int64_t id);
+};
+
+// リッスンソケットの接続受付の統計
+class AcceptStat
+{
+public:
+    uint64_t accepted_ = 0; // 受け付けた接続数
+    uint64_t batches_ = 0;  // 接続を受け付けたイベント数(accepted_との比が1回でまとめて受け付けた平均数)
+    uint64_t maxBatch_ = 0; // 1回のイベントでまとめて受け付けた最大数
+    uint64_t errors_ = 0;   // 受付エラー(EMFILEなど)
+    uint32_t queued_ = 0;   // 受付待ちキューの接続数(TCPのみ)
+    uint32_t backlog_ = 0;  // 受付待ちキューの上限(TCPのみ、net.core.somaxconnで制限された値)
+    // 受付待ちキューが溢れて捨てた接続数とSYN数(ホスト全体の/proc/net/netstatのTcpExt)
+    uint64_t listenOverflows_ = 0;
+    uint64_t listenDrops_ = 0;
+};
+
+// Clientの切断中の送信データ保持(アウトボックス)の統計
+class OutboxStat
+{
+public:
+    uint64_t queued_ = 0;          // 切断中に保持した送信データ数
+    uint64_t flushed_ = 0;         // 接続後に送信した保持データ数
+    uint64_t droppedOverflow_ = 0; // 保持の上限を超えて捨てた送信データ数
+    uint64_t droppedExpired_ = 0;  // 保持の期限を過ぎて捨てた送信データ数
+    uint64_t frames_ = 0;          // 保持中の送信データ数
+    uint64_t bytes_ = 0;           // 保持中の送信データのバイト数
+};
+
+// 接続ソケットのオプション(0・falseの項目は設定せず、OSの既定値を使う)
+// リッスンソケットにも設定し、受け付けた接続は改めて設定する(TCP_の項目はAF_UNIXでは設定しない)
+class SocketOptions
+{
+public:
+    bool noDelay_ = false;     // TCP_NODELAY: Nagleアルゴリズムを無効にし、小さなセグメントもすぐに送る
+    bool quickAck_ = false;    // TCP_QUICKACK: 遅延ACKを無効にする(カーネルが戻すため、受信のたびに設定し直す)
+    int32_t sendBuffer_ = 0;   // SO_SNDBUF[byte](設定すると自動調整が無効になる)
+    int32_t recvBuffer_ = 0;   // SO_RCVBUF[byte](ウィンドウスケールに効くため、接続前に設定する)
+    int32_t busyPollUs_ = 0;   // SO_BUSY_POLL[usec]: 受信待ちでNICのキューをビジーポーリングする(ループバックには効かない)
+    int32_t notSentLowat_ = 0; // TCP_NOTSENT_LOWAT[byte]: 未送信データがこれを下回るまで書き込み可能にしない
+    int32_t recvLowat_ = 0;    // SO_RCVLOWAT[byte]: これだけ溜まるまで読み込み可能にしない
+
+public:
+    // 小さなフレームの往復の遅延を抑える(Nagleを無効にし、カーネルの未送信キューを短く保つ)
+    // TCP_QUICKACKは受信のたびにシステムコールが増え、ループバックでは遅延が悪化したため含めない
+    static SocketOptions lowLatency();
+    // 大きなデータを連続して送る転送量を上げる(帯域遅延積の大きな経路でもウィンドウが足りるよう、送受信バッファを大きくする)
+    // 効果はtests/MySocketBenchのoptionsで既定値と比べて確かめる
+    static SocketOptions bulkThroughput();
+};
+
+class Socket
+{
+public:
+    // ストリーミング受信の通知(BEGINはsizeにフレームのサイズ、CHUNKはdata/sizeにフレームの一部を渡す)
+    // フレームの途中で接続が切れた場合は、ENDの代わりにABORTを通知する
+    enum class StreamEvent
+    {
+        BEGIN,
+        CHUNK,
+        END,
+        ABORT,
+    };
+
+    // 外部のイベントループ(ClientLoop)で接続ソケットを監視する場合に、積まれたタスクでループを起こす
+    class Waker
+    {
+    public:
+        virtual ~Waker();
+        // tagはsetLoopで渡した値(ループから外したソケットのtagは無視する)
+        virtual void wake(const uint64_t tag) = 0;
+    };
+
+protected:
+    int32_t logid_ = 0;
+
+protected:
+    std::mutex mtx_;
+    SOCKET sock_ = INVALID_SOCKET;
+    // 接続テーブルを変更するのはリアクタスレッドのみで、変更時はmtx_をロックする
+    // (リアクタスレッドからの参照はロック不要、他スレッドからの参照はmtx_をロックする)
+    ConnectionTable<Connection> connections_;
+    int32_t epfd_ = -1;
+    bool nonBlocking_ = false;
+    bool reusePort_ = false;
+    int32_t backlog_ = 0; // 0以下はSOMAXCONN
+    int32_t zeroCopyThreshold_ = 0;
+    // 非同期送信の設定と高水位は、ループに渡す送信でmtx_をロックせずに参照する
+    std::atomic<bool> asyncSend_{false};
+    std::atomic<size_t> sendHighWatermark_{16 * 1024 * 1024};
+    size_t sendLowWatermark_ = 4 * 1024 * 1024;
+    // 受信のフロー制御の水位(0はその項目で制限しない)
+    size_t recvHighBytes_ = 0;
+    size_t recvLowBytes_ = 0;
+    int32_t recvHighFrames_ = 0;
+    int32_t recvLowFrames_ = 0;
+    std::atomic<uint64_t> recvPauses_{0};
+    // ソケット全体の送受信の統計(切断した接続のカウンタを引き継ぐ、接続中の分は各接続のカウンタで数える)
+    TrafficCounter traffic_;
+    SocketOptions options_;
+    int32_t coalesceWindowUs_ = 0;
+    size_t coalesceBudget_ = 64 * 1024;
+    std::vector<int64_t> corked_; // 集約中の接続ID(mtx_をロックして参照する)
+    int32_t compressThreshold_ = 0;
+    int32_t streamChunk_ = 0;
+    std::function<void(int64_t, StreamEvent, const char *, int32_t)> func_stream_;
+    std::string unixPath_; // バインドしたAF_UNIXのソケットファイル(do_deleteで削除する)
+    // バックエンド固有のイベント待ちの状態(バックエンドのMySocket.cppで定義する、io_uringのリングなど)
+    class Reactor;
+    Reactor *reactor_ = nullptr;
+    // イベントループを起こすeventfd(epoll/io_uringで読み込みを監視する)と、ループのスレッドで実行するタスク
+    // wakePending_は書き込んだeventfdをループがまだ処理していない間trueで、続けて積んだタスクでは書き込まない
+    static constexpr uint64_t WAKE_EVENT = UINT64_MAX; // epollのイベントでwakeFd_を区別する値
+    static constexpr size_t POST_BATCH = 256;          // 1回のイベント処理で実行するタスク数の上限
+    // eventfdはループで使うまで作成しない(do_createで作成する)
+    std::atomic<int32_t> wakeFd_{-1};
+    std::atomic<bool> wakePending_{false};
+    PostQueue posted_;
+    // 積まれたタスクを実行するループのスレッド(run_posted_で記録する)と、ループに渡して送信キューに積んでいない送信のバイト数
+    std::atomic<std::thread::id> loopThread_{std::thread::id()};
+    std::atomic<size_t> postedBytes_{0};
+    // 外部のイベントループのepoll(setLoop、接続ソケットを直接登録し、閉じない)
+    // イベントにはloopTag_を格納し、タスクを積んだ時点でwaker_にループを起こさせる
+    int32_t loopFd_ = -1;
+    uint64_t loopTag_ = 0;
+    std::atomic<Waker *> waker_{nullptr};
+
+public:
+    Socket(int32_t logid = 0);
+    virtual ~Socket();
+    // ビルド時に選択したバックエンド名("epoll"/"uring"など)
+    static const char *backend();
+    SOCKET get() const;
+    // 接続IDは切断後に再利用されない(同じfdでも世代が異なる)
+    bool isConnected(const int64_t id) const;
+    bool hasConnection(const int64_t id);
+    size_t connectionCount();
+    void copySettings(const Socket &other);
+    void setNonBlocking(const bool nonBlocking);
+    void setReusePort(const bool reusePort);
+    // リッスンの受付待ちキューの長さ(0以下はSOMAXCONN、カーネルがnet.core.somaxconnで制限する)
+    void setBacklog(const int32_t backlog);
+    // 以降に作成・受付する接続ソケットのオプション
+    void setOptions(const SocketOptions &options);
+    void setZeroCopy(const int32_t threshold);
+    void setAsyncSend(const bool asyncSend);
+    void setSendWatermark(const size_t high, const size_t low);
+    // 処理を終えていない受信データが高水位を超えた接続の受信を止め、低水位以下になると再開する(high/lowが0の項目は制限しない)
+    void setRecieveWatermark(const size_t highBytes, const size_t lowBytes, const int32_t highFrames = 0, const int32_t lowFrames = 0);
+    void setCoalesce(const int32_t windowUs, const size_t budget);
+    void setCompression(const int32_t threshold);
+    // chunkSize以下のチャンク単位でフレームを受信し、受信した分からfunc_streamで通知する(0以下は無効)
+    // 圧縮フレームとRPCフレームは、これまで通りフレーム全体を受信してから通知する
+    void setStreaming(const int32_t chunkSize);
+    void setStreamHandler(const std::function<void(int64_t, StreamEvent, const char *, int32_t)> &func_stream);
+    bool isWritable(const int64_t id);
+    bool do_create();
+    void do_delete();
+    int32_t do_send(const int64_t id, const char *sndData, const int32_t sndSize);
+    // flagsはヘッダに付けるフラグ(RPCフレームなど)
+    int32_t do_send(const int64_t id, const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags = 0);
+    // RPCのフレームは、データをコピーせずに要求IDをヘッダに続けて送信する
+    int32_t do_send(const int64_t id, const uint32_t requestId, const char *sndData, const int32_t sndSize, const uint8_t flags);
+    int32_t do_zerocopy_event(const int64_t id);
+    // notifyがfalseの場合は低水位の通知をせず、EPOLLOUTを受けたリアクタに任せる
+    int32_t do_flush(const int64_t id, const std::function<void(int64_t)> &func_drained, const bool notify = true);
+    // 送信する側のスレッドから書き込む(ループに渡した非同期送信があれば、それを追い越さないようループで書き込む)
+    int32_t do_flush_send(const int64_t id);
+    int32_t do_recieve(const int64_t id, Buffer &rcvBuffer);
+    // flagsに受信したフレームのヘッダのフラグを返す
+    // ストリーミング受信したフレームは、rcvBufferを空のまま返す
+    int32_t do_recieve(const int64_t id, Buffer &rcvBuffer, uint8_t &flags);
+    int32_t do_recieve_nonblock(const int64_t id, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve);
+    // 受信したフレームの処理を始めた(受信スレッドから呼ぶ)・終えた(任意のスレッドから呼ぶ)
+    // setRecieveWatermarkの水位を超えると受信を止め、処理を終えて低水位以下になると再開する
+    void do_recieve_hold(const int64_t id, const int32_t size);
+    void do_recieve_release(const int64_t id, const int32_t size);
+    // 受信を止めた回数
+    uint64_t recievePauses() const;
+    // 送受信の統計(切断した接続を含む合計)
+    // 接続テーブルを参照する間だけmtx_をロックし、カウンタはリアクタを止めずに読む
+    TrafficStat trafficStat();
+    // 接続中の接続の送受信の統計(接続していない場合はfalse)
+    bool connectionStat(const int64_t id, TrafficStat &stat);
+    // taskをイベントループ(リアクタ)のスレッドで実行する(任意のスレッドから呼べる)
+    // ループを起こすため、イベント待ちのタイムアウトを待たずに実行される
+    void do_post(const std::function<void()> &task);
+    // イベント待ちのループを起こす(終了時にタイムアウトを待たないため)
+    void do_wakeup();
+    // 自身のイベント待ちを作らず、外部のイベントループのepfdに接続ソケットを直接登録する(ソケットの作成前に呼ぶ)
+    // epfdのイベントにはtagを格納し、タスクを積んだ時点でwakerを呼ぶ(epfdが-1で自身のイベント待ちに戻す)
+    void setLoop(const int32_t epfd, const uint64_t tag, Waker *waker);
+
+protected:
+    bool enable_zerocopy_(SOCKET sock);
+    void apply_options_(SOCKET sock);
+    // TCP_QUICKACKを設定し直す(受信のたびに呼ぶ)
+    void quick_ack_(SOCKET sock);
+    Connection *add_connection_(SOCKET sock, const bool zeroCopy);
+    void remove_connection_(Connection &conn, std::vector<std::function<void()>> &released);
+    int32_t coalesce_timeout_(const int32_t timeout);
+    // 集約中の送信キューの最も早い期限(無ければfalse)
+    bool coalesce_deadline_(std::chrono::steady_clock::time_point &deadline);
+    void flush_coalesced_(const std::function<void(int64_t)> &func_drained, std::vector<int64_t> &failed);
+    bool pack_frame_(const int64_t id, const char *sndData, const int32_t sndSize, const uint32_t *requestId, Buffer &packed);
+    bool unpack_frame_(Connection &conn, const Header &header, Buffer &buffer);
+    bool flow_enabled_() const;
+    bool recieve_paused_(const int64_t id);
+    // 接続の受信の停止・再開をイベントの監視に反映する(mtx_をロックして呼び出す)
+    void apply_flow_(Connection &conn);
+    // ストリーミング受信するフレームであればBEGINを通知してtrueを返す
+    bool stream_begin_(Connection &conn, const Header &header);
+    // 送信するフレームのヘッダに付ける、受信側の対応を示すフラグ
+    uint8_t accept_flags_() const;
+    // ソケットのアドレスファミリをfamilyにする(異なる場合は同じfd番号で作り直す)
+    bool set_family_(const int32_t family);
+    // 積まれたタスクを実行する(イベントループのスレッドから、イベントを処理した後に呼ぶ)
+    void run_posted_();
+    // 以下は接続ソケットの読み書きの準備をepollで待つ場合(epollバックエンドとsetLoop)に使う
+    // 接続ソケットの監視するイベントを、送信キューと受信の停止の状態に合わせる(opはEPOLL_CTL_ADD/MOD)
+    int32_t watch_(Connection &conn, const int32_t op);
+    // 送信キューのフレームを送信バッファが一杯になるまで書き込む(do_flushの実装)
+    int32_t flush_ready_(const int64_t id, const std::function<void(int64_t)> &func_drained, const bool notify);
+    // 以下はバックエンド(epoll/uringのMySocket.cpp)ごとに定義する
+    // イベント待ち(epoll/io_uringのリング)を作成し、ループを起こすeventfdを監視する(mtx_をロックして呼び出す)
+    bool open_reactor_();
+    // イベント待ちを破棄する(mtx_をロックして呼び出す、解放通知はreleasedに返す)
+    void close_reactor_(std::vector<std::function<void()>> &released);
+    // 送信キューのフレームをリアクタに送信させる(mtx_をロックして呼び出す)
+    void arm_send_(Connection &conn);
+    // 接続を登録してリアクタの受信を開始し、接続IDを返す(失敗は0)
+    int64_t attach_(SOCKET sock);
+    // 接続ソケットをリアクタの監視から外す(closeの前に呼び出す)
+    void detach_(SOCKET sock);
+
+private:
+    int32_t recv_(Connection &conn, char *rcvData, int32_t rcvSize);
+    int32_t sendv_(Connection &conn, struct iovec *iov, int32_t iovcnt, int32_t flags = 0, uint32_t *sendCount = nullptr);
+    int32_t send_frame_(const int64_t id, const char *sndData, const int32_t sndSize, const uint8_t flags, const std::function<void()> &release, std::vector<std::function<void()>> &released, const uint32_t *requestId = nullptr);
+    void zerocopy_complete_(SOCKET sock, ZeroCopyContext &ctx, std::vector<std::function<void()>> &released);
+    // sentは送信済みのバイト数(ヘッダを含む、同期送信で送信しきれなかったフレームの残りを積む場合)
+    int32_t enqueue_(Connection &conn, const char *sndData, const int32_t sndSize, const uint8_t flags, const std::function<void()> &release, const size_t sent = 0, const uint32_t *requestId = nullptr);
+    // ヘッダ(と要求ID)をheadに書き、その長さを返す
+    size_t make_head_(char *head, const int32_t sndSize, const uint8_t flags, const uint32_t *requestId);
+    int32_t send_data_(const int64_t id, const uint32_t *requestId, const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags);
+    // 非同期送信モードでループ以外のスレッドから送信する場合はtrue(mtx_をロックせずにループに渡す)
+    bool post_send_() const;
+    int32_t post_data_(const int64_t id, const uint32_t *requestId, const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags);
+};
+
+class ServerSocket : public Socket
+{
+    std::atomic<uint64_t> accepted_{0};
+    std::atomic<uint64_t> batches_{0};
+    std::atomic<uint64_t> maxBatch_{0};
+    std::atomic<uint64_t> acceptErrors_{0};
+
+public:
+    ServerSocket(int32_t logid = 0);
+    virtual ~ServerSocket() override;
+    // 接続IDに付けるループ番号(Serverのイベントループの番号)を設定する(開始前に呼ぶ)
+    void setLoopIndex(const int32_t index);
+    // ipaddrが"unix:パス"の場合はAF_UNIXのストリームソケットでリッスンする(portNoは使わない)
+    bool do_bind_listen(const std::string ipaddr, const uint16_t portNo);
+    // 接続の受け付けを止める(do_deleteの前に呼ぶ)
+    void do_stop_accept();
+    int32_t do_recieve_event(const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained = nullptr);
+    // 受付待ちの接続をEAGAINまでまとめて受け付け、受け付けた数を返す
+    int32_t do_accept();
+    void do_disconnect(const int64_t id);
+    void do_disconnect_all();
+    AcceptStat acceptStat();
+
+private:
+    void count_accept_(const uint64_t batch);
+    // リッスンを開始したソケットで接続の受け付けを始める(バックエンドごとに定義する)
+    bool start_accept_();
+};
+
+class ClientSocket : public Socket
+{
+    std::atomic<int64_t> id_;
+    bool connecting_ = false; // ノンブロッキングのconnectで接続中
+
+public:
+    ClientSocket(int32_t logid = 0);
+    virtual ~ClientSocket() override;
+    // 接続中の接続ID(未接続は0)
+    int64_t id() const;
+    // ipaddrが"unix:パス"の場合はAF_UNIXのストリームソケットで接続する(portNoは使わない)
+    bool do_connect(const std::string ipaddr, const uint16_t portNo);
+    // 接続を開始する(0:接続した 1:接続中 -1:失敗)
+    // asyncがtrueの場合はconnectでブロックせず、接続中はソケットが書き込み可能になった時点でdo_connect_finishを呼ぶ
+    int32_t do_connect_start(const std::string ipaddr, const uint16_t portNo, const bool async);
+    // 接続を完了して接続テーブルに登録する(接続できなかった場合はfalse)
+    bool do_connect_finish();
+    void do_disconnect();
+    int32_t do_send(const char *sndData, const int32_t sndSize);
+    int32_t do_send(const char *sndData, const int32_t sndSize, const std::function<void()> &release, const uint8_t flags = 0);
+    int32_t do_send(const uint32_t requestId, const char *sndData, const int32_t sndSize, const uint8_t flags);
+    int32_t do_zerocopy_event();
+    int32_t do_recieve(Buffer &rcvBuffer);
+    // timeoutは受信イベントを待つ時間[msec](0は待たずに処理できるイベントのみ処理する)
+    int32_t do_recieve_event(const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained = nullptr, const int32_t timeout = 1000);
+    // 受信イベントの待ち合わせに使うfd(epoll/io_uringのfd、読み込み可能になればdo_recieve_eventで処理できる)
+    int32_t waitFd() const;
+    // 集約中の送信キューの期限までの時間[msec](timeout以下)
+    int32_t waitTimeout(const int32_t timeout);
+    // 以下はsetLoopで外部のイベントループに登録した場合に使う
+    // 接続した接続ソケットをループのepollに登録する
+    bool do_watch();
+    // ループのepollで受けた接続ソケットのイベントを処理する(eventsが0の場合は積まれたタスクと集約の期限のみ処理する)
+    // 戻り値はdo_recieve_eventと同じ
+    int32_t do_recieve_ready(const uint32_t events, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained = nullptr);
+    // 集約中の送信キューの最も早い期限(無ければfalse)
+    bool waitDeadline(std::chrono::steady_clock::time_point &deadline);
+};
+
+class ClientLoop;
+
+class Server
+{
+public:
+    class Reciever
+    {
+    public:
+        virtual ~Reciever();
+        virtual void recieveData(const int64_t id, const char *data, const int32_t size) = 0;
+        // 受信バッファを保持したい場合にオーバーライドする(既定はrecieveDataを呼ぶ)
+        virtual void recieveBuffer(const int64_t id, Buffer buffer);
+        // 非同期送信モードで、送信キューが低水位を下回り再び送信できるようになった
+        virtual void sendDrained(const int64_t id);
+        // RPCの要求を受信した(Server::replyで応答する、既定は応答しない)
+        // 応答は別スレッドから後で返しても良く、要求の順序と異なっても良い
+        virtual void recieveRequest(const int64_t id, const uint32_t requestId, const char *data, const int32_t size);
+        // ストリーミング受信(setStreaming)で、フレームの受信開始・途中のチャンク・受信完了を受信スレッドから通知する
+        // completeがfalseの場合は、フレームの途中で接続が切れた
+        virtual void recieveBegin(const int64_t id, const int32_t size);
+        virtual void recieveChunk(const int64_t id, const char *data, const int32_t size);
+        virtual void recieveEnd(const int64_t id, const bool complete);
+    };
+
+    // イベントループごとの統計
+    class LoopStat
+    {
+    public:
+        int32_t connections_ = 0;
+        uint64_t cpuTimeUs_ = 0; // ループスレッドのCPU時間[usec]
+        uint64_t recvPauses_ = 0; // 受信のフロー制御で受信を止めた回数
+        TrafficStat traffic_;
+    };
+
+private:
+    // イベントループ(リアクタ)ごとのリッスンソケット・epoll・スレッド
+    // 複数ループの場合はSO_REUSEPORTで同じポートをリッスンし、カーネルが接続を振り分ける
+    class Loop
+    {
+    public:
+        ServerSocket serverSock_;
+        std::thread th_;
+        std::mutex mtx_;
+        Reciever *reciever_ = nullptr;
+        Dispatcher dispatcher_;
+
+    public:
+        Loop(int32_t logid);
+    };
+
+private:
+    int32_t logid_ = 0;
+    std::string ipaddr_ = "127.0.0.1";
+    uint16_t portNo_ = 9876;
+
+private:
+    std::vector<std::unique_ptr<Loop>> loops_;
+    std::atomic<bool> isRunning_{false};
+
+public:
+    Server(int32_t logid = 0);
+    ~Server();
+    // リッスンするアドレスを設定する(開始前に呼ぶ)
+    // "unix:パス"はAF_UNIXのストリームソケットでリッスンし、portNoは使わない("unix:@名前"は抽象名前空間)
+    // AF_UNIXではループ間で接続を振り分けられないため、接続を受け付けるのは最初にバインドしたループのみ
+    void setAddress(const std::string ipaddr, const uint16_t portNo = 9876);
+    // イベントループの数(開始前に呼ぶ、1〜ConnectionId::LOOP_MAX + 1)
+    void setLoopNum(const int32_t loopNum);
+    std::vector<LoopStat> getLoopStats();
+    // リッスンの受付待ちキューの長さ(開始前に呼ぶ、0以下はSOMAXCONN)
+    void setBacklog(const int32_t backlog);
+    // 接続ソケットのオプション(開始前に呼ぶ、SocketOptions::lowLatency()などのプリセットを渡せる)
+    void setOptions(const SocketOptions &options);
+    // 全ループの接続受付の統計
+    AcceptStat getAcceptStat();
+    // 全ループの送受信の統計
+    TrafficStat getTrafficStat();
+    // 接続ごとの送受信の統計(接続していない場合はfalse)
+    bool getConnectionStat(const int64_t id, TrafficStat &stat);
+    void setNonBlocking(const bool nonBlocking);
+    void setZeroCopy(const int32_t threshold);
+    void setAsyncSend(const bool asyncSend);
+    void setSendWatermark(const size_t high, const size_t low);
+    // 受信のフロー制御(開始前に呼ぶ)
+    // 接続ごとに、受信してからReciever::recieveDataなどの処理を終えるまでのバイト数かフレーム数が高水位を超えると受信を止め、
+    // 低水位以下になると再開する。受信しない間は送信元にTCPの背圧がかかり、処理待ちの受信データでメモリが増え続けない
+    // ThreadPoolで処理する場合に働く(受信スレッドで処理する場合は、処理を終えるまで次を受信しない)
+    void setRecieveWatermark(const size_t highBytes, const size_t lowBytes, const int32_t highFrames = 0, const int32_t lowFrames = 0);
+    // 小さなフレームの連続送信を集約する(非同期送信モードになる、windowUsが0以下で無効)
+    // 送信キューのフレームは、最初のフレームからwindowUs経過するかbudgetバイトに達した時点でまとめて書き込む
+    void setCoalesce(const int32_t windowUs, const size_t budget = 64 * 1024);
+    // threshold以上のサイズのデータを圧縮して送信する(0以下は無効)
+    // 圧縮フレームは、受信したフレームで圧縮に対応していると分かった接続にのみ送る
+    // 圧縮しても1/8以上小さくならないデータはそのまま送り、続く数フレームは圧縮を試さない
+    void setCompression(const int32_t threshold);
+    // 受信したフレームをchunkSize以下のチャンクに分けて、受信した分からReciever::recieveChunkで通知する(0以下は無効)
+    // 接続ごとの受信メモリがフレームの最大サイズではなくchunkSizeで抑えられる
+    // チャンクはThreadPoolを設定していても受信スレッドで通知する(圧縮フレームとRPCフレームは除く)
+    // 有効にすると、相手に圧縮フレームを送らないよう求める
+    void setStreaming(const int32_t chunkSize);
+    bool isWritable(const int64_t id);
+    // 受信データをThreadPoolで処理する(nullptrで受信スレッドでの処理に戻す)
+    // 同じ接続の受信データは受信順に処理されるが、異なる接続の受信データは並列に処理される
+    void setThreadPool(ThreadPool *pool);
+    void start(Reciever *reciever);
+    void end();
+    // 非同期送信モードでは、送信キューが高水位を超えると1を返す(データはキューに積まれている)
+    // 非同期送信モードで受信スレッド以外から送信したデータは、ロックを取らずにループに渡して積む(切断などの失敗はreleaseとログで知らせる)
+    // 同期送信でも、ノンブロッキングのソケットで送信しきれなかった残りは送信キューに積んでリアクタが送信する
+    int32_t sendData(const int64_t id, const char *data, const int32_t size);
+    // releaseはdataを再利用できるようになった時点で呼ばれる(MSG_ZEROCOPY送信時は完了通知受信後)
+    int32_t sendData(const int64_t id, const char *data, const int32_t size, const std::function<void()> &release);
+    // 集約中の送信キューを窓の期限を待たずに書き込む(遅延を抑えたい時点で呼ぶ)
+    int32_t flush(const int64_t id);
+    // RPCの要求に応答する
+    int32_t reply(const int64_t id, const uint32_t requestId, const char *data, const int32_t size);
+    // taskを接続idを受け持つイベントループのスレッドで実行する(接続していない場合は-1)
+    // 受信の通知と同じスレッドで実行されるため、接続ごとの状態をロックせずに扱える
+    int32_t post(const int64_t id, const std::function<void()> &task);
+
+private:
+    void task(Loop *loop);
+    ServerSocket *find(const int64_t id);
+    static void deliver(Reciever *reciever, const int64_t id, const uint8_t flags, Buffer &buffer);
+    static void stream(Reciever *reciever, const int64_t id, const Socket::StreamEvent event, const char *data, const int32_t size);
+};
+
+class Client
+{
+public:
+    class Reciever
+    {
+    public:
+        virtual ~Reciever();
+        virtual void recieveData(const int64_t id, const char *data, const int32_t size) = 0;
+        // 受信バッファを保持したい場合にオーバーライドする(既定はrecieveDataを呼ぶ)
+        virtual void recieveBuffer(const int64_t id, Buffer buffer);
+        // 非同期送信モードで、送信キューが低水位を下回り再び送信できるようになった
+        virtual void sendDrained(const int64_t id);
+        // ストリーミング受信(setStreaming)で、フレームの受信開始・途中のチャンク・受信完了を受信スレッドから通知する
+        // completeがfalseの場合は、フレームの途中で接続が切れた
+        virtual void recieveBegin(const int64_t id, const int32_t size);
+        virtual void recieveChunk(const int64_t id, const char *data, const int32_t size);
+        virtual void recieveEnd(const int64_t id, const bool complete);
+    };
+
+    // 送信データの保持が上限を超えた場合に捨てるデータ(NEWEST:新しく送信するデータ OLDEST:保持している古いデータ)
+    enum class OutboxDrop
+    {
+        NEWEST,
+        OLDEST,
+    };
+
+private:
+    int32_t logid_ = 0;
+    std::string ipaddr_ = "127.0.0.1";
+    uint16_t portNo_ = 9876;
+
+private:
+    ClientSocket clientSock_;
+
+    std::thread th_;
+    std::mutex mtx_;
+    Reciever *reciever_ = nullptr;
+    std::unique_ptr<Dispatcher> dispatcher_; // setThreadPoolで設定した場合のみ作成する
+    CallTable calls_;
+    std::atomic<bool> isRunning_{false};
+    ClientLoop *loop_ = nullptr;
+
+    // 切断中の送信データ(保持した時刻とデータ)
+    std::mutex outboxMtx_;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, Buffer>> outbox_;
+    size_t outboxMax_ = 0;
+    int32_t outboxAgeMs_ = 0;
+    OutboxDrop outboxDrop_ = OutboxDrop::OLDEST;
+    OutboxStat outboxStat_;
+
+public:
+    Client(int32_t logid = 0);
+    ~Client();
+    // 接続先のアドレスを設定する(開始前に呼ぶ、"unix:パス"はAF_UNIXのストリームソケットで接続する)
+    void setAddress(const std::string ipaddr, const uint16_t portNo = 9876);
+    void setNonBlocking(const bool nonBlocking);
+    // 接続ソケットのオプション(再接続時にも設定する、SocketOptions::lowLatency()などのプリセットを渡せる)
+    void setOptions(const SocketOptions &options);
+    void setZeroCopy(const int32_t threshold);
+    void setAsyncSend(const bool asyncSend);
+    void setSendWatermark(const size_t high, const size_t low);
+    // 小さなフレームの連続送信を集約する(非同期送信モードになる、windowUsが0以下で無効)
+    void setCoalesce(const int32_t windowUs, const size_t budget = 64 * 1024);
+    // threshold以上のサイズのデータを圧縮して送信する(0以下は無効)
+    void setCompression(const int32_t threshold);
+    // 受信したフレームをchunkSize以下のチャンクに分けて、受信した分からReciever::recieveChunkで通知する(0以下は無効)
+    void setStreaming(const int32_t chunkSize);
+    bool isWritable();
+    // 受信データをThreadPoolで処理する(nullptrで受信スレッドでの処理に戻す)
+    void setThreadPool(ThreadPool *pool);
+    // 自身のスレッドを起動せず、ClientLoopのスレッドで接続・受信・再接続する(開始前に呼ぶ、nullptrで自身のスレッドに戻す)
+    // ループのスレッドをブロックしないよう、ノンブロッキングモードになる
+    void setLoop(ClientLoop *loop);
+    // 切断中・再接続中の送信データをmaxBytesまで保持し、接続した時点で送信する(開始前に呼ぶ、0で無効)
+    // 送信で呼出し元をブロックしないよう非同期送信モードになる。maxAgeMsを過ぎたデータは送信せずに捨てる(0以下は無期限)
+    // 送信キューに積んだ後で切断した場合のデータは保持しない
+    void setOutbox(const size_t maxBytes, const int32_t maxAgeMs = 0, const OutboxDrop drop = OutboxDrop::OLDEST);
+    OutboxStat getOutboxStat();
+    // 送受信の統計(再接続前の接続を含む合計)
+    TrafficStat getTrafficStat();
+    void start(Reciever *reciever);
+    void end();
+    // 非同期送信モードでは、送信キューが高水位を超えると1を返す(データはキューに積まれている)
+    // 非同期送信モードで受信スレッド以外から送信したデータは、ロックを取らずにループに渡して積む(切断などの失敗はreleaseとログで知らせる)
+    // 同期送信でも、ノンブロッキングのソケットで送信しきれなかった残りは送信キューに積んでリアクタが送信する
+    // setOutboxで保持を有効にした場合、切断中の送信データは保持して0を返す(保持できずに捨てた場合は-1)
+    int32_t sendData(const char *data, const int32_t size);
+    // releaseはdataを再利用できるようになった時点で呼ばれる(MSG_ZEROCOPY送信時は完了通知受信後)
+    int32_t sendData(const char *data, const int32_t size, const std::function<void()> &release);
+    // 集約中の送信キューを窓の期限を待たずに書き込む(遅延を抑えたい時点で呼ぶ)
+    int32_t flush();
+    // RPCの要求を送信し、応答を受信するかtimeoutMs経過した時点で結果を返す
+    // 応答を待たずに続けて要求を送信できる(応答は要求IDで対応付ける)
+    std::future<CallResult> call(const char *data, const int32_t size, const int32_t timeoutMs);
+    // 結果はcallbackで通知する(受信スレッド、またはタイムアウト・切断を検出したスレッドから呼ばれる)
+    int32_t call(const char *data, const int32_t size, const int32_t timeoutMs, const std::function<void(CallResult &)> &callback);
+    // taskを受信スレッド(setLoopの場合はClientLoopのスレッド)で実行する
+    // 切断中に積んだタスクは、接続した後で実行する
+    void post(const std::function<void()> &task);
+
+private:
+    friend class ClientLoop;
+    void task();
+    // 接続を開始する(0:接続した 1:接続中 -1:失敗)
+    int32_t connect_(const bool async);
+    // 受信イベントを処理する(接続が切れた場合はfalse)
+    bool poll_(const int32_t timeout);
+    // ClientLoopのepollで検出したイベントを処理する(接続が切れた場合はfalse)
+    bool ready_(const uint32_t events);
+    void recieve_(const int64_t id, const uint8_t flags, Buffer &buffer);
+    void drained_(const int64_t id);
+    // 再接続を試みるため切断する
+    void disconnect_();
+    // 接続した時点で、保持していた送信データを送信する
+    void connected_();
+    int32_t send_outbox_(const char *data, const int32_t size, const std::function<void()> &release);
+    // 以下はoutboxMtx_をロックして呼ぶ(全て送信できた場合はtrue)
+    bool flush_outbox_();
+    int32_t hold_outbox_(const char *data, const int32_t size);
+    void expire_outbox_(const std::chrono::steady_clock::time_point now);
+    static void stream(Reciever *reciever, const int64_t id, const Socket::StreamEvent event, const char *data, const int32_t size);
+};
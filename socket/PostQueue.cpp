@@ -0,0 +1,62 @@
+﻿#include "PostQueue.hpp"
+
+#include <utility>
+
+PostQueue::Node::Node() : next_(nullptr)
+{
+}
+
+PostQueue::PostQueue() : head_(new Node()), tail_(head_.load())
+{
+}
+
+PostQueue::~PostQueue()
+{
+    while (tail_ != nullptr)
+    {
+        Node *next = tail_->next_.load(std::memory_order_acquire);
+        delete tail_;
+        tail_ = next;
+    }
+}
+
+void PostQueue::push(std::function<void()> task)
+{
+    Node *node = new Node();
+    node->task_ = std::move(task);
+    // 最後のノードを入れ替えてから前のノードに繋ぐ(繋ぐまでの間は取り出す側から見えない)
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next_.store(node, std::memory_order_release);
+}
+
+size_t PostQueue::run(const size_t maxNum)
+{
+    size_t count = 0;
+    std::function<void()> task;
+    while ((count < maxNum) && pop_(task))
+    {
+        task();
+        count++;
+    }
+    return count;
+}
+
+bool PostQueue::empty() const
+{
+    return tail_->next_.load(std::memory_order_acquire) == nullptr;
+}
+
+bool PostQueue::pop_(std::function<void()> &task)
+{
+    Node *next = tail_->next_.load(std::memory_order_acquire);
+    if (next == nullptr)
+    {
+        return false;
+    }
+    // 取り出したノードを次の番兵にする
+    task = std::move(next->task_);
+    next->task_ = nullptr;
+    delete tail_;
+    tail_ = next;
+    return true;
+}
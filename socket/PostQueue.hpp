@@ -0,0 +1,42 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <functional>
+
+// 複数のスレッドから積み、1つのスレッド(イベントループ)だけが取り出して実行するロックフリーのキュー(MPSC)
+// 積む側はアトミックな交換1回で終わり、ロックを取らない
+class PostQueue
+{
+private:
+    class Node
+    {
+    public:
+        std::atomic<Node *> next_;
+        std::function<void()> task_;
+
+    public:
+        Node();
+    };
+
+private:
+    std::atomic<Node *> head_; // 最後に積んだノード(積む側)
+    Node *tail_;               // 実行済みの番兵ノード(取り出す側のみ参照する)
+
+public:
+    PostQueue();
+    PostQueue(const PostQueue &) = delete;
+    PostQueue &operator=(const PostQueue &) = delete;
+    // 実行していないタスクは実行せずに破棄する
+    ~PostQueue();
+    // 任意のスレッドから呼べる
+    void push(std::function<void()> task);
+    // 以下は取り出す側のスレッドから呼ぶ
+    // 積まれた順にmaxNum個までタスクを実行し、実行した数を返す
+    size_t run(const size_t maxNum);
+    bool empty() const;
+
+private:
+    // 積む側がノードを繋ぎ終えていない場合は、空と同じくfalseを返す
+    bool pop_(std::function<void()> &task);
+};
@@ -0,0 +1,352 @@
+﻿#include "ShmRing.hpp"
+#include "Logger.hpp"
+
+#include <cstring>
+#include <new>
+
+#include <sys/mman.h>    // mmap(), memfd_create()
+#include <sys/stat.h>    // fstat()
+#include <sys/eventfd.h> // eventfd()
+#include <unistd.h>      // close(), ftruncate()
+#include <poll.h>        // poll()
+
+// 共有メモリ上のatomicは、プロセス間で同じアドレスの値として扱えるロックフリーのものに限る
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "lock-free 64bit atomic is required");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "lock-free 32bit atomic is required");
+
+size_t ShmRing::regionSize(const size_t capacity)
+{
+    return sizeof(Control) + capacity;
+}
+
+void ShmRing::attach(void *base, const size_t capacity, const int32_t dataEvent, const int32_t spaceEvent)
+{
+    ctrl_ = static_cast<Control *>(base);
+    data_ = static_cast<char *>(base) + sizeof(Control);
+    capacity_ = capacity;
+    dataEvent_ = dataEvent;
+    spaceEvent_ = spaceEvent;
+}
+
+void ShmRing::init()
+{
+    // 消費者は最初のフレームが届くまで待ち状態とする
+    new (ctrl_) Control();
+    ctrl_->head_.store(0, std::memory_order_relaxed);
+    ctrl_->tail_.store(0, std::memory_order_relaxed);
+    ctrl_->consumerParked_.store(1, std::memory_order_relaxed);
+    ctrl_->producerParked_.store(0, std::memory_order_relaxed);
+}
+
+size_t ShmRing::write(const char *data, const size_t size)
+{
+    uint64_t head = ctrl_->head_.load(std::memory_order_relaxed);
+    uint64_t tail = ctrl_->tail_.load(std::memory_order_acquire);
+    uint64_t space = capacity_ - (head - tail);
+    size_t n = (size < space) ? size : static_cast<size_t>(space);
+    if (n == 0)
+    {
+        return 0;
+    }
+    // リングの終端で折り返す
+    size_t offset = static_cast<size_t>(head & (capacity_ - 1));
+    size_t first = static_cast<size_t>(capacity_) - offset;
+    first = (n < first) ? n : first;
+    std::memcpy(data_ + offset, data, first);
+    std::memcpy(data_, data + first, n - first);
+
+    // 公開した位置の書き込みと待ち状態の読み込みの順序を保証する(消費者のparkConsumerと対になる)
+    ctrl_->head_.store(head + n, std::memory_order_seq_cst);
+    if ((ctrl_->consumerParked_.load(std::memory_order_seq_cst) != 0) && (ctrl_->consumerParked_.exchange(0) != 0))
+    {
+        signal_(dataEvent_);
+    }
+    return n;
+}
+
+size_t ShmRing::read(char *data, const size_t size)
+{
+    uint64_t tail = ctrl_->tail_.load(std::memory_order_relaxed);
+    uint64_t head = ctrl_->head_.load(std::memory_order_acquire);
+    uint64_t used = head - tail;
+    size_t n = (size < used) ? size : static_cast<size_t>(used);
+    if (n == 0)
+    {
+        return 0;
+    }
+    size_t offset = static_cast<size_t>(tail & (capacity_ - 1));
+    size_t first = static_cast<size_t>(capacity_) - offset;
+    first = (n < first) ? n : first;
+    std::memcpy(data, data_ + offset, first);
+    std::memcpy(data + first, data_, n - first);
+
+    ctrl_->tail_.store(tail + n, std::memory_order_seq_cst);
+    if ((ctrl_->producerParked_.load(std::memory_order_seq_cst) != 0) && (ctrl_->producerParked_.exchange(0) != 0))
+    {
+        signal_(spaceEvent_);
+    }
+    return n;
+}
+
+bool ShmRing::parkConsumer()
+{
+    // 待ち状態にしてから再確認し、その間に書き込まれたデータを取りこぼさない
+    ctrl_->consumerParked_.store(1, std::memory_order_seq_cst);
+    if (ctrl_->head_.load(std::memory_order_seq_cst) != ctrl_->tail_.load(std::memory_order_relaxed))
+    {
+        ctrl_->consumerParked_.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::parkProducer()
+{
+    ctrl_->producerParked_.store(1, std::memory_order_seq_cst);
+    if (ctrl_->head_.load(std::memory_order_relaxed) - ctrl_->tail_.load(std::memory_order_seq_cst) < capacity_)
+    {
+        ctrl_->producerParked_.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+int32_t ShmRing::dataEvent() const
+{
+    return dataEvent_;
+}
+
+int32_t ShmRing::spaceEvent() const
+{
+    return spaceEvent_;
+}
+
+void ShmRing::signal_(const int32_t event)
+{
+    uint64_t one = 1;
+    (void)::write(event, &one, sizeof(one));
+}
+
+ShmChannel::ShmChannel(int32_t logid) : logid_(logid), closed_(false)
+{
+}
+
+ShmChannel::~ShmChannel()
+{
+    if (base_ != nullptr)
+    {
+        (void)::munmap(base_, mapSize_);
+    }
+    for (int32_t &fd : fds_)
+    {
+        if (fd != -1)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+}
+
+bool ShmChannel::create(const size_t capacity)
+{
+    capacity_ = MIN_CAPACITY;
+    while (capacity_ < capacity)
+    {
+        capacity_ <<= 1;
+    }
+    fds_[0] = ::memfd_create("MySocket", MFD_CLOEXEC);
+    if (fds_[0] == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! memfd err:%d", errno);
+        return false;
+    }
+    if (::ftruncate(fds_[0], static_cast<off_t>(2 * ShmRing::regionSize(capacity_))) == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! ftruncate err:%d", errno);
+        return false;
+    }
+    for (int32_t i = 1; i < FD_NUM; i++)
+    {
+        fds_[i] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds_[i] == -1)
+        {
+            LOGGER_ERROR(logid_, "ERR! eventfd err:%d", errno);
+            return false;
+        }
+    }
+    if (!map_(true))
+    {
+        return false;
+    }
+    tx_.init();
+    rx_.init();
+    return true;
+}
+
+bool ShmChannel::attach(const int32_t *fds, const size_t capacity, const bool server)
+{
+    for (int32_t i = 0; i < FD_NUM; i++)
+    {
+        fds_[i] = fds[i];
+    }
+    capacity_ = capacity;
+    if ((capacity_ < MIN_CAPACITY) || ((capacity_ & (capacity_ - 1)) != 0))
+    {
+        LOGGER_ERROR(logid_, "ERR! shm capacity:%zu", capacity_);
+        return false;
+    }
+    // 相手から受け取ったmemfdがリング2つ分より小さいと、割り当てた範囲の外を参照してSIGBUSになる
+    struct stat st;
+    if (::fstat(fds_[0], &st) == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! fstat err:%d", errno);
+        return false;
+    }
+    if ((st.st_size < 0) || (static_cast<uint64_t>(st.st_size) / 2 < ShmRing::regionSize(capacity_)))
+    {
+        LOGGER_ERROR(logid_, "ERR! shm size:%lld capacity:%zu", static_cast<long long>(st.st_size), capacity_);
+        return false;
+    }
+    return map_(server);
+}
+
+bool ShmChannel::map_(const bool server)
+{
+    size_t regionSize = ShmRing::regionSize(capacity_);
+    mapSize_ = 2 * regionSize;
+    void *base = ::mmap(nullptr, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fds_[0], 0);
+    if (base == MAP_FAILED)
+    {
+        LOGGER_ERROR(logid_, "ERR! mmap err:%d", errno);
+        return false;
+    }
+    base_ = base;
+    char *s2c = static_cast<char *>(base_);
+    char *c2s = s2c + regionSize;
+    if (server)
+    {
+        tx_.attach(s2c, capacity_, fds_[1], fds_[2]);
+        rx_.attach(c2s, capacity_, fds_[3], fds_[4]);
+    }
+    else
+    {
+        tx_.attach(c2s, capacity_, fds_[3], fds_[4]);
+        rx_.attach(s2c, capacity_, fds_[1], fds_[2]);
+    }
+    return true;
+}
+
+const int32_t *ShmChannel::fds() const
+{
+    return fds_;
+}
+
+size_t ShmChannel::capacity() const
+{
+    return capacity_;
+}
+
+int32_t ShmChannel::recvEvent() const
+{
+    return rx_.dataEvent();
+}
+
+int32_t ShmChannel::send(const char *data, const int32_t size)
+{
+    Header header;
+    header.size_ = size;
+    // 送信するスレッドを1つにして、リングの生産者を1つに保つ
+    std::lock_guard<std::mutex> lock(sendMtx_);
+    if ((write_all_(reinterpret_cast<const char *>(&header), sizeof(header)) != 0) ||
+        (write_all_(data, static_cast<size_t>(size)) != 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int32_t ShmChannel::write_all_(const char *data, const size_t size)
+{
+    size_t written = 0;
+    while (written < size)
+    {
+        if (closed_.load(std::memory_order_acquire))
+        {
+            return -1;
+        }
+        size_t n = tx_.write(data + written, size - written);
+        written += n;
+        if ((n > 0) || !tx_.parkProducer())
+        {
+            continue;
+        }
+        // 消費者が読み込んで空きができるまで待つ(切断時はcloseが起こす)
+        struct pollfd pfd;
+        pfd.fd = tx_.spaceEvent();
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        (void)::poll(&pfd, 1, 100);
+        uint64_t count = 0;
+        (void)::read(tx_.spaceEvent(), &count, sizeof(count));
+    }
+    return 0;
+}
+
+int32_t ShmChannel::recieve(const std::function<void(Buffer &)> &func_recieve)
+{
+    // 通知を読み捨ててから読み込む(読み込み中に書き込まれた分は次の通知で読む)
+    uint64_t count = 0;
+    (void)::read(rx_.dataEvent(), &count, sizeof(count));
+    while (true)
+    {
+        size_t n = 0;
+        if (headerSize_ < static_cast<int32_t>(sizeof(Header)))
+        {
+            n = rx_.read(reinterpret_cast<char *>(&header_) + headerSize_, sizeof(Header) - static_cast<size_t>(headerSize_));
+            headerSize_ += static_cast<int32_t>(n);
+            if (headerSize_ == static_cast<int32_t>(sizeof(Header)))
+            {
+                if ((std::memcmp(header_.magic_, "SOC", 3) != 0) || (header_.size_ < 0))
+                {
+                    LOGGER_ERROR(logid_, "ERR! recv shm head invalid");
+                    return -1;
+                }
+                buffer_ = BufferPool::instance().get(header_.size_);
+                dataSize_ = 0;
+            }
+        }
+        else
+        {
+            n = rx_.read(buffer_.data() + dataSize_, static_cast<size_t>(header_.size_ - dataSize_));
+            dataSize_ += static_cast<int32_t>(n);
+        }
+
+        if ((headerSize_ == static_cast<int32_t>(sizeof(Header))) && (dataSize_ == header_.size_))
+        {
+            // フレーム受信完了(次のフレームの受信に備えて、受信状態を戻してから通知する)
+            LOGGER_DEBUG(logid_, "recv shm sz:%d", header_.size_);
+            Buffer buffer = std::move(buffer_);
+            headerSize_ = 0;
+            dataSize_ = 0;
+            func_recieve(buffer);
+            continue;
+        }
+        if ((n == 0) && rx_.parkConsumer())
+        {
+            return 0;
+        }
+    }
+}
+
+void ShmChannel::close()
+{
+    closed_.store(true, std::memory_order_release);
+    // 空きを待っている送信スレッドを起こす
+    uint64_t one = 1;
+    (void)::write(tx_.spaceEvent(), &one, sizeof(one));
+}
+
+bool ShmChannel::isClosed() const
+{
+    return closed_.load(std::memory_order_acquire);
+}
@@ -0,0 +1,107 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+
+#include "BufferPool.hpp"
+#include "MySocket.hpp"
+
+// 共有メモリ上のSPSCバイトリング(生産者・消費者はそれぞれ1スレッド)
+// 書き込み位置・読み込み位置は単調増加する総バイト数で、容量は2のべき乗
+// 相手が待ち状態(parked)の場合だけeventfdで起こすため、送受信が続いている間はシステムコールを呼ばない
+class ShmRing
+{
+public:
+    // 共有メモリの先頭に置く制御領域(生産者と消費者が書く値は別のキャッシュラインに置く)
+    class Control
+    {
+    public:
+        alignas(64) std::atomic<uint64_t> head_; // 生産者が書き込んだ総バイト数
+        std::atomic<uint32_t> consumerParked_;   // 消費者がdataEventを待っている
+        alignas(64) std::atomic<uint64_t> tail_; // 消費者が読み込んだ総バイト数
+        std::atomic<uint32_t> producerParked_;   // 生産者がspaceEventを待っている
+    };
+
+private:
+    Control *ctrl_ = nullptr;
+    char *data_ = nullptr;
+    uint64_t capacity_ = 0;
+    int32_t dataEvent_ = -1;  // 消費者を起こすeventfd
+    int32_t spaceEvent_ = -1; // 生産者を起こすeventfd
+
+public:
+    // 制御領域とデータ領域を合わせたサイズ
+    static size_t regionSize(const size_t capacity);
+    // baseから始まる領域を使う(initは領域を作成した側が1回だけ呼ぶ)
+    void attach(void *base, const size_t capacity, const int32_t dataEvent, const int32_t spaceEvent);
+    void init();
+    // 空きがある分だけ書き込み、書き込んだバイト数を返す(消費者が待っていれば起こす)
+    size_t write(const char *data, const size_t size);
+    // 読み込めるだけ読み込み、読み込んだバイト数を返す(生産者が待っていれば起こす)
+    size_t read(char *data, const size_t size);
+    // 読み込めるデータが無ければ待ち状態にしてtrueを返す(falseの場合は続けて読み込む)
+    bool parkConsumer();
+    // 空きが無ければ待ち状態にしてtrueを返す(falseの場合は続けて書き込む)
+    bool parkProducer();
+    int32_t dataEvent() const;
+    int32_t spaceEvent() const;
+
+private:
+    static void signal_(const int32_t event);
+};
+
+// 共有メモリの接続の片側(送信用と受信用のリングを持つ)
+// 領域は接続を受け付けた側がmemfdで作成し、eventfdと一緒にAF_UNIXソケットで相手に渡す
+class ShmChannel
+{
+public:
+    // memfdの領域: [サーバ->クライアントのリング][クライアント->サーバのリング]
+    // eventfd: サーバ->クライアントのdata/space、クライアント->サーバのdata/space
+    static constexpr int32_t FD_NUM = 5;
+    static constexpr size_t MIN_CAPACITY = 4096;
+
+private:
+    int32_t logid_ = 0;
+    int32_t fds_[FD_NUM] = {-1, -1, -1, -1, -1}; // memfd, eventfd x4
+    void *base_ = nullptr;
+    size_t mapSize_ = 0;
+    size_t capacity_ = 0;
+    ShmRing tx_;
+    ShmRing rx_;
+    std::mutex sendMtx_;
+    std::atomic<bool> closed_;
+    // 受信中のフレーム
+    Header header_;
+    int32_t headerSize_ = 0;
+    Buffer buffer_;
+    int32_t dataSize_ = 0;
+
+public:
+    ShmChannel(int32_t logid = 0);
+    ShmChannel(const ShmChannel &) = delete;
+    ShmChannel &operator=(const ShmChannel &) = delete;
+    ~ShmChannel();
+    // サーバ側: capacityバイトのリングを2つ持つ領域を作成する(capacityは2のべき乗に切り上げる)
+    bool create(const size_t capacity);
+    // クライアント側: 受け取ったfdの領域に接続する(fdsの所有権を受け取る)
+    bool attach(const int32_t *fds, const size_t capacity, const bool server);
+    const int32_t *fds() const;
+    size_t capacity() const;
+    // 受信データの到着を通知するeventfd(リアクタが監視する)
+    int32_t recvEvent() const;
+    // フレームを送信する(リングに空きが無い間は待つ、切断済みの場合は-1)
+    int32_t send(const char *data, const int32_t size);
+    // 受信リングのフレームを全て読み込んで通知し、待ち状態に戻す(不正なフレームの場合は-1)
+    int32_t recieve(const std::function<void(Buffer &)> &func_recieve);
+    // 切断する(送信待ちのスレッドを起こす)
+    void close();
+    bool isClosed() const;
+
+private:
+    bool map_(const bool server);
+    int32_t write_all_(const char *data, const size_t size);
+};
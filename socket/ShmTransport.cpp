@@ -0,0 +1,551 @@
+﻿#include "ShmTransport.hpp"
+#include "Logger.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+#include <sys/socket.h> // socket(), sendmsg(), recvmsg()
+#include <sys/un.h>     // sockaddr_un
+#include <sys/epoll.h>  // epoll系
+#include <unistd.h>     // close()
+#include <poll.h>       // poll()
+
+namespace
+{
+    // 接続を受け付ける抽象名前空間のアドレス(ソケットファイルを作らない)
+    socklen_t shm_address(const std::string &name, struct sockaddr_un &sa)
+    {
+        std::string path = "MySocket.shm." + name;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (path.size() + 1 > sizeof(sa.sun_path))
+        {
+            return 0;
+        }
+        std::memcpy(sa.sun_path + 1, path.data(), path.size());
+        return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + 1 + path.size());
+    }
+
+    // 接続時のメッセージとリングのfdを送る
+    bool send_fds(SOCKET sock, const ShmHello &hello, const int32_t *fds)
+    {
+        struct iovec iov;
+        iov.iov_base = const_cast<ShmHello *>(&hello);
+        iov.iov_len = sizeof(hello);
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(int32_t) * ShmChannel::FD_NUM)];
+            struct cmsghdr align;
+        } control;
+        std::memset(&control, 0, sizeof(control));
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int32_t) * ShmChannel::FD_NUM);
+        std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int32_t) * ShmChannel::FD_NUM);
+        return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(hello));
+    }
+
+    // 接続時のメッセージとリングのfdを受け取る(timeoutMs以内に届かなければ失敗)
+    bool recv_fds(SOCKET sock, ShmHello &hello, int32_t *fds, const int32_t timeoutMs)
+    {
+        struct pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, timeoutMs) <= 0)
+        {
+            return false;
+        }
+        struct iovec iov;
+        iov.iov_base = &hello;
+        iov.iov_len = sizeof(hello);
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(int32_t) * ShmChannel::FD_NUM)];
+            struct cmsghdr align;
+        } control;
+        std::memset(&control, 0, sizeof(control));
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1)
+        {
+            return false;
+        }
+
+        // 形式が合わない場合も受け取ったfdはプロセスに追加されているため、全て集めて失敗時に閉じる
+        // (制御データの領域には、アラインメントの分だけFD_NUMより多くのfdが入り得る)
+        int32_t received[sizeof(control.buf) / sizeof(int32_t)];
+        size_t count = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) || (cmsg->cmsg_len < CMSG_LEN(0)))
+            {
+                continue;
+            }
+            size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int32_t);
+            for (size_t i = 0; (i < num) && (count < sizeof(received) / sizeof(received[0])); i++)
+            {
+                std::memcpy(&received[count], CMSG_DATA(cmsg) + i * sizeof(int32_t), sizeof(int32_t));
+                count++;
+            }
+        }
+        if ((n != static_cast<ssize_t>(sizeof(hello))) || (std::memcmp(hello.magic_, "SHM", 3) != 0) ||
+            ((msg.msg_flags & MSG_CTRUNC) != 0) || (count != static_cast<size_t>(ShmChannel::FD_NUM)))
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                ::close(received[i]);
+            }
+            return false;
+        }
+        std::memcpy(fds, received, sizeof(int32_t) * ShmChannel::FD_NUM);
+        return true;
+    }
+
+    // epollのイベントには接続IDと種類(0:AF_UNIXソケット 1:受信リングの通知)を格納する
+    uint64_t event_key(const int64_t id, const uint64_t kind)
+    {
+        return (static_cast<uint64_t>(id) << 1) | kind;
+    }
+}
+
+ShmServer::ShmServer(int32_t logid) : logid_(logid), isRunning_(false)
+{
+}
+
+ShmServer::~ShmServer()
+{
+    end();
+}
+
+void ShmServer::setName(const std::string name)
+{
+    if (!isRunning_)
+    {
+        name_ = name;
+    }
+}
+
+void ShmServer::setRingSize(const size_t ringSize)
+{
+    if (!isRunning_)
+    {
+        ringSize_ = ringSize;
+    }
+}
+
+size_t ShmServer::connectionCount()
+{
+    std::lock_guard<std::mutex> lock(connMtx_);
+    return connections_.size();
+}
+
+bool ShmServer::start(Server::Reciever *reciever)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        reciever_ = reciever;
+    }
+    if (isRunning_)
+    {
+        return true;
+    }
+
+    struct sockaddr_un sa;
+    socklen_t len = shm_address(name_, sa);
+    if (len == 0)
+    {
+        LOGGER_ERROR(logid_, "ERR! shm name:%s", name_.c_str());
+        return false;
+    }
+    sock_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_ == INVALID_SOCKET)
+    {
+        LOGGER_ERROR(logid_, "ERR! create sock err:%d", errno);
+        return false;
+    }
+    if ((::bind(sock_, reinterpret_cast<struct sockaddr *>(&sa), len) != 0) || (::listen(sock_, SOMAXCONN) != 0))
+    {
+        LOGGER_ERROR(logid_, "ERR! bind shm:%s err:%d", name_.c_str(), errno);
+        ::close(sock_);
+        sock_ = INVALID_SOCKET;
+        return false;
+    }
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    if ((epfd_ == -1) || (::epoll_ctl(epfd_, EPOLL_CTL_ADD, sock_, &ev) == -1))
+    {
+        LOGGER_ERROR(logid_, "ERR! create epfd err:%d", errno);
+        ::close(sock_);
+        sock_ = INVALID_SOCKET;
+        if (epfd_ != -1)
+        {
+            ::close(epfd_);
+            epfd_ = -1;
+        }
+        return false;
+    }
+    LOGGER_INFO(logid_, "listen shm:%s", name_.c_str());
+
+    isRunning_ = true;
+    std::thread th(&ShmServer::task, this);
+    th_.swap(th);
+    return true;
+}
+
+void ShmServer::end()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        reciever_ = nullptr;
+    }
+    if (isRunning_)
+    {
+        isRunning_ = false;
+        th_.join();
+    }
+}
+
+int32_t ShmServer::sendData(const int64_t id, const char *data, const int32_t size)
+{
+    std::shared_ptr<ShmChannel> channel;
+    {
+        std::lock_guard<std::mutex> lock(connMtx_);
+        Connection *conn = connections_.find(id);
+        if (conn != nullptr)
+        {
+            channel = conn->channel_;
+        }
+    }
+    if (!channel)
+    {
+        LOGGER_ERROR(logid_, "ERR! send disconnect id:0x%llx", static_cast<unsigned long long>(id));
+        return -1;
+    }
+    LOGGER_DEBUG(logid_, "send shm id:0x%llx", static_cast<unsigned long long>(id));
+    LOGGER_DEBUG(logid_, " -> size:%d", size);
+    return channel->send(data, size);
+}
+
+void ShmServer::task()
+{
+    LOGGER_INFO(logid_, "task sta");
+    static constexpr int32_t MAX_EVENTS = 16;
+    struct epoll_event events[MAX_EVENTS];
+    while (isRunning_)
+    {
+        int32_t nfds = ::epoll_wait(epfd_, events, MAX_EVENTS, 100);
+        for (int32_t n = 0; n < nfds; n++)
+        {
+            if (events[n].data.u64 == 0)
+            {
+                (void)accept_();
+                continue;
+            }
+            int64_t id = static_cast<int64_t>(events[n].data.u64 >> 1);
+            Connection *conn = connections_.find(id);
+            if (conn == nullptr)
+            {
+                // 同じepoll_waitの結果の処理中に切断した
+                continue;
+            }
+            if (events[n].data.u64 & 1)
+            {
+                int32_t ret = conn->channel_->recieve([&](Buffer &buffer)
+                                                      { deliver_(id, buffer); });
+                if (ret != 0)
+                {
+                    disconnect_(id);
+                }
+            }
+            else
+            {
+                // AF_UNIXソケットにはデータを送らないため、読み込み可能は相手の切断を表す
+                disconnect_(id);
+            }
+        }
+    }
+
+    for (int64_t id : connections_.ids())
+    {
+        disconnect_(id);
+    }
+    ::close(epfd_);
+    epfd_ = -1;
+    ::close(sock_);
+    sock_ = INVALID_SOCKET;
+    LOGGER_INFO(logid_, "task end");
+}
+
+bool ShmServer::accept_()
+{
+    SOCKET client = ::accept4(sock_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == INVALID_SOCKET)
+    {
+        LOGGER_ERROR(logid_, "ERR! accept err:%d", errno);
+        return false;
+    }
+    std::shared_ptr<ShmChannel> channel = std::make_shared<ShmChannel>(logid_);
+    ShmHello hello;
+    if (!channel->create(ringSize_))
+    {
+        ::close(client);
+        return false;
+    }
+    hello.capacity_ = static_cast<uint32_t>(channel->capacity());
+    if (!send_fds(client, hello, channel->fds()))
+    {
+        LOGGER_ERROR(logid_, "ERR! send fds client:0x%x err:%d", client, errno);
+        ::close(client);
+        return false;
+    }
+
+    int64_t id = 0;
+    {
+        std::lock_guard<std::mutex> lock(connMtx_);
+        Connection *conn = connections_.add(client, id);
+        if (conn == nullptr)
+        {
+            ::close(client);
+            return false;
+        }
+        conn->sock_ = client;
+        conn->channel_ = channel;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = event_key(id, 0);
+    (void)::epoll_ctl(epfd_, EPOLL_CTL_ADD, client, &ev);
+    ev.events = EPOLLIN;
+    ev.data.u64 = event_key(id, 1);
+    (void)::epoll_ctl(epfd_, EPOLL_CTL_ADD, channel->recvEvent(), &ev);
+    LOGGER_INFO(logid_, "accept shm client:0x%x id:0x%llx", client, static_cast<unsigned long long>(id));
+    LOGGER_INFO(logid_, " -> ring:%zu", channel->capacity());
+    return true;
+}
+
+void ShmServer::disconnect_(const int64_t id)
+{
+    Connection *conn = connections_.find(id);
+    if (conn == nullptr)
+    {
+        return;
+    }
+    std::shared_ptr<ShmChannel> channel = conn->channel_;
+    // 相手が切断前に書き込んだフレームを通知してから切断する
+    (void)channel->recieve([&](Buffer &buffer)
+                           { deliver_(id, buffer); });
+    SOCKET sock = INVALID_SOCKET;
+    {
+        std::lock_guard<std::mutex> lock(connMtx_);
+        sock = conn->sock_;
+        conn->sock_ = INVALID_SOCKET;
+        conn->channel_.reset();
+        (void)connections_.remove(id);
+    }
+    struct epoll_event ev;
+    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, sock, &ev);
+    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, channel->recvEvent(), &ev);
+    ::close(sock);
+    // 送信中のスレッドが参照を手放した時点で領域を解放する
+    channel->close();
+    LOGGER_INFO(logid_, "disconnect shm id:0x%llx", static_cast<unsigned long long>(id));
+}
+
+void ShmServer::deliver_(const int64_t id, Buffer &buffer)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (reciever_ != nullptr)
+    {
+        reciever_->recieveBuffer(id, std::move(buffer));
+    }
+}
+
+ShmClient::ShmClient(int32_t logid) : logid_(logid), isRunning_(false)
+{
+}
+
+ShmClient::~ShmClient()
+{
+    end();
+}
+
+void ShmClient::setName(const std::string name)
+{
+    if (!isRunning_)
+    {
+        name_ = name;
+    }
+}
+
+void ShmClient::start(Client::Reciever *reciever)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        reciever_ = reciever;
+    }
+    if (!isRunning_)
+    {
+        isRunning_ = true;
+        std::thread th(&ShmClient::task, this);
+        th_.swap(th);
+    }
+}
+
+void ShmClient::end()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        reciever_ = nullptr;
+    }
+    if (isRunning_)
+    {
+        isRunning_ = false;
+        th_.join();
+    }
+}
+
+bool ShmClient::isConnected()
+{
+    std::lock_guard<std::mutex> lock(connMtx_);
+    return static_cast<bool>(channel_);
+}
+
+int32_t ShmClient::sendData(const char *data, const int32_t size)
+{
+    std::shared_ptr<ShmChannel> channel;
+    {
+        std::lock_guard<std::mutex> lock(connMtx_);
+        channel = channel_;
+    }
+    if (!channel)
+    {
+        LOGGER_ERROR(logid_, "ERR! send disconnect");
+        return -1;
+    }
+    LOGGER_DEBUG(logid_, "send shm");
+    LOGGER_DEBUG(logid_, " -> size:%d", size);
+    return channel->send(data, size);
+}
+
+void ShmClient::task()
+{
+    LOGGER_INFO(logid_, "task sta");
+    while (isRunning_)
+    {
+        struct sockaddr_un sa;
+        socklen_t len = shm_address(name_, sa);
+        SOCKET sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ((len == 0) || (sock == INVALID_SOCKET) || (::connect(sock, reinterpret_cast<struct sockaddr *>(&sa), len) != 0))
+        {
+            // リトライ
+            if (sock != INVALID_SOCKET)
+            {
+                ::close(sock);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        ShmHello hello;
+        int32_t fds[ShmChannel::FD_NUM];
+        std::shared_ptr<ShmChannel> channel = std::make_shared<ShmChannel>(logid_);
+        if (!recv_fds(sock, hello, fds, 1000))
+        {
+            LOGGER_ERROR(logid_, "ERR! recv fds sock:0x%x", sock);
+            ::close(sock);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        if (!channel->attach(fds, hello.capacity_, false))
+        {
+            ::close(sock);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        LOGGER_INFO(logid_, "connect shm:%s", name_.c_str());
+        LOGGER_INFO(logid_, " -> ring:%zu", channel->capacity());
+
+        run_(sock, channel);
+
+        // 再接続を試みるため切断する
+        {
+            std::lock_guard<std::mutex> lock(connMtx_);
+            channel_.reset();
+            id_ = 0;
+        }
+        channel->close();
+        ::close(sock);
+        LOGGER_INFO(logid_, "disconnect shm:%s", name_.c_str());
+    }
+    LOGGER_INFO(logid_, "task end");
+}
+
+void ShmClient::run_(SOCKET sock, const std::shared_ptr<ShmChannel> &channel)
+{
+    int32_t epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! create epfd err:%d", errno);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = 0;
+    (void)::epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+    ev.events = EPOLLIN;
+    ev.data.u64 = 1;
+    (void)::epoll_ctl(epfd, EPOLL_CTL_ADD, channel->recvEvent(), &ev);
+
+    int64_t id = ConnectionId::issue(sock, 0);
+    {
+        std::lock_guard<std::mutex> lock(connMtx_);
+        id_ = id;
+        channel_ = channel;
+    }
+    auto func = [&](Buffer &buffer)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (reciever_ != nullptr)
+        {
+            reciever_->recieveBuffer(id, std::move(buffer));
+        }
+    };
+
+    bool connected = true;
+    while (isRunning_ && connected)
+    {
+        struct epoll_event events[2];
+        int32_t nfds = ::epoll_wait(epfd, events, 2, 100);
+        for (int32_t n = 0; n < nfds; n++)
+        {
+            if (events[n].data.u64 == 1)
+            {
+                connected = connected && (channel->recieve(func) == 0);
+            }
+            else
+            {
+                // 相手が切断した(切断前に書き込まれたフレームは通知する)
+                (void)channel->recieve(func);
+                connected = false;
+            }
+        }
+    }
+    ::close(epfd);
+}
@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#include "MySocket.hpp"
+#include "ShmRing.hpp"
+#include "ConnectionTable.hpp"
+
+// 同一ホストのプロセス間で、共有メモリのリングでフレームを送受信する(Linuxのみ)
+// 接続はAF_UNIXの抽象名前空間のソケット("@MySocket.shm.名前")で受け付け、
+// 受け付けた側が作成したmemfdとeventfdをSCM_RIGHTSで相手に渡す
+// 以降のデータはカーネルを経由せずにリングでやり取りし、AF_UNIXソケットは切断の検出にのみ使う
+// 受信はServer/Clientと同じRecieverで通知する(圧縮・RPC・ストリーミング受信は使わない)
+
+// 接続時に送るメッセージ(fdと一緒に送る)
+class ShmHello
+{
+public:
+    char magic_[4] = "SHM";
+    uint32_t capacity_ = 0;
+};
+
+class ShmServer
+{
+private:
+    class Connection
+    {
+    public:
+        SOCKET sock_ = INVALID_SOCKET;
+        std::shared_ptr<ShmChannel> channel_;
+    };
+
+private:
+    int32_t logid_ = 0;
+    std::string name_ = "MySocket";
+    size_t ringSize_ = 4 * 1024 * 1024;
+    SOCKET sock_ = INVALID_SOCKET;
+    int32_t epfd_ = -1;
+
+    std::thread th_;
+    std::atomic<bool> isRunning_;
+    std::mutex mtx_;
+    Server::Reciever *reciever_ = nullptr;
+    // 接続テーブルを変更するのはリアクタスレッドのみで、変更時はconnMtx_をロックする
+    std::mutex connMtx_;
+    ConnectionTable<Connection> connections_;
+
+public:
+    ShmServer(int32_t logid = 0);
+    ~ShmServer();
+    // 接続を受け付ける名前と、接続ごとのリングの容量を設定する(開始前に呼ぶ)
+    void setName(const std::string name);
+    void setRingSize(const size_t ringSize);
+    size_t connectionCount();
+    bool start(Server::Reciever *reciever);
+    void end();
+    // リングに空きが無い間は待つ(切断済みの場合は-1)
+    int32_t sendData(const int64_t id, const char *data, const int32_t size);
+
+private:
+    void task();
+    bool accept_();
+    void disconnect_(const int64_t id);
+    void deliver_(const int64_t id, Buffer &buffer);
+};
+
+class ShmClient
+{
+private:
+    int32_t logid_ = 0;
+    std::string name_ = "MySocket";
+
+    std::thread th_;
+    std::atomic<bool> isRunning_;
+    std::mutex mtx_;
+    Client::Reciever *reciever_ = nullptr;
+    std::mutex connMtx_;
+    int64_t id_ = 0;
+    std::shared_ptr<ShmChannel> channel_;
+
+public:
+    ShmClient(int32_t logid = 0);
+    ~ShmClient();
+    void setName(const std::string name);
+    void start(Client::Reciever *reciever);
+    void end();
+    bool isConnected();
+    // リングに空きが無い間は待つ(未接続の場合は-1)
+    int32_t sendData(const char *data, const int32_t size);
+
+private:
+    void task();
+    void run_(SOCKET sock, const std::shared_ptr<ShmChannel> &channel);
+};
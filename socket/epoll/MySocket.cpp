@@ -1,15 +1,28 @@
 ﻿#include "MySocket.hpp"
 #include "Logger.hpp"
 
+#include <cstddef>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <chrono>
 
 #include <sys/socket.h> // socket(), setsockopt(), bind()
+#include <sys/uio.h>    // iovec
 #include <netinet/in.h> // sockaddr_in, htons()
 #include <unistd.h>     // close()
-#include <arpa/inet.h>  // inet_pton()
+#include <arpa/inet.h>  // inet_ntop()
 #include <sys/epoll.h>  // epoll系
+#include <fcntl.h>      // fcntl()
+#include <poll.h>       // poll()
+
+// 古いヘッダ向けの定義(Linux 4.14以降で有効)
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+// epollバックエンド
+// イベント待ちに依存する処理のみ定義し、共通の処理はMySocketLinux.cppで定義する
 
 #if 1
 #define LOG_DEBUG(...)
@@ -19,318 +32,251 @@
 #define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
 #endif
 
-Socket::Socket(int32_t logid) : logid_(logid)
-{
-}
-
-Socket::~Socket()
+const char *Socket::backend()
 {
-    do_delete();
+    return "epoll";
 }
 
-SOCKET Socket::get() const
+bool Socket::open_reactor_()
 {
-    return sock_;
-}
-
-bool Socket::isConnected(SOCKET sock) const
-{
-    if (sock == INVALID_SOCKET)
+    // epoll インスタンスの fd を生成する
+    epfd_ = ::epoll_create1(0);
+    if (epfd_ == -1)
     {
+        LOGGER_ERROR(logid_, "ERR! create epfd err:%d", errno);
         return false;
     }
+    LOGGER_INFO(logid_, "create epfd:%d", epfd_);
 
-    auto itr = connectedSockets_.begin();
-    while (itr != connectedSockets_.end())
+    // ループを起こすeventfdは、epollを作り直すたびに監視対象に加える
+    if (wakeFd_ != -1)
     {
-        if (*itr == sock)
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = WAKE_EVENT;
+        if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, wakeFd_, &ev) == -1)
         {
-            break;
+            LOGGER_ERROR(logid_, "ERR! ctl_add eventfd err:%d", errno);
         }
-        ++itr;
-    }
-    if (itr == connectedSockets_.end())
-    {
-        return false;
     }
-
     return true;
 }
 
-bool Socket::do_create()
+void Socket::close_reactor_(std::vector<std::function<void()>> &)
 {
-    std::lock_guard<std::mutex> lock(mtx_);
-    if (sock_ != INVALID_SOCKET)
-    {
-        // ソケット作成済みのため何もしない
-        return true;
-    }
-
-    // ソケットを作成する
-    // AF_INET: IPv4 SOCK_STREAM:TCP
-    sock_ = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_ == INVALID_SOCKET)
-    {
-        Logger::print(logid_, "ERR! create sock err:%d", errno);
-        return false;
-    }
-    Logger::print(logid_, "create sock:0x%x", sock_);
-
-    // epoll インスタンスの fd を生成する
-    epfd_ = ::epoll_create1(0);
-    if (epfd_ == -1)
-    {
-        Logger::print(logid_, "ERR! create epfd err:%d", errno);
-        return false;
-    }
-    Logger::print(logid_, "create epfd:%d", epfd_);
-    return true;
-}
-
-void Socket::do_delete()
-{
-    std::lock_guard<std::mutex> lock(mtx_);
     if (epfd_ != -1)
     {
-        Logger::print(logid_, "close epfd:%d", epfd_);
+        LOGGER_INFO(logid_, "close epfd:%d", epfd_);
         ::close(epfd_);
         epfd_ = -1;
     }
-    if (sock_ != INVALID_SOCKET)
-    {
-        Logger::print(logid_, "close sock:0x%x", sock_);
-        ::close(sock_);
-        sock_ = INVALID_SOCKET;
-    }
 }
 
-int32_t Socket::do_send(const SOCKET sndSock, const char *sndData, const int32_t sndSize)
+int32_t Socket::do_flush(const int64_t id, const std::function<void(int64_t)> &func_drained, const bool notify)
 {
-    std::lock_guard<std::mutex> lock(mtx_);
-    if (!isConnected(sndSock))
-    {
-        Logger::print(logid_, "ERR! send disconnect sock:0x%x", sndSock);
-        return -1;
-    }
-
-    Header header;
-    header.size_ = sndSize;
-    size_t headerSize = sizeof(header);
-    size_t newSize = static_cast<size_t>(sndSize) + headerSize;
-    char *newData = new char[newSize];
-    std::memcpy(newData, &header, headerSize);
-    std::memcpy(newData + headerSize, sndData, static_cast<size_t>(sndSize));
-
-    // 送信
-    // SIGPIPEを発生させないために、flagsにMSG_NOSIGNALを設定する
-    // 参考:https://daeudaeu.com/sigpipe/
-    ssize_t ret = ::send(sndSock, newData, newSize, MSG_NOSIGNAL);
-    if (ret == -1)
-    {
-        Logger::print(logid_, "ERR! send sock:0x%x err:%d", sndSock, errno);
-        delete[] newData;
-        return -1;
-    }
-    Logger::print(logid_, "send sock:0x%x", sndSock);
-    Logger::print(logid_, " -> size:%zu", newSize);
-    delete[] newData;
-    return 0;
+    return flush_ready_(id, func_drained, notify);
 }
 
-int32_t Socket::do_recieve(SOCKET rcvSock, char **rcvData, int32_t *rcvSize)
+void Socket::apply_flow_(Connection &conn)
 {
-    int32_t ret = 0;
-
-    Header rcvHeader;
-    ret = recv_(rcvSock, reinterpret_cast<char *>(&rcvHeader), sizeof(rcvHeader));
-    if (ret == SOCKET_ERROR)
-    {
-        // エラー
-        Logger::print(logid_, "ERR! recv head sock:0x%x err:%d", rcvSock, errno);
-        return ret;
-    }
-    if (ret == 0)
-    {
-        // 接続が切れた
-        Logger::print(logid_, "recv head disconnect sock:0x%x", rcvSock);
-        return ret;
-    }
-    Logger::print(logid_, "recv head sock:0x%x", rcvSock);
-    Logger::print(logid_, " -> %s sz:%d", rcvHeader.magic_, rcvHeader.size_);
-
-    if (std::memcmp(rcvHeader.magic_, "SOC", 3) != 0)
-    {
-        Logger::print(logid_, "ERR! recv head invalid");
-        return SOCKET_ERROR;
-    }
+    // 受信を止める間はEPOLLINを監視しない(送信キューのEPOLLOUTの監視は保つ)
+    // 再開時のEPOLL_CTL_MODで読み込み可能かを改めて評価するため、エッジトリガでも読み残しが通知される
+    (void)watch_(conn, EPOLL_CTL_MOD);
+}
 
-    char *data = new char[static_cast<size_t>(rcvHeader.size_)];
-    ret = recv_(rcvSock, data, rcvHeader.size_);
-    if (ret == SOCKET_ERROR)
+bool Socket::enable_zerocopy_(SOCKET sock)
+{
+    if (zeroCopyThreshold_ <= 0)
     {
-        // エラー
-        Logger::print(logid_, "ERR! recv data sock:0x%x err:%d", rcvSock, errno);
-        delete[] data;
-        return ret;
+        return false;
     }
-    if (ret == 0)
+    int32_t yes = 1;
+    if (::setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == -1)
     {
-        // 接続が切れた
-        Logger::print(logid_, "recv data disconnect sock:0x%x", rcvSock);
-        delete[] data;
-        return ret;
+        // 未対応のカーネルではコピー送信のみ使う
+        LOGGER_ERROR(logid_, "ERR! zerocopy sock:0x%x err:%d", sock, errno);
+        return false;
     }
-    Logger::print(logid_, "recv data sock:0x%x", rcvSock);
-    Logger::print(logid_, " -> sz:%d", ret);
-
-    *rcvData = data;
-    *rcvSize = rcvHeader.size_;
-
-    return ret;
+    return true;
 }
 
-int32_t Socket::recv_(SOCKET rcvSock, char *rcvData, int32_t rcvSize)
+void Socket::arm_send_(Connection &conn)
 {
-    int32_t remainSize = rcvSize;
-    int32_t recievedSize = 0;
-    while (remainSize > 0)
-    {
-        ssize_t sz = ::recv(rcvSock, rcvData + recievedSize, static_cast<size_t>(remainSize), 0);
-        if (sz == SOCKET_ERROR)
-        {
-            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-            {
-                // EAGAIN/EWOULDBLOCKは処理続行
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                continue;
-            }
-            return static_cast<int32_t>(sz);
-        }
-        else if (sz == 0)
-        {
-            return static_cast<int32_t>(sz);
-        }
-        else
-        {
-            recievedSize += static_cast<int32_t>(sz);
-            remainSize -= static_cast<int32_t>(sz);
-        }
-    }
-    return recievedSize;
+    // EPOLLOUTを監視してリアクタに書き込ませる
+    // (未登録の場合は、次の登録時にEPOLLOUTを含める)
+    conn.sendContext_.armed_ = true;
+    (void)watch_(conn, EPOLL_CTL_MOD);
 }
 
-ServerSocket::ServerSocket(int32_t logid) : Socket(logid)
+int64_t Socket::attach_(SOCKET sock)
 {
+    bool zeroCopy = enable_zerocopy_(sock);
+
+    // epollの監視対象には受信イベントの処理(do_recieve_event)で加える
+    std::lock_guard<std::mutex> lock(mtx_);
+    Connection *conn = add_connection_(sock, zeroCopy);
+    return (conn != nullptr) ? conn->id_ : 0;
 }
 
-ServerSocket::~ServerSocket()
+void Socket::detach_(SOCKET sock)
 {
-    do_disconnect_all();
+    struct epoll_event ev;
+    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, sock, &ev);
 }
 
-bool ServerSocket::do_bind_listen(const std::string ipaddr, const uint16_t portNo)
+bool ServerSocket::start_accept_()
 {
-    LOG_DEBUG("[Server\t](%4d) ipaddr:%s portNo:%d\n", __LINE__, ipaddr.c_str(), portNo);
-    int32_t ret = 0;
-
-    struct sockaddr_in sa;
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(portNo);
-    //sa.sin_addr.s_addr = INADDR_ANY;
-    inet_pton(sa.sin_family, ipaddr.c_str(), &sa.sin_addr.s_addr);
-
-    // SO_REUSEADDRを有効にする
-    // TIME_WAIT状態のポートが存在していてもbindができるようにする
-    int32_t yes = 1;
-    setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&yes), sizeof(yes));
-
-    // リッスンソケットをバインド
-    ret = ::bind(sock_, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa));
-    if (ret != 0)
+    // 受付待ちの接続をEAGAINまでまとめて受け付けるため、リッスンソケットは常にノンブロッキングにする
+    int32_t flags = ::fcntl(sock_, F_GETFL, 0);
+    if ((flags == -1) || (::fcntl(sock_, F_SETFL, flags | O_NONBLOCK) == -1))
     {
-        Logger::print(logid_, "ERR! bind sock:0x%x err:%d", sock_, errno);
+        LOGGER_ERROR(logid_, "ERR! fcntl sock:0x%x err:%d", sock_, errno);
         return false;
     }
-    Logger::print(logid_, "bind sock:0x%x", sock_);
-    Logger::print(logid_, " -> %s:%d", ipaddr.c_str(), portNo);
 
-    // リッスン開始
-    ret = ::listen(sock_, 0);
-    if (ret != 0)
+    // リッスンソケットは、受け付けを止めるまでepollの監視対象にしておく
+    // 接続ソケットのイベントには接続IDを格納するため、リッスンソケットは0で区別する
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = 0;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, sock_, &ev) == -1)
     {
-        Logger::print(logid_, "ERR! listen sock:0x%x err:%d", sock_, errno);
+        LOGGER_ERROR(logid_, "ERR! ctl_add epfd err:%d", errno);
         return false;
     }
-    Logger::print(logid_, "listen sock:0x%x", sock_);
-
     return true;
 }
 
-int32_t ServerSocket::do_recieve_event(const std::function<void(SOCKET, const char *, const int32_t)> &func_recieve)
+void ServerSocket::do_stop_accept()
 {
-    int32_t result = 0;
-
-    // ソケットをepollの監視対象に加える
     struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLRDHUP;
-    ev.data.fd = sock_;
+    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, sock_, &ev);
+}
 
-    int32_t ret = ::epoll_ctl(epfd_, EPOLL_CTL_ADD, sock_, &ev);
-    if (ret == -1)
-    {
-        Logger::print(logid_, "ERR! ctl_add epfd err:%d", errno);
-        return -1;
-    }
+int32_t ServerSocket::do_recieve_event(const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained)
+{
+    int32_t result = 0;
 
     // epoll_ctlで加えたソケットに対して、epoll_waitでReadyとなったものが格納される
     static constexpr int32_t MAX_EVENTS = 16;
     struct epoll_event events[MAX_EVENTS];
     int32_t timeout = 1000; // タイムアウト時間[msec]
+    if (coalesceWindowUs_ > 0)
+    {
+        timeout = coalesce_timeout_(timeout);
+    }
     int32_t nfds = ::epoll_wait(epfd_, events, MAX_EVENTS, timeout);
+    if (nfds > 0)
+    {
+        TrafficCounter::count(traffic_.wakeups_);
+    }
 
     // readyとなったfd数分ループ
     for (int32_t n = 0; n < nfds; n++)
     {
-        if (events[n].data.fd == sock_)
+        if (events[n].data.u64 == WAKE_EVENT)
         {
-            SOCKET client = do_accept();
-            if (client == INVALID_SOCKET)
-            {
-                // 受付エラー
-                continue;
-            }
+            // 積まれたタスクは、イベントを処理した後で実行する
+            uint64_t value = 0;
+            (void)::read(wakeFd_, &value, sizeof(value));
+            continue;
+        }
+        if (events[n].data.u64 == 0)
+        {
+            // 受付待ちの接続をまとめて受け付ける
+            (void)do_accept();
         }
         else
         {
             // クライアントからデータ受信
-            SOCKET client = events[n].data.fd;
-            if (events[n].events & EPOLLRDHUP)
+            int64_t client = static_cast<int64_t>(events[n].data.u64);
+            if (!isConnected(client))
+            {
+                // 同じepoll_waitの結果の処理中に切断した
+                continue;
+            }
+            if ((events[n].events & EPOLLERR) && (zeroCopyThreshold_ > 0))
+            {
+                // MSG_ZEROCOPYの完了通知はエラーキューに届く
+                if (do_zerocopy_event(client) != 0)
+                {
+                    LOGGER_INFO(logid_, "disconnect client:0x%llx", static_cast<unsigned long long>(client));
+                    do_disconnect(client);
+                    continue;
+                }
+                events[n].events &= ~static_cast<uint32_t>(EPOLLERR);
+                if (events[n].events == 0)
+                {
+                    continue;
+                }
+            }
+
+            if (events[n].events & EPOLLOUT)
+            {
+                // 送信キューに溜まったデータを書き込む
+                if (do_flush(client, func_drained) != 0)
+                {
+                    LOGGER_INFO(logid_, "disconnect client:0x%llx", static_cast<unsigned long long>(client));
+                    do_disconnect(client);
+                    continue;
+                }
+                events[n].events &= ~static_cast<uint32_t>(EPOLLOUT);
+                if (events[n].events == 0)
+                {
+                    continue;
+                }
+            }
+
+            if (nonBlocking_)
+            {
+                // 切断通知と同時に届いたデータも取りこぼさないよう、先に読み込む
+                int32_t ret = do_recieve_nonblock(client, func_recieve);
+                if ((ret > 0) && flow_enabled_() && recieve_paused_(client))
+                {
+                    // 受信を止めたため、読み残しと切断の通知は再開した時点で処理する
+                    continue;
+                }
+                if ((ret <= 0) || (events[n].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                {
+                    LOGGER_INFO(logid_, "disconnect client:0x%llx", static_cast<unsigned long long>(client));
+                    do_disconnect(client);
+                }
+            }
+            else if (events[n].events & EPOLLRDHUP)
             {
                 // 接続が切れたため、クライアントソケットから削除する
-                Logger::print(logid_, "disconnect client:0x%x", client);
+                LOGGER_INFO(logid_, "disconnect client:0x%llx", static_cast<unsigned long long>(client));
                 do_disconnect(client);
             }
             else if (events[n].events & EPOLLIN)
             {
-                char *data = nullptr;
-                int32_t size = 0;
-                ret = do_recieve(client, &data, &size);
-                if (ret > 0)
-                {
-                    func_recieve(client, data, size);
-                }
-                if (data != nullptr)
+                Buffer buffer;
+                uint8_t flags = 0;
+                int32_t ret = do_recieve(client, buffer, flags);
+                if ((ret > 0) && !buffer.empty())
                 {
-                    delete[] data;
+                    func_recieve(client, flags, buffer);
                 }
             }
             else
             {
-                Logger::print(logid_, "ERR! wait epfd events:%d", events[n].events);
+                LOGGER_ERROR(logid_, "ERR! wait epfd events:%d", events[n].events);
             }
         }
     }
 
+    if (coalesceWindowUs_ > 0)
+    {
+        // 窓の期限を過ぎた送信キューを書き込む
+        std::vector<int64_t> failed;
+        flush_coalesced_(func_drained, failed);
+        for (int64_t client : failed)
+        {
+            LOGGER_INFO(logid_, "disconnect client:0x%llx", static_cast<unsigned long long>(client));
+            do_disconnect(client);
+        }
+    }
+
     if (nfds == 0)
     {
         // タイムアウト
@@ -340,384 +286,155 @@ int32_t ServerSocket::do_recieve_event(const std::function<void(SOCKET, const ch
     if (nfds == -1)
     {
         // エラー
-        Logger::print(logid_, "ERR! wait epfd err:%d", errno);
+        LOGGER_ERROR(logid_, "ERR! wait epfd err:%d", errno);
         result = -1;
     }
 
-    struct epoll_event delev;
-    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, sock_, &delev);
+    // 他のスレッドから積まれたタスクを実行する
+    run_posted_();
 
     return result;
 }
 
-SOCKET ServerSocket::do_accept()
+int32_t ServerSocket::do_accept()
 {
-    struct sockaddr_in sa_client;
-    socklen_t len = sizeof(sa_client);
-    SOCKET client = accept(sock_, reinterpret_cast<struct sockaddr *>(&sa_client), &len);
-    if (client == INVALID_SOCKET)
+    // 接続が殺到した場合に備え、受付待ちの接続をEAGAINまでまとめて受け付ける
+    // 1回に受け付ける数は制限し、受信待ちの接続を待たせすぎないようにする(残りは次のイベントで受け付ける)
+    static constexpr int32_t MAX_BATCH = 64;
+    struct Accepted
     {
-        Logger::print(logid_, "ERR! accept client:0x%x err:%d", client, errno);
-        return INVALID_SOCKET;
-    }
-
-    // 接続ソケットをepollの監視対象に加える
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLRDHUP;
-    ev.data.fd = client;
-    int32_t ret = ::epoll_ctl(epfd_, EPOLL_CTL_ADD, client, &ev);
-    if (ret == -1)
+        SOCKET sock_;
+        struct sockaddr_storage sa_;
+        bool zeroCopy_;
+        int64_t id_;
+    };
+    Accepted accepted[MAX_BATCH];
+    int32_t count = 0;
+    int32_t flags = SOCK_CLOEXEC | (nonBlocking_ ? SOCK_NONBLOCK : 0);
+    while (count < MAX_BATCH)
     {
-        Logger::print(logid_, "ERR! ctl_add epfd err:%d", errno);
-        ::close(client);
-        return INVALID_SOCKET;
-    }
-
-    connectedSockets_.push_back(client);
-
-    char ip[32];
-    memset(ip, 0, sizeof(ip));
-    inet_ntop(sa_client.sin_family, &sa_client.sin_addr, ip, sizeof(ip));
-    Logger::print(logid_, "accept client:0x%x", client);
-    Logger::print(logid_, " -> %s:%d", ip, ntohs(sa_client.sin_port));
-
-    return client;
-}
-
-void ServerSocket::do_disconnect(SOCKET sock)
-{
-    struct epoll_event ev;
-    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, sock, &ev);
-
-    auto itr = connectedSockets_.begin();
-    while (itr != connectedSockets_.end())
-    {
-        if (*itr == sock)
+        Accepted &entry = accepted[count];
+        socklen_t len = sizeof(entry.sa_);
+        entry.sock_ = ::accept4(sock_, reinterpret_cast<struct sockaddr *>(&entry.sa_), &len, flags);
+        if (entry.sock_ == INVALID_SOCKET)
         {
+            if ((errno == EINTR) || (errno == ECONNABORTED))
+            {
+                // 受け付ける前に相手が切断した
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                LOGGER_ERROR(logid_, "ERR! accept err:%d", errno);
+                acceptErrors_++;
+            }
             break;
         }
-        ++itr;
+        entry.zeroCopy_ = enable_zerocopy_(entry.sock_);
+        apply_options_(entry.sock_);
+        entry.id_ = 0;
+        count++;
     }
-    (void)connectedSockets_.erase(itr);
-    ::close(sock);
-}
 
-void ServerSocket::do_disconnect_all()
-{
-    auto itr = connectedSockets_.begin();
-    while (itr != connectedSockets_.end())
     {
-        struct epoll_event ev;
-        (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, *itr, &ev);
-        ::close(*itr);
-        itr = connectedSockets_.erase(itr);
-    }
-}
-
-ClientSocket::ClientSocket(int32_t logid) : Socket(logid)
-{
-}
-
-ClientSocket::~ClientSocket()
-{
-}
-
-bool ClientSocket::do_connect(const std::string ipaddr, const uint16_t portNo)
-{
-    int32_t ret = 0;
-
-    struct sockaddr_in sa_server;
-    sa_server.sin_family = AF_INET;
-    sa_server.sin_port = htons(portNo);
-    inet_pton(sa_server.sin_family, ipaddr.c_str(), &sa_server.sin_addr.s_addr);
-
-    // 接続
-    ret = ::connect(sock_, reinterpret_cast<struct sockaddr *>(&sa_server), sizeof(sa_server));
-    if (ret != 0)
-    {
-        Logger::print(logid_, "ERR! connect sock:0x%x err:%d", sock_, errno);
-        return false;
-    }
-    Logger::print(logid_, "connect sock:0x%x", sock_);
-    Logger::print(logid_, " -> %s:%d", ipaddr.c_str(), portNo);
-
-    connectedSockets_.push_back(sock_);
-
-    return true;
-}
-
-void ClientSocket::do_disconnect()
-{
-    struct epoll_event ev;
-    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, sock_, &ev);
-
-    auto itr = connectedSockets_.begin();
-    while (itr != connectedSockets_.end())
-    {
-        if (*itr == sock_)
+        // 送信側から見えるようになる前にepollに登録する
+        // ロックは受け付けた接続ごとではなく、まとめて1回だけ取る
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (int32_t i = 0; i < count; i++)
         {
-            break;
+            Connection *conn = add_connection_(accepted[i].sock_, accepted[i].zeroCopy_);
+            if (conn == nullptr)
+            {
+                continue;
+            }
+
+            // 接続ソケットをepollの監視対象に加える
+            int32_t ret = watch_(*conn, EPOLL_CTL_ADD);
+            if (ret == -1)
+            {
+                LOGGER_ERROR(logid_, "ERR! ctl_add epfd err:%d", errno);
+                std::vector<std::function<void()>> released;
+                remove_connection_(*conn, released);
+                continue;
+            }
+            accepted[i].id_ = conn->id_;
         }
-        ++itr;
     }
-    (void)connectedSockets_.erase(itr);
-}
-
-int32_t ClientSocket::do_send(const char *sndData, const int32_t sndSize)
-{
-    return Socket::do_send(sock_, sndData, sndSize);
-}
 
-int32_t ClientSocket::do_recieve(char **rcvData, int32_t *rcvSize)
-{
-    return Socket::do_recieve(sock_, rcvData, rcvSize);
-}
-
-int32_t ClientSocket::do_recieve_event(const std::function<void(SOCKET, const char *, const int32_t)> &func_recieve)
-{
     int32_t result = 0;
-
-    // ソケットをepollの監視対象に加える
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLRDHUP;
-    ev.data.fd = sock_;
-
-    int32_t ret = ::epoll_ctl(epfd_, EPOLL_CTL_ADD, sock_, &ev);
-    if (ret == -1)
+    for (int32_t i = 0; i < count; i++)
     {
-        Logger::print(logid_, "ERR! ctl_add epfd err:%d", errno);
-        return -1;
-    }
-
-    // epoll_ctlで加えたソケットに対して、epoll_waitでReadyとなったものが格納される
-    static constexpr int32_t MAX_EVENTS = 1;
-    struct epoll_event events[MAX_EVENTS];
-    int32_t timeout = 1000; // タイムアウト時間[msec]
-    int32_t nfds = ::epoll_wait(epfd_, events, MAX_EVENTS, timeout);
-
-    if (nfds > 0)
-    {
-        if (events[0].events & EPOLLRDHUP)
+        SOCKET client = accepted[i].sock_;
+        if (accepted[i].id_ == 0)
         {
-            // 接続が切れたため、再接続させる
-            Logger::print(logid_, "disconnect sock:0x%x", sock_);
-            result = 1;
+            ::close(client);
+            acceptErrors_++;
+            continue;
         }
-        else if (events[0].events & EPOLLIN)
+        char ip[32];
+        memset(ip, 0, sizeof(ip));
+        uint16_t port = 0;
+        if (accepted[i].sa_.ss_family == AF_INET)
         {
-            // クライアントからデータ受信
-            char *data = nullptr;
-            int32_t size = 0;
-            ret = do_recieve(&data, &size);
-            if (ret > 0)
-            {
-                func_recieve(sock_, data, size);
-            }
-            else
-            {
-                // エラー
-                result = -1;
-            }
-            if (data != nullptr)
-            {
-                delete[] data;
-            }
+            const struct sockaddr_in &sa = *reinterpret_cast<const struct sockaddr_in *>(&accepted[i].sa_);
+            inet_ntop(sa.sin_family, &sa.sin_addr, ip, sizeof(ip));
+            port = ntohs(sa.sin_port);
         }
         else
         {
-            // エラー
-            Logger::print(logid_, "ERR! wait epfd events:%d", events[0].events);
-            result = -1;
+            std::strncpy(ip, "unix", sizeof(ip) - 1);
         }
+        LOGGER_INFO(logid_, "accept client:0x%x id:0x%llx", client, static_cast<unsigned long long>(accepted[i].id_));
+        LOGGER_INFO(logid_, " -> %s:%d", ip, port);
+        result++;
     }
-    else if (nfds == 0)
-    {
-        // タイムアウト
-        //Logger::print(logid_, "wait epfd TIMEOUT");
-        result = 0;
-    }
-    else
-    {
-        // エラー
-        Logger::print(logid_, "ERR! wait epfd err:%d", errno);
-        result = -1;
-    }
-
-    struct epoll_event delev;
-    (void)::epoll_ctl(epfd_, EPOLL_CTL_DEL, sock_, &delev);
+    count_accept_(static_cast<uint64_t>(result));
 
     return result;
 }
 
-Server::Reciever::~Reciever()
-{
-}
-
-Server::Server(int32_t logid) : logid_(logid), serverSock_(logid)
-{
-}
-
-Server::~Server()
-{
-    end();
-}
-
-void Server::start(Reciever *reciever)
+int32_t ClientSocket::do_recieve_event(const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained, const int32_t timeout)
 {
+    // ソケットをepollの監視対象に加える(監視対象に加えたソケットは切断まで外さない)
+    if (!do_watch())
     {
-        std::lock_guard<std::mutex> lock(mtx_);
-        reciever_ = reciever;
-    }
-
-    if (!isRunning_)
-    {
-        isRunning_ = true;
-        std::thread th(&Server::task, this);
-        th_.swap(th);
-    }
-}
-
-void Server::end()
-{
-    {
-        std::lock_guard<std::mutex> lock(mtx_);
-        reciever_ = nullptr;
-    }
-    if (isRunning_)
-    {
-        isRunning_ = false;
-        th_.join();
-    }
-}
-
-int32_t Server::sendData(const int32_t id, const char *data, const int32_t size)
-{
-    return serverSock_.do_send(id, data, size);
-}
-
-void Server::task()
-{
-    Logger::print(logid_, "task sta");
-
-    // ソケットを作成
-    if (!serverSock_.do_create())
-    {
-        return;
+        return -1;
     }
 
-    // バインド/リッスン開始
-    if (!serverSock_.do_bind_listen(ipaddr_, portNo_))
+    // epoll_ctlで加えたソケットに対して、epoll_waitでReadyとなったものが格納される
+    static constexpr int32_t MAX_EVENTS = 2;
+    struct epoll_event events[MAX_EVENTS];
+    int32_t nfds = ::epoll_wait(epfd_, events, MAX_EVENTS, waitTimeout(timeout));
+    if (nfds > 0)
     {
-        return;
+        TrafficCounter::count(traffic_.wakeups_);
     }
-
-    while (isRunning_)
+    // ループを起こすeventfdのイベントを除き、接続ソケットのイベントを処理する
+    // (積まれたタスクは、イベントを処理した後で実行する)
+    uint32_t ready = 0;
+    for (int32_t n = 0; n < nfds; n++)
     {
-        auto func = [&](SOCKET client, const char *data, const int32_t size)
+        if (events[n].data.u64 == WAKE_EVENT)
         {
-            std::lock_guard<std::mutex> lock(mtx_);
-            if (reciever_ != nullptr)
-            {
-                reciever_->recieveData(client, data, size);
-            }
-        };
-
-        (void)serverSock_.do_recieve_event(func);
-    }
-    serverSock_.do_disconnect_all();
-    serverSock_.do_delete();
-    Logger::print(logid_, "task end");
-}
-
-Client::Reciever::~Reciever()
-{
-}
-
-Client::Client(int32_t logid) : logid_(logid), clientSock_(logid)
-{
-}
-
-Client::~Client()
-{
-    end();
-}
-
-void Client::start(Reciever *reciever)
-{
-    {
-        std::lock_guard<std::mutex> lock(mtx_);
-        reciever_ = reciever;
-    }
-    if (!isRunning_)
-    {
-        isRunning_ = true;
-        std::thread th(&Client::task, this);
-        th_.swap(th);
-    }
-}
-
-void Client::end()
-{
-    {
-        std::lock_guard<std::mutex> lock(mtx_);
-        reciever_ = nullptr;
+            uint64_t value = 0;
+            (void)::read(wakeFd_, &value, sizeof(value));
+        }
+        else
+        {
+            ready = events[n].events;
+        }
     }
-    if (isRunning_)
+    if (nfds == -1)
     {
-        isRunning_ = false;
-        th_.join();
+        // エラー
+        LOGGER_ERROR(logid_, "ERR! wait epfd err:%d", errno);
     }
-}
 
-int32_t Client::sendData(const char *data, const int32_t size)
-{
-    return clientSock_.do_send(data, size);
+    int32_t result = do_recieve_ready(ready, func_recieve, func_drained);
+    return ((nfds == -1) && (result == 0)) ? -1 : result;
 }
 
-void Client::task()
+int32_t ClientSocket::waitFd() const
 {
-    Logger::print(logid_, "task sta");
-
-    while (isRunning_)
-    {
-        // ソケットを作成
-        if (!clientSock_.do_create())
-        {
-            // リトライ
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
-
-        // 接続
-        if (!clientSock_.do_connect(ipaddr_, portNo_))
-        {
-            // リトライ
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
-
-        while (isRunning_)
-        {
-            auto func = [&](SOCKET sock, const char *data, const int32_t size)
-            {
-                std::lock_guard<std::mutex> lock(mtx_);
-                if (reciever_ != nullptr)
-                {
-                    reciever_->recieveData(sock, data, size);
-                }
-            };
-
-            int32_t result = clientSock_.do_recieve_event(func);
-            if (result == 1)
-            {
-                // 接続が切れたため、再接続させる
-                break;
-            }
-        }
-        // 再接続を試みるためソケット破棄
-        clientSock_.do_disconnect();
-        clientSock_.do_delete();
-    }
-
-    Logger::print(logid_, "task end");
+    return epfd_;
 }
@@ -156,9 +156,9 @@ int32_t Socket::do_recieve(SOCKET rcvSock, char **rcvData, int32_t *rcvSize)
         return ret;
     }
     Logger::print(logid_, "recv head sock:0x%x", rcvSock);
-    Logger::print(logid_, " -> %s sz:%d", rcvHeader.magic_, rcvHeader.size_);
+    Logger::print(logid_, " -> %.3s sz:%d", rcvHeader.magic_, rcvHeader.size_);
 
-    if (std::memcmp(rcvHeader.magic_, "SOC", 3) != 0)
+    if ((std::memcmp(rcvHeader.magic_, "SOC", 3) != 0) || (rcvHeader.size_ < 0))
     {
         Logger::print(logid_, "ERR! recv head invalid");
         return SOCKET_ERROR;
@@ -328,7 +328,7 @@ int32_t ServerSocket::do_recieve_event(const std::function<void(SOCKET, const ch
 #if 0
             else
             {
-                Logger::print(logid_, "ERR! wait epfd fflags:%d", events[n].fflags);
+                Logger::print(logid_, "ERR! wait epfd fflags:%u", events[n].fflags);
             }
 #endif
         }
@@ -533,7 +533,7 @@ int32_t ClientSocket::do_recieve_event(const std::function<void(SOCKET, const ch
         else
         {
             // エラー
-            Logger::print(logid_, "ERR! wait epfd fflags:%d", events[0].fflags);
+            Logger::print(logid_, "ERR! wait epfd fflags:%u", events[0].fflags);
             result = -1;
         }
 #endif
@@ -598,9 +598,9 @@ void Server::end()
     }
 }
 
-int32_t Server::sendData(const int32_t id, const char *data, const int32_t size)
+int32_t Server::sendData(const int64_t id, const char *data, const int32_t size)
 {
-    return serverSock_.do_send(id, data, size);
+    return serverSock_.do_send(static_cast<SOCKET>(id), data, size);
 }
 
 void Server::task()
@@ -153,9 +153,9 @@ int32_t Socket::do_recieve(SOCKET rcvSock)
     }
     //LOG_DEBUG("[%s] recv_() header magic:%s size:%d\n", debug_.c_str(), header.magic_, header.size_);
 
-    if (std::memcmp(header.magic_, "SOC", 3) != 0)
+    if ((std::memcmp(header.magic_, "SOC", 3) != 0) || (header.size_ < 0))
     {
-        LOG_ERROR("[%s] !!!ERROR!!! recv_() header magic invalid\n", debug_.c_str());
+        LOG_ERROR("[%s] !!!ERROR!!! recv_() header invalid\n", debug_.c_str());
         return SOCKET_ERROR;
     }
 
@@ -0,0 +1,1310 @@
+﻿#include "MySocket.hpp"
+#include "Logger.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+
+#include <sys/socket.h>     // socket(), setsockopt(), bind()
+#include <sys/uio.h>        // iovec
+#include <sys/mman.h>       // mmap()
+#include <sys/epoll.h>      // epoll系
+#include <sys/syscall.h>    // syscall()
+#include <netinet/in.h>     // sockaddr_in, htons()
+#include <unistd.h>         // close()
+#include <arpa/inet.h>      // inet_pton()
+#include <poll.h>           // poll()
+#include <signal.h>         // _NSIG
+#include <linux/io_uring.h> // io_uring系
+
+// io_uringバックエンド(Linux 6.0以降)
+// 接続の受け付けと受信はマルチショット要求で行い、受信データはプロバイドバッファのリングに届く
+// 非同期送信モードの送信は、送信キューのフレームをまとめたSENDMSG要求で行う
+// イベント待ちに依存する処理のみ定義し、共通の処理はMySocketLinux.cppで定義する
+
+#if 1
+#define LOG_DEBUG(...)
+//#define LOG_ERROR(...)
+#else
+#define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+// io_uringのリング(SQ/CQ)と、マルチショット受信で使うプロバイドバッファ
+// SQへの積み込みはmtx_をロックして行い、CQの刈り取りはリアクタスレッドのみが行う
+class Socket::Reactor
+{
+public:
+    static constexpr uint32_t ENTRIES = 256;
+    static constexpr uint32_t CQ_ENTRIES = ENTRIES * 8; // マルチショットの完了通知を溜められるように大きくする
+    static constexpr uint16_t BUF_COUNT = 64;           // 2のべき乗
+    static constexpr uint32_t BUF_SIZE = 32 * 1024;
+    static constexpr uint16_t BUF_GROUP = 0;
+    static constexpr size_t MAX_IOV = 64;
+
+    // user_dataの下位3bitで要求の種類を区別する(送信はSendOpのアドレス、受信は3bit左シフトした接続ID)
+    static constexpr uint64_t TAG_MASK = 0x7;
+    static constexpr uint64_t TAG_ACCEPT = 1;
+    static constexpr uint64_t TAG_RECV = 2;
+    static constexpr uint64_t TAG_SEND = 3;
+    static constexpr uint64_t TAG_CANCEL = 4;
+    static constexpr uint64_t TAG_WAKE = 5;
+
+    // 送信中のフレーム
+    // 送信キューの先頭から複数フレームをまとめて1つのSENDMSGで送信し、完了通知まで保持する
+    class alignas(8) SendOp
+    {
+    public:
+        int64_t id_ = 0;
+        struct msghdr msg_;
+        struct iovec iov_[MAX_IOV];
+        std::vector<SendEntry> entries_;
+        size_t bytes_ = 0; // 未送信のバイト数
+
+    public:
+        SendOp();
+    };
+
+    // 接続ごとの受信要求の状態(受信のフロー制御で受信を止める・再開する)
+    class RecvState
+    {
+    public:
+        bool cancelling_ = false; // マルチショット受信の取消し中
+        bool stopped_ = false;    // 受信を止めている
+        std::vector<char> held_;  // 受信を止めた時点で未通知の受信データ(再開した時点で続きから組み立てる)
+    };
+
+private:
+    int32_t logid_ = 0;
+    int32_t fd_ = -1;
+    std::mutex mtx_;                // SQへの積み込みとsubmitを保護する
+    std::atomic<int32_t> inflight_; // 完了通知待ちの要求数(マルチショットは終了するまで1つと数える)
+
+    void *ring_ = MAP_FAILED;
+    size_t ringSize_ = 0;
+    struct io_uring_sqe *sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+    uint32_t *sqHead_ = nullptr;
+    uint32_t *sqTail_ = nullptr;
+    uint32_t sqMask_ = 0;
+    uint32_t sqEntries_ = 0;
+    uint32_t sqLocalTail_ = 0;
+    uint32_t unsubmitted_ = 0;
+    uint32_t *cqHead_ = nullptr;
+    uint32_t *cqTail_ = nullptr;
+    uint32_t cqMask_ = 0;
+    struct io_uring_cqe *cqes_ = nullptr;
+
+    struct io_uring_buf *bufRing_ = nullptr;
+    size_t bufRingSize_ = 0;
+    char *bufs_ = nullptr;
+    uint16_t bufTail_ = 0;
+
+    // Socket::mtx_をロックして参照する
+    std::vector<SendOp *> freeOps_;
+    std::vector<RecvState> recvStates_; // 接続ソケットのfdを添字とする
+    std::vector<int64_t> resumed_;      // 受信を再開した、保持している受信データがある接続
+
+public:
+    Reactor(int32_t logid);
+    ~Reactor();
+    bool init();
+    // 完了通知があれば読み込み可能になる
+    int32_t fd() const;
+    // Socket::mtx_をロックして呼び出す(解放通知はロック外で呼び出す)
+    void deinit(std::vector<std::function<void()>> &released);
+
+    // 受け付けた接続ソケットは、nonBlockingがtrueの場合ノンブロッキングにする
+    void prep_accept(SOCKET sock, const bool nonBlocking);
+    void prep_recv(const int64_t id, SOCKET sock);
+    // 接続のマルチショット受信を取り消す(受信の完了通知は-ECANCELEDで終わる)
+    void prep_cancel_recv(const int64_t id);
+    // ループを起こすeventfdの読み込み可能をマルチショットで監視する
+    void prep_wake(const int32_t fd);
+    // 接続を登録してマルチショット受信を開始し、接続IDを返す(失敗は0)
+    // submitがfalseの場合は受信要求を積むだけで、呼び出し元がまとめてカーネルに渡す
+    int64_t attach(Socket &owner, SOCKET sock, const bool submit);
+    // 以下はSocket::mtx_をロックして呼び出す
+    void send_next(Connection &conn);
+    RecvState &recv_state(SOCKET sock);
+    // 保持している受信データを、受信を再開した時点で組み立てる
+    void resume_held(const int64_t id);
+    int32_t submit();
+
+    // 以下はリアクタスレッドから呼び出す
+    int32_t wait(const int32_t timeout);
+    int32_t reap(Socket &owner, const std::function<void(SOCKET)> &func_accept, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve,
+                 const std::function<void(int64_t)> &func_drained, std::vector<int64_t> &closed);
+    // resume_heldした接続の保持している受信データを組み立てる(積まれたタスクを実行した後で呼び出す)
+    void feed_held(Socket &owner, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, std::vector<int64_t> &closed);
+
+private:
+    struct io_uring_sqe *get_sqe_();
+    int32_t submit_();
+    void push_send_(SendOp *op, SOCKET sock);
+    void recycle_(const uint16_t bid);
+    SendOp *alloc_op_();
+    void free_op_(SendOp *op, std::vector<std::function<void()>> &released);
+    int32_t feed_(Socket &owner, Connection &conn, const char *data, size_t size, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve);
+    // 受信を止めている間の受信データを保持する(保持していればtrue)
+    bool hold_(Socket &owner, Connection &conn, const char *data, size_t size, const bool paused);
+};
+
+namespace
+{
+    // liburingを使わずにシステムコールを直接呼び出す
+    int32_t sys_io_uring_setup(uint32_t entries, struct io_uring_params *p)
+    {
+        return static_cast<int32_t>(::syscall(__NR_io_uring_setup, entries, p));
+    }
+
+    int32_t sys_io_uring_enter(int32_t fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags, const void *arg, size_t argSize)
+    {
+        return static_cast<int32_t>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+    }
+
+    int32_t sys_io_uring_register(int32_t fd, uint32_t opcode, const void *arg, uint32_t nrArgs)
+    {
+        return static_cast<int32_t>(::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs));
+    }
+
+    uint32_t load_acquire(const uint32_t *p)
+    {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+
+    void store_release(uint32_t *p, uint32_t v)
+    {
+        __atomic_store_n(p, v, __ATOMIC_RELEASE);
+    }
+}
+
+Socket::Reactor::SendOp::SendOp()
+{
+    std::memset(&msg_, 0, sizeof(msg_));
+    entries_.reserve(MAX_IOV / 2);
+}
+
+Socket::Reactor::Reactor(int32_t logid) : logid_(logid), inflight_(0)
+{
+}
+
+Socket::Reactor::~Reactor()
+{
+    for (SendOp *op : freeOps_)
+    {
+        delete op;
+    }
+}
+
+bool Socket::Reactor::init()
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = CQ_ENTRIES;
+    fd_ = sys_io_uring_setup(ENTRIES, &params);
+    if (fd_ == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! io_uring_setup err:%d", errno);
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        // マルチショット受信が使えるカーネル(6.0以降)はどちらも対応している
+        LOGGER_ERROR(logid_, "ERR! io_uring features:0x%x", params.features);
+        return false;
+    }
+
+    // SQとCQのリングは1回のmmapで共有される
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ringSize_ = (sqSize > cqSize) ? sqSize : cqSize;
+    ring_ = ::mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (ring_ == MAP_FAILED)
+    {
+        LOGGER_ERROR(logid_, "ERR! mmap ring err:%d", errno);
+        return false;
+    }
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        LOGGER_ERROR(logid_, "ERR! mmap sqes err:%d", errno);
+        return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+    char *ring = static_cast<char *>(ring_);
+    sqHead_ = reinterpret_cast<uint32_t *>(ring + params.sq_off.head);
+    sqTail_ = reinterpret_cast<uint32_t *>(ring + params.sq_off.tail);
+    sqMask_ = *reinterpret_cast<uint32_t *>(ring + params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+    sqLocalTail_ = *sqTail_;
+    // SQEの配列とSQのインデックスは1対1に対応させる
+    uint32_t *sqArray = reinterpret_cast<uint32_t *>(ring + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; i++)
+    {
+        sqArray[i] = i;
+    }
+    cqHead_ = reinterpret_cast<uint32_t *>(ring + params.cq_off.head);
+    cqTail_ = reinterpret_cast<uint32_t *>(ring + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<uint32_t *>(ring + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(ring + params.cq_off.cqes);
+
+    // 受信用のプロバイドバッファのリングを登録する(カーネルが空きバッファを選んで受信する)
+    bufRingSize_ = BUF_COUNT * sizeof(struct io_uring_buf);
+    void *bufRing = ::mmap(nullptr, bufRingSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufRing == MAP_FAILED)
+    {
+        LOGGER_ERROR(logid_, "ERR! mmap buf ring err:%d", errno);
+        return false;
+    }
+    bufRing_ = static_cast<struct io_uring_buf *>(bufRing);
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufRing_);
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (sys_io_uring_register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        LOGGER_ERROR(logid_, "ERR! register buf ring err:%d", errno);
+        return false;
+    }
+    bufs_ = new char[static_cast<size_t>(BUF_COUNT) * BUF_SIZE];
+    for (uint16_t bid = 0; bid < BUF_COUNT; bid++)
+    {
+        recycle_(bid);
+    }
+    return true;
+}
+
+void Socket::Reactor::deinit(std::vector<std::function<void()>> &released)
+{
+    if ((fd_ != -1) && (cqes_ != nullptr))
+    {
+        // 完了していない要求を全て取り消し、送信中のデータが参照されなくなるまで待つ
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            struct io_uring_sqe *sqe = get_sqe_();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data = TAG_CANCEL;
+            (void)submit_();
+        }
+
+        auto sta = std::chrono::steady_clock::now();
+        while ((inflight_ > 0) && (std::chrono::steady_clock::now() - sta < std::chrono::seconds(1)))
+        {
+            if (wait(100) <= 0)
+            {
+                continue;
+            }
+            uint32_t head = *cqHead_;
+            uint32_t tail = load_acquire(cqTail_);
+            for (; head != tail; head++)
+            {
+                const struct io_uring_cqe &cqe = cqes_[head & cqMask_];
+                uint64_t tag = cqe.user_data & TAG_MASK;
+                if (tag == TAG_SEND)
+                {
+                    free_op_(reinterpret_cast<SendOp *>(cqe.user_data & ~TAG_MASK), released);
+                    inflight_--;
+                }
+                else if ((tag == TAG_ACCEPT) || (tag == TAG_RECV) || (tag == TAG_WAKE))
+                {
+                    if ((tag == TAG_ACCEPT) && (cqe.res >= 0))
+                    {
+                        // 取り消しの前に受け付けた接続は、誰も受信しないため閉じる
+                        ::close(cqe.res);
+                    }
+                    if (!(cqe.flags & IORING_CQE_F_MORE))
+                    {
+                        inflight_--;
+                    }
+                }
+            }
+            store_release(cqHead_, head);
+        }
+        if (inflight_ > 0)
+        {
+            LOGGER_ERROR(logid_, "ERR! io_uring inflight:%d", static_cast<int32_t>(inflight_));
+        }
+    }
+    if (fd_ != -1)
+    {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    if (sqes_ != nullptr)
+    {
+        ::munmap(sqes_, sqesSize_);
+        sqes_ = nullptr;
+    }
+    if (ring_ != MAP_FAILED)
+    {
+        ::munmap(ring_, ringSize_);
+        ring_ = MAP_FAILED;
+        cqes_ = nullptr;
+    }
+    if (bufRing_ != nullptr)
+    {
+        ::munmap(bufRing_, bufRingSize_);
+        bufRing_ = nullptr;
+    }
+    delete[] bufs_;
+    bufs_ = nullptr;
+}
+
+struct io_uring_sqe *Socket::Reactor::get_sqe_()
+{
+    // mtx_をロックして呼び出すこと
+    if (sqLocalTail_ - load_acquire(sqHead_) >= sqEntries_)
+    {
+        // SQが一杯のため、先に積んだ要求をカーネルに渡して空きを作る
+        (void)submit_();
+    }
+    struct io_uring_sqe *sqe = &sqes_[sqLocalTail_ & sqMask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqLocalTail_++;
+    unsubmitted_++;
+    store_release(sqTail_, sqLocalTail_);
+    return sqe;
+}
+
+int32_t Socket::Reactor::fd() const
+{
+    return fd_;
+}
+
+int32_t Socket::Reactor::submit()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return submit_();
+}
+
+int32_t Socket::Reactor::submit_()
+{
+    // mtx_をロックして呼び出すこと
+    while (unsubmitted_ > 0)
+    {
+        int32_t ret = sys_io_uring_enter(fd_, unsubmitted_, 0, 0, nullptr, 0);
+        if (ret == -1)
+        {
+            if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+            {
+                continue;
+            }
+            LOGGER_ERROR(logid_, "ERR! io_uring_enter submit err:%d", errno);
+            return -1;
+        }
+        unsubmitted_ -= (static_cast<uint32_t>(ret) < unsubmitted_) ? static_cast<uint32_t>(ret) : unsubmitted_;
+    }
+    return 0;
+}
+
+int32_t Socket::Reactor::wait(const int32_t timeout)
+{
+    uint32_t ready = load_acquire(cqTail_) - *cqHead_;
+    if (ready > 0)
+    {
+        return static_cast<int32_t>(ready);
+    }
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = static_cast<long long>(timeout % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    std::memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    int32_t ret = sys_io_uring_enter(fd_, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if ((ret == -1) && (errno != ETIME) && (errno != EINTR))
+    {
+        LOGGER_ERROR(logid_, "ERR! io_uring_enter wait err:%d", errno);
+        return -1;
+    }
+    return static_cast<int32_t>(load_acquire(cqTail_) - *cqHead_);
+}
+
+void Socket::Reactor::prep_accept(SOCKET sock, const bool nonBlocking)
+{
+    // マルチショットで、1回の要求で接続を受け付け続ける
+    std::lock_guard<std::mutex> lock(mtx_);
+    struct io_uring_sqe *sqe = get_sqe_();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0);
+    sqe->user_data = TAG_ACCEPT;
+    inflight_++;
+}
+
+void Socket::Reactor::prep_recv(const int64_t id, SOCKET sock)
+{
+    // マルチショットで、届いたデータをプロバイドバッファに受信し続ける
+    std::lock_guard<std::mutex> lock(mtx_);
+    struct io_uring_sqe *sqe = get_sqe_();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = (static_cast<uint64_t>(id) << 3) | TAG_RECV;
+    inflight_++;
+}
+
+void Socket::Reactor::prep_cancel_recv(const int64_t id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    struct io_uring_sqe *sqe = get_sqe_();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (static_cast<uint64_t>(id) << 3) | TAG_RECV;
+    sqe->user_data = TAG_CANCEL;
+}
+
+void Socket::Reactor::prep_wake(const int32_t fd)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    struct io_uring_sqe *sqe = get_sqe_();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TAG_WAKE;
+    inflight_++;
+}
+
+void Socket::Reactor::send_next(Connection &conn)
+{
+    SendContext &ctx = conn.sendContext_;
+    if (ctx.armed_ || ctx.queue_.empty())
+    {
+        return;
+    }
+
+    // 送信キューに溜まったフレームをまとめて1つの要求にする
+    SendOp *op = alloc_op_();
+    op->id_ = conn.id_;
+    while (!ctx.queue_.empty() && (op->entries_.size() < MAX_IOV / 2))
+    {
+        op->entries_.emplace_back(std::move(ctx.queue_.front()));
+        ctx.queue_.pop_front();
+    }
+    size_t iovcnt = 0;
+    op->bytes_ = 0;
+    for (SendEntry &entry : op->entries_)
+    {
+        // 同期送信で送信しきれなかったフレームは、送信済みの分を除いて送る
+        size_t offset = entry.sent_;
+        if (offset < entry.headSize_)
+        {
+            op->iov_[iovcnt].iov_base = entry.head_ + offset;
+            op->iov_[iovcnt].iov_len = entry.headSize_ - offset;
+            iovcnt++;
+            offset = 0;
+        }
+        else
+        {
+            offset -= entry.headSize_;
+        }
+        if (static_cast<size_t>(entry.size_) > offset)
+        {
+            op->iov_[iovcnt].iov_base = const_cast<char *>(entry.data_) + offset;
+            op->iov_[iovcnt].iov_len = static_cast<size_t>(entry.size_) - offset;
+            iovcnt++;
+        }
+        op->bytes_ += entry.headSize_ + static_cast<size_t>(entry.size_) - entry.sent_;
+    }
+    std::memset(&op->msg_, 0, sizeof(op->msg_));
+    op->msg_.msg_iov = op->iov_;
+    op->msg_.msg_iovlen = iovcnt;
+    // 送信要求の完了待ちの間はarmed_をtrueにする(同じ接続の送信要求は1つずつ順に出す)
+    ctx.armed_ = true;
+    push_send_(op, conn.sock_);
+}
+
+int64_t Socket::Reactor::attach(Socket &owner, SOCKET sock, const bool submit)
+{
+    // 受信完了時に接続IDで参照するため、接続テーブルに登録してから受信を開始する
+    std::lock_guard<std::mutex> lock(owner.mtx_);
+    Connection *conn = owner.add_connection_(sock, owner.enable_zerocopy_(sock));
+    if (conn == nullptr)
+    {
+        return 0;
+    }
+    recv_state(sock) = RecvState();
+    prep_recv(conn->id_, sock);
+    if (submit && (this->submit() != 0))
+    {
+        std::vector<std::function<void()>> released;
+        owner.remove_connection_(*conn, released);
+        return 0;
+    }
+    return conn->id_;
+}
+
+Socket::Reactor::RecvState &Socket::Reactor::recv_state(SOCKET sock)
+{
+    size_t idx = static_cast<size_t>(sock);
+    if (idx >= recvStates_.size())
+    {
+        recvStates_.resize(idx + 1);
+    }
+    return recvStates_[idx];
+}
+
+void Socket::Reactor::resume_held(const int64_t id)
+{
+    resumed_.emplace_back(id);
+}
+
+void Socket::Reactor::push_send_(SendOp *op, SOCKET sock)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    struct io_uring_sqe *sqe = get_sqe_();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = reinterpret_cast<uint64_t>(&op->msg_);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = reinterpret_cast<uint64_t>(op) | TAG_SEND;
+    inflight_++;
+}
+
+Socket::Reactor::SendOp *Socket::Reactor::alloc_op_()
+{
+    if (freeOps_.empty())
+    {
+        return new SendOp();
+    }
+    SendOp *op = freeOps_.back();
+    freeOps_.pop_back();
+    return op;
+}
+
+void Socket::Reactor::free_op_(SendOp *op, std::vector<std::function<void()>> &released)
+{
+    for (SendEntry &entry : op->entries_)
+    {
+        if (entry.release_)
+        {
+            released.emplace_back(std::move(entry.release_));
+        }
+    }
+    op->entries_.clear();
+    freeOps_.emplace_back(op);
+}
+
+void Socket::Reactor::recycle_(const uint16_t bid)
+{
+    // リングの先頭要素のresvは末尾位置と重なっているため、フィールドごとに書き込む
+    struct io_uring_buf &buf = bufRing_[bufTail_ & (BUF_COUNT - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(bufs_ + static_cast<size_t>(bid) * BUF_SIZE);
+    buf.len = BUF_SIZE;
+    buf.bid = bid;
+    bufTail_++;
+    __atomic_store_n(&bufRing_[0].resv, bufTail_, __ATOMIC_RELEASE);
+}
+
+int32_t Socket::Reactor::feed_(Socket &owner, Connection &conn, const char *data, size_t size, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve)
+{
+    // 受信したバイト列をフレームに組み立てる(フレームの途中で終わった場合は受信状態を保持する)
+    RecvContext &ctx = conn.recv_;
+    size_t offset = 0;
+    while (true)
+    {
+        if (ctx.state_ == RecvContext::State::HEADER)
+        {
+            if (offset == size)
+            {
+                if (ctx.headerSize_ > 0)
+                {
+                    // ヘッダの途中で受信データが途切れた
+                    TrafficCounter::count(conn.traffic_.partialReads_);
+                }
+                return 0;
+            }
+            size_t n = sizeof(Header) - static_cast<size_t>(ctx.headerSize_);
+            n = (n < size - offset) ? n : (size - offset);
+            std::memcpy(reinterpret_cast<char *>(&ctx.header_) + ctx.headerSize_, data + offset, n);
+            ctx.headerSize_ += static_cast<int32_t>(n);
+            offset += n;
+            if (ctx.headerSize_ < static_cast<int32_t>(sizeof(Header)))
+            {
+                continue;
+            }
+            LOGGER_DEBUG(logid_, "recv head sock:0x%x", conn.sock_);
+            LOGGER_DEBUG(logid_, " -> %.3s flags:0x%x sz:%d", ctx.header_.magic_, ctx.header_.flags(), ctx.header_.size_);
+            if ((std::memcmp(ctx.header_.magic_, "SOC", 3) != 0) || (ctx.header_.size_ < 0))
+            {
+                LOGGER_ERROR(logid_, "ERR! recv head invalid");
+                return -1;
+            }
+            if (!owner.stream_begin_(conn, ctx.header_))
+            {
+                ctx.buffer_ = BufferPool::instance().get(ctx.header_.size_);
+            }
+            ctx.dataSize_ = 0;
+            ctx.state_ = RecvContext::State::BODY;
+        }
+
+        if (ctx.dataSize_ < ctx.header_.size_)
+        {
+            if (offset == size)
+            {
+                // データの途中で受信データが途切れた
+                TrafficCounter::count(conn.traffic_.partialReads_);
+                return 0;
+            }
+            size_t n = static_cast<size_t>(ctx.header_.size_ - ctx.dataSize_);
+            n = (n < size - offset) ? n : (size - offset);
+            if (ctx.streaming_)
+            {
+                // ストリーミング受信では、受信バッファのデータをコピーせずにチャンクとして渡す
+                size_t chunk = static_cast<size_t>(owner.streamChunk_);
+                for (size_t done = 0; done < n; done += chunk)
+                {
+                    size_t m = (chunk < n - done) ? chunk : (n - done);
+                    owner.func_stream_(conn.id_, StreamEvent::CHUNK, data + offset + done, static_cast<int32_t>(m));
+                }
+            }
+            else
+            {
+                std::memcpy(ctx.buffer_.data() + ctx.dataSize_, data + offset, n);
+            }
+            ctx.dataSize_ += static_cast<int32_t>(n);
+            offset += n;
+            if (ctx.dataSize_ < ctx.header_.size_)
+            {
+                continue;
+            }
+        }
+
+        // フレーム受信完了
+        if (ctx.streaming_)
+        {
+            LOGGER_DEBUG(logid_, "recv stream sock:0x%x", conn.sock_);
+            LOGGER_DEBUG(logid_, " -> sz:%d", ctx.dataSize_);
+            int32_t frameSize = ctx.dataSize_;
+            ctx.reset();
+            TrafficCounter::count(conn.traffic_.framesIn_);
+            owner.func_stream_(conn.id_, StreamEvent::END, nullptr, frameSize);
+        }
+        else
+        {
+            LOGGER_DEBUG(logid_, "recv data sock:0x%x", conn.sock_);
+            LOGGER_DEBUG(logid_, " -> sz:%d", ctx.dataSize_);
+            Buffer buffer = std::move(ctx.buffer_);
+            Header header = ctx.header_;
+            ctx.reset();
+            if (!owner.unpack_frame_(conn, header, buffer))
+            {
+                return -1;
+            }
+            TrafficCounter::count(conn.traffic_.framesIn_);
+            func_recieve(conn.id_, header.flags(), buffer);
+        }
+
+        // 通知したフレームで高水位を超えた場合は、プロバイドバッファの残りを通知せずに再開まで保持する
+        if ((offset < size) && owner.flow_enabled_() && owner.recieve_paused_(conn.id_))
+        {
+            (void)hold_(owner, conn, data + offset, size - offset, true);
+            return 0;
+        }
+    }
+}
+
+bool Socket::Reactor::hold_(Socket &owner, Connection &conn, const char *data, size_t size, const bool paused)
+{
+    std::lock_guard<std::mutex> lock(owner.mtx_);
+    RecvState &state = recv_state(conn.sock_);
+    if (!paused && !conn.flow_.paused_ && state.held_.empty())
+    {
+        return false;
+    }
+    // 受信を止めた後に届いた分も、受信順を保つよう後ろに足す
+    state.held_.insert(state.held_.end(), data, data + size);
+    return true;
+}
+
+void Socket::Reactor::feed_held(Socket &owner, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, std::vector<int64_t> &closed)
+{
+    // (同期送信はmtx_を保持したままブロックするため、フロー制御が無効ならロックしない)
+    if (!owner.flow_enabled_())
+    {
+        return;
+    }
+    std::vector<int64_t> ids;
+    {
+        std::lock_guard<std::mutex> lock(owner.mtx_);
+        ids.swap(resumed_);
+    }
+    for (int64_t id : ids)
+    {
+        // 接続テーブルを変更するのはリアクタスレッドのみのため、ロックせずに参照する
+        Connection *conn = owner.connections_.find(id);
+        if (conn == nullptr)
+        {
+            continue;
+        }
+        std::vector<char> held;
+        {
+            std::lock_guard<std::mutex> lock(owner.mtx_);
+            if (conn->flow_.paused_)
+            {
+                // 組み立てる前に再び止めた
+                continue;
+            }
+            held.swap(recv_state(conn->sock_).held_);
+        }
+        if (!held.empty() && (feed_(owner, *conn, held.data(), held.size(), func_recieve) != 0))
+        {
+            closed.emplace_back(id);
+        }
+    }
+}
+
+int32_t Socket::Reactor::reap(Socket &owner, const std::function<void(SOCKET)> &func_accept, const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve,
+                            const std::function<void(int64_t)> &func_drained, std::vector<int64_t> &closed)
+{
+    std::vector<std::function<void()>> released;
+    std::vector<int64_t> drained;
+    uint32_t head = *cqHead_;
+    uint32_t tail = load_acquire(cqTail_);
+    int32_t count = 0;
+    for (; head != tail; head++, count++)
+    {
+        const struct io_uring_cqe cqe = cqes_[head & cqMask_];
+        uint64_t tag = cqe.user_data & TAG_MASK;
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+        if (tag == TAG_ACCEPT)
+        {
+            if (!more)
+            {
+                inflight_--;
+            }
+            if (cqe.res >= 0)
+            {
+                if (func_accept)
+                {
+                    func_accept(cqe.res);
+                }
+                else
+                {
+                    ::close(cqe.res);
+                }
+            }
+            else if (cqe.res != -ECANCELED)
+            {
+                LOGGER_ERROR(logid_, "ERR! accept err:%d", -cqe.res);
+                if (func_accept)
+                {
+                    // 受付エラーはINVALID_SOCKETで通知する
+                    func_accept(INVALID_SOCKET);
+                }
+            }
+            if (!more && (cqe.res != -ECANCELED))
+            {
+                // マルチショットが終了したため、受け付けを再開する
+                prep_accept(owner.sock_, owner.nonBlocking_);
+            }
+        }
+        else if (tag == TAG_RECV)
+        {
+            int64_t id = static_cast<int64_t>(cqe.user_data >> 3);
+            if (!more)
+            {
+                inflight_--;
+            }
+            // 接続テーブルを変更するのはリアクタスレッドのみのため、ロックせずに参照する
+            Connection *conn = owner.connections_.find(id);
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+            {
+                uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if ((conn != nullptr) && (cqe.res > 0))
+                {
+                    TrafficCounter::count(conn->traffic_.bytesIn_, static_cast<uint64_t>(cqe.res));
+                    owner.quick_ack_(conn->sock_);
+                    const char *data = bufs_ + static_cast<size_t>(bid) * BUF_SIZE;
+                    // 受信を止めている間(取消しが完了するまで)に届いた分は、通知せずに保持する
+                    bool held = owner.flow_enabled_() && hold_(owner, *conn, data, static_cast<size_t>(cqe.res), false);
+                    if (!held && (feed_(owner, *conn, data, static_cast<size_t>(cqe.res), func_recieve) != 0))
+                    {
+                        closed.emplace_back(id);
+                    }
+                }
+                recycle_(bid);
+            }
+            if (conn == nullptr)
+            {
+                // 切断済みの接続
+                continue;
+            }
+            if ((cqe.res == 0) || ((cqe.res < 0) && (cqe.res != -ENOBUFS) && (cqe.res != -ECANCELED)))
+            {
+                // 接続が切れた
+                LOGGER_INFO(logid_, "recv disconnect sock:0x%x res:%d", conn->sock_, cqe.res);
+                closed.emplace_back(id);
+            }
+            else if (!more)
+            {
+                // プロバイドバッファが足りないか、受信のフロー制御で取り消したためマルチショットが終了した
+                // 受信を止めている場合は、再開した時点で受信要求を出し直す
+                // (同期送信はmtx_を保持したままブロックするため、フロー制御が無効ならロックしない)
+                bool stopped = false;
+                if (owner.flow_enabled_())
+                {
+                    std::lock_guard<std::mutex> lock(owner.mtx_);
+                    RecvState &state = recv_state(conn->sock_);
+                    state.cancelling_ = false;
+                    state.stopped_ = conn->flow_.paused_;
+                    stopped = state.stopped_;
+                }
+                if (!stopped)
+                {
+                    prep_recv(id, conn->sock_);
+                }
+            }
+        }
+        else if (tag == TAG_WAKE)
+        {
+            // 積まれたタスクは、刈り取りの後で実行する
+            uint64_t value = 0;
+            (void)::read(owner.wakeFd_, &value, sizeof(value));
+            if (!more)
+            {
+                inflight_--;
+                if (cqe.res != -ECANCELED)
+                {
+                    // マルチショットが終了したため、監視を再開する
+                    prep_wake(owner.wakeFd_);
+                }
+            }
+        }
+        else if (tag == TAG_SEND)
+        {
+            SendOp *op = reinterpret_cast<SendOp *>(cqe.user_data & ~TAG_MASK);
+            inflight_--;
+            std::lock_guard<std::mutex> lock(owner.mtx_);
+            Connection *conn = owner.connections_.find(op->id_);
+            if (conn == nullptr)
+            {
+                // 切断済みの接続の送信データは呼び出し元に返却する
+                free_op_(op, released);
+                continue;
+            }
+            SendContext &ctx = conn->sendContext_;
+            if (cqe.res < 0)
+            {
+                LOGGER_ERROR(logid_, "ERR! send sock:0x%x err:%d", conn->sock_, -cqe.res);
+                ctx.queuedBytes_ -= op->bytes_;
+                ctx.armed_ = false;
+                free_op_(op, released);
+                closed.emplace_back(op->id_);
+                continue;
+            }
+
+            size_t sent = static_cast<size_t>(cqe.res);
+            ctx.queuedBytes_ -= sent;
+            TrafficCounter::count(conn->traffic_.bytesOut_, sent);
+            LOGGER_DEBUG(logid_, "send sock:0x%x", conn->sock_);
+            LOGGER_DEBUG(logid_, " -> size:%zu remain:%zu", sent, ctx.queuedBytes_);
+            if (sent < op->bytes_)
+            {
+                // 部分送信の場合は、送信済みの分だけiovを進めて続きを送る
+                op->bytes_ -= sent;
+                while ((op->msg_.msg_iovlen > 0) && (sent >= op->msg_.msg_iov[0].iov_len))
+                {
+                    sent -= op->msg_.msg_iov[0].iov_len;
+                    op->msg_.msg_iov++;
+                    op->msg_.msg_iovlen--;
+                }
+                if (op->msg_.msg_iovlen > 0)
+                {
+                    op->msg_.msg_iov[0].iov_base = static_cast<char *>(op->msg_.msg_iov[0].iov_base) + sent;
+                    op->msg_.msg_iov[0].iov_len -= sent;
+                }
+                push_send_(op, conn->sock_);
+                continue;
+            }
+
+            TrafficCounter::count(conn->traffic_.framesOut_, op->entries_.size());
+            free_op_(op, released);
+            ctx.armed_ = false;
+            // 送信中に積まれたフレームを続けて送信する
+            send_next(*conn);
+            if (!ctx.writable_ && (ctx.queuedBytes_ <= owner.sendLowWatermark_))
+            {
+                ctx.writable_ = true;
+                drained.emplace_back(conn->id_);
+            }
+        }
+    }
+    store_release(cqHead_, head);
+
+    // 刈り取り中に積んだ要求(受信の再開・続きの送信)をまとめてカーネルに渡す
+    (void)submit();
+
+    for (auto &func : released)
+    {
+        func();
+    }
+    if (func_drained)
+    {
+        for (int64_t id : drained)
+        {
+            func_drained(id);
+        }
+    }
+    return count;
+}
+
+const char *Socket::backend()
+{
+    return "uring";
+}
+
+bool Socket::open_reactor_()
+{
+    // io_uringのリングを生成する
+    reactor_ = new Reactor(logid_);
+    if (!reactor_->init())
+    {
+        std::vector<std::function<void()>> released;
+        reactor_->deinit(released);
+        delete reactor_;
+        reactor_ = nullptr;
+        return false;
+    }
+    LOGGER_INFO(logid_, "create uring");
+
+    // ループを起こすeventfdは、リングを作り直すたびに監視する
+    if (wakeFd_ != -1)
+    {
+        reactor_->prep_wake(wakeFd_);
+        (void)reactor_->submit();
+    }
+    return true;
+}
+
+void Socket::close_reactor_(std::vector<std::function<void()>> &released)
+{
+    if (reactor_ != nullptr)
+    {
+        LOGGER_INFO(logid_, "close uring");
+        reactor_->deinit(released);
+        delete reactor_;
+        reactor_ = nullptr;
+    }
+}
+
+int32_t Socket::do_flush(const int64_t id, const std::function<void(int64_t)> &func_drained, const bool notify)
+{
+    if (loopFd_ != -1)
+    {
+        // 外部のイベントループのepollでは、書き込み可能の通知を受けて送信キューを書き込む
+        return flush_ready_(id, func_drained, notify);
+    }
+
+    // 送信の完了はリアクタが刈り取り、続きの送信と低水位の通知もリアクタが行う
+    std::lock_guard<std::mutex> lock(mtx_);
+    Connection *conn = connections_.find(id);
+    if ((conn == nullptr) || (reactor_ == nullptr))
+    {
+        return 0;
+    }
+    conn->sendContext_.corked_ = false;
+    reactor_->send_next(*conn);
+    return reactor_->submit();
+}
+
+void Socket::apply_flow_(Connection &conn)
+{
+    if (loopFd_ != -1)
+    {
+        // 外部のイベントループのepollでは、受信を止める間はEPOLLINを監視しない
+        (void)watch_(conn, EPOLL_CTL_MOD);
+        return;
+    }
+
+    // マルチショット受信を取り消して受信を止め、再開時に受信要求を出し直す
+    // (取消しの完了前に再開した場合は、完了通知を刈り取った時点で受信要求を出し直す)
+    Reactor::RecvState &state = reactor_->recv_state(conn.sock_);
+    if (conn.flow_.paused_)
+    {
+        if (!state.cancelling_ && !state.stopped_)
+        {
+            state.cancelling_ = true;
+            reactor_->prep_cancel_recv(conn.id_);
+            (void)reactor_->submit();
+        }
+    }
+    else
+    {
+        if (!state.held_.empty())
+        {
+            // 止めた時点で通知しなかった受信データを、積まれたタスクの実行後に組み立てる
+            reactor_->resume_held(conn.id_);
+        }
+        if (state.stopped_)
+        {
+            state.stopped_ = false;
+            reactor_->prep_recv(conn.id_, conn.sock_);
+            (void)reactor_->submit();
+        }
+    }
+}
+
+bool Socket::enable_zerocopy_(SOCKET)
+{
+    // io_uringバックエンドではコピー送信のみ使う
+    return false;
+}
+
+void Socket::arm_send_(Connection &conn)
+{
+    // 送信要求が無ければすぐに出す
+    // (完了待ちの間に積まれたフレームは、完了を刈り取ったリアクタがまとめて送信する)
+    if (loopFd_ != -1)
+    {
+        // 外部のイベントループのepollでは、EPOLLOUTを監視してループに書き込ませる
+        conn.sendContext_.armed_ = true;
+        (void)watch_(conn, EPOLL_CTL_MOD);
+    }
+    else if (reactor_ != nullptr)
+    {
+        reactor_->send_next(conn);
+        (void)reactor_->submit();
+    }
+}
+
+int64_t Socket::attach_(SOCKET sock)
+{
+    if (loopFd_ != -1)
+    {
+        // 外部のイベントループのepollには、ループが受信イベントの処理(do_watch)で加える
+        std::lock_guard<std::mutex> lock(mtx_);
+        Connection *conn = add_connection_(sock, false);
+        return (conn != nullptr) ? conn->id_ : 0;
+    }
+    return (reactor_ != nullptr) ? reactor_->attach(*this, sock, true) : 0;
+}
+
+void Socket::detach_(SOCKET sock)
+{
+    // 受信中のマルチショットはソケットを参照し続けるため、closeの前にshutdownで終了させる
+    (void)::shutdown(sock, SHUT_RDWR);
+}
+
+bool ServerSocket::start_accept_()
+{
+    // マルチショットの受け付けを開始する(受け付けた接続はリアクタが登録する)
+    if (reactor_ == nullptr)
+    {
+        return false;
+    }
+    reactor_->prep_accept(sock_, nonBlocking_);
+    if (reactor_->submit() != 0)
+    {
+        LOGGER_ERROR(logid_, "ERR! accept sock:0x%x", sock_);
+        return false;
+    }
+    return true;
+}
+
+void ServerSocket::do_stop_accept()
+{
+    // マルチショットの受け付けは、リングを閉じる(do_delete)と終わる
+}
+
+int32_t ServerSocket::do_recieve_event(const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained)
+{
+    if (reactor_ == nullptr)
+    {
+        return -1;
+    }
+
+    // 受け付け・受信・送信の完了通知を待つ
+    int32_t timeout = 1000; // タイムアウト時間[msec]
+    if (coalesceWindowUs_ > 0)
+    {
+        timeout = coalesce_timeout_(timeout);
+    }
+    int32_t ready = reactor_->wait(timeout);
+    if (ready == -1)
+    {
+        // エラー
+        return -1;
+    }
+    if (ready > 0)
+    {
+        TrafficCounter::count(traffic_.wakeups_);
+    }
+
+    std::vector<int64_t> closed;
+    if (coalesceWindowUs_ > 0)
+    {
+        // 窓の期限を過ぎた送信キューを送信する
+        flush_coalesced_(func_drained, closed);
+    }
+    if (ready > 0)
+    {
+        // マルチショットの受け付けで、受付待ちの接続はカーネルがまとめて完了通知する
+        // 受信要求は刈り取りの最後にまとめてカーネルに渡す
+        uint64_t batch = 0;
+        auto func_accept = [&](SOCKET client)
+        {
+            if (client == INVALID_SOCKET)
+            {
+                acceptErrors_++;
+                return;
+            }
+            apply_options_(client);
+            int64_t id = reactor_->attach(*this, client, false);
+            if (id == 0)
+            {
+                // 受付エラー
+                ::close(client);
+                acceptErrors_++;
+                return;
+            }
+            batch++;
+            LOGGER_INFO(logid_, "accept client:0x%x id:0x%llx", client, static_cast<unsigned long long>(id));
+        };
+        (void)reactor_->reap(*this, func_accept, func_recieve, func_drained, closed);
+        count_accept_(batch);
+    }
+
+    // 他のスレッドから積まれたタスクを実行する(受信を再開した接続は、保持している受信データから組み立てる)
+    run_posted_();
+    reactor_->feed_held(*this, func_recieve, closed);
+
+    for (int64_t client : closed)
+    {
+        // 接続が切れたため、クライアントソケットから削除する
+        if (isConnected(client))
+        {
+            LOGGER_INFO(logid_, "disconnect client:0x%llx", static_cast<unsigned long long>(client));
+            do_disconnect(client);
+        }
+    }
+    return 0;
+}
+
+int32_t ServerSocket::do_accept()
+{
+    // リアクタはマルチショットで受け付けるため、ここは直接呼び出した場合のみ使う
+    // 最初の接続は待ち、続く受付待ちの接続はブロックしない範囲でまとめて受け付ける
+    static constexpr int32_t MAX_BATCH = 64;
+    int32_t result = 0;
+    for (int32_t n = 0; n < MAX_BATCH; n++)
+    {
+        if (n > 0)
+        {
+            struct pollfd pfd;
+            pfd.fd = sock_;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (::poll(&pfd, 1, 0) <= 0)
+            {
+                break;
+            }
+        }
+        struct sockaddr_storage sa_client;
+        socklen_t len = sizeof(sa_client);
+        SOCKET client = ::accept4(sock_, reinterpret_cast<struct sockaddr *>(&sa_client), &len, SOCK_CLOEXEC | (nonBlocking_ ? SOCK_NONBLOCK : 0));
+        if (client == INVALID_SOCKET)
+        {
+            LOGGER_ERROR(logid_, "ERR! accept client:0x%x err:%d", client, errno);
+            acceptErrors_++;
+            break;
+        }
+
+        apply_options_(client);
+        int64_t id = attach_(client);
+        if (id == 0)
+        {
+            ::close(client);
+            acceptErrors_++;
+            continue;
+        }
+
+        char ip[32];
+        memset(ip, 0, sizeof(ip));
+        uint16_t port = 0;
+        if (sa_client.ss_family == AF_INET)
+        {
+            const struct sockaddr_in &sa = *reinterpret_cast<const struct sockaddr_in *>(&sa_client);
+            inet_ntop(sa.sin_family, &sa.sin_addr, ip, sizeof(ip));
+            port = ntohs(sa.sin_port);
+        }
+        else
+        {
+            std::strncpy(ip, "unix", sizeof(ip) - 1);
+        }
+        LOGGER_INFO(logid_, "accept client:0x%x id:0x%llx", client, static_cast<unsigned long long>(id));
+        LOGGER_INFO(logid_, " -> %s:%d", ip, port);
+        result++;
+    }
+    count_accept_(static_cast<uint64_t>(result));
+
+    return result;
+}
+
+int32_t ClientSocket::do_recieve_event(const std::function<void(int64_t, uint8_t, Buffer &)> &func_recieve, const std::function<void(int64_t)> &func_drained, const int32_t timeout)
+{
+    if (reactor_ == nullptr)
+    {
+        return -1;
+    }
+
+    // 受信・送信の完了通知を待つ
+    int32_t ready = reactor_->wait(waitTimeout(timeout));
+    if (ready == -1)
+    {
+        // エラー
+        return -1;
+    }
+    if (ready > 0)
+    {
+        TrafficCounter::count(traffic_.wakeups_);
+    }
+
+    std::vector<int64_t> closed;
+    if (coalesceWindowUs_ > 0)
+    {
+        // 窓の期限を過ぎた送信キューを送信する
+        flush_coalesced_(func_drained, closed);
+    }
+    if (ready > 0)
+    {
+        (void)reactor_->reap(*this, nullptr, func_recieve, func_drained, closed);
+    }
+
+    // 他のスレッドから積まれたタスクを実行する(受信を再開した接続は、保持している受信データから組み立てる)
+    run_posted_();
+    reactor_->feed_held(*this, func_recieve, closed);
+
+    int64_t id = id_;
+    for (int64_t client : closed)
+    {
+        if (client == id)
+        {
+            // 接続が切れたため、再接続させる
+            LOGGER_INFO(logid_, "disconnect sock:0x%x", sock_);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int32_t ClientSocket::waitFd() const
+{
+    return (reactor_ != nullptr) ? reactor_->fd() : -1;
+}
@@ -0,0 +1,19 @@
+﻿#include <cstdio>
+
+#include "Logger.hpp"
+
+// Logger::init()にパスを渡して出力したバイナリのログをテキストにする
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <log file>\n", argv[0]);
+        return 1;
+    }
+    if (!Logger::decode(argv[1], stdout))
+    {
+        fprintf(stderr, "ERR! decode %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1927 @@
+﻿#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <condition_variable>
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h> // send()
+#include <netinet/in.h> // sockaddr_in
+#include <arpa/inet.h>  // inet_pton()
+#include <unistd.h>     // close()
+#include <poll.h>       // poll()
+#include <sys/epoll.h>  // epoll_wait()
+#include <sys/resource.h> // getrusage()
+#include <dlfcn.h>      // dlsym()
+#include <time.h>       // clock_gettime()
+
+#include "MySocket.hpp"
+#include "Compressor.hpp"
+#include "Logger.hpp"
+#include "ShmTransport.hpp"
+#include "ClientLoop.hpp"
+
+//#define LOG_DEBUG(...)
+#define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+// 計測結果はソケットのログ(stderr)と分けて標準出力に出す
+#define LOG_RESULT(...) fprintf(stdout, __VA_ARGS__)
+
+// 計測中のスレッドで発生したヒープ確保を数える
+namespace
+{
+    thread_local bool g_countAlloc = false;
+    thread_local uint64_t g_allocCount = 0;
+    thread_local uint64_t g_allocBytes = 0;
+}
+
+void *operator new(size_t size)
+{
+    if (g_countAlloc)
+    {
+        g_allocCount++;
+        g_allocBytes += size;
+    }
+    void *p = std::malloc((size == 0) ? 1 : size);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+// 計測中にライブラリが呼んだI/O関連のシステムコールを数える
+// libcの関数を同名の関数で置き換えて数え、dlsym(RTLD_NEXT)で取得した本来の関数を呼ぶ
+// libc内部の呼出し(fprintfのwrite等)やfutex・nanosleepは数えない
+namespace
+{
+    std::atomic<uint64_t> g_syscallCount(0);
+
+    template <typename T>
+    T next_symbol(const char *name)
+    {
+        return reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+    }
+}
+
+#define COUNT_SYSCALL(name, ...) \
+    static auto real = next_symbol<__VA_ARGS__>(#name); \
+    g_syscallCount.fetch_add(1, std::memory_order_relaxed)
+
+extern "C"
+{
+    ssize_t send(int fd, const void *buf, size_t len, int flags)
+    {
+        COUNT_SYSCALL(send, ssize_t (*)(int, const void *, size_t, int));
+        return real(fd, buf, len, flags);
+    }
+
+    ssize_t recv(int fd, void *buf, size_t len, int flags)
+    {
+        COUNT_SYSCALL(recv, ssize_t (*)(int, void *, size_t, int));
+        return real(fd, buf, len, flags);
+    }
+
+    ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+    {
+        COUNT_SYSCALL(sendmsg, ssize_t (*)(int, const struct msghdr *, int));
+        return real(fd, msg, flags);
+    }
+
+    ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+    {
+        COUNT_SYSCALL(recvmsg, ssize_t (*)(int, struct msghdr *, int));
+        return real(fd, msg, flags);
+    }
+
+    ssize_t read(int fd, void *buf, size_t count)
+    {
+        COUNT_SYSCALL(read, ssize_t (*)(int, void *, size_t));
+        return real(fd, buf, count);
+    }
+
+    ssize_t write(int fd, const void *buf, size_t count)
+    {
+        COUNT_SYSCALL(write, ssize_t (*)(int, const void *, size_t));
+        return real(fd, buf, count);
+    }
+
+    int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+    {
+        COUNT_SYSCALL(epoll_wait, int (*)(int, struct epoll_event *, int, int));
+        return real(epfd, events, maxevents, timeout);
+    }
+
+    int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) __THROW
+    {
+        COUNT_SYSCALL(epoll_ctl, int (*)(int, int, int, struct epoll_event *));
+        return real(epfd, op, fd, event);
+    }
+
+    int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+    {
+        COUNT_SYSCALL(poll, int (*)(struct pollfd *, nfds_t, int));
+        return real(fds, nfds, timeout);
+    }
+
+    int setsockopt(int fd, int level, int name, const void *value, socklen_t len) __THROW
+    {
+        COUNT_SYSCALL(setsockopt, int (*)(int, int, int, const void *, socklen_t));
+        return real(fd, level, name, value, len);
+    }
+
+    // io_uringのio_uring_enter等はsyscall()で呼ぶ(引数は最大6個のlongとして渡す)
+    long syscall(long number, ...) __THROW
+    {
+        COUNT_SYSCALL(syscall, long (*)(long, ...));
+        va_list ap;
+        va_start(ap, number);
+        long args[6];
+        for (long &arg : args)
+        {
+            arg = va_arg(ap, long);
+        }
+        va_end(ap);
+        return real(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+    }
+}
+
+namespace
+{
+    static constexpr uint16_t BENCH_PORT = 9877;
+
+    static double elapsed_sec(const std::chrono::steady_clock::time_point &sta)
+    {
+        auto diff = std::chrono::steady_clock::now() - sta;
+        return std::chrono::duration<double>(diff).count();
+    }
+
+    static double thread_cpu_sec()
+    {
+        struct timespec ts;
+        (void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) / 1e9;
+    }
+
+    // 受信側: ノンブロッキングモードのServerSocketで受信したバイト数を数える
+    class Sink
+    {
+        ServerSocket sock_;
+        std::thread th_;
+        std::atomic<bool> isRunning_;
+        std::atomic<uint64_t> bytes_;
+
+    public:
+        Sink() : sock_(0), isRunning_(false), bytes_(0)
+        {
+        }
+
+        bool start()
+        {
+            sock_.setNonBlocking(true);
+            if (!sock_.do_create() || !sock_.do_bind_listen("127.0.0.1", BENCH_PORT))
+            {
+                return false;
+            }
+            isRunning_ = true;
+            std::thread th(&Sink::task, this);
+            th_.swap(th);
+            return true;
+        }
+
+        void end()
+        {
+            if (isRunning_)
+            {
+                isRunning_ = false;
+                th_.join();
+            }
+            sock_.do_stop_accept();
+            sock_.do_disconnect_all();
+            sock_.do_delete();
+        }
+
+        uint64_t bytes() const
+        {
+            return bytes_;
+        }
+
+        bool wait(uint64_t bytes) const
+        {
+            auto sta = std::chrono::steady_clock::now();
+            while (bytes_ < bytes)
+            {
+                if (elapsed_sec(sta) > 60.0)
+                {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            return true;
+        }
+
+    private:
+        void task()
+        {
+            auto func = [&](int32_t, uint8_t, Buffer &buffer)
+            {
+                bytes_ += static_cast<uint64_t>(buffer.size());
+            };
+            while (isRunning_)
+            {
+                (void)sock_.do_recieve_event(func);
+            }
+        }
+    };
+
+    // 変更前のdo_sendと同じ送信(ヘッダとデータを新規バッファにコピーしてから送信)
+    static int32_t send_copy(ClientSocket &sock, const char *data, const int32_t size)
+    {
+        Header header;
+        header.size_ = size;
+        size_t headerSize = sizeof(header);
+        size_t newSize = static_cast<size_t>(size) + headerSize;
+        char *newData = new char[newSize];
+        std::memcpy(newData, &header, headerSize);
+        std::memcpy(newData + headerSize, data, static_cast<size_t>(size));
+        size_t sent = 0;
+        while (sent < newSize)
+        {
+            ssize_t ret = ::send(sock.get(), newData + sent, newSize - sent, MSG_NOSIGNAL);
+            if (ret == -1)
+            {
+                delete[] newData;
+                return -1;
+            }
+            sent += static_cast<size_t>(ret);
+        }
+        delete[] newData;
+        return 0;
+    }
+
+    // 送信方式ごとのメッセージサイズ別スループットと送信スレッドのヒープ確保回数を計測する
+    static void bench_send()
+    {
+        Logger::init();
+        Sink sink;
+        if (!sink.start())
+        {
+            LOG_DEBUG("ERR! sink start\n");
+            Logger::deinit();
+            return;
+        }
+        ClientSocket client(0);
+        if (!client.do_create() || !client.do_connect("127.0.0.1", BENCH_PORT))
+        {
+            LOG_DEBUG("ERR! client connect\n");
+            sink.end();
+            Logger::deinit();
+            return;
+        }
+
+        const int32_t sizes[] = {1024, 64 * 1024, 3 * 1024 * 1024};
+        const uint64_t totalBytes = 64ULL * 1024 * 1024;
+        LOG_RESULT("[send] %10s %8s %8s %10s %10s %12s %16s\n", "size", "method", "msgs", "MB/s", "msg/s", "allocs/msg", "alloc_bytes/msg");
+        for (const int32_t size : sizes)
+        {
+            std::vector<char> payload(static_cast<size_t>(size), 'x');
+            const uint64_t count = totalBytes / static_cast<uint64_t>(size);
+            for (int32_t method = 0; method < 2; method++)
+            {
+                const uint64_t base = sink.bytes();
+                g_allocCount = 0;
+                g_allocBytes = 0;
+                auto sta = std::chrono::steady_clock::now();
+                g_countAlloc = true;
+                for (uint64_t i = 0; i < count; i++)
+                {
+                    if (method == 0)
+                    {
+                        (void)send_copy(client, payload.data(), size);
+                    }
+                    else
+                    {
+                        (void)client.do_send(payload.data(), size);
+                    }
+                }
+                g_countAlloc = false;
+                if (!sink.wait(base + count * static_cast<uint64_t>(size)))
+                {
+                    LOG_DEBUG("ERR! recv timeout\n");
+                }
+                double sec = elapsed_sec(sta);
+                LOG_RESULT("[send] %10d %8s %8llu %10.1f %10.0f %12.2f %16.1f\n",
+                          size, (method == 0) ? "copy" : "writev", static_cast<unsigned long long>(count),
+                          static_cast<double>(count * static_cast<uint64_t>(size)) / (1024.0 * 1024.0) / sec,
+                          static_cast<double>(count) / sec,
+                          static_cast<double>(g_allocCount) / static_cast<double>(count),
+                          static_cast<double>(g_allocBytes) / static_cast<double>(count));
+            }
+        }
+
+        client.do_disconnect();
+        client.do_delete();
+        sink.end();
+        Logger::deinit();
+    }
+
+    // 大きなメッセージのコピー送信とMSG_ZEROCOPY送信で、送信スレッドのCPU時間を比較する
+    static void bench_zerocopy()
+    {
+        Logger::init();
+        Sink sink;
+        if (!sink.start())
+        {
+            LOG_DEBUG("ERR! sink start\n");
+            Logger::deinit();
+            return;
+        }
+
+        const int32_t sizes[] = {64 * 1024, 1024 * 1024, 3 * 1024 * 1024};
+        const uint64_t totalBytes = 256ULL * 1024 * 1024;
+        LOG_RESULT("[zerocopy] %10s %8s %8s %10s %14s\n", "size", "method", "msgs", "MB/s", "cpu_us/MB");
+        for (const int32_t size : sizes)
+        {
+            std::vector<char> payload(static_cast<size_t>(size), 'x');
+            const uint64_t count = totalBytes / static_cast<uint64_t>(size);
+            // 0:コピー送信 1:MSG_ZEROCOPY(解放通知)
+            // (解放通知の無い送信はMSG_ZEROCOPYを使わない)
+            for (int32_t method = 0; method < 2; method++)
+            {
+                ClientSocket client(0);
+                client.setZeroCopy((method == 0) ? 0 : size);
+                if (!client.do_create() || !client.do_connect("127.0.0.1", BENCH_PORT))
+                {
+                    LOG_DEBUG("ERR! client connect\n");
+                    continue;
+                }
+
+                std::atomic<uint64_t> released(0);
+                auto release = [&]()
+                {
+                    released++;
+                };
+                const uint64_t base = sink.bytes();
+                auto sta = std::chrono::steady_clock::now();
+                double cpu = thread_cpu_sec();
+                for (uint64_t i = 0; i < count; i++)
+                {
+                    if (method == 1)
+                    {
+                        (void)client.do_send(payload.data(), size, release);
+                    }
+                    else
+                    {
+                        (void)client.do_send(payload.data(), size);
+                    }
+                }
+                while ((method == 1) && (released < count))
+                {
+                    if (client.do_zerocopy_event() != 0)
+                    {
+                        break;
+                    }
+                }
+                cpu = thread_cpu_sec() - cpu;
+                if (!sink.wait(base + count * static_cast<uint64_t>(size)))
+                {
+                    LOG_DEBUG("ERR! recv timeout\n");
+                }
+                double sec = elapsed_sec(sta);
+                double mb = static_cast<double>(count * static_cast<uint64_t>(size)) / (1024.0 * 1024.0);
+                const char *names[] = {"copy", "zerocopy"};
+                LOG_RESULT("[zerocopy] %10d %8s %8llu %10.1f %14.1f\n",
+                          size, names[method], static_cast<unsigned long long>(count), mb / sec, cpu * 1e6 / mb);
+
+                client.do_disconnect();
+                client.do_delete();
+            }
+        }
+
+        sink.end();
+        Logger::deinit();
+    }
+
+    // 受信したバイト数を数え、エコーモードでは受信データをそのまま送り返す
+    class EchoReciever : public Server::Reciever
+    {
+        Server *server_ = nullptr;
+        bool echo_ = false;
+        std::atomic<uint64_t> bytes_;
+
+    public:
+        EchoReciever(Server *server, bool echo) : server_(server), echo_(echo), bytes_(0)
+        {
+        }
+
+        void recieveData(const int64_t id, const char *data, const int32_t size) override
+        {
+            bytes_ += static_cast<uint64_t>(size);
+            if (echo_)
+            {
+                (void)server_->sendData(id, data, size);
+            }
+        }
+
+        uint64_t bytes() const
+        {
+            return bytes_;
+        }
+    };
+
+    // 送り返されたデータの受信を待ち合わせる
+    class PongReciever : public Client::Reciever
+    {
+        std::mutex mtx_;
+        std::condition_variable cv_;
+        uint64_t count_ = 0;
+
+    public:
+        void recieveData(const int64_t, const char *, const int32_t) override
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            count_++;
+            cv_.notify_one();
+        }
+
+        bool wait(uint64_t count)
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            return cv_.wait_for(lock, std::chrono::seconds(5), [&]
+                                { return count_ >= count; });
+        }
+
+        uint64_t count()
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            return count_;
+        }
+    };
+
+    static bool wait_connect(Client &client)
+    {
+        auto sta = std::chrono::steady_clock::now();
+        while (!client.isWritable())
+        {
+            if (elapsed_sec(sta) > 10.0)
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return true;
+    }
+
+    // 往復時間[nsec]を記録する対数線形のヒストグラム
+    // 2のべき乗の区間ごとに64分割するので、各ビンの幅は値の1/64以下(相対誤差1.6%以下)になる
+    // 値をすべて保持せずに固定サイズで記録でき、パーセンタイルはビンの上限値で返す
+    class LatencyHistogram
+    {
+        static constexpr int32_t SUB_BITS = 7;
+        static constexpr uint64_t SUB_NUM = 1ULL << SUB_BITS;
+        static constexpr uint64_t HALF_NUM = SUB_NUM / 2;
+        static constexpr int32_t MAX_EXP = 40; // 約18分まで(超えた値は最後のビンに入れる)
+        std::vector<uint64_t> bins_;
+        uint64_t count_ = 0;
+        uint64_t min_ = UINT64_MAX;
+        uint64_t max_ = 0;
+        double sum_ = 0.0;
+
+        static int32_t msb(uint64_t value)
+        {
+            return 63 - __builtin_clzll(value);
+        }
+
+        static size_t index(uint64_t value)
+        {
+            if (value < SUB_NUM)
+            {
+                return static_cast<size_t>(value);
+            }
+            int32_t shift = msb(value) - SUB_BITS + 1;
+            return static_cast<size_t>(static_cast<uint64_t>(shift) * HALF_NUM + (value >> shift));
+        }
+
+        // ビンに入る値の上限
+        static uint64_t upper(size_t idx)
+        {
+            if (idx < SUB_NUM)
+            {
+                return idx;
+            }
+            uint64_t shift = (idx - HALF_NUM) / HALF_NUM;
+            uint64_t mantissa = idx - shift * HALF_NUM;
+            return ((mantissa + 1) << shift) - 1;
+        }
+
+    public:
+        LatencyHistogram() : bins_(index((1ULL << MAX_EXP) - 1) + 1, 0)
+        {
+        }
+
+        void record(uint64_t nsec)
+        {
+            size_t idx = std::min(index(nsec), bins_.size() - 1);
+            bins_[idx]++;
+            count_++;
+            min_ = std::min(min_, nsec);
+            max_ = std::max(max_, nsec);
+            sum_ += static_cast<double>(nsec);
+        }
+
+        uint64_t count() const
+        {
+            return count_;
+        }
+
+        // percentileは0~100
+        double percentileUs(double percentile) const
+        {
+            if (count_ == 0)
+            {
+                return 0.0;
+            }
+            uint64_t target = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(count_)));
+            target = std::max<uint64_t>(target, 1);
+            uint64_t total = 0;
+            for (size_t i = 0; i < bins_.size(); i++)
+            {
+                total += bins_[i];
+                if (total >= target)
+                {
+                    return static_cast<double>(std::min(upper(i), max_)) / 1e3;
+                }
+            }
+            return static_cast<double>(max_) / 1e3;
+        }
+
+        double minUs() const
+        {
+            return (count_ == 0) ? 0.0 : static_cast<double>(min_) / 1e3;
+        }
+
+        double maxUs() const
+        {
+            return static_cast<double>(max_) / 1e3;
+        }
+
+        double meanUs() const
+        {
+            return (count_ == 0) ? 0.0 : sum_ / static_cast<double>(count_) / 1e3;
+        }
+    };
+
+    // ループバックで接続したServerとClient
+    // echoの場合はServerが受信データを送り返し、Clientはpong_で受信を待ち合わせる
+    class EchoPair
+    {
+    public:
+        Server server_;
+        EchoReciever reciever_;
+        Client client_;
+        PongReciever pong_;
+
+    public:
+        explicit EchoPair(const bool echo) : server_(0), reciever_(&server_, echo), client_(0)
+        {
+        }
+
+        ~EchoPair()
+        {
+            client_.end();
+            server_.end();
+        }
+
+        void setAsyncSend(const bool asyncSend)
+        {
+            server_.setAsyncSend(asyncSend);
+            client_.setAsyncSend(asyncSend);
+        }
+
+        void setOptions(const SocketOptions &options)
+        {
+            server_.setOptions(options);
+            client_.setOptions(options);
+        }
+
+        void setCompression(const int32_t threshold)
+        {
+            server_.setCompression(threshold);
+            client_.setCompression(threshold);
+        }
+
+        // 設定した後で開始し、接続するまで待つ
+        void start(const std::string &address)
+        {
+            server_.setAddress(address, BENCH_PORT);
+            server_.start(&reciever_);
+            client_.setAddress(address, BENCH_PORT);
+            client_.start(&pong_);
+            if (!wait_connect(client_))
+            {
+                LOG_DEBUG("ERR! client connect\n");
+            }
+        }
+
+        // 非同期送信で送信キューが高水位を超えたら、低水位を下回るまで待つ
+        void send(const char *data, const int32_t size)
+        {
+            if (client_.sendData(data, size) == 1)
+            {
+                while (!client_.isWritable())
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            }
+        }
+
+        uint64_t received() const
+        {
+            return reciever_.bytes();
+        }
+    };
+
+    // 送信のスループット
+    class Throughput
+    {
+    public:
+        uint64_t msgs_ = 0;
+        double mbps_ = 0.0;
+        double msgps_ = 0.0;
+    };
+
+    // 合計totalBytesになるまでpayloadを送り続け、相手が全て受信するまでの時間からスループットを求める
+    template <typename Pair>
+    static Throughput measure_throughput(Pair &pair, const std::vector<char> &payload, const uint64_t totalBytes)
+    {
+        const int32_t size = static_cast<int32_t>(payload.size());
+        Throughput result;
+        result.msgs_ = totalBytes / static_cast<uint64_t>(size);
+        const uint64_t bytes = pair.received() + result.msgs_ * static_cast<uint64_t>(size);
+        auto sta = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < result.msgs_; i++)
+        {
+            pair.send(payload.data(), size);
+        }
+        while (pair.received() < bytes)
+        {
+            if (elapsed_sec(sta) > 60.0)
+            {
+                LOG_DEBUG("ERR! recv timeout\n");
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        double sec = elapsed_sec(sta);
+        result.mbps_ = static_cast<double>(result.msgs_ * static_cast<uint64_t>(size)) / (1024.0 * 1024.0) / sec;
+        result.msgps_ = static_cast<double>(result.msgs_) / sec;
+        return result;
+    }
+
+    // payloadを1つずつ送って送り返されるのを待ち、warmup回の後の往復時間をhistogramに記録する
+    // 戻り値は計測した回数の経過時間[sec]
+    template <typename Pair>
+    static double measure_pingpong(Pair &pair, const std::vector<char> &payload, const uint64_t count, const uint64_t warmup,
+                                   LatencyHistogram &histogram)
+    {
+        const int32_t size = static_cast<int32_t>(payload.size());
+        const uint64_t base = pair.pong_.count();
+        auto begin = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < warmup + count; i++)
+        {
+            if (i == warmup)
+            {
+                begin = std::chrono::steady_clock::now();
+            }
+            auto sta = std::chrono::steady_clock::now();
+            pair.send(payload.data(), size);
+            if (!pair.pong_.wait(base + i + 1))
+            {
+                LOG_DEBUG("ERR! pong timeout\n");
+                break;
+            }
+            if (i >= warmup)
+            {
+                histogram.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                           std::chrono::steady_clock::now() - sta)
+                                                           .count()));
+            }
+        }
+        return elapsed_sec(begin);
+    }
+
+    // ビルド時に選択したバックエンド(-DSOCKET_BACKEND=epoll/uring)のループバックでの
+    // 非同期送信のスループットと、1メッセージの往復時間を計測する
+    // バックエンドごとにビルドしたベンチマークの結果を並べて比較する
+    static void bench_backend()
+    {
+        Logger::init();
+        const char *backend = Socket::backend();
+
+        {
+            EchoPair pair(false);
+            pair.setAsyncSend(true);
+            pair.start("127.0.0.1");
+
+            const int32_t sizes[] = {64, 4 * 1024, 64 * 1024};
+            const uint64_t totalBytes = 64ULL * 1024 * 1024;
+            LOG_RESULT("[backend] %8s %10s %8s %10s %12s\n", "backend", "size", "msgs", "MB/s", "msg/s");
+            for (const int32_t size : sizes)
+            {
+                std::vector<char> payload(static_cast<size_t>(size), 'x');
+                Throughput result = measure_throughput(pair, payload, totalBytes);
+                LOG_RESULT("[backend] %8s %10d %8llu %10.1f %12.0f\n",
+                          backend, size, static_cast<unsigned long long>(result.msgs_), result.mbps_, result.msgps_);
+            }
+        }
+
+        {
+            EchoPair pair(true);
+            pair.start("127.0.0.1");
+
+            const int32_t size = 64;
+            std::vector<char> payload(static_cast<size_t>(size), 'x');
+            LatencyHistogram histogram;
+            (void)measure_pingpong(pair, payload, 20000, 0, histogram);
+            if (histogram.count() > 0)
+            {
+                LOG_RESULT("[backend] %8s %10s %8s %10s %10s %10s\n", "backend", "size", "msgs", "p50_us", "p99_us", "max_us");
+                LOG_RESULT("[backend] %8s %10d %8llu %10.1f %10.1f %10.1f\n",
+                          backend, size, static_cast<unsigned long long>(histogram.count()),
+                          histogram.percentileUs(50.0), histogram.percentileUs(99.0), histogram.maxUs());
+            }
+        }
+
+        Logger::deinit();
+    }
+
+    // クライアント側で受信したバイト数を数える
+    class CountReciever : public Client::Reciever
+    {
+        std::atomic<uint64_t> bytes_;
+
+    public:
+        CountReciever() : bytes_(0)
+        {
+        }
+
+        void recieveData(const int64_t, const char *, const int32_t size) override
+        {
+            bytes_ += static_cast<uint64_t>(size);
+        }
+
+        uint64_t bytes() const
+        {
+            return bytes_;
+        }
+    };
+
+    // 最初に受信した接続IDを記録する
+    class IdReciever : public Server::Reciever
+    {
+        std::atomic<int64_t> id_;
+
+    public:
+        IdReciever() : id_(0)
+        {
+        }
+
+        void recieveData(const int64_t id, const char *, const int32_t) override
+        {
+            id_ = id;
+        }
+
+        int64_t id() const
+        {
+            return id_;
+        }
+    };
+
+    // 小さなメッセージの連続送信で、送信方式ごとの秒間メッセージ数と送信側のCPU時間を計測する
+    // sync:1メッセージごとに書き込む async:リアクタが送信キューを書き込む coalesce:窓と上限バイト数で集約して書き込む
+    // 送信側のCPU時間は、送信スレッドとサーバのイベントループスレッドの合計
+    static void bench_coalesce()
+    {
+        Logger::init();
+        const int32_t sizes[] = {64, 256, 1024, 4096};
+        const uint64_t totalBytes = 64ULL * 1024 * 1024;
+        const uint64_t maxCount = 200000;
+        const char *names[] = {"sync", "async", "coalesce"};
+        LOG_RESULT("[coalesce] %8s %10s %8s %12s %10s %14s\n", "size", "method", "msgs", "msg/s", "MB/s", "send_cpu_ns/msg");
+        for (const int32_t size : sizes)
+        {
+            std::vector<char> payload(static_cast<size_t>(size), 'x');
+            uint64_t count = totalBytes / static_cast<uint64_t>(size);
+            count = (count < maxCount) ? count : maxCount;
+            for (int32_t method = 0; method < 3; method++)
+            {
+                Server server(0);
+                IdReciever idReciever;
+                if (method == 1)
+                {
+                    server.setAsyncSend(true);
+                }
+                else if (method == 2)
+                {
+                    server.setCoalesce(200, 64 * 1024);
+                }
+                server.start(&idReciever);
+                Client client(0);
+                CountReciever reciever;
+                client.start(&reciever);
+                if (!wait_connect(client))
+                {
+                    LOG_DEBUG("ERR! client connect\n");
+                }
+                // サーバが接続IDを知るために1回送信する
+                (void)client.sendData(payload.data(), 1);
+                auto idSta = std::chrono::steady_clock::now();
+                while ((idReciever.id() == 0) && (elapsed_sec(idSta) < 10.0))
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                const int64_t id = idReciever.id();
+
+                uint64_t loopCpuUs = server.getLoopStats()[0].cpuTimeUs_;
+                double cpu = thread_cpu_sec();
+                auto sta = std::chrono::steady_clock::now();
+                for (uint64_t i = 0; i < count; i++)
+                {
+                    if (server.sendData(id, payload.data(), size) == 1)
+                    {
+                        while (!server.isWritable(id))
+                        {
+                            std::this_thread::sleep_for(std::chrono::microseconds(50));
+                        }
+                    }
+                }
+                if (method == 2)
+                {
+                    // 最後に溜まった分は窓の期限を待たずに書き込む
+                    (void)server.flush(id);
+                }
+                cpu = thread_cpu_sec() - cpu;
+                auto waitSta = std::chrono::steady_clock::now();
+                while ((reciever.bytes() < count * static_cast<uint64_t>(size)) && (elapsed_sec(waitSta) < 60.0))
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+                double sec = elapsed_sec(sta);
+                loopCpuUs = server.getLoopStats()[0].cpuTimeUs_ - loopCpuUs;
+                double sendCpu = cpu + static_cast<double>(loopCpuUs) / 1e6;
+                LOG_RESULT("[coalesce] %8d %10s %8llu %12.0f %10.1f %14.0f\n",
+                          size, names[method], static_cast<unsigned long long>(count),
+                          static_cast<double>(count) / sec,
+                          static_cast<double>(count * static_cast<uint64_t>(size)) / (1024.0 * 1024.0) / sec,
+                          sendCpu * 1e9 / static_cast<double>(count));
+                client.end();
+                server.end();
+            }
+        }
+        Logger::deinit();
+    }
+    // 圧縮の計測用データ(kind 0:JSON風のテキスト 1:波形 2:乱数)
+    static std::vector<char> make_payload(const int32_t kind, const size_t size)
+    {
+        std::vector<char> data(size);
+        uint32_t x = 2463534242U;
+        size_t pos = 0;
+        int32_t n = 0;
+        while (pos < size)
+        {
+            char line[128];
+            int32_t len = 0;
+            if (kind == 0)
+            {
+                len = std::snprintf(line, sizeof(line), "{\"id\":%d,\"name\":\"user%d\",\"score\":%d,\"active\":%s}\n",
+                                    n, n % 1000, (n * 37) % 10000, (n % 3 == 0) ? "true" : "false");
+            }
+            else
+            {
+                for (len = 0; len < 64; len++)
+                {
+                    x ^= x << 13;
+                    x ^= x >> 17;
+                    x ^= x << 5;
+                    // 波形は32サンプル周期に小さな揺らぎを加える
+                    line[len] = (kind == 1) ? static_cast<char>((((n * 64 + len) % 32) * 8) + static_cast<int32_t>(x & 1)) : static_cast<char>(x);
+                }
+            }
+            size_t copy = std::min(static_cast<size_t>(len), size - pos);
+            std::memcpy(data.data() + pos, line, copy);
+            pos += copy;
+            n++;
+        }
+        return data;
+    }
+
+    // 圧縮・伸長の速度と圧縮率、およびループバックで1MBのメッセージを往復させた時の秒間メッセージ数を計測する
+    // (乱数は圧縮率が悪いため圧縮せずに送られ、圧縮を試した分だけが余計にかかる)
+    static void bench_compress()
+    {
+        Logger::init();
+        const char *kinds[] = {"text", "wave", "noise"};
+        const int32_t size = 1024 * 1024;
+        LOG_RESULT("[compress] %8s %10s %8s %12s %12s\n", "data", "size", "ratio", "pack_MB/s", "unpack_MB/s");
+        for (int32_t kind = 0; kind < 3; kind++)
+        {
+            std::vector<char> payload = make_payload(kind, static_cast<size_t>(size));
+            const int32_t loop = 50;
+            Buffer packed;
+            bool compressed = false;
+            auto sta = std::chrono::steady_clock::now();
+            for (int32_t i = 0; i < loop; i++)
+            {
+                compressed = Compressor::pack(payload.data(), size, packed);
+            }
+            double packSec = elapsed_sec(sta);
+            double unpackSec = 0.0;
+            if (compressed)
+            {
+                Buffer unpacked;
+                sta = std::chrono::steady_clock::now();
+                for (int32_t i = 0; i < loop; i++)
+                {
+                    (void)Compressor::unpack(packed, unpacked);
+                }
+                unpackSec = elapsed_sec(sta);
+            }
+            double mb = static_cast<double>(size) * loop / (1024.0 * 1024.0);
+            LOG_RESULT("[compress] %8s %10d %8.3f %12.1f %12.1f\n", kinds[kind], size,
+                      compressed ? static_cast<double>(packed.size()) / size : 1.0, mb / packSec, compressed ? mb / unpackSec : 0.0);
+        }
+
+        LOG_RESULT("[compress] %8s %10s %8s %12s %12s\n", "data", "size", "method", "msgs", "msg/s");
+        for (int32_t kind = 0; kind < 3; kind++)
+        {
+            std::vector<char> payload = make_payload(kind, static_cast<size_t>(size));
+            for (int32_t method = 0; method < 2; method++)
+            {
+                EchoPair pair(true);
+                if (method == 1)
+                {
+                    pair.setCompression(1024);
+                }
+                pair.start("127.0.0.1");
+                // 最初の往復で互いに圧縮フレームを受信できることを知る
+                pair.send(payload.data(), 1);
+                (void)pair.pong_.wait(1);
+
+                const uint64_t count = 200;
+                LatencyHistogram histogram;
+                double sec = measure_pingpong(pair, payload, count, 0, histogram);
+                LOG_RESULT("[compress] %8s %10d %8s %12llu %12.1f\n", kinds[kind], size, (method == 1) ? "lz" : "raw",
+                          static_cast<unsigned long long>(histogram.count()), static_cast<double>(histogram.count()) / sec);
+            }
+        }
+        Logger::deinit();
+    }
+    // RPCの要求をそのまま応答として返す
+    class RpcEcho : public Server::Reciever
+    {
+        Server *server_ = nullptr;
+
+    public:
+        explicit RpcEcho(Server *server) : server_(server)
+        {
+        }
+
+        void recieveData(const int64_t, const char *, const int32_t) override
+        {
+        }
+
+        void recieveRequest(const int64_t id, const uint32_t requestId, const char *data, const int32_t size) override
+        {
+            (void)server_->reply(id, requestId, data, size);
+        }
+    };
+
+    // 1つの接続で同時に応答待ちにする要求数(depth)ごとの秒間呼び出し数と応答時間を計測する
+    // depth=1は1往復ずつ応答を待つ従来の使い方に相当する
+    static void bench_rpc()
+    {
+        Logger::init();
+        Server server(0);
+        RpcEcho echo(&server);
+        server.setNonBlocking(true);
+        server.start(&echo);
+        Client client(0);
+        client.setNonBlocking(true);
+        client.start(nullptr);
+        if (!wait_connect(client))
+        {
+            LOG_DEBUG("ERR! client connect\n");
+        }
+
+        const int32_t depths[] = {1, 4, 16, 64};
+        const int32_t size = 64;
+        const uint64_t count = 20000;
+        std::vector<char> payload(static_cast<size_t>(size), 'x');
+        LOG_RESULT("[rpc] %8s %8s %8s %12s %10s %10s\n", "depth", "size", "calls", "calls/s", "p50_us", "p99_us");
+        for (const int32_t depth : depths)
+        {
+            std::mutex mtx;
+            std::condition_variable cv;
+            int32_t inflight = 0;
+            uint64_t failed = 0;
+            LatencyHistogram histogram;
+            auto sta = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < count; i++)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [&]
+                            { return inflight < depth; });
+                    inflight++;
+                }
+                auto callSta = std::chrono::steady_clock::now();
+                (void)client.call(payload.data(), size, 5000, [&, callSta](CallResult &result)
+                                  {
+                                      auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                      std::chrono::steady_clock::now() - callSta)
+                                                      .count();
+                                      std::lock_guard<std::mutex> lock(mtx);
+                                      if (result.status_ == CallResult::Status::OK)
+                                      {
+                                          histogram.record(static_cast<uint64_t>(nsec));
+                                      }
+                                      else
+                                      {
+                                          failed++;
+                                      }
+                                      inflight--;
+                                      cv.notify_all(); });
+            }
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&]
+                        { return inflight == 0; });
+            }
+            double sec = elapsed_sec(sta);
+            if (failed > 0)
+            {
+                LOG_DEBUG("ERR! rpc failed:%llu\n", static_cast<unsigned long long>(failed));
+            }
+            if (histogram.count() > 0)
+            {
+                LOG_RESULT("[rpc] %8d %8d %8llu %12.0f %10.1f %10.1f\n", depth, size, static_cast<unsigned long long>(count),
+                          static_cast<double>(count) / sec, histogram.percentileUs(50.0), histogram.percentileUs(99.0));
+            }
+        }
+        client.end();
+        server.end();
+        Logger::deinit();
+    }
+    // 同一ホストでのループバックTCPとAF_UNIXのストリームソケットで
+    // 非同期送信のスループットと、1メッセージの往復時間を比較する
+    static void bench_uds()
+    {
+        Logger::init();
+        const char *names[] = {"tcp", "unix"};
+        const std::string addresses[] = {"127.0.0.1", "unix:@MySocketBench"};
+
+        LOG_RESULT("[uds] %8s %10s %8s %10s %12s\n", "transport", "size", "msgs", "MB/s", "msg/s");
+        for (int32_t t = 0; t < 2; t++)
+        {
+            EchoPair pair(false);
+            pair.setAsyncSend(true);
+            pair.start(addresses[t]);
+
+            const int32_t sizes[] = {64, 4 * 1024, 64 * 1024};
+            const uint64_t totalBytes = 64ULL * 1024 * 1024;
+            for (const int32_t size : sizes)
+            {
+                std::vector<char> payload(static_cast<size_t>(size), 'x');
+                Throughput result = measure_throughput(pair, payload, totalBytes);
+                LOG_RESULT("[uds] %8s %10d %8llu %10.1f %12.0f\n",
+                          names[t], size, static_cast<unsigned long long>(result.msgs_), result.mbps_, result.msgps_);
+            }
+        }
+
+        LOG_RESULT("[uds] %8s %10s %8s %10s %10s %10s\n", "transport", "size", "msgs", "p50_us", "p99_us", "max_us");
+        for (int32_t t = 0; t < 2; t++)
+        {
+            EchoPair pair(true);
+            pair.start(addresses[t]);
+
+            const int32_t size = 64;
+            std::vector<char> payload(static_cast<size_t>(size), 'x');
+            LatencyHistogram histogram;
+            (void)measure_pingpong(pair, payload, 20000, 0, histogram);
+            if (histogram.count() > 0)
+            {
+                LOG_RESULT("[uds] %8s %10d %8llu %10.1f %10.1f %10.1f\n",
+                          names[t], size, static_cast<unsigned long long>(histogram.count()),
+                          histogram.percentileUs(50.0), histogram.percentileUs(99.0), histogram.maxUs());
+            }
+        }
+
+        Logger::deinit();
+    }
+
+    // 共有メモリのリングで受信したデータを数え、必要なら送り返す
+    class ShmEchoReciever : public Server::Reciever
+    {
+        ShmServer *server_ = nullptr;
+        bool echo_ = false;
+        std::atomic<uint64_t> bytes_;
+
+    public:
+        ShmEchoReciever(ShmServer *server, bool echo) : server_(server), echo_(echo), bytes_(0)
+        {
+        }
+
+        void recieveData(const int64_t id, const char *data, const int32_t size) override
+        {
+            bytes_ += static_cast<uint64_t>(size);
+            if (echo_)
+            {
+                (void)server_->sendData(id, data, size);
+            }
+        }
+
+        uint64_t bytes() const
+        {
+            return bytes_;
+        }
+    };
+
+    // 共有メモリのリングで接続したServerとClient(EchoPairと同じ使い方で計測する)
+    class ShmPair
+    {
+    public:
+        ShmServer server_;
+        ShmEchoReciever reciever_;
+        ShmClient client_;
+        PongReciever pong_;
+
+    public:
+        explicit ShmPair(const bool echo) : server_(0), reciever_(&server_, echo), client_(0)
+        {
+        }
+
+        ~ShmPair()
+        {
+            client_.end();
+            server_.end();
+        }
+
+        void start(const std::string &name)
+        {
+            server_.setName(name);
+            (void)server_.start(&reciever_);
+            client_.setName(name);
+            client_.start(&pong_);
+            auto sta = std::chrono::steady_clock::now();
+            while (!client_.isConnected() && (elapsed_sec(sta) < 10.0))
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+
+        // リングが一杯の間は送信側が待つ
+        void send(const char *data, const int32_t size)
+        {
+            (void)client_.sendData(data, size);
+        }
+
+        uint64_t received() const
+        {
+            return reciever_.bytes();
+        }
+    };
+
+    // 同じホストのプロセス間通信として、AF_UNIXソケットと共有メモリのリングの
+    // スループットと1メッセージの往復時間を比較する
+    static void bench_shm()
+    {
+        Logger::init();
+        const int32_t sizes[] = {64, 4 * 1024, 64 * 1024};
+        const uint64_t totalBytes = 64ULL * 1024 * 1024;
+
+        LOG_RESULT("[shm] %8s %10s %8s %10s %12s\n", "transport", "size", "msgs", "MB/s", "msg/s");
+        {
+            EchoPair pair(false);
+            pair.setAsyncSend(true);
+            pair.start("unix:@MySocketBench");
+            for (const int32_t size : sizes)
+            {
+                std::vector<char> payload(static_cast<size_t>(size), 'x');
+                Throughput result = measure_throughput(pair, payload, totalBytes);
+                LOG_RESULT("[shm] %8s %10d %8llu %10.1f %12.0f\n",
+                          "unix", size, static_cast<unsigned long long>(result.msgs_), result.mbps_, result.msgps_);
+            }
+        }
+        {
+            ShmPair pair(false);
+            pair.start("MySocketBench");
+            for (const int32_t size : sizes)
+            {
+                std::vector<char> payload(static_cast<size_t>(size), 'x');
+                Throughput result = measure_throughput(pair, payload, totalBytes);
+                LOG_RESULT("[shm] %8s %10d %8llu %10.1f %12.0f\n",
+                          "shm", size, static_cast<unsigned long long>(result.msgs_), result.mbps_, result.msgps_);
+            }
+        }
+
+        LOG_RESULT("[shm] %8s %10s %8s %10s %10s %10s\n", "transport", "size", "msgs", "p50_us", "p99_us", "max_us");
+        const int32_t size = 64;
+        const uint64_t count = 20000;
+        std::vector<char> payload(static_cast<size_t>(size), 'x');
+        for (int32_t t = 0; t < 2; t++)
+        {
+            LatencyHistogram histogram;
+            if (t == 0)
+            {
+                EchoPair pair(true);
+                pair.start("unix:@MySocketBench");
+                (void)measure_pingpong(pair, payload, count, 0, histogram);
+            }
+            else
+            {
+                ShmPair pair(true);
+                pair.start("MySocketBench");
+                (void)measure_pingpong(pair, payload, count, 0, histogram);
+            }
+            if (histogram.count() > 0)
+            {
+                LOG_RESULT("[shm] %8s %10d %8llu %10.1f %10.1f %10.1f\n",
+                          (t == 0) ? "unix" : "shm", size, static_cast<unsigned long long>(histogram.count()),
+                          histogram.percentileUs(50.0), histogram.percentileUs(99.0), histogram.maxUs());
+            }
+        }
+
+        Logger::deinit();
+    }
+
+    // 接続と切断を繰り返し、1秒あたりに受け付けた接続数と受付の統計を計測する
+    // burst数の接続をノンブロッキングで一度に張ってから全て閉じる
+    // 受付待ちキューが短いとSYNが捨てられて再送を待つため、1秒以内に確立しなかった接続は失敗として数える
+    static void bench_churn()
+    {
+        Logger::init();
+        LOG_RESULT("[churn] %8s %6s %8s %10s %8s %10s %8s %8s %10s %10s\n",
+                   "backlog", "burst", "conns", "conn/s", "batches", "avg_batch", "max", "failed", "overflows", "drops");
+        const int32_t backlogs[] = {1, 0};
+        const int32_t bursts[] = {1, 256};
+        struct sockaddr_in sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(BENCH_PORT);
+        (void)::inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+        for (const int32_t backlog : backlogs)
+        {
+            for (const int32_t burst : bursts)
+            {
+                Server server(0);
+                EchoReciever reciever(&server, false);
+                server.setAddress("127.0.0.1", BENCH_PORT);
+                server.setBacklog(backlog);
+                server.start(&reciever);
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+                const uint64_t total = (burst == 1) ? 2000 : 1024;
+                const AcceptStat base = server.getAcceptStat();
+                std::vector<SOCKET> socks;
+                socks.reserve(static_cast<size_t>(burst));
+                std::vector<struct pollfd> pending;
+                uint64_t attempts = 0;
+                uint64_t conns = 0;
+                uint64_t failed = 0;
+                auto sta = std::chrono::steady_clock::now();
+                while (attempts < total)
+                {
+                    for (int32_t n = 0; n < burst; n++)
+                    {
+                        SOCKET sock = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                        socks.emplace_back(sock);
+                        if (::connect(sock, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) == 0)
+                        {
+                            conns++;
+                            continue;
+                        }
+                        struct pollfd pfd;
+                        pfd.fd = sock;
+                        pfd.events = POLLOUT;
+                        pfd.revents = 0;
+                        pending.emplace_back(pfd);
+                    }
+                    attempts += static_cast<uint64_t>(burst);
+                    // 接続の確立を待つ
+                    auto wait = std::chrono::steady_clock::now();
+                    while (!pending.empty() && (elapsed_sec(wait) < 1.0))
+                    {
+                        if (::poll(pending.data(), pending.size(), 10) <= 0)
+                        {
+                            continue;
+                        }
+                        for (size_t n = 0; n < pending.size();)
+                        {
+                            if (pending[n].revents == 0)
+                            {
+                                n++;
+                                continue;
+                            }
+                            int32_t err = 0;
+                            socklen_t len = sizeof(err);
+                            (void)::getsockopt(pending[n].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                            conns += (err == 0) ? 1 : 0;
+                            failed += (err == 0) ? 0 : 1;
+                            pending[n] = pending.back();
+                            pending.pop_back();
+                        }
+                    }
+                    failed += pending.size();
+                    pending.clear();
+                    // 全ての接続が受け付けられるのを待つ
+                    wait = std::chrono::steady_clock::now();
+                    while ((server.getAcceptStat().accepted_ < base.accepted_ + conns) && (elapsed_sec(wait) < 1.0))
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds(50));
+                    }
+                    for (SOCKET sock : socks)
+                    {
+                        // TIME_WAITを残さないようRSTで閉じる
+                        struct linger lg;
+                        lg.l_onoff = 1;
+                        lg.l_linger = 0;
+                        (void)::setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                        ::close(sock);
+                    }
+                    socks.clear();
+                }
+                double sec = elapsed_sec(sta);
+                AcceptStat stat = server.getAcceptStat();
+                uint64_t batches = stat.batches_ - base.batches_;
+                LOG_RESULT("[churn] %8d %6d %8llu %10.0f %8llu %10.1f %8llu %8llu %10llu %10llu\n",
+                           backlog, burst, static_cast<unsigned long long>(conns), static_cast<double>(conns) / sec,
+                           static_cast<unsigned long long>(batches),
+                           (batches > 0) ? static_cast<double>(stat.accepted_ - base.accepted_) / static_cast<double>(batches) : 0.0,
+                           static_cast<unsigned long long>(stat.maxBatch_), static_cast<unsigned long long>(failed),
+                           static_cast<unsigned long long>(stat.listenOverflows_ - base.listenOverflows_),
+                           static_cast<unsigned long long>(stat.listenDrops_ - base.listenDrops_));
+                server.end();
+            }
+        }
+        Logger::deinit();
+    }
+
+    // プロセスの常駐メモリ[KB]とスレッド数(/proc/self/status)
+    static void process_usage(int64_t &rssKb, int32_t &threads)
+    {
+        rssKb = 0;
+        threads = 0;
+        FILE *fp = std::fopen("/proc/self/status", "r");
+        if (fp == nullptr)
+        {
+            return;
+        }
+        char line[256];
+        while (std::fgets(line, sizeof(line), fp) != nullptr)
+        {
+            long long value = 0;
+            if (std::sscanf(line, "VmRSS: %lld", &value) == 1)
+            {
+                rssKb = value;
+            }
+            else if (std::sscanf(line, "Threads: %lld", &value) == 1)
+            {
+                threads = static_cast<int32_t>(value);
+            }
+        }
+        std::fclose(fp);
+    }
+
+    // 多数のClientを、Clientごとのスレッドで動かす場合とClientLoopで多重化する場合で
+    // 全Clientが接続するまでの時間・Clientあたりの常駐メモリとスレッド数・全Clientが1往復する時間を比較する
+    static void bench_clientloop()
+    {
+        Logger::init();
+        static constexpr int32_t CLIENT_NUM = 500;
+        LOG_RESULT("[clientloop] %8s %8s %10s %12s %10s %12s\n", "mode", "clients", "connect_ms", "rss_kb/conn", "threads", "roundtrip_ms");
+        for (int32_t t = 0; t < 2; t++)
+        {
+            Server server(0);
+            EchoReciever reciever(&server, true);
+            server.setAddress("127.0.0.1", BENCH_PORT);
+            server.start(&reciever);
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+            ClientLoop loop(0);
+            if (t == 1)
+            {
+                (void)loop.start();
+            }
+            int64_t baseRss = 0;
+            int32_t baseThreads = 0;
+            process_usage(baseRss, baseThreads);
+
+            std::vector<std::unique_ptr<PongReciever>> pongs;
+            std::vector<std::unique_ptr<Client>> clients;
+            auto sta = std::chrono::steady_clock::now();
+            for (int32_t i = 0; i < CLIENT_NUM; i++)
+            {
+                pongs.emplace_back(new PongReciever());
+                clients.emplace_back(new Client(0));
+                clients.back()->setAddress("127.0.0.1", BENCH_PORT);
+                clients.back()->setNonBlocking(true);
+                if (t == 1)
+                {
+                    clients.back()->setLoop(&loop);
+                }
+                clients.back()->start(pongs.back().get());
+            }
+            for (auto &client : clients)
+            {
+                if (!wait_connect(*client))
+                {
+                    LOG_DEBUG("ERR! client connect\n");
+                }
+            }
+            double connectMs = elapsed_sec(sta) * 1e3;
+            int64_t rss = 0;
+            int32_t threads = 0;
+            process_usage(rss, threads);
+
+            // 全Clientが1メッセージずつ送り、全ての応答が届くまで
+            const int32_t size = 64;
+            std::vector<char> payload(static_cast<size_t>(size), 'x');
+            sta = std::chrono::steady_clock::now();
+            for (auto &client : clients)
+            {
+                (void)client->sendData(payload.data(), size);
+            }
+            for (auto &pong : pongs)
+            {
+                if (!pong->wait(1))
+                {
+                    LOG_DEBUG("ERR! pong timeout\n");
+                }
+            }
+            double roundtripMs = elapsed_sec(sta) * 1e3;
+            LOG_RESULT("[clientloop] %8s %8d %10.1f %12.1f %10d %12.2f\n",
+                       (t == 0) ? "thread" : "loop", CLIENT_NUM, connectMs,
+                       static_cast<double>(rss - baseRss) / CLIENT_NUM, threads - baseThreads, roundtripMs);
+
+            // Clientごとのスレッドはイベント待ちのタイムアウトまで終了しないため、並行して終了させる
+            std::vector<std::thread> enders;
+            for (auto &client : clients)
+            {
+                Client *target = client.get();
+                enders.emplace_back([target]()
+                                    { target->end(); });
+            }
+            for (auto &th : enders)
+            {
+                th.join();
+            }
+            loop.end();
+            server.end();
+        }
+        Logger::deinit();
+    }
+
+    // 接続ソケットのオプションのプリセットごとに、ループバックでの往復時間と連続送信の転送量を計測する
+    // SocketOptions::lowLatency()/bulkThroughput()の値を変える場合は、この結果で既定値より悪くならないことを確かめる
+    // 計測のばらつきを均すため、プリセットを入れ替えながら繰り返し、各回の値の中央値を出す
+    static void bench_options()
+    {
+        Logger::init();
+        static constexpr int32_t PRESET_NUM = 3;
+        static constexpr int32_t ROUNDS = 5;
+        const char *names[PRESET_NUM] = {"default", "latency", "bulk"};
+        const SocketOptions presets[PRESET_NUM] = {SocketOptions(), SocketOptions::lowLatency(), SocketOptions::bulkThroughput()};
+        auto median = [](std::vector<double> values)
+        {
+            std::sort(values.begin(), values.end());
+            return values.empty() ? 0.0 : values[values.size() / 2];
+        };
+
+        // 小さなフレームと、複数セグメントに分かれる大きなフレームの往復
+        const int32_t pingSizes[] = {64, 256 * 1024};
+        const uint64_t pingCounts[] = {5000, 500};
+        std::vector<double> p50s[PRESET_NUM][2];
+        std::vector<double> p99s[PRESET_NUM][2];
+        for (int32_t r = 0; r < ROUNDS; r++)
+        {
+            for (int32_t t = 0; t < PRESET_NUM; t++)
+            {
+                EchoPair pair(true);
+                pair.setOptions(presets[t]);
+                pair.start("127.0.0.1");
+                for (int32_t s = 0; s < 2; s++)
+                {
+                    std::vector<char> payload(static_cast<size_t>(pingSizes[s]), 'x');
+                    LatencyHistogram histogram;
+                    (void)measure_pingpong(pair, payload, pingCounts[s], 0, histogram);
+                    if (histogram.count() > 0)
+                    {
+                        p50s[t][s].emplace_back(histogram.percentileUs(50.0));
+                        p99s[t][s].emplace_back(histogram.percentileUs(99.0));
+                    }
+                }
+            }
+        }
+        LOG_RESULT("[options] %8s %10s %8s %10s %10s\n", "preset", "size", "rounds", "p50_us", "p99_us");
+        for (int32_t t = 0; t < PRESET_NUM; t++)
+        {
+            for (int32_t s = 0; s < 2; s++)
+            {
+                LOG_RESULT("[options] %8s %10d %8d %10.1f %10.1f\n", names[t], pingSizes[s], ROUNDS, median(p50s[t][s]), median(p99s[t][s]));
+            }
+        }
+
+        const int32_t bulkSizes[] = {4 * 1024, 64 * 1024, 1024 * 1024};
+        const uint64_t totalBytes = 256ULL * 1024 * 1024;
+        std::vector<double> mbps[PRESET_NUM][3];
+        for (int32_t r = 0; r < ROUNDS; r++)
+        {
+            for (int32_t t = 0; t < PRESET_NUM; t++)
+            {
+                EchoPair pair(false);
+                pair.setAsyncSend(true);
+                pair.setOptions(presets[t]);
+                pair.start("127.0.0.1");
+                for (int32_t s = 0; s < 3; s++)
+                {
+                    std::vector<char> payload(static_cast<size_t>(bulkSizes[s]), 'x');
+                    mbps[t][s].emplace_back(measure_throughput(pair, payload, totalBytes).mbps_);
+                }
+            }
+        }
+        LOG_RESULT("[options] %8s %10s %8s %10s\n", "preset", "size", "rounds", "MB/s");
+        for (int32_t t = 0; t < PRESET_NUM; t++)
+        {
+            for (int32_t s = 0; s < 3; s++)
+            {
+                LOG_RESULT("[options] %8s %10d %8d %10.1f\n", names[t], bulkSizes[s], ROUNDS, median(mbps[t][s]));
+            }
+        }
+
+        Logger::deinit();
+    }
+    // ベンチマークの引数(key=value)
+    // 各ベンチマークは受け付けるキーを指定し、それ以外のキーはエラーにする
+    class BenchArgs
+    {
+        std::map<std::string, std::string> values_;
+
+    public:
+        bool parse(int32_t argc, char *argv[], const std::vector<std::string> &keys)
+        {
+            for (int32_t i = 2; i < argc; i++)
+            {
+                std::string arg = argv[i];
+                size_t pos = arg.find('=');
+                std::string key = arg.substr(0, pos);
+                if ((pos == std::string::npos) || (std::find(keys.begin(), keys.end(), key) == keys.end()))
+                {
+                    LOG_DEBUG("ERR! unknown argument %s\n", arg.c_str());
+                    return false;
+                }
+                values_[key] = arg.substr(pos + 1);
+            }
+            return true;
+        }
+
+        uint64_t number(const std::string &key, const uint64_t value) const
+        {
+            auto it = values_.find(key);
+            return (it == values_.end()) ? value : std::strtoull(it->second.c_str(), nullptr, 10);
+        }
+
+        std::string text(const std::string &key, const std::string &value) const
+        {
+            auto it = values_.find(key);
+            return (it == values_.end()) ? value : it->second;
+        }
+
+        // カンマ区切りの数値の並び
+        std::vector<uint64_t> numbers(const std::string &key, const std::vector<uint64_t> &value) const
+        {
+            auto it = values_.find(key);
+            if (it == values_.end())
+            {
+                return value;
+            }
+            std::vector<uint64_t> list;
+            size_t sta = 0;
+            while (sta <= it->second.size())
+            {
+                size_t end = it->second.find(',', sta);
+                end = (end == std::string::npos) ? it->second.size() : end;
+                list.emplace_back(std::strtoull(it->second.substr(sta, end - sta).c_str(), nullptr, 10));
+                sta = end + 1;
+            }
+            return list;
+        }
+
+        // 出力形式(textは表、csv/jsonは回帰の追跡用に1計測を1行で出す)
+        static bool isFormat(const std::string &format)
+        {
+            return (format == "text") || (format == "csv") || (format == "json");
+        }
+    };
+
+    // ServerとClientの間で1メッセージずつ往復させ、要求から応答までの時間の分布を計測する
+    // 引数はkey=valueで指定する(例: MySocketBench latency count=100000 size=64 warmup=1000 format=csv)
+    //   count   計測する往復回数
+    //   size    ペイロードのバイト数
+    //   warmup  計測前に捨てる往復回数(接続直後の割り当てやキャッシュの影響を除く)
+    //   format  text/csv/json(csv/jsonは回帰の追跡用に1計測を1行で出す)
+    static void bench_latency(int32_t argc, char *argv[])
+    {
+        BenchArgs args;
+        if (!args.parse(argc, argv, {"count", "size", "warmup", "format"}))
+        {
+            return;
+        }
+        const uint64_t count = args.number("count", 100000);
+        const int32_t size = static_cast<int32_t>(args.number("size", 64));
+        const uint64_t warmup = args.number("warmup", 1000);
+        const std::string format = args.text("format", "text");
+        if ((count == 0) || (size <= 0) || !BenchArgs::isFormat(format))
+        {
+            LOG_DEBUG("ERR! count:%llu size:%d format:%s\n", static_cast<unsigned long long>(count), size, format.c_str());
+            return;
+        }
+
+        Logger::init();
+        const char *backend = Socket::backend();
+        LatencyHistogram histogram;
+        {
+            EchoPair pair(true);
+            pair.start("127.0.0.1");
+            std::vector<char> payload(static_cast<size_t>(size), 'x');
+            (void)measure_pingpong(pair, payload, count, warmup, histogram);
+        }
+        Logger::deinit();
+
+        const unsigned long long measured = static_cast<unsigned long long>(histogram.count());
+        const unsigned long long warmed = static_cast<unsigned long long>(warmup);
+        if (format == "csv")
+        {
+            LOG_RESULT("backend,size,count,warmup,min_us,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+            LOG_RESULT("%s,%d,%llu,%llu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                       backend, size, measured, warmed, histogram.minUs(), histogram.meanUs(), histogram.percentileUs(50.0),
+                       histogram.percentileUs(90.0), histogram.percentileUs(99.0), histogram.percentileUs(99.9), histogram.maxUs());
+        }
+        else if (format == "json")
+        {
+            LOG_RESULT("{\"backend\":\"%s\",\"size\":%d,\"count\":%llu,\"warmup\":%llu,\"min_us\":%.3f,\"mean_us\":%.3f,"
+                       "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+                       backend, size, measured, warmed, histogram.minUs(), histogram.meanUs(), histogram.percentileUs(50.0),
+                       histogram.percentileUs(90.0), histogram.percentileUs(99.0), histogram.percentileUs(99.9), histogram.maxUs());
+        }
+        else
+        {
+            LOG_RESULT("[latency] %8s %10s %8s %10s %10s %10s %10s %10s\n", "backend", "size", "msgs", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+            LOG_RESULT("[latency] %8s %10d %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                       backend, size, measured, histogram.percentileUs(50.0), histogram.percentileUs(90.0),
+                       histogram.percentileUs(99.0), histogram.percentileUs(99.9), histogram.maxUs());
+        }
+    }
+
+    // メッセージサイズと接続数ごとに、ServerとClientの間の連続送信の転送量を計測する
+    // 引数はkey=valueで指定する(例: MySocketBench throughput sizes=64,4096 conns=1,100 mode=echo format=csv)
+    //   sizes   メッセージのバイト数(カンマ区切り)
+    //   conns   接続数(カンマ区切り、ClientはClientLoopで多重化する)
+    //   mode    oneway(ClientからServerへの片方向)/echo(Serverが送り返す)/both
+    //   bytes   1計測で送る総バイト数の目安(全接続に1メッセージ以上は送る)
+    //   msgs    1計測で送るメッセージ数の上限
+    //   format  text/csv/json
+    // CPU時間・システムコール数は送受信の両側を含むプロセス全体の値
+    // echoの転送量は送り返されたバイト数、メッセージ数は往復の数で数える
+    static void bench_throughput(int32_t argc, char *argv[])
+    {
+        BenchArgs args;
+        if (!args.parse(argc, argv, {"sizes", "conns", "mode", "bytes", "msgs", "format"}))
+        {
+            return;
+        }
+        const std::vector<uint64_t> sizes = args.numbers("sizes", {64, 1024, 16 * 1024, 256 * 1024, 4 * 1024 * 1024});
+        const std::vector<uint64_t> conns = args.numbers("conns", {1, 10, 100, 1000});
+        const std::string mode = args.text("mode", "both");
+        const uint64_t totalBytes = args.number("bytes", 64ULL * 1024 * 1024);
+        const uint64_t maxMsgs = args.number("msgs", 200000);
+        const std::string format = args.text("format", "text");
+        if (!BenchArgs::isFormat(format) || ((mode != "oneway") && (mode != "echo") && (mode != "both")))
+        {
+            LOG_DEBUG("ERR! mode:%s format:%s\n", mode.c_str(), format.c_str());
+            return;
+        }
+        for (uint64_t value : sizes)
+        {
+            if ((value == 0) || (value > 64ULL * 1024 * 1024))
+            {
+                LOG_DEBUG("ERR! size:%llu\n", static_cast<unsigned long long>(value));
+                return;
+            }
+        }
+        // 送り終えて未受信のバイト数の上限(接続数とサイズによらずメモリの使用量を抑える)
+        static constexpr uint64_t WINDOW_BYTES = 64ULL * 1024 * 1024;
+
+        Logger::init();
+        const char *backend = Socket::backend();
+        if (format == "csv")
+        {
+            LOG_RESULT("backend,mode,conns,size,msgs,sec,mb_per_sec,msgs_per_sec,cpu_ns_per_byte,syscalls_per_msg\n");
+        }
+        else if (format == "text")
+        {
+            LOG_RESULT("[throughput] %8s %8s %6s %9s %8s %10s %12s %12s %12s\n", "backend", "mode", "conns", "size", "msgs", "MB/s", "msg/s", "cpu_ns/B", "syscall/msg");
+        }
+        for (int32_t m = 0; m < 2; m++)
+        {
+            const bool echo = (m == 1);
+            if (mode != "both" && (mode != (echo ? "echo" : "oneway")))
+            {
+                continue;
+            }
+            for (const uint64_t connNum : conns)
+            {
+                Server server(0);
+                EchoReciever reciever(&server, echo);
+                server.setAddress("127.0.0.1", BENCH_PORT);
+                server.setAsyncSend(true);
+                server.start(&reciever);
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+                ClientLoop loop(0);
+                (void)loop.start();
+                CountReciever counter;
+                std::vector<std::unique_ptr<Client>> clients;
+                for (uint64_t i = 0; i < connNum; i++)
+                {
+                    clients.emplace_back(new Client(0));
+                    clients.back()->setAddress("127.0.0.1", BENCH_PORT);
+                    clients.back()->setAsyncSend(true);
+                    clients.back()->setLoop(&loop);
+                    clients.back()->start(&counter);
+                }
+                bool connected = true;
+                for (auto &client : clients)
+                {
+                    connected = connected && wait_connect(*client);
+                }
+                if (!connected)
+                {
+                    LOG_DEBUG("ERR! client connect conns:%llu\n", static_cast<unsigned long long>(connNum));
+                }
+
+                for (const uint64_t size : sizes)
+                {
+                    std::vector<char> payload(static_cast<size_t>(size), 'x');
+                    uint64_t count = std::min(std::max<uint64_t>(totalBytes / size, 1), maxMsgs);
+                    count = std::max<uint64_t>(count / connNum, 1) * connNum;
+                    auto done = [&]()
+                    {
+                        return echo ? counter.bytes() : reciever.bytes();
+                    };
+                    const uint64_t base = done();
+                    const uint64_t target = base + count * size;
+
+                    struct rusage ru0;
+                    (void)getrusage(RUSAGE_SELF, &ru0);
+                    const uint64_t calls0 = g_syscallCount.load(std::memory_order_relaxed);
+                    auto sta = std::chrono::steady_clock::now();
+                    uint64_t sent = base;
+                    bool ok = true;
+                    for (uint64_t i = 0; (i < count) && ok; i++)
+                    {
+                        while ((sent - done() > WINDOW_BYTES) && ok)
+                        {
+                            std::this_thread::sleep_for(std::chrono::microseconds(50));
+                            ok = (elapsed_sec(sta) < 120.0);
+                        }
+                        if (clients[i % connNum]->sendData(payload.data(), static_cast<int32_t>(size)) < 0)
+                        {
+                            ok = false;
+                        }
+                        sent += size;
+                    }
+                    while ((done() < target) && ok)
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                        ok = (elapsed_sec(sta) < 120.0);
+                    }
+                    const double sec = elapsed_sec(sta);
+                    const uint64_t calls = g_syscallCount.load(std::memory_order_relaxed) - calls0;
+                    struct rusage ru1;
+                    (void)getrusage(RUSAGE_SELF, &ru1);
+                    if (!ok)
+                    {
+                        LOG_DEBUG("ERR! throughput timeout conns:%llu size:%llu\n", static_cast<unsigned long long>(connNum), static_cast<unsigned long long>(size));
+                        continue;
+                    }
+
+                    auto usec = [](const struct rusage &ru)
+                    {
+                        return static_cast<double>(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + static_cast<double>(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+                    };
+                    const double bytes = static_cast<double>(count * size);
+                    const double mbps = bytes / (1024.0 * 1024.0) / sec;
+                    const double msgps = static_cast<double>(count) / sec;
+                    const double cpuNsPerByte = (usec(ru1) - usec(ru0)) * 1e3 / bytes;
+                    const double callsPerMsg = static_cast<double>(calls) / static_cast<double>(count);
+                    const char *modeName = echo ? "echo" : "oneway";
+                    const unsigned long long c = static_cast<unsigned long long>(connNum);
+                    const unsigned long long z = static_cast<unsigned long long>(size);
+                    const unsigned long long n = static_cast<unsigned long long>(count);
+                    if (format == "csv")
+                    {
+                        LOG_RESULT("%s,%s,%llu,%llu,%llu,%.3f,%.1f,%.0f,%.3f,%.3f\n", backend, modeName, c, z, n, sec, mbps, msgps, cpuNsPerByte, callsPerMsg);
+                    }
+                    else if (format == "json")
+                    {
+                        LOG_RESULT("{\"backend\":\"%s\",\"mode\":\"%s\",\"conns\":%llu,\"size\":%llu,\"msgs\":%llu,\"sec\":%.3f,"
+                                   "\"mb_per_sec\":%.1f,\"msgs_per_sec\":%.0f,\"cpu_ns_per_byte\":%.3f,\"syscalls_per_msg\":%.3f}\n",
+                                   backend, modeName, c, z, n, sec, mbps, msgps, cpuNsPerByte, callsPerMsg);
+                    }
+                    else
+                    {
+                        LOG_RESULT("[throughput] %8s %8s %6llu %9llu %8llu %10.1f %12.0f %12.3f %12.3f\n", backend, modeName, c, z, n, mbps, msgps, cpuNsPerByte, callsPerMsg);
+                    }
+                }
+                for (auto &client : clients)
+                {
+                    client->end();
+                }
+                loop.end();
+                server.end();
+            }
+        }
+        Logger::deinit();
+    }
+
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+    const char *name = (argc > 1) ? argv[1] : "all";
+    bool all = (std::strcmp(name, "all") == 0);
+
+    if (all || (std::strcmp(name, "send") == 0))
+    {
+        bench_send();
+    }
+    if (all || (std::strcmp(name, "zerocopy") == 0))
+    {
+        bench_zerocopy();
+    }
+    if (all || (std::strcmp(name, "backend") == 0))
+    {
+        bench_backend();
+    }
+    if (all || (std::strcmp(name, "coalesce") == 0))
+    {
+        bench_coalesce();
+    }
+    if (all || (std::strcmp(name, "compress") == 0))
+    {
+        bench_compress();
+    }
+    if (all || (std::strcmp(name, "rpc") == 0))
+    {
+        bench_rpc();
+    }
+    if (all || (std::strcmp(name, "uds") == 0))
+    {
+        bench_uds();
+    }
+    if (all || (std::strcmp(name, "shm") == 0))
+    {
+        bench_shm();
+    }
+    if (all || (std::strcmp(name, "churn") == 0))
+    {
+        bench_churn();
+    }
+    if (all || (std::strcmp(name, "clientloop") == 0))
+    {
+        bench_clientloop();
+    }
+    if (all || (std::strcmp(name, "options") == 0))
+    {
+        bench_options();
+    }
+    if (all || (std::strcmp(name, "latency") == 0))
+    {
+        bench_latency(argc, argv);
+    }
+    if (all || (std::strcmp(name, "throughput") == 0))
+    {
+        bench_throughput(argc, argv);
+    }
+
+    return 0;
+}
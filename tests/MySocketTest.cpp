@@ -1,10 +1,29 @@
 ﻿#include <chrono>
 #include <cstring>
+#include <vector>
+#include <map>
+#include <condition_variable>
+#include <future>
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
 #define _USE_MATH_DEFINES
 #include <cmath>
 
 #include "MySocket.hpp"
 #include "Logger.hpp"
+#if defined(__linux__)
+#include "Compressor.hpp"
+#include "MyThread.hpp"
+#include "ShmTransport.hpp"
+#include "ClientLoop.hpp"
+#endif
 
 //#define LOG_DEBUG(...)
 #define LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
@@ -77,17 +96,25 @@ class Manager : public Server::Reciever
     int32_t logid_ = 0;
     Server server_;
 
+public:
+    // 受信したフレーム数・バイト数と、内容が送信データの先頭と一致しなかったフレーム数
+    std::atomic<int32_t> frames_{0};
+    std::atomic<int64_t> bytes_{0};
+    std::atomic<int32_t> errors_{0};
+
 public:
     Manager();
     virtual ~Manager() override;
+    Server &server();
     void start();
     void end();
 
 public:
-    void sendData(const int32_t id, const char *data, const int32_t size);
+    void sendData(const int64_t id, const char *data, const int32_t size);
+    bool wait(const int32_t frames, const int32_t millisecond);
 
 private:
-    virtual void recieveData(const int32_t id, const char *data, const int32_t size) override;
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
 };
 
 Manager::Manager() : logid_(Logger::add("<Server>")), server_(logid_)
@@ -98,6 +125,11 @@ Manager::~Manager()
 {
 }
 
+Server &Manager::server()
+{
+    return server_;
+}
+
 void Manager::start()
 {
     server_.start(this);
@@ -108,46 +140,66 @@ void Manager::end()
     server_.end();
 }
 
-void Manager::sendData(const int32_t id, const char *data, const int32_t size)
+void Manager::sendData(const int64_t id, const char *data, const int32_t size)
 {
     if ((id <= 0) || (data == nullptr))
     {
         return;
     }
-    Logger::print(logid_, "sendData id:%d", id);
+    Logger::print(logid_, "sendData id:%lld", static_cast<long long>(id));
     Logger::print(logid_, " -> sz:%d", size);
     server_.sendData(id, data, size);
 }
 
-void Manager::recieveData(const int32_t id, const char *data, const int32_t size)
+void Manager::recieveData(const int64_t id, const char *data, const int32_t size)
 {
     if ((id <= 0) || (data == nullptr))
     {
         return;
     }
-    int32_t result = std::memcmp(data, g_sin_wave->data_, static_cast<size_t>(size));
-    Logger::print(logid_, "recvData id:%d", id);
-    Logger::print(logid_, " -> sz:%d <%s>", size, (result == 0) ? "OK" : "NG");
+    bool isOk = (size <= g_sin_wave->size_) && (std::memcmp(data, g_sin_wave->data_, static_cast<size_t>(size)) == 0);
+    Logger::print(logid_, "recvData id:%lld", static_cast<long long>(id));
+    Logger::print(logid_, " -> sz:%d <%s>", size, isOk ? "OK" : "NG");
+    errors_ += isOk ? 0 : 1;
+    bytes_ += size;
+    frames_++;
 
     sendData(id, g_cos_wave->data_, g_cos_wave->size_);
 }
 
+bool Manager::wait(const int32_t frames, const int32_t millisecond)
+{
+    for (int32_t i = 0; (i < millisecond / 10) && (frames_ < frames); i++)
+    {
+        wait_time(10);
+    }
+    return frames_ >= frames;
+}
+
 class User : public Client::Reciever
 {
     int32_t logid_ = 0;
     Client client_;
 
+public:
+    // 受信したフレーム数・バイト数と、内容が応答データの先頭と一致しなかったフレーム数
+    std::atomic<int32_t> frames_{0};
+    std::atomic<int64_t> bytes_{0};
+    std::atomic<int32_t> errors_{0};
+
 public:
     User();
     virtual ~User() override;
+    Client &client();
     void start();
     void end();
 
 public:
     void sendData(const char *data, const int32_t size);
+    bool wait(const int32_t frames, const int32_t millisecond);
 
 private:
-    virtual void recieveData(const int32_t id, const char *data, const int32_t size) override;
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
 };
 
 User::User() : logid_(Logger::add("<Client>")), client_(logid_)
@@ -158,6 +210,11 @@ User::~User()
 {
 }
 
+Client &User::client()
+{
+    return client_;
+}
+
 void User::start()
 {
     client_.start(this);
@@ -179,17 +236,97 @@ void User::sendData(const char *data, const int32_t size)
     client_.sendData(data, size);
 }
 
-void User::recieveData(const int32_t id, const char *data, const int32_t size)
+void User::recieveData(const int64_t id, const char *data, const int32_t size)
 {
     if ((id <= 0) || (data == nullptr))
     {
         return;
     }
-    int32_t result = std::memcmp(data, g_cos_wave->data_, static_cast<size_t>(size));
-    Logger::print(logid_, "recvData id:%d", id);
-    Logger::print(logid_, "sendData sz:%d <%s>", size, (result == 0) ? "OK" : "NG");
+    bool isOk = (size <= g_cos_wave->size_) && (std::memcmp(data, g_cos_wave->data_, static_cast<size_t>(size)) == 0);
+    Logger::print(logid_, "recvData id:%lld", static_cast<long long>(id));
+    Logger::print(logid_, " -> sz:%d <%s>", size, isOk ? "OK" : "NG");
+    errors_ += isOk ? 0 : 1;
+    bytes_ += size;
+    frames_++;
+}
+
+bool User::wait(const int32_t frames, const int32_t millisecond)
+{
+    for (int32_t i = 0; (i < millisecond / 10) && (frames_ < frames); i++)
+    {
+        wait_time(10);
+    }
+    return frames_ >= frames;
+}
+
+#if defined(__linux__)
+// 受信バッファをコピーせずに保持するクライアント
+class Holder : public Client::Reciever
+{
+    int32_t logid_ = 0;
+    Client client_;
+    std::mutex mtx_;
+    std::vector<Buffer> buffers_;
+
+public:
+    Holder();
+    virtual ~Holder() override;
+    void start();
+    void end();
+    void sendData(const char *data, const int32_t size);
+    std::vector<Buffer> take();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+    virtual void recieveBuffer(const int64_t id, Buffer buffer) override;
+};
+
+Holder::Holder() : logid_(Logger::add("<Holder>")), client_(logid_)
+{
+}
+
+Holder::~Holder()
+{
+}
+
+void Holder::start()
+{
+    client_.setNonBlocking(true);
+    client_.start(this);
+}
+
+void Holder::end()
+{
+    client_.end();
 }
 
+void Holder::sendData(const char *data, const int32_t size)
+{
+    client_.sendData(data, size);
+}
+
+std::vector<Buffer> Holder::take()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::vector<Buffer> buffers;
+    buffers.swap(buffers_);
+    return buffers;
+}
+
+void Holder::recieveData(const int64_t, const char *, const int32_t)
+{
+}
+
+void Holder::recieveBuffer(const int64_t id, Buffer buffer)
+{
+    Logger::print(logid_, "recvBuffer id:%lld", static_cast<long long>(id));
+    Logger::print(logid_, " -> sz:%d", buffer.size());
+    std::lock_guard<std::mutex> lock(mtx_);
+    buffers_.emplace_back(std::move(buffer));
+}
+
+#endif
+
 // サーバとクライアントが1対1で接続
 // サーバとクライアントが1度だけデータの送受信を実施する
 static void test1_1()
@@ -334,35 +471,2383 @@ static void test3_2()
     Logger::deinit();
 }
 
-int32_t main()
+// 以降はepoll/io_uringのバックエンド(Linux)で加えたAPIの試験
+#if defined(__linux__)
+// サーバとクライアントが1対多で接続(ノンブロッキング/エッジトリガ)
+// 複数クライアントの大きなフレームが分割して届いても、途中から受信を再開できること
+static void test4_1()
 {
+    Logger::init();
+    {
+        Manager manager;
+        manager.server().setNonBlocking(true);
+        manager.start();
+        {
+            User user1;
+            user1.client().setNonBlocking(true);
+            user1.start();
+            User user2;
+            user2.client().setNonBlocking(true);
+            user2.start();
+            User user3;
+            user3.start();
+            wait_time(1000);
+            static constexpr int32_t SEND_NUM = 10;
+            for (int32_t i = 0; i < SEND_NUM; i++)
+            {
+                user1.sendData(g_sin_wave->data_, g_sin_wave->size_);
+                user2.sendData(g_sin_wave->data_, g_sin_wave->size_);
+                user3.sendData(g_sin_wave->data_, g_sin_wave->size_);
+            }
 
-    g_sin_wave = new Wave(Wave::Type::SIN, 2 * 1024 * 1024);
-    g_cos_wave = new Wave(Wave::Type::COS, 3 * 1024 * 1024);
+            // 分割して届いたフレームも、組み立て直すと送信したサイズ・内容と一致すること
+            // (フレームごとに内容を比較し、フレーム数と合計のバイト数でサイズを確認する)
+            bool isOk = manager.wait(SEND_NUM * 3, 5000);
+            const int64_t serverBytes = static_cast<int64_t>(g_sin_wave->size_) * SEND_NUM * 3;
+            LOG_DEBUG("server frames:%d bytes:%lld errors:%d <%s>\n", manager.frames_.load(), static_cast<long long>(manager.bytes_.load()), manager.errors_.load(),
+                      (isOk && (manager.frames_ == SEND_NUM * 3) && (manager.bytes_ == serverBytes) && (manager.errors_ == 0)) ? "OK" : "NG");
+            User *users[] = {&user1, &user2, &user3};
+            for (User *user : users)
+            {
+                isOk = user->wait(SEND_NUM, 5000);
+                const int64_t clientBytes = static_cast<int64_t>(g_cos_wave->size_) * SEND_NUM;
+                LOG_DEBUG("client frames:%d bytes:%lld errors:%d <%s>\n", user->frames_.load(), static_cast<long long>(user->bytes_.load()), user->errors_.load(),
+                          (isOk && (user->frames_ == SEND_NUM) && (user->bytes_ == clientBytes) && (user->errors_ == 0)) ? "OK" : "NG");
+            }
+        }
+    }
+    Logger::deinit();
+}
 
-    LOG_DEBUG("\n----------- test1_1 START -----------\n");
-    test1_1();
-    LOG_DEBUG("\n----------- test1_1 END -----------\n");
+// サーバとクライアントが1対1で接続(MSG_ZEROCOPY)
+// releaseを渡した1MB以上のデータはゼロコピー送信、それ以外はコピー送信で送受信できること
+// ゼロコピー送信のreleaseは完了通知を受信した時点で呼ばれること
+static void test4_2()
+{
+    Logger::init();
+    {
+        std::atomic<int32_t> released(0);
+        Manager manager;
+        manager.server().setNonBlocking(true);
+        manager.server().setZeroCopy(1024 * 1024);
+        manager.start();
+        wait_time(1000);
+        User user;
+        user.client().setZeroCopy(1024 * 1024);
+        user.start();
+        wait_time(1000);
+        for (int32_t i = 0; i < 10; i++)
+        {
+            (void)user.client().sendData(g_sin_wave->data_, g_sin_wave->size_, [&released]()
+                                         { released++; });
+        }
+        user.sendData(g_sin_wave->data_, g_sin_wave->size_);
+        user.sendData(g_sin_wave->data_, 1024);
+        wait_time(1000);
+        LOG_DEBUG("released:%d <%s>\n", released.load(), (released == 10) ? "OK" : "NG");
+    }
+    Logger::deinit();
+}
 
-    LOG_DEBUG("\n----------- test1_2 START -----------\n");
-    test1_2();
-    LOG_DEBUG("\n----------- test1_2 END -----------\n");
+// サーバとクライアントが1対1で接続(受信バッファのプール)
+// 受信したバッファをコピーせずに保持でき、定常状態では受信バッファを新規確保しないこと
+static void test4_3()
+{
+    Logger::init();
+    {
+        Manager manager;
+        manager.server().setNonBlocking(true);
+        manager.start();
+        wait_time(1000);
+        {
+            Holder holder;
+            holder.start();
+            wait_time(1000);
+            for (int32_t i = 0; i < 5; i++)
+            {
+                holder.sendData(g_sin_wave->data_, g_sin_wave->size_);
+            }
+            wait_time(1000);
+            holder.end();
 
-    LOG_DEBUG("\n----------- test1_3 START -----------\n");
-    test1_3();
-    LOG_DEBUG("\n----------- test1_3 END -----------\n");
+            std::vector<Buffer> buffers = holder.take();
+            int32_t ok = 0;
+            for (const Buffer &buffer : buffers)
+            {
+                if ((buffer.size() == g_cos_wave->size_) &&
+                    (std::memcmp(buffer.data(), g_cos_wave->data_, static_cast<size_t>(buffer.size())) == 0))
+                {
+                    ok++;
+                }
+            }
+            LOG_DEBUG("hold buffers:%d <%s>\n", ok, ((ok == 5) && (buffers.size() == 5)) ? "OK" : "NG");
+        }
 
-    LOG_DEBUG("\n----------- test2_1 START -----------\n");
-    test2_1();
-    LOG_DEBUG("\n----------- test2_1 END -----------\n");
+        User user;
+        user.client().setNonBlocking(true);
+        user.start();
+        wait_time(1000);
+        user.sendData(g_sin_wave->data_, g_sin_wave->size_);
+        wait_time(1000);
+        uint64_t allocCount = BufferPool::instance().allocCount();
+        for (int32_t i = 0; i < 10; i++)
+        {
+            user.sendData(g_sin_wave->data_, g_sin_wave->size_);
+            wait_time(100);
+        }
+        wait_time(1000);
+        uint64_t diff = BufferPool::instance().allocCount() - allocCount;
+        LOG_DEBUG("pool alloc:%llu <%s>\n", static_cast<unsigned long long>(diff), (diff == 0) ? "OK" : "NG");
+        // 負のサイズは確保しない
+        Buffer invalid = BufferPool::instance().get(-1);
+        LOG_DEBUG("pool invalid size <%s>\n", invalid.empty() ? "OK" : "NG");
+    }
+    Logger::deinit();
+}
 
-    LOG_DEBUG("\n----------- test3_1 START -----------\n");
-    test3_1();
-    LOG_DEBUG("\n----------- test3_1 END -----------\n");
+// サーバとクライアントが1対多で接続(非同期送信)
+// 送信はキューに積むだけで呼び出し元をブロックせず、全データが送受信できること
+static void test4_4()
+{
+    Logger::init();
+    {
+        Manager manager;
+        manager.server().setAsyncSend(true);
+        manager.start();
+        wait_time(1000);
+        {
+            User user1;
+            user1.client().setAsyncSend(true);
+            user1.client().setSendWatermark(8 * 1024 * 1024, 2 * 1024 * 1024);
+            user1.start();
+            User user2;
+            user2.client().setAsyncSend(true);
+            user2.start();
+            wait_time(2000);
+            auto sta = std::chrono::steady_clock::now();
+            for (int32_t i = 0; i < 10; i++)
+            {
+                user1.sendData(g_sin_wave->data_, g_sin_wave->size_);
+                user2.sendData(g_sin_wave->data_, g_sin_wave->size_);
+            }
+            auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - sta).count();
+            LOG_DEBUG("enqueue time:%lldms <%s>\n", static_cast<long long>(msec), (msec < 500) ? "OK" : "NG");
+            LOG_DEBUG("writable:%d\n", user1.client().isWritable() ? 1 : 0);
+            wait_time(2000);
+            LOG_DEBUG("writable:%d <%s>\n", user1.client().isWritable() ? 1 : 0, user1.client().isWritable() ? "OK" : "NG");
+        }
+    }
+    Logger::deinit();
+}
 
-    LOG_DEBUG("\n----------- test3_2 START -----------\n");
-    test3_2();
-    LOG_DEBUG("\n----------- test3_2 END -----------\n");
+// サーバとクライアントが1対多で接続(マルチリアクタ)
+// 複数のイベントループに接続が振り分けられ、それぞれのループで送受信できること
+static void test4_5()
+{
+    Logger::init();
+    {
+        Manager manager;
+        manager.server().setNonBlocking(true);
+        manager.server().setLoopNum(2);
+        manager.start();
+        wait_time(1000);
+        {
+            static constexpr int32_t USER_NUM = 4;
+            User users[USER_NUM];
+            for (User &user : users)
+            {
+                user.client().setNonBlocking(true);
+                user.start();
+                wait_time(100);
+            }
+            wait_time(2000);
+            for (int32_t i = 0; i < 5; i++)
+            {
+                for (User &user : users)
+                {
+                    user.sendData(g_sin_wave->data_, g_sin_wave->size_);
+                }
+            }
+            wait_time(2000);
+
+            int32_t connections = 0;
+            std::vector<Server::LoopStat> stats = manager.server().getLoopStats();
+            for (size_t i = 0; i < stats.size(); i++)
+            {
+                LOG_DEBUG("loop%zu connections:%d cpu:%lluus\n", i, stats[i].connections_, static_cast<unsigned long long>(stats[i].cpuTimeUs_));
+                connections += stats[i].connections_;
+            }
+            LOG_DEBUG("loops:%zu connections:%d <%s>\n", stats.size(), connections, ((stats.size() == 2) && (connections == USER_NUM)) ? "OK" : "NG");
+        }
+    }
+    Logger::deinit();
+}
+
+// 受信順序を検査するサーバ(受信データは接続ごとの通し番号)
+class Sequencer : public Server::Reciever
+{
+    int32_t logid_ = 0;
+    Server server_;
+    std::mutex mtx_;
+    std::map<int64_t, int32_t> next_;
+    std::vector<int64_t> ids_;
+    int32_t count_ = 0;
+    int32_t error_ = 0;
+    int32_t running_ = 0;
+    int32_t maxRunning_ = 0;
+
+public:
+    Sequencer();
+    virtual ~Sequencer() override;
+    Server &server();
+    void start();
+    void end();
+    int32_t count();
+    int32_t error();
+    int32_t maxRunning();
+    std::vector<int64_t> ids();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+Sequencer::Sequencer() : logid_(Logger::add("<Sequencer>")), server_(logid_)
+{
+}
+
+Sequencer::~Sequencer()
+{
+}
+
+Server &Sequencer::server()
+{
+    return server_;
+}
+
+void Sequencer::start()
+{
+    server_.start(this);
+}
+
+void Sequencer::end()
+{
+    server_.end();
+}
+
+int32_t Sequencer::count()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return count_;
+}
+
+int32_t Sequencer::error()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return error_;
+}
+
+int32_t Sequencer::maxRunning()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return maxRunning_;
+}
+
+std::vector<int64_t> Sequencer::ids()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return ids_;
+}
+
+void Sequencer::recieveData(const int64_t id, const char *data, const int32_t size)
+{
+    if ((data == nullptr) || (size != static_cast<int32_t>(sizeof(int32_t))))
+    {
+        return;
+    }
+    int32_t seq = 0;
+    std::memcpy(&seq, data, sizeof(seq));
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (next_.find(id) == next_.end())
+        {
+            ids_.emplace_back(id);
+        }
+        if (next_[id] != seq)
+        {
+            Logger::print(logid_, "recvData id:%lld seq:%d expect:%d", static_cast<long long>(id), seq, next_[id]);
+            error_++;
+        }
+        next_[id] = seq + 1;
+        count_++;
+        running_++;
+        maxRunning_ = (running_ > maxRunning_) ? running_ : maxRunning_;
+    }
+    // 処理に時間がかかるアプリケーションを模擬する
+    wait_time(1);
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        running_--;
+    }
+}
+
+// サーバとクライアントが1対多で接続(ThreadPoolで受信処理)
+// 接続ごとの受信順序が保たれたまま、異なる接続の受信データが並列に処理されること
+static void test4_6()
+{
+    Logger::init();
+    {
+        ThreadPool pool(2, 1024, false);
+        Sequencer sequencer;
+        sequencer.server().setNonBlocking(true);
+        sequencer.server().setThreadPool(&pool);
+        sequencer.start();
+        wait_time(1000);
+        {
+            static constexpr int32_t USER_NUM = 3;
+            static constexpr int32_t SEND_NUM = 100;
+            User users[USER_NUM];
+            for (User &user : users)
+            {
+                user.client().setNonBlocking(true);
+                user.client().setThreadPool(&pool);
+                user.start();
+                wait_time(100);
+            }
+            wait_time(2000);
+            for (int32_t i = 0; i < SEND_NUM; i++)
+            {
+                for (User &user : users)
+                {
+                    user.sendData(reinterpret_cast<const char *>(&i), static_cast<int32_t>(sizeof(i)));
+                }
+            }
+            wait_time(2000);
+            LOG_DEBUG("dispatch count:%d <%s>\n", sequencer.count(), (sequencer.count() == USER_NUM * SEND_NUM) ? "OK" : "NG");
+            LOG_DEBUG("dispatch order error:%d <%s>\n", sequencer.error(), (sequencer.error() == 0) ? "OK" : "NG");
+            LOG_DEBUG("dispatch parallel:%d <%s>\n", sequencer.maxRunning(), (sequencer.maxRunning() > 1) ? "OK" : "NG");
+        }
+        sequencer.end();
+    }
+    Logger::deinit();
+}
+
+// サーバとクライアントが1対1で接続(接続IDの再利用)
+// 切断後に同じfdが再利用されても、以前の接続IDには送信できないこと
+static void test4_7()
+{
+    Logger::init();
+    {
+        Sequencer sequencer;
+        sequencer.start();
+        wait_time(1000);
+        int32_t seq = 0;
+        {
+            User user;
+            user.start();
+            wait_time(1000);
+            user.sendData(reinterpret_cast<const char *>(&seq), static_cast<int32_t>(sizeof(seq)));
+            wait_time(500);
+            user.end();
+        }
+        wait_time(1500);
+        {
+            User user;
+            user.start();
+            wait_time(1000);
+            user.sendData(reinterpret_cast<const char *>(&seq), static_cast<int32_t>(sizeof(seq)));
+            wait_time(500);
+
+            std::vector<int64_t> ids = sequencer.ids();
+            if (ids.size() == 2)
+            {
+                LOG_DEBUG("id:0x%llx fd:%d -> id:0x%llx fd:%d\n", static_cast<unsigned long long>(ids[0]), ConnectionId::fd(ids[0]),
+                          static_cast<unsigned long long>(ids[1]), ConnectionId::fd(ids[1]));
+                int32_t ret = sequencer.server().sendData(ids[0], g_cos_wave->data_, 16);
+                LOG_DEBUG("send old id:%d <%s>\n", ret, (ret == -1) ? "OK" : "NG");
+            }
+            LOG_DEBUG("ids:%zu <%s>\n", ids.size(), ((ids.size() == 2) && (ids[0] != ids[1])) ? "OK" : "NG");
+            int32_t connections = sequencer.server().getLoopStats()[0].connections_;
+            LOG_DEBUG("connections:%d <%s>\n", connections, (connections == 1) ? "OK" : "NG");
+            user.end();
+        }
+        sequencer.end();
+    }
+    // 同じfdに何千回も接続IDを割り当てても以前の接続IDと一致せず、接続IDからループ番号とfdを取り出せること
+    // (fd 0はソケットに使われないため、世代を進めても接続に影響しない)
+    {
+        int64_t first = ConnectionId::issue(0, 3);
+        bool unique = (first > 0);
+        for (int32_t i = 0; i < 10000; i++)
+        {
+            unique = unique && (ConnectionId::issue(0, 3) != first);
+        }
+        bool decoded = (ConnectionId::fd(first) == 0) && (ConnectionId::loop(first) == 3);
+        LOG_DEBUG("id:0x%llx unique:%d decoded:%d <%s>\n", static_cast<unsigned long long>(first), unique, decoded, (unique && decoded) ? "OK" : "NG");
+    }
+    Logger::deinit();
+}
+
+// サーバとクライアントが1対1で接続(送信の集約)
+// 集約中のフレームは、flush()・窓の期限・上限バイト数のいずれかで順序を保ったまま送信されること
+static void test4_8()
+{
+    Logger::init();
+    {
+        Sequencer sequencer;
+        sequencer.start();
+        wait_time(1000);
+        {
+            User user;
+            user.client().setCoalesce(500 * 1000, 4096);
+            user.start();
+            wait_time(1000);
+            int32_t seq = 0;
+            user.sendData(reinterpret_cast<const char *>(&seq), static_cast<int32_t>(sizeof(seq)));
+            seq++;
+            wait_time(100);
+            LOG_DEBUG("coalesce hold count:%d <%s>\n", sequencer.count(), (sequencer.count() == 0) ? "OK" : "NG");
+            int32_t ret = user.client().flush();
+            wait_time(100);
+            LOG_DEBUG("coalesce flush ret:%d count:%d <%s>\n", ret, sequencer.count(), ((ret == 0) && (sequencer.count() == 1)) ? "OK" : "NG");
+
+            // 窓の期限まで溜めてから送信する
+            for (int32_t i = 0; i < 100; i++, seq++)
+            {
+                user.sendData(reinterpret_cast<const char *>(&seq), static_cast<int32_t>(sizeof(seq)));
+            }
+            wait_time(100);
+            LOG_DEBUG("coalesce window hold count:%d <%s>\n", sequencer.count(), (sequencer.count() == 1) ? "OK" : "NG");
+            wait_time(1000);
+            LOG_DEBUG("coalesce window count:%d <%s>\n", sequencer.count(), (sequencer.count() == seq) ? "OK" : "NG");
+
+            // 上限バイト数に達した時点で窓の期限を待たずに送信する
+            int32_t base = sequencer.count();
+            for (int32_t i = 0; i < 400; i++, seq++)
+            {
+                user.sendData(reinterpret_cast<const char *>(&seq), static_cast<int32_t>(sizeof(seq)));
+            }
+            wait_time(200);
+            LOG_DEBUG("coalesce budget count:%d <%s>\n", sequencer.count(), (sequencer.count() > base) ? "OK" : "NG");
+            wait_time(1000);
+            LOG_DEBUG("coalesce count:%d <%s>\n", sequencer.count(), (sequencer.count() == seq) ? "OK" : "NG");
+            LOG_DEBUG("coalesce order error:%d <%s>\n", sequencer.error(), (sequencer.error() == 0) ? "OK" : "NG");
+            user.end();
+        }
+        sequencer.end();
+    }
+    Logger::deinit();
+}
+
+// サーバとクライアントが1対多で接続(圧縮)
+// 圧縮率の悪いデータと不正な圧縮データを扱えること、圧縮した送信データがブロッキング・ノンブロッキングのいずれの受信でも元に戻ること
+static void test4_9()
+{
+    Logger::init();
+    {
+        Buffer packed;
+        bool ret = Compressor::pack(g_cos_wave->data_, g_cos_wave->size_, packed);
+        LOG_DEBUG("pack sz:%d -> %d <%s>\n", g_cos_wave->size_, packed.size(), (ret && (packed.size() < g_cos_wave->size_ / 4)) ? "OK" : "NG");
+        Buffer unpacked;
+        ret = Compressor::unpack(packed, unpacked);
+        bool same = ret && (unpacked.size() == g_cos_wave->size_) && (std::memcmp(unpacked.data(), g_cos_wave->data_, static_cast<size_t>(g_cos_wave->size_)) == 0);
+        LOG_DEBUG("unpack sz:%d <%s>\n", unpacked.size(), same ? "OK" : "NG");
+
+        // 乱数は圧縮できないため、圧縮せずに送る
+        Buffer noise = BufferPool::instance().get(64 * 1024);
+        uint32_t x = 2463534242U;
+        for (int32_t i = 0; i < noise.size(); i++)
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            noise.data()[i] = static_cast<char>(x);
+        }
+        Buffer noisePacked;
+        ret = Compressor::pack(noise.data(), noise.size(), noisePacked);
+        LOG_DEBUG("pack noise:%d <%s>\n", ret, !ret ? "OK" : "NG");
+
+        // 途中で切れた圧縮データ・伸長後のサイズを偽った圧縮データは伸長しない
+        Buffer broken = packed;
+        broken.resize(packed.size() - 1);
+        ret = Compressor::unpack(broken, unpacked);
+        LOG_DEBUG("unpack truncated:%d <%s>\n", ret, !ret ? "OK" : "NG");
+        Buffer forged = BufferPool::instance().get(packed.size());
+        std::memcpy(forged.data(), packed.data(), static_cast<size_t>(packed.size()));
+        int32_t size = 0x7fffffff;
+        std::memcpy(forged.data(), &size, sizeof(size));
+        ret = Compressor::unpack(forged, unpacked);
+        LOG_DEBUG("unpack forged:%d <%s>\n", ret, !ret ? "OK" : "NG");
+    }
+    {
+        Manager manager;
+        manager.server().setNonBlocking(true);
+        manager.server().setCompression(1024);
+        manager.start();
+        wait_time(1000);
+        {
+            User user1;
+            user1.client().setNonBlocking(true);
+            user1.client().setCompression(1024);
+            user1.start();
+            User user2;
+            user2.client().setCompression(1024);
+            user2.start();
+            // 圧縮を有効にしていなくても、圧縮フレームは受信できる
+            User user3;
+            user3.start();
+            wait_time(1000);
+            for (int32_t i = 0; i < 10; i++)
+            {
+                user1.sendData(g_sin_wave->data_, g_sin_wave->size_);
+                user2.sendData(g_sin_wave->data_, g_sin_wave->size_);
+                user3.sendData(g_sin_wave->data_, g_sin_wave->size_);
+            }
+            wait_time(1000);
+        }
+        manager.end();
+    }
+    Logger::deinit();
+}
+
+// RPCの要求に応答するサーバ(要求データは操作と値)
+// 0:値を2倍にしてすぐに応答する 1:release()まで応答を保留する 2:応答しない
+class Responder : public Server::Reciever
+{
+public:
+    enum Op : int32_t
+    {
+        OP_DOUBLE = 0,
+        OP_HOLD = 1,
+        OP_DROP = 2,
+    };
+
+private:
+    int32_t logid_ = 0;
+    Server server_;
+    std::mutex mtx_;
+    std::vector<std::pair<int64_t, std::pair<uint32_t, int32_t>>> held_;
+
+public:
+    Responder();
+    virtual ~Responder() override;
+    Server &server();
+    void start();
+    void end();
+    // 保留した要求に、受信と逆の順序で応答する
+    size_t release();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+    virtual void recieveRequest(const int64_t id, const uint32_t requestId, const char *data, const int32_t size) override;
+};
+
+Responder::Responder() : logid_(Logger::add("<Responder>")), server_(logid_)
+{
+}
+
+Responder::~Responder()
+{
+}
+
+Server &Responder::server()
+{
+    return server_;
+}
+
+void Responder::start()
+{
+    server_.start(this);
+}
+
+void Responder::end()
+{
+    server_.end();
+}
+
+size_t Responder::release()
+{
+    std::vector<std::pair<int64_t, std::pair<uint32_t, int32_t>>> held;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        held.swap(held_);
+    }
+    for (auto itr = held.rbegin(); itr != held.rend(); ++itr)
+    {
+        int32_t value = itr->second.second * 2;
+        (void)server_.reply(itr->first, itr->second.first, reinterpret_cast<const char *>(&value), static_cast<int32_t>(sizeof(value)));
+    }
+    return held.size();
+}
+
+void Responder::recieveData(const int64_t, const char *, const int32_t)
+{
+}
+
+void Responder::recieveRequest(const int64_t id, const uint32_t requestId, const char *data, const int32_t size)
+{
+    int32_t request[2] = {};
+    if (size != static_cast<int32_t>(sizeof(request)))
+    {
+        return;
+    }
+    std::memcpy(request, data, sizeof(request));
+    Logger::print(logid_, "recvRequest id:%lld req:%u op:%d", static_cast<long long>(id), requestId, request[0]);
+    if (request[0] == OP_HOLD)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        held_.emplace_back(id, std::make_pair(requestId, request[1]));
+    }
+    else if (request[0] == OP_DOUBLE)
+    {
+        int32_t value = request[1] * 2;
+        (void)server_.reply(id, requestId, reinterpret_cast<const char *>(&value), static_cast<int32_t>(sizeof(value)));
+    }
+}
+
+static int32_t reply_value(const CallResult &result)
+{
+    int32_t value = -1;
+    if ((result.status_ == CallResult::Status::OK) && (result.size() == static_cast<int32_t>(sizeof(value))))
+    {
+        std::memcpy(&value, result.data(), sizeof(value));
+    }
+    return value;
+}
+
+// サーバとクライアントが1対1で接続(RPC)
+// 応答を待たずに送信した複数の要求に、要求IDで対応付けた応答が返ること
+// 応答の順序が要求と異なっても良く、期限切れ・切断は応答待ちに通知されること
+static void test4_10()
+{
+    Logger::init();
+    {
+        Responder responder;
+        responder.server().setNonBlocking(true);
+        responder.start();
+        wait_time(1000);
+        Client client(Logger::add("<Caller>"));
+        client.start(nullptr);
+        wait_time(1000);
+
+        // パイプライン: 100件の要求を続けて送信してから応答を待つ
+        static constexpr int32_t CALL_NUM = 100;
+        std::vector<std::future<CallResult>> futures;
+        for (int32_t i = 0; i < CALL_NUM; i++)
+        {
+            int32_t request[2] = {Responder::OP_DOUBLE, i};
+            futures.emplace_back(client.call(reinterpret_cast<const char *>(request), static_cast<int32_t>(sizeof(request)), 3000));
+        }
+        int32_t matched = 0;
+        for (int32_t i = 0; i < CALL_NUM; i++)
+        {
+            CallResult result = futures[static_cast<size_t>(i)].get();
+            matched += (reply_value(result) == i * 2) ? 1 : 0;
+        }
+        LOG_DEBUG("call pipelined:%d <%s>\n", matched, (matched == CALL_NUM) ? "OK" : "NG");
+
+        // 保留した要求より後の要求が先に応答され、保留した要求は逆順に応答される
+        int32_t hold1[2] = {Responder::OP_HOLD, 100};
+        int32_t hold2[2] = {Responder::OP_HOLD, 200};
+        int32_t quick[2] = {Responder::OP_DOUBLE, 300};
+        std::future<CallResult> f1 = client.call(reinterpret_cast<const char *>(hold1), static_cast<int32_t>(sizeof(hold1)), 3000);
+        std::future<CallResult> f2 = client.call(reinterpret_cast<const char *>(hold2), static_cast<int32_t>(sizeof(hold2)), 3000);
+        std::future<CallResult> f3 = client.call(reinterpret_cast<const char *>(quick), static_cast<int32_t>(sizeof(quick)), 3000);
+        int32_t value = reply_value(f3.get());
+        bool pending = (f1.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) &&
+                       (f2.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready);
+        LOG_DEBUG("call out of order:%d <%s>\n", value, ((value == 600) && pending) ? "OK" : "NG");
+        wait_time(100);
+        size_t released = responder.release();
+        int32_t v1 = reply_value(f1.get());
+        int32_t v2 = reply_value(f2.get());
+        LOG_DEBUG("call released:%zu %d %d <%s>\n", released, v1, v2, ((released == 2) && (v1 == 200) && (v2 == 400)) ? "OK" : "NG");
+
+        // 応答が無い要求は期限切れで通知する(コールバック)
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done = false;
+        CallResult::Status status = CallResult::Status::OK;
+        auto sta = std::chrono::steady_clock::now();
+        int32_t drop[2] = {Responder::OP_DROP, 0};
+        int32_t ret = client.call(reinterpret_cast<const char *>(drop), static_cast<int32_t>(sizeof(drop)), 200, [&](CallResult &result)
+                                  {
+                                      std::lock_guard<std::mutex> lock(mtx);
+                                      status = result.status_;
+                                      done = true;
+                                      cv.notify_all(); });
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            (void)cv.wait_for(lock, std::chrono::seconds(3), [&]
+                              { return done; });
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - sta).count();
+        LOG_DEBUG("call timeout ret:%d ms:%lld <%s>\n", ret, static_cast<long long>(ms),
+                  ((ret == 0) && (status == CallResult::Status::TIMEOUT) && (ms >= 200) && (ms < 1000)) ? "OK" : "NG");
+
+        // 応答待ちのまま切断された要求は、期限を待たずに失敗する
+        int32_t hold3[2] = {Responder::OP_HOLD, 0};
+        std::future<CallResult> f4 = client.call(reinterpret_cast<const char *>(hold3), static_cast<int32_t>(sizeof(hold3)), 10000);
+        wait_time(100);
+        responder.end();
+        bool ready = (f4.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+        LOG_DEBUG("call disconnect <%s>\n", (ready && (f4.get().status_ == CallResult::Status::FAILED)) ? "OK" : "NG");
+        client.end();
+    }
+    Logger::deinit();
+}
+
+// ストリーミング受信の結果(受信スレッドで更新し、送受信の完了後に参照する)
+class StreamStat
+{
+public:
+    std::mutex mtx_;
+    int32_t begins_ = 0;
+    int32_t ends_ = 0;
+    int32_t aborts_ = 0;
+    int32_t frames_ = 0; // フレーム全体で受信した数
+    int32_t size_ = 0;   // 最後に受信開始したフレームのサイズ
+    int32_t total_ = 0;  // 最後に受信開始したフレームで受信したサイズ
+    int32_t maxChunk_ = 0;
+    uint32_t hash_ = 0;
+    bool ordered_ = true; // 開始・チャンク・完了の順に通知された
+    bool inFrame_ = false;
+
+public:
+    void begin(const int32_t size);
+    void chunk(const char *data, const int32_t size);
+    void end(const bool complete);
+    static uint32_t hash(const char *data, const int32_t size, uint32_t h = 2166136261U);
+};
+
+void StreamStat::begin(const int32_t size)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    ordered_ = ordered_ && !inFrame_;
+    inFrame_ = true;
+    begins_++;
+    size_ = size;
+    total_ = 0;
+    hash_ = hash(nullptr, 0);
+}
+
+void StreamStat::chunk(const char *data, const int32_t size)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    ordered_ = ordered_ && inFrame_;
+    total_ += size;
+    maxChunk_ = (size > maxChunk_) ? size : maxChunk_;
+    hash_ = hash(data, size, hash_);
+}
+
+void StreamStat::end(const bool complete)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    ordered_ = ordered_ && inFrame_;
+    inFrame_ = false;
+    if (complete)
+    {
+        ends_++;
+    }
+    else
+    {
+        aborts_++;
+    }
+}
+
+uint32_t StreamStat::hash(const char *data, const int32_t size, uint32_t h)
+{
+    // FNV-1a
+    for (int32_t i = 0; i < size; i++)
+    {
+        h ^= static_cast<uint8_t>(data[i]);
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// ストリーミング受信したフレームと同じサイズの波形を送り返すサーバ
+class StreamServer : public Server::Reciever
+{
+    int32_t logid_ = 0;
+    Server server_;
+
+public:
+    StreamStat stat_;
+
+public:
+    StreamServer();
+    virtual ~StreamServer() override;
+    Server &server();
+    void start();
+    void end();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+    virtual void recieveBegin(const int64_t id, const int32_t size) override;
+    virtual void recieveChunk(const int64_t id, const char *data, const int32_t size) override;
+    virtual void recieveEnd(const int64_t id, const bool complete) override;
+};
+
+StreamServer::StreamServer() : logid_(Logger::add("<StreamServer>")), server_(logid_)
+{
+}
+
+StreamServer::~StreamServer()
+{
+}
+
+Server &StreamServer::server()
+{
+    return server_;
+}
+
+void StreamServer::start()
+{
+    server_.start(this);
+}
+
+void StreamServer::end()
+{
+    server_.end();
+}
+
+void StreamServer::recieveData(const int64_t, const char *, const int32_t)
+{
+    std::lock_guard<std::mutex> lock(stat_.mtx_);
+    stat_.frames_++;
+}
+
+void StreamServer::recieveBegin(const int64_t, const int32_t size)
+{
+    stat_.begin(size);
+}
+
+void StreamServer::recieveChunk(const int64_t, const char *data, const int32_t size)
+{
+    stat_.chunk(data, size);
+}
+
+void StreamServer::recieveEnd(const int64_t id, const bool complete)
+{
+    stat_.end(complete);
+    if (complete)
+    {
+        (void)server_.sendData(id, g_cos_wave->data_, g_cos_wave->size_);
+    }
+}
+
+class StreamClient : public Client::Reciever
+{
+public:
+    StreamStat stat_;
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+    virtual void recieveBegin(const int64_t id, const int32_t size) override;
+    virtual void recieveChunk(const int64_t id, const char *data, const int32_t size) override;
+    virtual void recieveEnd(const int64_t id, const bool complete) override;
+};
+
+void StreamClient::recieveData(const int64_t, const char *, const int32_t)
+{
+    std::lock_guard<std::mutex> lock(stat_.mtx_);
+    stat_.frames_++;
+}
+
+void StreamClient::recieveBegin(const int64_t, const int32_t size)
+{
+    stat_.begin(size);
+}
+
+void StreamClient::recieveChunk(const int64_t, const char *data, const int32_t size)
+{
+    stat_.chunk(data, size);
+}
+
+void StreamClient::recieveEnd(const int64_t, const bool complete)
+{
+    stat_.end(complete);
+}
+
+static void check_stream(const char *name, StreamStat &stat, const int32_t frames, const int32_t chunkSize)
+{
+    std::lock_guard<std::mutex> lock(stat.mtx_);
+    uint32_t expect = StreamStat::hash(g_cos_wave->data_, g_cos_wave->size_);
+    LOG_DEBUG("%s begin:%d end:%d frame:%d <%s>\n", name, stat.begins_, stat.ends_, stat.frames_,
+              ((stat.begins_ == frames) && (stat.ends_ == frames) && (stat.frames_ == 0) && stat.ordered_) ? "OK" : "NG");
+    LOG_DEBUG("%s size:%d total:%d chunk:%d <%s>\n", name, stat.size_, stat.total_, stat.maxChunk_,
+              ((stat.size_ == g_cos_wave->size_) && (stat.total_ == g_cos_wave->size_) && (stat.maxChunk_ > 0) && (stat.maxChunk_ <= chunkSize)) ? "OK" : "NG");
+    LOG_DEBUG("%s hash:0x%x <%s>\n", name, stat.hash_, (stat.hash_ == expect) ? "OK" : "NG");
+}
+
+static void test4_11()
+{
+    Logger::init();
+    for (int32_t i = 0; i < 2; i++)
+    {
+        bool nonBlocking = (i == 0);
+        LOG_DEBUG("nonBlocking:%d\n", nonBlocking);
+        StreamServer server;
+        server.server().setNonBlocking(nonBlocking);
+        server.server().setStreaming(16 * 1024);
+        server.start();
+        wait_time(1000);
+
+        StreamClient reciever;
+        Client client;
+        client.setNonBlocking(nonBlocking);
+        client.setStreaming(4 * 1024);
+        // 相手がストリーミング受信する場合は、圧縮を有効にしても圧縮フレームを送らない
+        client.setCompression(1024);
+        client.start(&reciever);
+        wait_time(1000);
+        for (int32_t n = 0; n < 2; n++)
+        {
+            (void)client.sendData(g_cos_wave->data_, g_cos_wave->size_);
+            wait_time(1000);
+        }
+        check_stream("server", server.stat_, 2, 16 * 1024);
+        check_stream("client", reciever.stat_, 2, 4 * 1024);
+
+        // フレームの途中で切断した場合は、完了ではなく中断を通知する
+        ClientSocket sock;
+        if (sock.do_create() && sock.do_connect("127.0.0.1", 9876))
+        {
+            Header header;
+            header.size_ = 100000;
+            (void)::send(sock.get(), &header, sizeof(header), MSG_NOSIGNAL);
+            (void)::send(sock.get(), g_cos_wave->data_, 1000, MSG_NOSIGNAL);
+            wait_time(500);
+            sock.do_disconnect();
+            sock.do_delete();
+        }
+        wait_time(500);
+        {
+            std::lock_guard<std::mutex> lock(server.stat_.mtx_);
+            LOG_DEBUG("abort begin:%d abort:%d total:%d <%s>\n", server.stat_.begins_, server.stat_.aborts_, server.stat_.total_,
+                      ((server.stat_.begins_ == 3) && (server.stat_.aborts_ == 1) && (server.stat_.total_ == 1000) && server.stat_.ordered_) ? "OK" : "NG");
+        }
+        client.end();
+        server.end();
+    }
+    Logger::deinit();
+}
+
+// AF_UNIXのストリームソケットで接続(パス・抽象名前空間)
+// TCPと同じAPIで要求・応答と大きなフレームを送受信でき、残ったソケットファイルは作り直すこと
+static void test4_12()
+{
+    Logger::init();
+    static const char UNIX_PATH[] = "/tmp/MySocketTest.sock";
+    const std::string addresses[] = {std::string("unix:") + UNIX_PATH, "unix:@MySocketTest"};
+    for (const std::string &address : addresses)
+    {
+        for (int32_t i = 0; i < 2; i++)
+        {
+            bool nonBlocking = (i == 0);
+            LOG_DEBUG("address:%s nonBlocking:%d\n", address.c_str(), nonBlocking);
+            // 前回の実行で残ったソケットファイル
+            (void)::unlink(UNIX_PATH);
+            bool isPath = (address.find('@') == std::string::npos);
+            if (isPath)
+            {
+                SOCKET stale = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                struct sockaddr_un sa;
+                std::memset(&sa, 0, sizeof(sa));
+                sa.sun_family = AF_UNIX;
+                std::strncpy(sa.sun_path, UNIX_PATH, sizeof(sa.sun_path) - 1);
+                (void)::bind(stale, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa));
+                ::close(stale);
+            }
+
+            Responder responder;
+            responder.server().setAddress(address);
+            responder.server().setNonBlocking(nonBlocking);
+            responder.start();
+            wait_time(1000);
+            // リッスン中のアドレスにはバインドしない
+            Responder other;
+            other.server().setAddress(address);
+            other.start();
+            wait_time(500);
+            other.end();
+
+            Client client(Logger::add("<Caller>"));
+            client.setAddress(address);
+            client.setNonBlocking(nonBlocking);
+            client.start(nullptr);
+            wait_time(1000);
+            int32_t request[2] = {Responder::OP_DOUBLE, 21};
+            CallResult result = client.call(reinterpret_cast<const char *>(request), static_cast<int32_t>(sizeof(request)), 3000).get();
+            int32_t value = reply_value(result);
+            LOG_DEBUG("unix call:%d <%s>\n", value, (value == 42) ? "OK" : "NG");
+            client.end();
+            responder.end();
+            if (isPath)
+            {
+                bool removed = (::access(UNIX_PATH, F_OK) != 0);
+                LOG_DEBUG("unix unlink:%d <%s>\n", removed, removed ? "OK" : "NG");
+            }
+
+            StreamServer server;
+            server.server().setAddress(address);
+            server.server().setNonBlocking(nonBlocking);
+            server.server().setStreaming(64 * 1024);
+            server.start();
+            wait_time(1000);
+            StreamClient reciever;
+            Client streamClient;
+            streamClient.setAddress(address);
+            streamClient.setNonBlocking(nonBlocking);
+            streamClient.setStreaming(64 * 1024);
+            streamClient.start(&reciever);
+            wait_time(1000);
+            (void)streamClient.sendData(g_cos_wave->data_, g_cos_wave->size_);
+            wait_time(1000);
+            check_stream("server", server.stat_, 1, 64 * 1024);
+            check_stream("client", reciever.stat_, 1, 64 * 1024);
+            streamClient.end();
+            server.end();
+        }
+    }
+    Logger::deinit();
+}
+
+// 共有メモリのリングで受信したフレームをそのまま送り返すサーバ
+class ShmEcho : public Server::Reciever
+{
+public:
+    ShmServer server_;
+    std::atomic<int64_t> lastId_;
+
+public:
+    ShmEcho();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+ShmEcho::ShmEcho() : server_(Logger::add("<ShmEcho>")), lastId_(0)
+{
+}
+
+void ShmEcho::recieveData(const int64_t id, const char *data, const int32_t size)
+{
+    lastId_ = id;
+    (void)server_.sendData(id, data, size);
+}
+
+// 受信したフレームのサイズとハッシュを記録する
+class ShmCollector : public Client::Reciever
+{
+public:
+    std::mutex mtx_;
+    std::vector<std::pair<int32_t, uint32_t>> frames_;
+
+public:
+    bool wait(const size_t count, const int32_t millisecond);
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+bool ShmCollector::wait(const size_t count, const int32_t millisecond)
+{
+    for (int32_t i = 0; i < millisecond / 10; i++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (frames_.size() >= count)
+            {
+                return true;
+            }
+        }
+        wait_time(10);
+    }
+    return false;
+}
+
+void ShmCollector::recieveData(const int64_t, const char *data, const int32_t size)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    frames_.push_back(std::make_pair(size, StreamStat::hash(data, size)));
+}
+
+static void test4_13()
+{
+    Logger::init();
+    ShmEcho echo;
+    echo.server_.setName("MySocketTest");
+    // 3MBの波形がリングを何周もするように小さくする
+    echo.server_.setRingSize(64 * 1024);
+    bool started = echo.server_.start(&echo);
+    LOG_DEBUG("shm start:%d <%s>\n", started, started ? "OK" : "NG");
+    // 使用中の名前では開始しない
+    ShmServer other;
+    other.setName("MySocketTest");
+    bool duplicated = other.start(nullptr);
+    LOG_DEBUG("shm duplicate start:%d <%s>\n", duplicated, !duplicated ? "OK" : "NG");
+
+    ShmCollector collectors[2];
+    ShmClient clients[2];
+    for (int32_t i = 0; i < 2; i++)
+    {
+        clients[i].setName("MySocketTest");
+        clients[i].start(&collectors[i]);
+    }
+    wait_time(500);
+    for (int32_t i = 0; i < 2; i++)
+    {
+        bool connected = clients[i].isConnected();
+        LOG_DEBUG("shm client[%d] connected:%d <%s>\n", i, connected, connected ? "OK" : "NG");
+    }
+    size_t count = echo.server_.connectionCount();
+    LOG_DEBUG("shm connections:%zu <%s>\n", count, (count == 2) ? "OK" : "NG");
+
+    const char small[] = "shm";
+    for (int32_t i = 0; i < 2; i++)
+    {
+        int32_t ret = clients[i].sendData(g_cos_wave->data_, g_cos_wave->size_);
+        ret |= clients[i].sendData(small, static_cast<int32_t>(sizeof(small)));
+        LOG_DEBUG("shm client[%d] send:%d <%s>\n", i, ret, (ret == 0) ? "OK" : "NG");
+    }
+    uint32_t expect = StreamStat::hash(g_cos_wave->data_, g_cos_wave->size_);
+    for (int32_t i = 0; i < 2; i++)
+    {
+        bool recieved = collectors[i].wait(2, 5000);
+        std::lock_guard<std::mutex> lock(collectors[i].mtx_);
+        bool ok = recieved && (collectors[i].frames_.size() == 2) &&
+                  (collectors[i].frames_[0].first == g_cos_wave->size_) && (collectors[i].frames_[0].second == expect) &&
+                  (collectors[i].frames_[1].first == static_cast<int32_t>(sizeof(small)));
+        LOG_DEBUG("shm client[%d] echo:%zu <%s>\n", i, collectors[i].frames_.size(), ok ? "OK" : "NG");
+    }
+
+    // 切断したクライアントは接続テーブルから削除され、そのIDには送信できない
+    int64_t lastId = echo.lastId_;
+    clients[1].end();
+    wait_time(500);
+    count = echo.server_.connectionCount();
+    LOG_DEBUG("shm connections after end:%zu <%s>\n", count, (count == 1) ? "OK" : "NG");
+    int32_t ret = echo.server_.sendData(lastId, small, static_cast<int32_t>(sizeof(small)));
+    LOG_DEBUG("shm send stale id:%d <%s>\n", ret, (ret == -1) ? "OK" : "NG");
+
+    // サーバを再起動するとクライアントは再接続する
+    echo.server_.end();
+    wait_time(500);
+    bool connected = clients[0].isConnected();
+    LOG_DEBUG("shm disconnected:%d <%s>\n", connected, !connected ? "OK" : "NG");
+    started = echo.server_.start(&echo);
+    wait_time(1000);
+    connected = clients[0].isConnected();
+    LOG_DEBUG("shm reconnected:%d <%s>\n", connected, (started && connected) ? "OK" : "NG");
+    {
+        std::lock_guard<std::mutex> lock(collectors[0].mtx_);
+        collectors[0].frames_.clear();
+    }
+    (void)clients[0].sendData(g_sin_wave->data_, g_sin_wave->size_);
+    bool recieved = collectors[0].wait(1, 5000);
+    LOG_DEBUG("shm echo after reconnect:%d <%s>\n", recieved, recieved ? "OK" : "NG");
+
+    clients[0].end();
+    echo.server_.end();
+
+    // 受け取ったmemfdがリング2つ分より小さい場合は接続しない
+    bool rejected = false;
+    ShmChannel owner;
+    if (owner.create(64 * 1024))
+    {
+        int32_t fds[ShmChannel::FD_NUM];
+        for (int32_t i = 0; i < ShmChannel::FD_NUM; i++)
+        {
+            fds[i] = ::dup(owner.fds()[i]);
+        }
+        rejected = (::ftruncate(fds[0], 4096) == 0);
+        ShmChannel peer;
+        rejected = rejected && !peer.attach(fds, 64 * 1024, false);
+    }
+    LOG_DEBUG("shm short memfd rejected:%d <%s>\n", rejected, rejected ? "OK" : "NG");
+    Logger::deinit();
+}
+
+static void test4_14()
+{
+    Logger::init();
+    for (int32_t i = 0; i < 2; i++)
+    {
+        bool nonBlocking = (i == 0);
+        LOG_DEBUG("nonBlocking:%d\n", nonBlocking);
+        Responder responder;
+        responder.server().setBacklog(128);
+        responder.server().setNonBlocking(nonBlocking);
+        responder.start();
+        wait_time(1000);
+
+        // リアクタが受け付ける前に多数の接続を一度に張る
+        static constexpr int32_t CONN_NUM = 200;
+        std::vector<SOCKET> socks;
+        struct sockaddr_in sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(9876);
+        (void)::inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+        for (int32_t n = 0; n < CONN_NUM; n++)
+        {
+            SOCKET sock = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (::connect(sock, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) == 0)
+            {
+                socks.emplace_back(sock);
+            }
+            else
+            {
+                ::close(sock);
+            }
+        }
+        for (int32_t n = 0; (n < 100) && (responder.server().getLoopStats()[0].connections_ < CONN_NUM); n++)
+        {
+            wait_time(10);
+        }
+        int32_t connections = responder.server().getLoopStats()[0].connections_;
+        LOG_DEBUG("accept connections:%d <%s>\n", connections, ((socks.size() == CONN_NUM) && (connections == CONN_NUM)) ? "OK" : "NG");
+
+        AcceptStat stat = responder.server().getAcceptStat();
+        LOG_DEBUG("accept stat accepted:%llu batches:%llu max:%llu errors:%llu\n",
+                  static_cast<unsigned long long>(stat.accepted_), static_cast<unsigned long long>(stat.batches_),
+                  static_cast<unsigned long long>(stat.maxBatch_), static_cast<unsigned long long>(stat.errors_));
+        bool ok = (stat.accepted_ == CONN_NUM) && (stat.batches_ >= 1) && (stat.batches_ <= stat.accepted_) &&
+                  (stat.maxBatch_ >= 1) && (stat.errors_ == 0);
+        LOG_DEBUG("accept stat <%s>\n", ok ? "OK" : "NG");
+        LOG_DEBUG("accept backlog:%u queued:%u <%s>\n", stat.backlog_, stat.queued_, ((stat.backlog_ == 128) && (stat.queued_ == 0)) ? "OK" : "NG");
+        LOG_DEBUG("accept listen overflows:%llu drops:%llu\n",
+                  static_cast<unsigned long long>(stat.listenOverflows_), static_cast<unsigned long long>(stat.listenDrops_));
+
+        // 受け付けた接続で通信できる
+        Client client(Logger::add("<Caller>"));
+        client.setNonBlocking(nonBlocking);
+        client.start(nullptr);
+        wait_time(1000);
+        int32_t request[2] = {Responder::OP_DOUBLE, 21};
+        CallResult result = client.call(reinterpret_cast<const char *>(request), static_cast<int32_t>(sizeof(request)), 3000).get();
+        int32_t value = reply_value(result);
+        LOG_DEBUG("accept call:%d <%s>\n", value, (value == 42) ? "OK" : "NG");
+        client.end();
+
+        for (SOCKET sock : socks)
+        {
+            ::close(sock);
+        }
+        for (int32_t n = 0; (n < 100) && (responder.server().getLoopStats()[0].connections_ > 0); n++)
+        {
+            wait_time(10);
+        }
+        connections = responder.server().getLoopStats()[0].connections_;
+        LOG_DEBUG("accept disconnect:%d <%s>\n", connections, (connections == 0) ? "OK" : "NG");
+        responder.end();
+    }
+    Logger::deinit();
+}
+
+// 受信したデータとRPCの要求をそのまま送り返すサーバ
+class LoopEcho : public Server::Reciever
+{
+public:
+    Server server_;
+
+public:
+    LoopEcho();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+    virtual void recieveRequest(const int64_t id, const uint32_t requestId, const char *data, const int32_t size) override;
+};
+
+LoopEcho::LoopEcho() : server_(Logger::add("<LoopEcho>"))
+{
+}
+
+void LoopEcho::recieveData(const int64_t id, const char *data, const int32_t size)
+{
+    (void)server_.sendData(id, data, size);
+}
+
+void LoopEcho::recieveRequest(const int64_t id, const uint32_t requestId, const char *data, const int32_t size)
+{
+    // 空の要求には応答しない(応答待ちの期限を確認する)
+    if (size > 0)
+    {
+        (void)server_.reply(id, requestId, data, size);
+    }
+}
+
+// ClientLoopで受信したデータの数とサイズを数える
+class LoopUser : public Client::Reciever
+{
+public:
+    std::atomic<int32_t> frames_{0};
+    std::atomic<int64_t> bytes_{0};
+
+public:
+    bool wait(const int32_t frames, const int32_t millisecond);
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+bool LoopUser::wait(const int32_t frames, const int32_t millisecond)
+{
+    for (int32_t i = 0; (i < millisecond / 10) && (frames_ < frames); i++)
+    {
+        wait_time(10);
+    }
+    return frames_ >= frames;
+}
+
+void LoopUser::recieveData(const int64_t, const char *, const int32_t size)
+{
+    bytes_ += size;
+    frames_++;
+}
+
+static int32_t thread_count()
+{
+    int32_t count = 0;
+    DIR *dir = ::opendir("/proc/self/task");
+    if (dir == nullptr)
+    {
+        return 0;
+    }
+    while (struct dirent *entry = ::readdir(dir))
+    {
+        count += (entry->d_name[0] != '.') ? 1 : 0;
+    }
+    ::closedir(dir);
+    return count;
+}
+
+static bool wait_writable(std::unique_ptr<Client> *clients, const int32_t num, const int32_t millisecond)
+{
+    for (int32_t i = 0; i < millisecond / 10; i++)
+    {
+        int32_t writable = 0;
+        for (int32_t n = 0; n < num; n++)
+        {
+            writable += clients[n]->isWritable() ? 1 : 0;
+        }
+        if (writable == num)
+        {
+            return true;
+        }
+        wait_time(10);
+    }
+    return false;
+}
+
+static void test4_15()
+{
+    Logger::init();
+    LoopEcho echo;
+    echo.server_.start(&echo);
+    wait_time(500);
+
+    ClientLoop loop(Logger::add("<ClientLoop>"));
+    loop.setThreadNum(2);
+    bool started = loop.start();
+    LOG_DEBUG("loop start:%d <%s>\n", started, started ? "OK" : "NG");
+
+    // Clientごとにスレッドを起動しない
+    static constexpr int32_t CLIENT_NUM = 40;
+    LoopUser users[CLIENT_NUM];
+    std::unique_ptr<Client> clients[CLIENT_NUM];
+    int32_t threads = thread_count();
+    for (int32_t i = 0; i < CLIENT_NUM; i++)
+    {
+        clients[i].reset(new Client());
+        clients[i]->setLoop(&loop);
+        clients[i]->start(&users[i]);
+    }
+    bool connected = wait_writable(clients, CLIENT_NUM, 3000);
+    LOG_DEBUG("loop connected:%d <%s>\n", connected, connected ? "OK" : "NG");
+    int32_t added = thread_count() - threads;
+    LOG_DEBUG("loop threads:%d <%s>\n", added, (added == 0) ? "OK" : "NG");
+    size_t count = loop.clientCount();
+    LOG_DEBUG("loop clients:%zu <%s>\n", count, (count == CLIENT_NUM) ? "OK" : "NG");
+
+    // それぞれのRecieverに送り返される
+    const char small[64] = "loop";
+    for (int32_t i = 0; i < CLIENT_NUM; i++)
+    {
+        (void)clients[i]->sendData(small, static_cast<int32_t>(sizeof(small)));
+    }
+    (void)clients[0]->sendData(g_sin_wave->data_, g_sin_wave->size_);
+    bool ok = users[0].wait(2, 5000) && (users[0].bytes_ == static_cast<int64_t>(sizeof(small)) + g_sin_wave->size_);
+    for (int32_t i = 1; i < CLIENT_NUM; i++)
+    {
+        ok = ok && users[i].wait(1, 3000) && (users[i].bytes_ == static_cast<int64_t>(sizeof(small)));
+    }
+    LOG_DEBUG("loop echo <%s>\n", ok ? "OK" : "NG");
+
+    int32_t request[2] = {Responder::OP_DOUBLE, 21};
+    CallResult result = clients[1]->call(reinterpret_cast<const char *>(request), static_cast<int32_t>(sizeof(request)), 3000).get();
+    ok = (result.status_ == CallResult::Status::OK) && (result.size() == static_cast<int32_t>(sizeof(request)));
+    LOG_DEBUG("loop call <%s>\n", ok ? "OK" : "NG");
+
+    // 応答待ちの期限はループのタイマーで通知する(RPCの監視スレッドを起動しない)
+    auto sta = std::chrono::steady_clock::now();
+    result = clients[1]->call(nullptr, 0, 200).get();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - sta).count();
+    added = thread_count() - threads;
+    ok = (result.status_ == CallResult::Status::TIMEOUT) && (ms >= 200) && (ms < 1000) && (added == 0);
+    LOG_DEBUG("loop call timeout ms:%lld threads:%d <%s>\n", static_cast<long long>(ms), added, ok ? "OK" : "NG");
+
+    // 接続できない相手への接続中も、他のClientの処理は止まらない
+    LoopUser refusedUser;
+    Client refused;
+    refused.setAddress("127.0.0.1", 9879);
+    refused.setLoop(&loop);
+    refused.start(&refusedUser);
+    wait_time(300);
+    int32_t frames = users[2].frames_;
+    (void)clients[2]->sendData(small, static_cast<int32_t>(sizeof(small)));
+    ok = users[2].wait(frames + 1, 3000) && !refused.isWritable();
+    LOG_DEBUG("loop refused <%s>\n", ok ? "OK" : "NG");
+    refused.end();
+
+    // サーバが再起動すると再接続する
+    echo.server_.end();
+    wait_time(500);
+    echo.server_.start(&echo);
+    connected = wait_writable(clients, CLIENT_NUM, 5000);
+    LOG_DEBUG("loop reconnected:%d <%s>\n", connected, connected ? "OK" : "NG");
+    frames = users[3].frames_;
+    (void)clients[3]->sendData(small, static_cast<int32_t>(sizeof(small)));
+    ok = users[3].wait(frames + 1, 3000);
+    LOG_DEBUG("loop echo after reconnect <%s>\n", ok ? "OK" : "NG");
+
+    // ループの実行中と停止後のどちらでも終了できる
+    for (int32_t i = 0; i < CLIENT_NUM / 2; i++)
+    {
+        clients[i]->end();
+    }
+    count = loop.clientCount();
+    LOG_DEBUG("loop clients after end:%zu <%s>\n", count, (count == CLIENT_NUM / 2) ? "OK" : "NG");
+    loop.end();
+    bool disconnected = !clients[CLIENT_NUM - 1]->isWritable();
+    LOG_DEBUG("loop disconnected:%d <%s>\n", disconnected, disconnected ? "OK" : "NG");
+    for (int32_t i = CLIENT_NUM / 2; i < CLIENT_NUM; i++)
+    {
+        clients[i]->end();
+    }
+    count = loop.clientCount();
+    LOG_DEBUG("loop clients after loop end:%zu <%s>\n", count, (count == 0) ? "OK" : "NG");
+    echo.server_.end();
+    Logger::deinit();
+}
+
+// 切断中の送信データの保持(アウトボックス)
+// サーバの起動前に送信したデータが、接続した時点で順序を保って届くこと(自身のスレッドとClientLoopの両方)
+// 保持の上限・期限を超えたデータは捨てられ、統計に数えられること
+static void test4_16()
+{
+    Logger::init();
+    static constexpr int32_t SEND_NUM = 100;
+    {
+        Sequencer sequencer;
+        ClientLoop loop(Logger::add("<ClientLoop>"));
+        (void)loop.start();
+        Client clients[2];
+        clients[1].setLoop(&loop);
+        for (Client &client : clients)
+        {
+            client.setOutbox(64 * 1024);
+            client.start(nullptr);
+        }
+
+        // サーバが起動していなくても、呼出し元をブロックせずに受け付ける
+        auto start = std::chrono::steady_clock::now();
+        int32_t failed = 0;
+        for (int32_t i = 0; i < SEND_NUM; i++)
+        {
+            for (Client &client : clients)
+            {
+                failed += (client.sendData(reinterpret_cast<const char *>(&i), static_cast<int32_t>(sizeof(i))) != 0) ? 1 : 0;
+            }
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOG_DEBUG("outbox hold failed:%d elapsed:%lldms <%s>\n", failed, static_cast<long long>(elapsed), ((failed == 0) && (elapsed < 100)) ? "OK" : "NG");
+        OutboxStat stat = clients[0].getOutboxStat();
+        bool ok = (stat.queued_ == SEND_NUM) && (stat.frames_ == SEND_NUM) && (stat.bytes_ == SEND_NUM * sizeof(int32_t));
+        LOG_DEBUG("outbox frames:%llu bytes:%llu <%s>\n", static_cast<unsigned long long>(stat.frames_), static_cast<unsigned long long>(stat.bytes_), ok ? "OK" : "NG");
+
+        // 接続した時点で保持していたデータを送信する
+        sequencer.start();
+        for (int32_t n = 0; (n < 500) && (sequencer.count() < 2 * SEND_NUM); n++)
+        {
+            wait_time(10);
+        }
+        LOG_DEBUG("outbox flush count:%d <%s>\n", sequencer.count(), (sequencer.count() == 2 * SEND_NUM) ? "OK" : "NG");
+        LOG_DEBUG("outbox flush order error:%d <%s>\n", sequencer.error(), (sequencer.error() == 0) ? "OK" : "NG");
+        for (Client &client : clients)
+        {
+            stat = client.getOutboxStat();
+            ok = (stat.flushed_ == SEND_NUM) && (stat.frames_ == 0) && (stat.bytes_ == 0);
+            LOG_DEBUG("outbox flushed:%llu <%s>\n", static_cast<unsigned long long>(stat.flushed_), ok ? "OK" : "NG");
+        }
+
+        // 接続中の送信は保持しない
+        for (int32_t i = SEND_NUM; i < 2 * SEND_NUM; i++)
+        {
+            (void)clients[0].sendData(reinterpret_cast<const char *>(&i), static_cast<int32_t>(sizeof(i)));
+        }
+        for (int32_t n = 0; (n < 500) && (sequencer.count() < 3 * SEND_NUM); n++)
+        {
+            wait_time(10);
+        }
+        stat = clients[0].getOutboxStat();
+        ok = (sequencer.count() == 3 * SEND_NUM) && (sequencer.error() == 0) && (stat.queued_ == SEND_NUM);
+        LOG_DEBUG("outbox connected count:%d queued:%llu <%s>\n", sequencer.count(), static_cast<unsigned long long>(stat.queued_), ok ? "OK" : "NG");
+
+        for (Client &client : clients)
+        {
+            client.end();
+        }
+        loop.end();
+        sequencer.end();
+    }
+
+    // 上限を超えた場合は、指定した側のデータを捨てる
+    const char data[300] = {};
+    for (int32_t i = 0; i < 2; i++)
+    {
+        Client::OutboxDrop drop = (i == 0) ? Client::OutboxDrop::NEWEST : Client::OutboxDrop::OLDEST;
+        Client client;
+        client.setAddress("127.0.0.1", 9879);
+        client.setOutbox(1000, 0, drop);
+        client.start(nullptr);
+        int32_t rets[4];
+        for (int32_t &ret : rets)
+        {
+            ret = client.sendData(data, static_cast<int32_t>(sizeof(data)));
+        }
+        int32_t last = (drop == Client::OutboxDrop::NEWEST) ? -1 : 0;
+        OutboxStat stat = client.getOutboxStat();
+        bool ok = (rets[0] == 0) && (rets[1] == 0) && (rets[2] == 0) && (rets[3] == last) &&
+                  (stat.droppedOverflow_ == 1) && (stat.frames_ == 3) && (stat.bytes_ == 3 * sizeof(data));
+        LOG_DEBUG("outbox overflow drop:%s ret:%d dropped:%llu <%s>\n", (i == 0) ? "NEWEST" : "OLDEST", rets[3],
+                  static_cast<unsigned long long>(stat.droppedOverflow_), ok ? "OK" : "NG");
+        client.end();
+    }
+
+    // 期限を過ぎたデータは送信せずに捨てる
+    {
+        Client client;
+        client.setAddress("127.0.0.1", 9879);
+        client.setOutbox(1000, 100);
+        client.start(nullptr);
+        (void)client.sendData(data, static_cast<int32_t>(sizeof(data)));
+        (void)client.sendData(data, static_cast<int32_t>(sizeof(data)));
+        wait_time(300);
+        OutboxStat stat = client.getOutboxStat();
+        bool ok = (stat.droppedExpired_ == 2) && (stat.frames_ == 0) && (stat.bytes_ == 0);
+        LOG_DEBUG("outbox expired:%llu <%s>\n", static_cast<unsigned long long>(stat.droppedExpired_), ok ? "OK" : "NG");
+        client.end();
+    }
+    Logger::deinit();
+}
+
+// 開くまで受信データの処理を止める(先頭4バイトの連番で受信順を確かめる)
+class Gate : public Server::Reciever
+{
+public:
+    Server server_;
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool open_ = false;
+    int32_t frames_ = 0;
+    int32_t error_ = 0;
+
+public:
+    Gate();
+    void open();
+    bool wait(const int32_t frames, const int32_t millisecond);
+    int32_t error();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+Gate::Gate() : server_(Logger::add("<Gate>"))
+{
+}
+
+void Gate::open()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    open_ = true;
+    cv_.notify_all();
+}
+
+bool Gate::wait(const int32_t frames, const int32_t millisecond)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return cv_.wait_for(lock, std::chrono::milliseconds(millisecond), [&]()
+                        { return frames_ >= frames; });
+}
+
+int32_t Gate::error()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return error_;
+}
+
+void Gate::recieveData(const int64_t, const char *data, const int32_t size)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [&]()
+             { return open_; });
+    int32_t seq = -1;
+    if (size >= static_cast<int32_t>(sizeof(seq)))
+    {
+        std::memcpy(&seq, data, sizeof(seq));
+    }
+    if (seq != frames_)
+    {
+        error_++;
+    }
+    frames_++;
+    cv_.notify_all();
+}
+
+// 受信のフロー制御
+// 処理待ちの受信データが高水位を超えると受信を止め、送信元の送信キューに背圧がかかること
+// 処理が進んで受信を再開すると、全てのデータが順序を保って届くこと
+static void test4_17()
+{
+    Logger::init();
+    static constexpr int32_t SEND_NUM = 4000;
+    static constexpr int32_t SEND_SIZE = 8 * 1024;
+    std::vector<char> data(SEND_SIZE, 'f');
+    for (int32_t i = 0; i < 3; i++)
+    {
+        // 0:バイト数の水位(ノンブロッキング) 1:フレーム数の水位(ブロッキング) 2:フロー制御なし
+        const char *names[] = {"bytes", "frames", "none"};
+        ThreadPool pool(2, 1024, false);
+        Gate gate;
+        gate.server_.setNonBlocking(i != 1);
+        gate.server_.setThreadPool(&pool);
+        if (i == 0)
+        {
+            gate.server_.setRecieveWatermark(256 * 1024, 64 * 1024);
+        }
+        else if (i == 1)
+        {
+            gate.server_.setRecieveWatermark(0, 0, 16, 4);
+        }
+        gate.server_.start(&gate);
+        wait_time(500);
+
+        Client client(Logger::add("<Producer>"));
+        client.setAsyncSend(true);
+        client.setSendWatermark(1024 * 1024, 256 * 1024);
+        client.start(nullptr);
+        wait_time(500);
+
+        // 処理を止めたまま、カーネルのソケットバッファより多く送信する
+        for (int32_t seq = 0; seq < SEND_NUM; seq++)
+        {
+            std::memcpy(data.data(), &seq, sizeof(seq));
+            (void)client.sendData(data.data(), SEND_SIZE);
+        }
+        wait_time(1000);
+        bool writable = client.isWritable();
+        Server::LoopStat stat = gate.server_.getLoopStats()[0];
+        uint64_t pauses = stat.recvPauses_;
+        bool ok = (i == 2) ? (writable && (pauses == 0)) : (!writable && (pauses == 1));
+        LOG_DEBUG("flow %s writable:%d pauses:%llu <%s>\n", names[i], writable, static_cast<unsigned long long>(pauses), ok ? "OK" : "NG");
+        if (i != 2)
+        {
+            // 高水位を超えたフレームで通知を止める(受信済みの残りは再開まで保持する)
+            uint64_t limit = (i == 0) ? (256 * 1024 / SEND_SIZE + 1) : (16 + 1);
+            uint64_t frames = stat.traffic_.framesIn_;
+            LOG_DEBUG("flow %s paused frames:%llu <%s>\n", names[i], static_cast<unsigned long long>(frames), (frames == limit) ? "OK" : "NG");
+        }
+
+        // 処理を再開すると受信も再開し、送信キューが捌ける
+        gate.open();
+        ok = gate.wait(SEND_NUM, 10000) && (gate.error() == 0);
+        LOG_DEBUG("flow %s recieved order error:%d <%s>\n", names[i], gate.error(), ok ? "OK" : "NG");
+        for (int32_t n = 0; (n < 100) && !client.isWritable(); n++)
+        {
+            wait_time(10);
+        }
+        LOG_DEBUG("flow %s drained <%s>\n", names[i], client.isWritable() ? "OK" : "NG");
+        client.end();
+        gate.server_.end();
+    }
+    Logger::deinit();
+}
+
+// ソケットオプションのプリセット
+// TCPには設定が反映され、AF_UNIXではTCPのオプションを飛ばして同じように接続できること
+static void test4_18()
+{
+    Logger::init();
+    const SocketOptions presets[] = {SocketOptions::lowLatency(), SocketOptions::bulkThroughput()};
+    const char *names[] = {"lowLatency", "bulkThroughput"};
+    const std::string addresses[] = {"127.0.0.1", "unix:@MySocketTest"};
+    for (int32_t i = 0; i < 2; i++)
+    {
+        for (const std::string &address : addresses)
+        {
+            Responder responder;
+            responder.server().setAddress(address);
+            responder.server().setOptions(presets[i]);
+            responder.start();
+            wait_time(500);
+
+            Client client(Logger::add("<Caller>"));
+            client.setAddress(address);
+            client.setOptions(presets[i]);
+            client.start(nullptr);
+            wait_time(500);
+            int32_t request[2] = {Responder::OP_DOUBLE, 21};
+            CallResult result = client.call(reinterpret_cast<const char *>(request), static_cast<int32_t>(sizeof(request)), 3000).get();
+            int32_t value = reply_value(result);
+            LOG_DEBUG("%s %s call:%d <%s>\n", names[i], address.c_str(), value, (value == 42) ? "OK" : "NG");
+            client.end();
+
+            if (address.find("unix:") == std::string::npos)
+            {
+                // 既定のソケットと比べて、プリセットの値が反映されていること
+                ClientSocket plain;
+                ClientSocket tuned;
+                tuned.setOptions(presets[i]);
+                if (plain.do_create() && plain.do_connect(address, 9876) && tuned.do_create() && tuned.do_connect(address, 9876))
+                {
+                    auto get = [](SOCKET sock, int32_t level, int32_t name)
+                    {
+                        int32_t value = 0;
+                        socklen_t len = sizeof(value);
+                        (void)::getsockopt(sock, level, name, &value, &len);
+                        return value;
+                    };
+                    bool ok = (i == 0) ? ((get(tuned.get(), IPPROTO_TCP, TCP_NODELAY) != 0) && (get(tuned.get(), IPPROTO_TCP, TCP_NOTSENT_LOWAT) == 16 * 1024))
+                                       : ((get(tuned.get(), SOL_SOCKET, SO_SNDBUF) > get(plain.get(), SOL_SOCKET, SO_SNDBUF)) && (get(tuned.get(), SOL_SOCKET, SO_RCVBUF) > get(plain.get(), SOL_SOCKET, SO_RCVBUF)));
+                    LOG_DEBUG("%s applied nodelay:%d notsent:%d sndbuf:%d rcvbuf:%d <%s>\n", names[i], get(tuned.get(), IPPROTO_TCP, TCP_NODELAY), get(tuned.get(), IPPROTO_TCP, TCP_NOTSENT_LOWAT),
+                              get(tuned.get(), SOL_SOCKET, SO_SNDBUF), get(tuned.get(), SOL_SOCKET, SO_RCVBUF), ok ? "OK" : "NG");
+                }
+                else
+                {
+                    LOG_DEBUG("%s connect <NG>\n", names[i]);
+                }
+                plain.do_disconnect();
+                plain.do_delete();
+                tuned.do_disconnect();
+                tuned.do_delete();
+            }
+            responder.end();
+        }
+    }
+    Logger::deinit();
+}
+
+// 受信したデータを送り返し、最後に受信した接続IDを保持する
+class TrafficEcho : public Server::Reciever
+{
+public:
+    Server server_;
+    std::atomic<int64_t> id_{0};
+
+public:
+    TrafficEcho();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+TrafficEcho::TrafficEcho() : server_(Logger::add("<TrafficEcho>"))
+{
+}
+
+void TrafficEcho::recieveData(const int64_t id, const char *data, const int32_t size)
+{
+    id_ = id;
+    (void)server_.sendData(id, data, size);
+}
+
+// 送受信の統計
+// 送受信したバイト数・フレーム数が実際の送受信と一致し、切断後も合計に残ること
+static void test4_19()
+{
+    Logger::init();
+    static constexpr int32_t SEND_NUM = 100;
+    static constexpr int32_t SEND_SIZE = 1000;
+    static constexpr int32_t LARGE_SIZE = 1024 * 1024;
+    const uint64_t frames = SEND_NUM + 1;
+    const uint64_t bytes = SEND_NUM * (SEND_SIZE + sizeof(Header)) + (LARGE_SIZE + sizeof(Header));
+    for (int32_t i = 0; i < 2; i++)
+    {
+        bool nonBlocking = (i == 0);
+        LOG_DEBUG("nonBlocking:%d\n", nonBlocking);
+        TrafficEcho echo;
+        echo.server_.setNonBlocking(nonBlocking);
+        echo.server_.start(&echo);
+        wait_time(500);
+
+        LoopUser user;
+        Client client(Logger::add("<TrafficUser>"));
+        client.setNonBlocking(nonBlocking);
+        client.start(&user);
+        wait_time(500);
+        for (int32_t n = 0; n < SEND_NUM; n++)
+        {
+            (void)client.sendData(g_sin_wave->data_, SEND_SIZE);
+        }
+        // 1回の受信では読み切れない大きなフレーム
+        (void)client.sendData(g_sin_wave->data_, LARGE_SIZE);
+        bool ok = user.wait(static_cast<int32_t>(frames), 10000);
+        LOG_DEBUG("echo frames:%d <%s>\n", user.frames_.load(), ok ? "OK" : "NG");
+
+        TrafficStat cstat = client.getTrafficStat();
+        ok = (cstat.framesOut_ == frames) && (cstat.bytesOut_ == bytes) && (cstat.framesIn_ == frames) && (cstat.bytesIn_ == bytes) &&
+             (cstat.connected_ == 1) && (cstat.connections_ == 1);
+        LOG_DEBUG("client out:%llu/%llu in:%llu/%llu <%s>\n", static_cast<unsigned long long>(cstat.framesOut_), static_cast<unsigned long long>(cstat.bytesOut_),
+                  static_cast<unsigned long long>(cstat.framesIn_), static_cast<unsigned long long>(cstat.bytesIn_), ok ? "OK" : "NG");
+
+        TrafficStat sstat = echo.server_.getTrafficStat();
+        ok = (sstat.framesIn_ == frames) && (sstat.bytesIn_ == bytes) && (sstat.framesOut_ == frames) && (sstat.bytesOut_ == bytes) &&
+             (sstat.partialReads_ > 0) && (sstat.wakeups_ > 0) && (sstat.connected_ == 1) && (sstat.connections_ == 1);
+        LOG_DEBUG("server in:%llu/%llu out:%llu/%llu partial:%llu wakeups:%llu <%s>\n", static_cast<unsigned long long>(sstat.framesIn_), static_cast<unsigned long long>(sstat.bytesIn_),
+                  static_cast<unsigned long long>(sstat.framesOut_), static_cast<unsigned long long>(sstat.bytesOut_),
+                  static_cast<unsigned long long>(sstat.partialReads_), static_cast<unsigned long long>(sstat.wakeups_), ok ? "OK" : "NG");
+
+        // 接続ごとの統計は、ループごとの統計と一致する
+        TrafficStat conn;
+        ok = echo.server_.getConnectionStat(echo.id_, conn) && (conn.bytesIn_ == bytes) && (conn.framesOut_ == frames) &&
+             (echo.server_.getLoopStats()[0].traffic_.bytesIn_ == bytes) && !echo.server_.getConnectionStat(0, conn);
+        LOG_DEBUG("connection stat <%s>\n", ok ? "OK" : "NG");
+
+        // 切断した接続の分も合計に残る
+        client.end();
+        wait_time(500);
+        sstat = echo.server_.getTrafficStat();
+        ok = (sstat.bytesIn_ == bytes) && (sstat.framesOut_ == frames) && (sstat.disconnected_ == 1) && (sstat.connections_ == 0) &&
+             !echo.server_.getConnectionStat(echo.id_, conn);
+        LOG_DEBUG("disconnected:%llu connections:%llu <%s>\n", static_cast<unsigned long long>(sstat.disconnected_), static_cast<unsigned long long>(sstat.connections_), ok ? "OK" : "NG");
+        echo.server_.end();
+    }
+    Logger::deinit();
+}
+
+// 非同期ロガー
+// バイナリファイルに出力したログをデコードすると、snprintfで書式化した結果と一致すること
+static void test4_20()
+{
+    static const char LOG_PATH[] = "/tmp/MySocketTest.log";
+    Logger::init(LOG_PATH);
+    int32_t logid0 = Logger::add("<LogTest0>");
+    int32_t logid1 = Logger::add("<LogTest1>");
+
+    // 書式ごとに、snprintfで書式化した結果と同じになること
+    std::vector<std::string> expected;
+    expected.push_back("<LogTest0>");
+    expected.push_back("\t\t\t<LogTest1>");
+    char wk[256];
+    const char magic[4] = {'S', 'O', 'C', 'X'}; // 終端の'\0'が無い
+    const char *nullText = nullptr;
+    const std::string text = "text";
+#define PRINT_AND_EXPECT(id, ...)                                        \
+    do                                                                   \
+    {                                                                    \
+        Logger::print(id, __VA_ARGS__);                                  \
+        snprintf(&wk[0], sizeof(wk), __VA_ARGS__);                       \
+        expected.push_back(std::string((id == 0) ? "" : "\t\t\t") + wk); \
+    } while (0)
+    PRINT_AND_EXPECT(logid0, "sock:0x%x err:%d", 0x1234, -5);
+    PRINT_AND_EXPECT(logid1, " -> %.3s flags:0x%x sz:%d", magic, 0x80, 1000);
+    PRINT_AND_EXPECT(logid1, "size:%zu remain:%zd ll:%lld ull:%llu", static_cast<size_t>(123456789012ULL), static_cast<ssize_t>(-42), -9000000000LL, 18000000000ULL);
+    PRINT_AND_EXPECT(logid0, "%s:%d %-6s| %5.2f %e %c %%", text.c_str(), 8080, "ab", 3.14159, 1.0e-9, 'Z');
+    PRINT_AND_EXPECT(logid0, "[%*d] [%-*.*s] %hhu %hd %ld", 6, 42, 8, 3, "abcdef", 300, 70000, -1L);
+    PRINT_AND_EXPECT(logid0, "no args");
+    Logger::print(logid0, "null:%s", nullText);
+    expected.push_back("null:(null)");
+
+    // 別スレッドのリングと、リングの折り返し
+    static constexpr int32_t LOOP_NUM = 20000;
+    std::thread th([logid1]() {
+        for (int32_t i = 0; i < LOOP_NUM; i++)
+        {
+            Logger::print(logid1, "thread loop:%d", i);
+            if ((i % 1000) == 999)
+            {
+                Logger::flush();
+            }
+        }
+    });
+    th.join();
+    for (int32_t i = 0; i < LOOP_NUM; i++)
+    {
+        snprintf(&wk[0], sizeof(wk), "\t\t\tthread loop:%d", i);
+        expected.push_back(wk);
+    }
+    Logger::deinit();
+
+    FILE *out = tmpfile();
+    bool isOk = Logger::decode(LOG_PATH, out);
+    rewind(out);
+    std::vector<std::string> lines;
+    char line[2048];
+    while (fgets(&line[0], sizeof(line), out) != nullptr)
+    {
+        std::string decoded(line);
+        if (!decoded.empty() && (decoded.back() == '\n'))
+        {
+            decoded.pop_back();
+        }
+        // 先頭の時刻(HH:MM:SS.uuuuuu )を外す
+        lines.push_back((decoded.size() >= 16) ? decoded.substr(16) : decoded);
+    }
+    fclose(out);
+    unlink(LOG_PATH);
+
+    if (!isOk || (lines.size() != expected.size()))
+    {
+        LOG_DEBUG("<NG> decode:%d lines:%zu expected:%zu\n", isOk, lines.size(), expected.size());
+        return;
+    }
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        if (lines[i] != expected[i])
+        {
+            LOG_DEBUG("<NG> line:%zu [%s] expected:[%s]\n", i, lines[i].c_str(), expected[i].c_str());
+            return;
+        }
+    }
+    LOG_DEBUG("<OK> lines:%zu\n", lines.size());
+
+    // 初期化前と終了後のprintは何もしない
+    Logger::print(logid0, "after deinit:%d", 1);
+
+    // 他のスレッドがprint()中でもdeinit()できる(破棄したLoggerには書き込まない)
+    std::atomic<bool> printing(true);
+    std::atomic<int64_t> printed(0);
+    std::thread printer([&printing, &printed]() {
+        while (printing)
+        {
+            Logger::print(0, "race:%d", 1);
+            printed++;
+        }
+    });
+    for (int32_t i = 0; i < 200; i++)
+    {
+        Logger::init(LOG_PATH);
+        wait_time(1);
+        Logger::deinit();
+    }
+    printing = false;
+    printer.join();
+    unlink(LOG_PATH);
+    LOG_DEBUG("deinit while printing printed:%lld <%s>\n", static_cast<long long>(printed.load()), (printed > 0) ? "OK" : "NG");
+}
+
+class PostEcho : public Server::Reciever
+{
+public:
+    Server server_;
+    std::atomic<int64_t> id_{0};
+    std::mutex mtx_;
+    std::thread::id thread_; // 受信を通知したスレッド
+
+public:
+    PostEcho();
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+PostEcho::PostEcho() : server_(Logger::add("<PostEcho>"))
+{
+}
+
+void PostEcho::recieveData(const int64_t id, const char *data, const int32_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        thread_ = std::this_thread::get_id();
+    }
+    id_ = id;
+    (void)server_.sendData(id, data, size);
+}
+
+class PostUser : public Client::Reciever
+{
+public:
+    std::atomic<int32_t> frames_{0};
+    std::mutex mtx_;
+    std::thread::id thread_; // 受信を通知したスレッド
+
+public:
+    bool wait(const int32_t frames, const int32_t millisecond);
+
+private:
+    virtual void recieveData(const int64_t id, const char *data, const int32_t size) override;
+};
+
+bool PostUser::wait(const int32_t frames, const int32_t millisecond)
+{
+    for (int32_t i = 0; (i < millisecond / 10) && (frames_ < frames); i++)
+    {
+        wait_time(10);
+    }
+    return frames_ >= frames;
+}
+
+void PostUser::recieveData(const int64_t, const char *, const int32_t)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        thread_ = std::this_thread::get_id();
+    }
+    frames_++;
+}
+
+// イベントループへのタスクの投入(post)
+// タスクは受信を通知するスレッドで、スレッドごとに積んだ順に実行されること
+// end()がイベント待ちのタイムアウト(1秒)を待たずに戻ること
+static void test4_21()
+{
+    Logger::init();
+    static constexpr int32_t THREAD_NUM = 4;
+    static constexpr int32_t POST_NUM = 1000;
+    for (int32_t i = 0; i < 2; i++)
+    {
+        bool nonBlocking = (i == 0);
+        LOG_DEBUG("nonBlocking:%d\n", nonBlocking);
+        PostEcho echo;
+        echo.server_.setNonBlocking(nonBlocking);
+        echo.server_.start(&echo);
+        wait_time(500);
+
+        PostUser user;
+        Client client(Logger::add("<PostUser>"));
+        client.setNonBlocking(nonBlocking);
+        client.start(&user);
+        wait_time(500);
+        (void)client.sendData(g_sin_wave->data_, 100);
+        bool ok = user.wait(1, 5000);
+        LOG_DEBUG("echo <%s>\n", ok ? "OK" : "NG");
+
+        // 複数のスレッドからサーバのループに積む(カウンタはループのスレッドだけが触る)
+        std::thread::id serverThread;
+        {
+            std::lock_guard<std::mutex> lock(echo.mtx_);
+            serverThread = echo.thread_;
+        }
+        int32_t executed = 0;
+        int32_t otherThread = 0;
+        int32_t disorder = 0;
+        std::vector<int32_t> last(THREAD_NUM, -1);
+        std::vector<std::thread> threads;
+        for (int32_t t = 0; t < THREAD_NUM; t++)
+        {
+            threads.emplace_back([&, t]()
+                                 {
+                                     for (int32_t n = 0; n < POST_NUM; n++)
+                                     {
+                                         (void)echo.server_.post(echo.id_, [&, t, n]()
+                                                                 {
+                                                                     executed++;
+                                                                     otherThread += (std::this_thread::get_id() != serverThread) ? 1 : 0;
+                                                                     disorder += (n != last[t] + 1) ? 1 : 0;
+                                                                     last[t] = n;
+                                                                 });
+                                     }
+                                 });
+        }
+        for (auto &th : threads)
+        {
+            th.join();
+        }
+        auto done = std::make_shared<std::promise<void>>();
+        std::future<void> future = done->get_future();
+        (void)echo.server_.post(echo.id_, [done]()
+                                { done->set_value(); });
+        ok = (future.wait_for(std::chrono::seconds(1)) == std::future_status::ready) && (executed == THREAD_NUM * POST_NUM) && (otherThread == 0) && (disorder == 0);
+        LOG_DEBUG("server post executed:%d other:%d disorder:%d <%s>\n", executed, otherThread, disorder, ok ? "OK" : "NG");
+
+        // ループのスレッドから送信する
+        (void)echo.server_.post(echo.id_, [&echo]()
+                                { (void)echo.server_.sendData(echo.id_, g_sin_wave->data_, 200); });
+        ok = user.wait(2, 5000) && (echo.server_.post(0, []() {}) == -1);
+        LOG_DEBUG("server post send <%s>\n", ok ? "OK" : "NG");
+
+        // クライアントの受信スレッドで実行する
+        std::thread::id clientThread;
+        {
+            std::lock_guard<std::mutex> lock(user.mtx_);
+            clientThread = user.thread_;
+        }
+        auto posted = std::make_shared<std::promise<std::thread::id>>();
+        std::future<std::thread::id> postedFuture = posted->get_future();
+        client.post([posted]()
+                    { posted->set_value(std::this_thread::get_id()); });
+        ok = (postedFuture.wait_for(std::chrono::seconds(1)) == std::future_status::ready) && (postedFuture.get() == clientThread);
+        LOG_DEBUG("client post <%s>\n", ok ? "OK" : "NG");
+
+        // 終了はイベント待ちのタイムアウトを待たない
+        auto sta = std::chrono::steady_clock::now();
+        client.end();
+        auto clientUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sta).count();
+        sta = std::chrono::steady_clock::now();
+        echo.server_.end();
+        auto serverUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sta).count();
+        ok = (clientUs < 200 * 1000) && (serverUs < 200 * 1000);
+        LOG_DEBUG("end client:%lldus server:%lldus <%s>\n", static_cast<long long>(clientUs), static_cast<long long>(serverUs), ok ? "OK" : "NG");
+    }
+    Logger::deinit();
+}
+
+// 送信の排他(mtx_)を外から保持できるソケット
+class LockableSocket : public ClientSocket
+{
+public:
+    LockableSocket();
+    std::mutex &mutex();
+};
+
+LockableSocket::LockableSocket() : ClientSocket(Logger::add("<Lockable>"))
+{
+}
+
+std::mutex &LockableSocket::mutex()
+{
+    return mtx_;
+}
+
+// 非同期送信モードでループ以外のスレッドから送信
+// 送信はmtx_をロックせずにループに渡すため、mtx_を保持されていても戻り、ループがスレッドごとに積んだ順に送信すること
+static void test4_22()
+{
+    Logger::init();
+    static constexpr int32_t THREAD_NUM = 4;
+    static constexpr int32_t SEND_NUM = 100;
+    static constexpr int32_t TOTAL = THREAD_NUM * SEND_NUM;
+    PostEcho echo;
+    echo.server_.setNonBlocking(true);
+    echo.server_.start(&echo);
+    wait_time(500);
+
+    LockableSocket sock;
+    sock.setAsyncSend(true);
+    bool ok = sock.do_create() && sock.do_connect("127.0.0.1", 9876);
+    LOG_DEBUG("connect <%s>\n", ok ? "OK" : "NG");
+
+    // エコーされたデータ(スレッド番号と通し番号)を受信するループ
+    std::mutex mtx;
+    std::vector<int32_t> last(THREAD_NUM, -1);
+    int32_t frames = 0;
+    int32_t disorder = 0;
+    std::atomic<bool> running{ok};
+    std::thread loop([&]()
+                     {
+                         auto func = [&](int64_t, uint8_t, Buffer &buffer)
+                         {
+                             int32_t data[2] = {0, 0};
+                             if (buffer.size() != static_cast<int32_t>(sizeof(data)))
+                             {
+                                 return;
+                             }
+                             std::memcpy(data, buffer.data(), sizeof(data));
+                             if ((data[0] < 0) || (data[0] >= THREAD_NUM))
+                             {
+                                 return;
+                             }
+                             size_t t = static_cast<size_t>(data[0]);
+                             std::lock_guard<std::mutex> lock(mtx);
+                             disorder += (data[1] != last[t] + 1) ? 1 : 0;
+                             last[t] = data[1];
+                             frames++;
+                         };
+                         while (running)
+                         {
+                             (void)sock.do_recieve_event(func, nullptr, 100);
+                         }
+                     });
+    wait_time(500);
+
+    // mtx_を保持したまま、複数のスレッドから送信する
+    std::atomic<int32_t> sent{0};
+    std::atomic<int32_t> failed{0};
+    std::vector<std::thread> threads;
+    {
+        std::unique_lock<std::mutex> lock(sock.mutex());
+        for (int32_t t = 0; t < THREAD_NUM; t++)
+        {
+            threads.emplace_back([&, t]()
+                                 {
+                                     for (int32_t n = 0; n < SEND_NUM; n++)
+                                     {
+                                         int32_t data[2] = {t, n};
+                                         if (sock.do_send(reinterpret_cast<const char *>(data), static_cast<int32_t>(sizeof(data))) != 0)
+                                         {
+                                             failed++;
+                                         }
+                                         sent++;
+                                     }
+                                 });
+        }
+        for (int32_t i = 0; (i < 100) && (sent < TOTAL); i++)
+        {
+            wait_time(10);
+        }
+        LOG_DEBUG("send while locked sent:%d failed:%d <%s>\n", sent.load(), failed.load(), ((sent == TOTAL) && (failed == 0)) ? "OK" : "NG");
+    }
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+
+    // ロックを外すと、ループが積まれた順に送信する
+    int32_t recieved = 0;
+    for (int32_t i = 0; (i < 500) && (recieved < TOTAL); i++)
+    {
+        wait_time(10);
+        std::lock_guard<std::mutex> lock(mtx);
+        recieved = frames;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        LOG_DEBUG("echo frames:%d disorder:%d <%s>\n", frames, disorder, ((frames == TOTAL) && (disorder == 0)) ? "OK" : "NG");
+    }
+
+    running = false;
+    loop.join();
+    sock.do_disconnect();
+    sock.do_delete();
+    echo.server_.end();
+    Logger::deinit();
+}
+#endif
+
+int32_t main()
+{
+
+    g_sin_wave = new Wave(Wave::Type::SIN, 2 * 1024 * 1024);
+    g_cos_wave = new Wave(Wave::Type::COS, 3 * 1024 * 1024);
+
+    LOG_DEBUG("\n----------- test1_1 START -----------\n");
+    test1_1();
+    LOG_DEBUG("\n----------- test1_1 END -----------\n");
+
+    LOG_DEBUG("\n----------- test1_2 START -----------\n");
+    test1_2();
+    LOG_DEBUG("\n----------- test1_2 END -----------\n");
+
+    LOG_DEBUG("\n----------- test1_3 START -----------\n");
+    test1_3();
+    LOG_DEBUG("\n----------- test1_3 END -----------\n");
+
+    LOG_DEBUG("\n----------- test2_1 START -----------\n");
+    test2_1();
+    LOG_DEBUG("\n----------- test2_1 END -----------\n");
+
+    LOG_DEBUG("\n----------- test3_1 START -----------\n");
+    test3_1();
+    LOG_DEBUG("\n----------- test3_1 END -----------\n");
+
+    LOG_DEBUG("\n----------- test3_2 START -----------\n");
+    test3_2();
+    LOG_DEBUG("\n----------- test3_2 END -----------\n");
+
+#if defined(__linux__)
+    LOG_DEBUG("\n----------- test4_1 START -----------\n");
+    test4_1();
+    LOG_DEBUG("\n----------- test4_1 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_2 START -----------\n");
+    test4_2();
+    LOG_DEBUG("\n----------- test4_2 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_3 START -----------\n");
+    test4_3();
+    LOG_DEBUG("\n----------- test4_3 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_4 START -----------\n");
+    test4_4();
+    LOG_DEBUG("\n----------- test4_4 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_5 START -----------\n");
+    test4_5();
+    LOG_DEBUG("\n----------- test4_5 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_6 START -----------\n");
+    test4_6();
+    LOG_DEBUG("\n----------- test4_6 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_7 START -----------\n");
+    test4_7();
+    LOG_DEBUG("\n----------- test4_7 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_8 START -----------\n");
+    test4_8();
+    LOG_DEBUG("\n----------- test4_8 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_9 START -----------\n");
+    test4_9();
+    LOG_DEBUG("\n----------- test4_9 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_10 START -----------\n");
+    test4_10();
+    LOG_DEBUG("\n----------- test4_10 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_11 START -----------\n");
+    test4_11();
+    LOG_DEBUG("\n----------- test4_11 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_12 START -----------\n");
+    test4_12();
+    LOG_DEBUG("\n----------- test4_12 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_13 START -----------\n");
+    test4_13();
+    LOG_DEBUG("\n----------- test4_13 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_14 START -----------\n");
+    test4_14();
+    LOG_DEBUG("\n----------- test4_14 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_15 START -----------\n");
+    test4_15();
+    LOG_DEBUG("\n----------- test4_15 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_16 START -----------\n");
+    test4_16();
+    LOG_DEBUG("\n----------- test4_16 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_17 START -----------\n");
+    test4_17();
+    LOG_DEBUG("\n----------- test4_17 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_18 START -----------\n");
+    test4_18();
+    LOG_DEBUG("\n----------- test4_18 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_19 START -----------\n");
+    test4_19();
+    LOG_DEBUG("\n----------- test4_19 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_20 START -----------\n");
+    test4_20();
+    LOG_DEBUG("\n----------- test4_20 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_21 START -----------\n");
+    test4_21();
+    LOG_DEBUG("\n----------- test4_21 END -----------\n");
+
+    LOG_DEBUG("\n----------- test4_22 START -----------\n");
+    test4_22();
+    LOG_DEBUG("\n----------- test4_22 END -----------\n");
+#endif
 
     delete g_sin_wave;
     delete g_cos_wave;
@@ -29,21 +29,21 @@
 
 namespace
 {
-    Logger *logger = nullptr;
+    ThreadLogger *logger = nullptr;
 }
 
-void Logger::createInstance()
+void ThreadLogger::createInstance()
 {
     if (logger == nullptr)
     {
-        logger = new Logger;
+        logger = new ThreadLogger;
     }
 }
-Logger *Logger::getInstance()
+ThreadLogger *ThreadLogger::getInstance()
 {
     return logger;
 }
-void Logger::freeInstance()
+void ThreadLogger::freeInstance()
 {
     if (logger != nullptr)
     {
@@ -52,7 +52,7 @@ void Logger::freeInstance()
     }
 }
 
-void Logger::addThread(std::thread::id id, std::string name)
+void ThreadLogger::addThread(std::thread::id id, std::string name)
 {
     std::lock_guard<std::mutex> lock(mtx_);
     LogThread log;
@@ -63,7 +63,7 @@ void Logger::addThread(std::thread::id id, std::string name)
     print();
 }
 
-void Logger::updateThread(std::thread::id id, LogThread::State state)
+void ThreadLogger::updateThread(std::thread::id id, LogThread::State state)
 {
     for (size_t i = 0; i < logthreads.size(); i++)
     {
@@ -76,7 +76,7 @@ void Logger::updateThread(std::thread::id id, LogThread::State state)
     print();
 }
 
-size_t Logger::addQueue(LogQueue::State state)
+size_t ThreadLogger::addQueue(LogQueue::State state)
 {
     std::lock_guard<std::mutex> lock(mtx_);
     LogQueue log;
@@ -86,7 +86,7 @@ size_t Logger::addQueue(LogQueue::State state)
     return logqueues.size() - 1;
 }
 
-void Logger::updateQueue(size_t idx, std::thread::id id, LogQueue::State state)
+void ThreadLogger::updateQueue(size_t idx, std::thread::id id, LogQueue::State state)
 {
     if (idx >= logqueues.size())
     {
@@ -98,7 +98,7 @@ void Logger::updateQueue(size_t idx, std::thread::id id, LogQueue::State state)
     print();
 }
 
-void Logger::print()
+void ThreadLogger::print()
 {
     LOG_DEBUG("\x1B[2J\x1B[H");
 
@@ -161,13 +161,19 @@ void Logger::print()
     }
 }
 
-ThreadPool::ThreadPool(const int32_t threadCount, const int32_t queueSize) : queue_(queueSize), isRunning_(true)
+ThreadPool::ThreadPool(const int32_t threadCount, const int32_t queueSize, const bool trace) : queue_(queueSize, trace), isRunning_(true), trace_(trace)
 {
-    Logger::createInstance();
+    if (trace_)
+    {
+        ThreadLogger::createInstance();
+    }
     for (size_t i = 0; i < static_cast<size_t>(threadCount); i++)
     {
         threads_.emplace_back(std::thread(&ThreadPool::main_task, this));
-        Logger::getInstance()->addThread(threads_[i].get_id(), "TH" + std::to_string(i));
+        if (trace_)
+        {
+            ThreadLogger::getInstance()->addThread(threads_[i].get_id(), "TH" + std::to_string(i));
+        }
 #ifdef WIN32
         std::wstring name = L"WokerThread" + std::to_wstring(i);
         SetThreadDescription(threads_.at(i).native_handle(), name.c_str());
@@ -187,7 +193,10 @@ ThreadPool::~ThreadPool()
     {
         threads_.at(i).join();
     }
-    Logger::freeInstance();
+    if (trace_)
+    {
+        ThreadLogger::freeInstance();
+    }
 }
 
 bool ThreadPool::add(std::function<void()> &&func)
@@ -230,7 +239,10 @@ void ThreadPool::main_task()
             {
                 if (!isRunning_)
                 {
-                    Logger::getInstance()->updateThread(std::this_thread::get_id(), LogThread::State::STOP);
+                    if (trace_)
+                    {
+                        ThreadLogger::getInstance()->updateThread(std::this_thread::get_id(), LogThread::State::STOP);
+                    }
                     return;
                 }
                 cv_.wait(lock);
@@ -239,8 +251,14 @@ void ThreadPool::main_task()
             idx = queue_.getIndex();
             assert(result);
         }
-        Logger::getInstance()->updateQueue(idx, std::this_thread::get_id(), LogQueue::State::RUN);
+        if (trace_)
+        {
+            ThreadLogger::getInstance()->updateQueue(idx, std::this_thread::get_id(), LogQueue::State::RUN);
+        }
         func();
-        Logger::getInstance()->updateQueue(idx, std::this_thread::get_id(), LogQueue::State::FINISH);
+        if (trace_)
+        {
+            ThreadLogger::getInstance()->updateQueue(idx, std::this_thread::get_id(), LogQueue::State::FINISH);
+        }
     }
 }
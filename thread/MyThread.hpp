@@ -39,7 +39,7 @@ public:
     State state_;
 };
 
-class Logger
+class ThreadLogger
 {
 private:
     std::mutex mtx_;
@@ -48,7 +48,7 @@ private:
 
 public:
     static void createInstance();
-    static Logger *getInstance();
+    static ThreadLogger *getInstance();
     static void freeInstance();
 
     void addThread(std::thread::id id, std::string name);
@@ -65,11 +65,12 @@ class Queue
 {
 private:
     int32_t size_;
+    bool trace_;
     std::deque<T> deque_;
     std::deque<size_t> deque_index_;
 
 public:
-    Queue(int32_t size) : size_(size), deque_(), deque_index_()
+    Queue(int32_t size, bool trace = true) : size_(size), trace_(trace), deque_(), deque_index_()
     {
     }
 
@@ -77,12 +78,18 @@ public:
     {
         if (size_ <= static_cast<int32_t>(deque_.size()))
         {
-            (void)Logger::getInstance()->addQueue(LogQueue::State::ERR);
+            if (trace_)
+            {
+                (void)ThreadLogger::getInstance()->addQueue(LogQueue::State::ERR);
+            }
             return false;
         }
         deque_.emplace_back(std::move(data));
-        size_t idx = Logger::getInstance()->addQueue(LogQueue::State::WAIT);
-        deque_index_.emplace_back(idx);
+        if (trace_)
+        {
+            size_t idx = ThreadLogger::getInstance()->addQueue(LogQueue::State::WAIT);
+            deque_index_.emplace_back(idx);
+        }
         return true;
     }
 
@@ -90,12 +97,18 @@ public:
     {
         if (size_ <= static_cast<int32_t>(deque_.size()))
         {
-            (void)Logger::getInstance()->addQueue(LogQueue::State::ERR);
+            if (trace_)
+            {
+                (void)ThreadLogger::getInstance()->addQueue(LogQueue::State::ERR);
+            }
             return false;
         }
         deque_.emplace_back(data);
-        size_t idx = Logger::getInstance()->addQueue(LogQueue::State::WAIT);
-        deque_index_.emplace_back(idx);
+        if (trace_)
+        {
+            size_t idx = ThreadLogger::getInstance()->addQueue(LogQueue::State::WAIT);
+            deque_index_.emplace_back(idx);
+        }
         return true;
     }
 
@@ -112,6 +125,10 @@ public:
 
     size_t getIndex()
     {
+        if (deque_index_.empty())
+        {
+            return 0;
+        }
         size_t idx = deque_index_.front();
         deque_index_.pop_front();
         return idx;
@@ -131,9 +148,11 @@ private:
     std::mutex mutex_;
     std::condition_variable cv_;
     bool isRunning_;
+    bool trace_;
 
 public:
-    ThreadPool(const int32_t threadCount, const int32_t queueSize);
+    // trace=falseの場合は実行状況の表示を行わない(ソケットの受信処理など頻繁に追加する用途向け)
+    ThreadPool(const int32_t threadCount, const int32_t queueSize, const bool trace = true);
     ~ThreadPool();
     bool add(std::function<void()> &&func);
     bool add(const std::function<void()> &func);